@@ -3,6 +3,18 @@
 .pushsection .text.entry
 .global _start
 _start:
+    # every hart gets its own 8KiB slice of the stack, hart 0 at the top
+    csrr t0, mhartid
+    la sp, _stack_top
+    la t1, _stack_bottom
+    sub t1, sp, t1
+    srli t1, t1, 13
+    # harts the stack has no slice for park, they'd overwrite bss otherwise
+    bgeu t0, t1, _park
+    slli t1, t0, 13
+    sub sp, sp, t1
+    bnez t0, _wait_for_bss
+
     # zero bss segment
     la a0, _bss_start
     la a1, _bss_end
@@ -12,10 +24,30 @@ _zero_bss:
     addi a0, a0, 8
     j _zero_bss
 2:
+    # let the other harts in once bss is zeroed
+    fence rw, w
+    la a0, _bss_ready
+    li a1, 1
+    sw a1, (a0)
+    j _call_main
 
-    la sp, _stack_top
+_wait_for_bss:
+    la a0, _bss_ready
+3:  lw a1, (a0)
+    beqz a1, 3b
+    fence r, rw
+
+_call_main:
     call main
     # insurance for if main returns
     9: j 9b
 
+_park:
+    wfi
+    j _park
+
+.popsection
+
+.pushsection .data
+_bss_ready: .word 0
 .popsection
@@ -102,6 +102,13 @@ void whisker_write_uart(const char *str) {
   }
 }
 
+_Noreturn void whisker_exit(uint16_t code) {
+  *FINISHER = code == 0 ? 0x5555 : ((uint32_t)code << 16) | 0x3333;
+  // the other harts can still run for a moment before the run stops
+  for (;;) {
+  }
+}
+
 void rev_arr(char arr[], int64_t len){
     for(int64_t i = 0; i < len / 2; i += 1){
         char tmp = arr[i];
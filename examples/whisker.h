@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 static char *UART = (char *)0x10000000;
+static volatile uint32_t *FINISHER = (uint32_t *)0x100000;
 
 /*
 // if lhs or rhs are int64_t::MIN, behavior is undefined
@@ -29,4 +30,7 @@ void whisker_write_uart(const char *str);
 
 void int_to_string(int64_t val, char buf[21]);
 
+// ends the run, whisker exits with code (0 passes, anything else fails)
+_Noreturn void whisker_exit(uint16_t code);
+
 #endif
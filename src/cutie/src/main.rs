@@ -1,6 +1,11 @@
-use std::collections::HashSet;
+use std::collections::{HashMap, HashSet};
+use std::ffi::{OsStr, OsString};
+use std::fs;
+use std::num::NonZeroUsize;
 use std::path::Path;
 use std::process::exit;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
 use std::{path::PathBuf, process::Command};
 
 use clap::{Parser, Subcommand};
@@ -58,6 +63,13 @@ enum Commands {
 		extensions: Vec<ISAExtension>,
 		#[arg(long, short = 'C')]
 		compile_args: Vec<String>,
+		/// build a separate binary from each of these, named after it and linked with all of the other files. the
+		/// other files are only compiled once for all of them
+		#[arg(long = "program", short = 'p', conflicts_with = "out")]
+		programs: Vec<PathBuf>,
+		/// how many files are compiled at once, defaults to the number of cores
+		#[arg(short, long)]
+		jobs: Option<NonZeroUsize>,
 
 		files: Vec<PathBuf>,
 	},
@@ -80,12 +92,16 @@ fn main() {
 			linker_script,
 			extensions,
 			compile_args,
+			programs,
+			jobs,
 		} => compile(
 			out.as_str(),
 			files.as_slice(),
+			programs.as_slice(),
 			linker_script.as_path(),
 			flatten_to_set(extensions),
 			compile_args.as_slice(),
+			jobs,
 		),
 		Commands::CompileBootLoader {} => {
 			let bootloader_name = "boot.bin";
@@ -94,9 +110,11 @@ fn main() {
 			compile(
 				bootloader_name,
 				&[bootloader_path],
+				&[],
 				linker_script.as_path(),
 				HashSet::new(),
 				&[],
+				None,
 			);
 		}
 	}
@@ -119,14 +137,177 @@ fn flatten_to_set<T: Eq + std::hash::Hash>(mut vec: Vec<T>) -> HashSet<T> {
 	set
 }
 
+/// fnv-1a, the manifest has to hash the same way in every build of cutie
+fn stable_hash(parts: &[&OsStr]) -> u64 {
+	let mut hash: u64 = 0xcbf2_9ce4_8422_2325;
+	for part in parts {
+		for byte in part.as_encoded_bytes().iter().chain([&0]) {
+			hash ^= u64::from(*byte);
+			hash = hash.wrapping_mul(0x0100_0000_01b3);
+		}
+	}
+	hash
+}
+
+/// Which command line every object file in `target/` was last built with, as `<hash> <object path>` lines. an
+/// object is only reused if it was built with the same command line and is newer than everything it was built from
+struct Manifest {
+	path: PathBuf,
+	entries: HashMap<PathBuf, u64>,
+}
+
+impl Manifest {
+	fn load(target_dir: &Path) -> Self {
+		let path = target_dir.join("cutie-manifest");
+		let entries = fs::read_to_string(&path)
+			.unwrap_or_default()
+			.lines()
+			.filter_map(|line| {
+				let (hash, object) = line.split_once(' ')?;
+				Some((PathBuf::from(object), u64::from_str_radix(hash, 16).ok()?))
+			})
+			.collect();
+		Self { path, entries }
+	}
+
+	fn save(&self) {
+		let mut contents = String::new();
+		for (object, hash) in &self.entries {
+			contents.push_str(&format!("{hash:016x} {}\n", object.display()));
+		}
+		if let Err(e) = fs::write(&self.path, contents) {
+			warn!(
+				"could not write `{}`, everything is rebuilt next time: {e}",
+				self.path.display()
+			);
+		}
+	}
+}
+
+/// A source file and the object file it compiles to
+struct Unit {
+	source: PathBuf,
+	object: PathBuf,
+	// where the compiler lists the headers the source includes
+	deps: PathBuf,
+	command: Vec<OsString>,
+	hash: u64,
+}
+
+impl Unit {
+	/// whether the object was built by the same command and nothing it was built from changed since
+	fn up_to_date(&self, manifest: &Manifest) -> bool {
+		if manifest.entries.get(&self.object) != Some(&self.hash) {
+			return false;
+		}
+		let Ok(built) = fs::metadata(&self.object).and_then(|meta| meta.modified()) else {
+			return false;
+		};
+		// assembly without a preprocessor doesn't get a dependency file
+		let deps = fs::read_to_string(&self.deps).unwrap_or_default();
+		let inputs = parse_deps(&deps);
+		std::iter::once(self.source.as_path())
+			.chain(inputs.iter().map(Path::new))
+			.all(|input| {
+				fs::metadata(input)
+					.and_then(|meta| meta.modified())
+					.is_ok_and(|time| time <= built)
+			})
+	}
+
+	fn compile(&self, cc: &str) -> Result<(), String> {
+		info!("compiling {}", self.source.display());
+		// a stale list could only make it look newer than it is
+		let _ = fs::remove_file(&self.deps);
+		let output = Command::new(cc)
+			.args(&self.command)
+			.output()
+			.map_err(|e| format!("could not run {cc}: {e}"))?;
+		if !output.status.success() {
+			return Err(format!(
+				"failed to compile {}: {}",
+				self.source.display(),
+				String::from_utf8_lossy(&output.stderr)
+			));
+		}
+		Ok(())
+	}
+}
+
+/// the prerequisites in a make rule like the ones `-MMD` writes, the target itself isn't included
+fn parse_deps(rule: &str) -> Vec<String> {
+	let Some((_, prerequisites)) = rule.split_once(": ") else {
+		return Vec::new();
+	};
+	let mut deps = Vec::new();
+	let mut current = String::new();
+	let mut chars = prerequisites.chars().peekable();
+	while let Some(c) = chars.next() {
+		match c {
+			// an escaped space is part of the path, a line continuation isn't
+			'\\' if chars.peek() == Some(&' ') => current.push(chars.next().unwrap()),
+			'\\' if chars.peek() == Some(&'\n') => {}
+			c if c.is_whitespace() => {
+				if !current.is_empty() {
+					deps.push(std::mem::take(&mut current));
+				}
+			}
+			c => current.push(c),
+		}
+	}
+	if !current.is_empty() {
+		deps.push(current);
+	}
+	deps
+}
+
+/// runs `f` on every item on up to `jobs` threads, the results are in the same order as the items
+fn parallel_map<T: Sync, R: Send>(jobs: usize, items: &[T], f: impl Fn(&T) -> R + Sync) -> Vec<R> {
+	let next = AtomicUsize::new(0);
+	let mut results = thread::scope(|scope| {
+		let workers = (0..jobs.min(items.len()))
+			.map(|_| {
+				scope.spawn(|| {
+					let mut results = Vec::new();
+					loop {
+						let idx = next.fetch_add(1, Ordering::Relaxed);
+						let Some(item) = items.get(idx) else {
+							break results;
+						};
+						results.push((idx, f(item)));
+					}
+				})
+			})
+			.collect::<Vec<_>>();
+		workers
+			.into_iter()
+			// UNWRAP: workers only panic if `f` does, and then so should we
+			.flat_map(|worker| worker.join().unwrap())
+			.collect::<Vec<_>>()
+	});
+	results.sort_by_key(|(idx, _)| *idx);
+	results.into_iter().map(|(_, result)| result).collect()
+}
+
+/// A binary linked from some of the compiled files
+struct Program {
+	/// the flat binary, in `target/`
+	out_name: String,
+	/// the linked elf it's copied out of, in `target/`
+	elf_name: String,
+	sources: Vec<PathBuf>,
+}
+
 fn compile(
 	out_name: &str,
 	files: &[PathBuf],
+	programs: &[PathBuf],
 	linker_script: &Path,
 	extensions: HashSet<ISAExtension>,
 	compile_args: &[String],
+	jobs: Option<NonZeroUsize>,
 ) {
-	if files.is_empty() {
+	if files.is_empty() && programs.is_empty() {
 		error!("no input files given");
 		exit(1)
 	}
@@ -135,12 +316,25 @@ fn compile(
 	let target_dir = base_dir.join("target");
 
 	let mut any_missing = false;
-	for file in files.iter() {
+	for file in files.iter().chain(programs) {
 		let full = base_dir.join(file);
 		if !full.exists() {
 			any_missing = true;
 			error!("file `{}` does not exist", full.display());
 		}
+		match full.extension() {
+			Some(ext) => {
+				if !(ext.eq_ignore_ascii_case("s") || ext.eq_ignore_ascii_case("asm") || ext.eq_ignore_ascii_case("c"))
+				{
+					error!("unsupported file extension {}", ext.to_string_lossy());
+					exit(1)
+				}
+			}
+			None => {
+				error!("could not determine extension of file `{}`", full.display());
+				exit(1)
+			}
+		};
 	}
 	if any_missing {
 		exit(1);
@@ -162,36 +356,60 @@ fn compile(
 		eprintln!("Error: No suitable RISC-V toolchain found (Missing objcopy).");
 		std::process::exit(1);
 	};
+	if let Err(e) = fs::create_dir_all(&target_dir) {
+		error!("could not create `{}`: {e}", target_dir.display());
+		exit(1);
+	}
 
-	let mut out_files = Vec::new();
-	for file in files.iter() {
-		info!("compiling {}", file.display());
-		let file = base_dir.join(file);
-		match file.extension() {
-			Some(ext) => {
-				if !(ext.eq_ignore_ascii_case("s") || ext.eq_ignore_ascii_case("asm") || ext.eq_ignore_ascii_case("c"))
-				{
-					error!("unsupported file extension {}", ext.to_string_lossy());
-					exit(1)
+	// without programs every file goes into a single binary, otherwise every program gets all the other files
+	let programs = if programs.is_empty() {
+		vec![Program {
+			out_name: out_name.to_owned(),
+			elf_name: String::from("out.elf"),
+			sources: files.to_vec(),
+		}]
+	} else {
+		programs
+			.iter()
+			.map(|program| {
+				// UNWRAP: the extension was checked, so there's a file name
+				let stem = program.file_stem().unwrap().to_string_lossy();
+				Program {
+					out_name: format!("{stem}.bin"),
+					elf_name: format!("{stem}.elf"),
+					sources: files.iter().chain([program]).cloned().collect(),
 				}
-			}
-			None => {
-				error!("could not determine extension of file `{}`", file.display());
-				exit(1)
-			}
-		};
+			})
+			.collect()
+	};
 
-		let out_path = target_dir.join(file.file_stem().unwrap()).with_extension("o");
+	// This is the base ISA + D, GCC needs D even when it doesn't emit D instructions for some reason
+	let mut march = String::from("rv64id");
+	for ele in &extensions {
+		march.push(ele.to_char());
+	}
+	info!("compiling with march: {march}");
 
-		// This is the base ISA + D, GCC needs D even when it doesn't emit D instructions for some reason
-		let mut march = String::from("rv64id");
-		for ele in &extensions {
-			march.push(ele.to_char());
+	// every file is only compiled once, no matter how many programs it's in
+	let mut units: Vec<Unit> = Vec::new();
+	for file in programs.iter().flat_map(|program| &program.sources) {
+		let source = base_dir.join(file);
+		if units.iter().any(|unit| unit.source == source) {
+			continue;
 		}
-		info!("compiling with march: {march}");
-
-		let mut cmd = Command::new(cc);
-		cmd.args([
+		// UNWRAP: the extension was checked, so there's a file name
+		let object = target_dir.join(source.file_stem().unwrap()).with_extension("o");
+		if let Some(other) = units.iter().find(|unit| unit.object == object) {
+			error!(
+				"`{}` and `{}` would both compile to `{}`",
+				other.source.display(),
+				source.display(),
+				object.display()
+			);
+			exit(1);
+		}
+		let deps = object.with_extension("d");
+		let mut command: Vec<OsString> = [
 			&format!("-march={march}"),
 			"-mcmodel=medany",
 			"-c",
@@ -200,28 +418,106 @@ fn compile(
 			"-Wall",
 			"-Wpedantic",
 			"-Wextra",
-		])
-		.arg(file)
-		.arg("-o")
-		.arg(&out_path)
-		.args(["-ffreestanding", "-fno-stack-protector"])
-		.args(compile_args);
-		let output = cmd.output().unwrap();
-		if !output.status.success() {
-			error!("failed to compile: {}", String::from_utf8_lossy(&output.stderr));
-			exit(1);
+		]
+		.into_iter()
+		.map(OsString::from)
+		.collect();
+		command.extend([source.as_os_str(), "-o".as_ref(), object.as_os_str()].map(OsString::from));
+		command.extend(["-MMD", "-MF"].map(OsString::from));
+		command.push(deps.clone().into());
+		command.extend(["-ffreestanding", "-fno-stack-protector"].map(OsString::from));
+		command.extend(compile_args.iter().map(OsString::from));
+		let hash = stable_hash(
+			&std::iter::once(cc.as_ref())
+				.chain(command.iter().map(OsString::as_os_str))
+				.collect::<Vec<_>>(),
+		);
+		units.push(Unit {
+			source,
+			object,
+			deps,
+			command,
+			hash,
+		});
+	}
+
+	let jobs = jobs
+		.or_else(|| thread::available_parallelism().ok())
+		.map_or(1, NonZeroUsize::get);
+	let mut manifest = Manifest::load(&target_dir);
+	let stale = units
+		.iter()
+		.filter(|unit| {
+			let up_to_date = unit.up_to_date(&manifest);
+			if up_to_date {
+				info!("{} is up to date", unit.source.display());
+			}
+			!up_to_date
+		})
+		.collect::<Vec<_>>();
+	let results = parallel_map(jobs, &stale, |unit| unit.compile(cc));
+	let mut failed = false;
+	for (unit, result) in stale.iter().zip(results) {
+		match result {
+			Ok(()) => {
+				manifest.entries.insert(unit.object.clone(), unit.hash);
+			}
+			Err(e) => {
+				manifest.entries.remove(&unit.object);
+				error!("{e}");
+				failed = true;
+			}
 		}
-		out_files.push(out_path);
 	}
+	manifest.save();
+	if failed {
+		exit(1);
+	}
+
+	let results = parallel_map(jobs, &programs, |program| {
+		let objects = program
+			.sources
+			.iter()
+			.map(|file| {
+				let source = base_dir.join(file);
+				// UNWRAP: every source has a unit
+				&units.iter().find(|unit| unit.source == source).unwrap().object
+			})
+			.collect::<Vec<_>>();
+		link(cc, objcopy, program, &objects, linker_script, &target_dir)
+	});
+	let mut failed = false;
+	for result in results {
+		if let Err(e) = result {
+			error!("{e}");
+			failed = true;
+		}
+	}
+	if failed {
+		exit(1);
+	}
+}
 
+fn link(
+	cc: &str,
+	objcopy: &str,
+	program: &Program,
+	objects: &[&PathBuf],
+	linker_script: &Path,
+	target_dir: &Path,
+) -> Result<(), String> {
 	// ========
 	// LINKING
 	// ========
-	for file in out_files.iter() {
-		info!("linking `{}`", file.strip_prefix(&target_dir).unwrap().display());
+	for file in objects.iter() {
+		info!(
+			"linking `{}` into `{}`",
+			file.strip_prefix(target_dir).unwrap().display(),
+			program.elf_name
+		);
 	}
 
-	let linked_path = target_dir.join("out.elf");
+	let linked_path = target_dir.join(&program.elf_name);
 	let mut cmd = Command::new(cc);
 	cmd.args([
 		"-mcmodel=medany",
@@ -233,11 +529,14 @@ fn compile(
 	.arg(&linked_path)
 	.arg("-T")
 	.arg(linker_script)
-	.args(out_files);
+	.args(objects);
 	let output = cmd.output().unwrap();
 	if !output.status.success() {
-		error!("failed to link: {}", String::from_utf8_lossy(&output.stderr));
-		exit(1);
+		return Err(format!(
+			"failed to link {}: {}",
+			program.elf_name,
+			String::from_utf8_lossy(&output.stderr)
+		));
 	}
 
 	if !output.stdout.is_empty() {
@@ -250,18 +549,22 @@ fn compile(
 	// =======================
 	// copying to flat binary
 	// =======================
-	info!("copying to flat binary...");
-	let out_path = target_dir.join(out_name);
+	info!("copying {} to flat binary...", program.elf_name);
+	let out_path = target_dir.join(&program.out_name);
 	let mut cmd = Command::new(objcopy);
 	cmd.args(["-O", "binary"]).arg(linked_path).arg(&out_path);
 	let output = cmd.output().unwrap();
 	if !output.status.success() {
-		error!("failed to copy: {}", String::from_utf8_lossy(&output.stderr));
-		exit(1);
+		return Err(format!(
+			"failed to copy {}: {}",
+			program.elf_name,
+			String::from_utf8_lossy(&output.stderr)
+		));
 	}
 
 	info!(
 		"DONE! output binary at `{}`",
 		out_path.strip_prefix(target_dir).unwrap().display()
 	);
+	Ok(())
 }
@@ -0,0 +1,325 @@
+use std::any::Any;
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io;
+use std::num::NonZeroUsize;
+use std::panic::{self, AssertUnwindSafe};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use clap::Args;
+use tracing::*;
+
+use crate::cpu::{StopReason, WhiskerCpu, WhiskerExecState};
+use crate::finisher::GuestExit;
+use crate::mem::{BootromImage, PhysBacking};
+use crate::uart::Uart;
+
+#[derive(Debug, Args)]
+pub struct BatchArgs {
+	/// Number of kernels to run at once, defaults to the number of host cores
+	#[arg(short = 'j', long)]
+	jobs: Option<NonZeroUsize>,
+	/// Stop a kernel after it has executed this many instructions
+	#[arg(long)]
+	max_instructions: Option<u64>,
+	/// Write the UART output of every kernel to `<output-dir>/<kernel name>.out`, otherwise it is discarded. kernels
+	/// with the same name can't share an output dir
+	#[arg(long)]
+	output_dir: Option<PathBuf>,
+	/// Back guest memory with huge pages
+	#[arg(long)]
+	hugepages: bool,
+	/// Compute every float operation with softfloat, not just the ones the host fpu can't do exactly
+	#[arg(long)]
+	exact_float: bool,
+	#[arg()]
+	bootrom: PathBuf,
+	/// Kernel images, directories (every `*.bin` inside) or patterns using `*` and `?` in the file name
+	#[arg(required = true)]
+	kernels: Vec<PathBuf>,
+}
+
+#[derive(Debug)]
+pub enum KernelStatus {
+	/// the kernel ended up spinning on a jump to itself
+	Halted,
+	/// the kernel exited through the test finisher
+	Exited(GuestExit),
+	BudgetExhausted,
+	Failed(String),
+}
+
+#[derive(Debug)]
+struct KernelReport {
+	status: KernelStatus,
+	instructions: u64,
+	elapsed: Duration,
+}
+
+/// Runs every kernel and prints a report for each, returns false if any of them failed
+pub fn run_batch(args: BatchArgs) -> bool {
+	let kernels = expand_kernels(&args.kernels);
+	if kernels.is_empty() {
+		error!("no kernels matched");
+		return false;
+	}
+
+	let outputs = match &args.output_dir {
+		Some(dir) => {
+			let outputs = kernels
+				.iter()
+				.map(|kernel| output_path(dir, kernel))
+				.collect::<Vec<_>>();
+			// the kernels run at the same time, they'd truncate each other's output
+			let mut seen = HashMap::new();
+			for (idx, output) in outputs.iter().enumerate() {
+				if let Some(other) = seen.insert(output, idx) {
+					error!(
+						"`{}` and `{}` would both write to `{}`",
+						kernels[other].display(),
+						kernels[idx].display(),
+						output.display()
+					);
+					return false;
+				}
+			}
+			fs::create_dir_all(dir).unwrap_or_else(|e| panic!("could not create output dir {}: {e:?}", dir.display()));
+			Some(outputs)
+		}
+		None => None,
+	};
+
+	let bootrom = crate::read_bootrom(&args.bootrom);
+	let jobs = args
+		.jobs
+		.or_else(|| thread::available_parallelism().ok())
+		.map_or(1, NonZeroUsize::get)
+		.min(kernels.len());
+
+	info!("running {} kernels on {} threads", kernels.len(), jobs);
+
+	let next = AtomicUsize::new(0);
+	let reports = Mutex::new(Vec::with_capacity(kernels.len()));
+	let start = Instant::now();
+	thread::scope(|s| {
+		for _ in 0..jobs {
+			s.spawn(|| loop {
+				let idx = next.fetch_add(1, Ordering::Relaxed);
+				let Some(kernel) = kernels.get(idx) else {
+					break;
+				};
+				let output = outputs.as_ref().map(|outputs| outputs[idx].as_path());
+				let report = run_kernel(&args, bootrom.clone(), kernel, output);
+				reports.lock().unwrap().push((idx, report));
+			});
+		}
+	});
+	let elapsed = start.elapsed();
+
+	let mut reports = reports.into_inner().unwrap();
+	reports.sort_by_key(|(idx, _)| *idx);
+
+	let mut failed = 0;
+	for (idx, report) in &reports {
+		let status = match &report.status {
+			KernelStatus::Halted => "halted".to_owned(),
+			KernelStatus::Exited(GuestExit::Pass) => "passed".to_owned(),
+			KernelStatus::Exited(GuestExit::Fail(code)) => {
+				failed += 1;
+				format!("failed: exited with code {code}")
+			}
+			KernelStatus::BudgetExhausted => "budget exhausted".to_owned(),
+			KernelStatus::Failed(reason) => {
+				failed += 1;
+				format!("failed: {reason}")
+			}
+		};
+		let secs = report.elapsed.as_secs_f64();
+		println!(
+			"{}: {status}, {} instructions in {:.3}s ({:.2} MIPS)",
+			kernels[*idx].display(),
+			report.instructions,
+			secs,
+			report.instructions as f64 / secs / 1_000_000.0,
+		);
+	}
+	println!(
+		"{} kernels, {} failed, {:.3}s total",
+		reports.len(),
+		failed,
+		elapsed.as_secs_f64()
+	);
+
+	failed == 0
+}
+
+/// where the UART output of `kernel` goes in `dir`
+fn output_path(dir: &Path, kernel: &Path) -> PathBuf {
+	let name = kernel.file_stem().unwrap_or(kernel.as_os_str()).to_string_lossy();
+	dir.join(format!("{name}.out"))
+}
+
+/// `output` is where the UART output goes, it's discarded if there is none
+fn run_kernel(args: &BatchArgs, bootrom: BootromImage, kernel: &Path, output: Option<&Path>) -> KernelReport {
+	let start = Instant::now();
+	// the UART buffers on its own
+	let console: Box<dyn io::Write + Send> = match output {
+		Some(path) => {
+			let file =
+				File::create(path).unwrap_or_else(|e| panic!("could not create output file {}: {e:?}", path.display()));
+			Box::new(file)
+		}
+		None => Box::new(io::sink()),
+	};
+
+	let backing = if args.hugepages {
+		PhysBacking::HugePages
+	} else {
+		PhysBacking::Anonymous
+	};
+
+	let mut cpu = match panic::catch_unwind(AssertUnwindSafe(|| {
+		crate::init_cpu(bootrom, kernel, backing, 1, None, Arc::new(Uart::new(console)), None)
+	})) {
+		Ok(cpu) => cpu,
+		Err(payload) => {
+			return KernelReport {
+				status: KernelStatus::Failed(panic_reason(payload)),
+				instructions: 0,
+				elapsed: start.elapsed(),
+			}
+		}
+	};
+	cpu.exec_state = WhiskerExecState::Running;
+	cpu.exact_float = args.exact_float;
+
+	let budget = args.max_instructions.unwrap_or(u64::MAX);
+	// the cpu panics on anything it can't handle (including traps for now), that only takes down this kernel
+	let result = panic::catch_unwind(AssertUnwindSafe(|| run_to_completion(&mut cpu, budget)));
+
+	KernelReport {
+		status: result.unwrap_or_else(|payload| KernelStatus::Failed(panic_reason(payload))),
+		instructions: cpu.cycles,
+		elapsed: start.elapsed(),
+	}
+}
+
+/// runs `cpu` until the kernel exits, halts, traps or uses up `budget` instructions
+pub fn run_to_completion(cpu: &mut WhiskerCpu, budget: u64) -> KernelStatus {
+	// kernels that don't use the test finisher are done once they keep jumping to the same instruction. the pc has to
+	// stay put twice in a row so a pending trap gets a chance to stop the run first, and a block looping back to its
+	// own start doesn't count
+	let mut stuck = 0;
+	loop {
+		let pc = cpu.pc;
+		let cycles = cpu.cycles;
+		match cpu.run_block(budget) {
+			Some(StopReason::Exited(exit)) => return KernelStatus::Exited(exit),
+			Some(StopReason::Trap { mcause, mtval }) => {
+				return KernelStatus::Failed(format!(
+					"can't take a trap, mcause={mcause:#X} mtval={mtval:#018X} pc={:#018X}",
+					cpu.pc
+				))
+			}
+			Some(StopReason::BudgetExhausted) => return KernelStatus::BudgetExhausted,
+			Some(StopReason::HitBreakpoint | StopReason::HitWatchpoint(_) | StopReason::Interrupted) => {
+				unreachable!("batch runs never set breakpoints, watchpoints or interrupts")
+			}
+			None => {}
+		}
+		if cpu.pc == pc && cpu.cycles - cycles == 1 {
+			stuck += 1;
+			if stuck >= 2 {
+				return KernelStatus::Halted;
+			}
+		} else {
+			stuck = 0;
+		}
+	}
+}
+
+fn panic_reason(payload: Box<dyn Any + Send>) -> String {
+	payload
+		.downcast_ref::<&str>()
+		.map(|s| s.to_string())
+		.or_else(|| payload.downcast_ref::<String>().cloned())
+		.unwrap_or_else(|| "panicked".to_owned())
+}
+
+pub fn expand_kernels(patterns: &[PathBuf]) -> Vec<PathBuf> {
+	let mut kernels = Vec::new();
+	for pattern in patterns {
+		if pattern.is_dir() {
+			kernels.extend(matching_files(pattern, "*.bin"));
+			continue;
+		}
+
+		match pattern.file_name().and_then(|name| name.to_str()) {
+			Some(name) if name.contains(['*', '?']) => {
+				let dir = match pattern.parent() {
+					Some(dir) if !dir.as_os_str().is_empty() => dir,
+					_ => Path::new("."),
+				};
+				let matched = matching_files(dir, name);
+				if matched.is_empty() {
+					warn!("{} did not match any files", pattern.display());
+				}
+				kernels.extend(matched);
+			}
+			_ => kernels.push(pattern.clone()),
+		}
+	}
+	kernels
+}
+
+fn matching_files(dir: &Path, pattern: &str) -> Vec<PathBuf> {
+	let entries = fs::read_dir(dir).unwrap_or_else(|e| panic!("could not read directory {}: {e:?}", dir.display()));
+	let mut files = entries
+		.filter_map(|entry| entry.ok())
+		.filter(|entry| entry.file_type().is_ok_and(|ty| ty.is_file()))
+		.filter(|entry| {
+			entry
+				.file_name()
+				.to_str()
+				.is_some_and(|name| wildcard_match(pattern, name))
+		})
+		.map(|entry| entry.path())
+		.collect::<Vec<_>>();
+	files.sort();
+	files
+}
+
+/// matches `*` (any run of characters) and `?` (any single character)
+fn wildcard_match(pattern: &str, name: &str) -> bool {
+	let pattern = pattern.chars().collect::<Vec<_>>();
+	let name = name.chars().collect::<Vec<_>>();
+
+	let (mut p, mut n) = (0, 0);
+	// position of the last `*` and where in the name it started matching
+	let mut backtrack = None;
+	while n < name.len() {
+		match pattern.get(p) {
+			Some('*') => {
+				backtrack = Some((p, n));
+				p += 1;
+			}
+			Some(&c) if c == '?' || c == name[n] => {
+				p += 1;
+				n += 1;
+			}
+			_ => match backtrack {
+				Some((star, start)) => {
+					p = star + 1;
+					n = start + 1;
+					backtrack = Some((star, start + 1));
+				}
+				None => return false,
+			},
+		}
+	}
+	pattern[p..].iter().all(|&c| c == '*')
+}
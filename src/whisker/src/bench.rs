@@ -0,0 +1,413 @@
+//! Benchmarks for comparing one build of whisker against another.
+//!
+//! Micro benchmarks time the hot paths on their own: decoding both instruction lengths, loads and stores to every
+//! kind of page, AMOs as the cpu executes them, and float operations through the host fast path and softfloat. Macro
+//! benchmarks run whole kernels (like [crate::batch] does, one at a time) for a fixed number of instructions and
+//! report guest MIPS.
+//!
+//! Every benchmark is repeated `--samples` times and the median is reported, in ns per operation (per guest
+//! instruction for kernels). `--save` writes the results as `<name>\t<ns>` lines, and `--baseline` compares against
+//! such a file and fails the run if anything got slower than `--tolerance` allows. Run on an otherwise idle host, with
+//! the same arguments, for the numbers to mean anything.
+
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs;
+use std::hint::black_box;
+use std::io;
+use std::num::NonZeroUsize;
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use clap::Args;
+use tracing::*;
+
+use crate::batch::KernelStatus;
+use crate::cpu::{WhiskerCpu, WhiskerExecState};
+use crate::finisher::GuestExit;
+use crate::insn::Instruction;
+use crate::mem::{BootromImage, Device, MemoryBuilder, PageBase};
+use crate::soft::double::SoftDouble;
+use crate::soft::float::SoftFloat;
+use crate::soft::RoundingMode;
+use crate::ty::{GPRegisterIndex, SupportedExtensions};
+use crate::uart::Uart;
+
+/// how long a single sample of a micro benchmark runs for at least
+const SAMPLE_TIME: Duration = Duration::from_millis(20);
+/// where the micro benchmarks put a device, it's not mapped to anything else
+const DEVICE_ADDR: u64 = 0x2000_0000;
+/// an address nothing is mapped at
+const UNMAPPED_ADDR: u64 = 0x4000_0000;
+
+/// a mix of common compressed instructions: c.addi, c.li, c.lw, c.sw, c.j, c.beqz, c.mv, c.add
+const PARCELS_16: [u16; 8] = [0x0505, 0x4595, 0x41C8, 0xC588, 0xA831, 0xCD09, 0x852E, 0x952E];
+/// a mix of common full size instructions: addi, add, lw, sd, beq, jal, lui, mul, amoadd.w, fadd.s
+const PARCELS_32: [u32; 10] = [
+	0x0015_0513,
+	0x00C5_8533,
+	0x0081_2503,
+	0x00B1_3823,
+	0x02B5_0E63,
+	0x0380_00EF,
+	0x1234_5537,
+	0x02C5_8533,
+	0x00B6_252F,
+	0x00C5_F553,
+];
+
+/// AMOs on `(a2)`, each is benchmarked on its own
+const AMOS: [(&str, u32); 4] = [
+	("amoswap.w", 0x08B6_252F),
+	("amoadd.d", 0x00B6_352F),
+	("amomax.d.aqrl", 0xA6B6_352F),
+	("amoor.w.aq", 0x44B6_252F),
+];
+/// lr.d a0, (a2) and sc.d a3, a1, (a2)
+const LR_SC: [u32; 2] = [0x1006_352F, 0x18B6_36AF];
+
+#[derive(Debug, Args)]
+pub struct BenchArgs {
+	/// Times every benchmark is repeated, the median is reported
+	#[arg(long, default_value_t = NonZeroUsize::new(5).unwrap())]
+	samples: NonZeroUsize,
+	/// Instructions every kernel runs for at most, fewer if it exits or halts first
+	#[arg(long, default_value_t = 100_000_000)]
+	max_instructions: u64,
+	/// Only run benchmarks whose name contains this
+	#[arg(long)]
+	filter: Option<String>,
+	/// Translate hot code in kernels to native code, only supported on x86-64 hosts
+	#[arg(long)]
+	jit: bool,
+	/// Write the results here, to compare later runs against with `--baseline`
+	#[arg(long)]
+	save: Option<PathBuf>,
+	/// Compare against results written by `--save`, and fail if a benchmark got slower than `--tolerance` allows
+	#[arg(long)]
+	baseline: Option<PathBuf>,
+	/// How many percent slower than the baseline a benchmark may get
+	#[arg(long, default_value_t = 5.0)]
+	tolerance: f64,
+	/// The bootrom kernels start from, without one only the micro benchmarks run
+	#[arg(requires = "kernels")]
+	bootrom: Option<PathBuf>,
+	/// Kernel images, directories (every `*.bin` inside) or patterns using `*` and `?` in the file name
+	#[arg()]
+	kernels: Vec<PathBuf>,
+}
+
+struct Measurement {
+	name: String,
+	/// median ns per operation
+	ns: f64,
+	/// the spread of the samples around the median, in percent
+	spread: f64,
+	/// guest instructions per sample, only for kernels
+	instructions: Option<u64>,
+}
+
+/// Runs every benchmark and prints the results, returns false if a kernel failed or a benchmark regressed
+pub fn run_bench(args: BenchArgs) -> bool {
+	let baseline = args.baseline.as_ref().map(|path| {
+		let text =
+			fs::read_to_string(path).unwrap_or_else(|e| panic!("could not read baseline {}: {e:?}", path.display()));
+		parse_results(&text)
+	});
+
+	let mut bench = Bench {
+		args: &args,
+		results: Vec::new(),
+		ok: true,
+	};
+	bench.micro();
+	if let Some(bootrom) = &args.bootrom {
+		let kernels = crate::batch::expand_kernels(&args.kernels);
+		if kernels.is_empty() {
+			error!("no kernels matched");
+			return false;
+		}
+		let bootrom = crate::read_bootrom(bootrom);
+		for kernel in &kernels {
+			bench.kernel(bootrom.clone(), kernel);
+		}
+	}
+
+	let Bench { results, mut ok, .. } = bench;
+	if results.is_empty() {
+		warn!("no benchmarks matched");
+	}
+
+	for result in &results {
+		let mut line = format!("{:<32} {:>10.2} ns ±{:>4.1}%", result.name, result.ns, result.spread);
+		if let Some(instructions) = result.instructions {
+			// UNWRAP: writing to a string can't fail
+			write!(line, " {:>9.2} MIPS ({instructions} instructions)", 1000.0 / result.ns).unwrap();
+		}
+		if let Some(base) = baseline.as_ref().and_then(|baseline| baseline.get(&result.name)) {
+			let change = (result.ns / base - 1.0) * 100.0;
+			// UNWRAP: writing to a string can't fail
+			write!(line, " {change:+.1}% vs baseline").unwrap();
+			if change > args.tolerance {
+				line.push_str(" REGRESSED");
+				ok = false;
+			}
+		}
+		println!("{line}");
+	}
+	if let Some(baseline) = &baseline {
+		for name in baseline
+			.keys()
+			.filter(|name| !results.iter().any(|result| &result.name == *name))
+		{
+			warn!("{name} is in the baseline but wasn't run");
+		}
+	}
+
+	if let Some(path) = &args.save {
+		let mut text = String::new();
+		for result in &results {
+			// UNWRAP: writing to a string can't fail
+			writeln!(text, "{}\t{}", result.name, result.ns).unwrap();
+		}
+		fs::write(path, text).unwrap_or_else(|e| panic!("could not write results to {}: {e:?}", path.display()));
+	}
+
+	ok
+}
+
+/// reads the lines [run_bench] saves, lines it doesn't understand are skipped
+fn parse_results(text: &str) -> HashMap<String, f64> {
+	text.lines()
+		.filter_map(|line| {
+			let (name, ns) = line.split_once('\t')?;
+			Some((name.to_owned(), ns.trim().parse().ok()?))
+		})
+		.collect()
+}
+
+struct Bench<'a> {
+	args: &'a BenchArgs,
+	results: Vec<Measurement>,
+	ok: bool,
+}
+
+impl Bench<'_> {
+	fn selected(&self, name: &str) -> bool {
+		self.args
+			.filter
+			.as_ref()
+			.map_or(true, |filter| name.contains(filter.as_str()))
+	}
+
+	/// times `op`, which does `ops` operations per call
+	fn measure(&mut self, name: &str, ops: u64, mut op: impl FnMut()) {
+		if !self.selected(name) {
+			return;
+		}
+
+		// enough calls to fill a sample, this also warms up the caches
+		let mut iters = 1_u64;
+		loop {
+			let start = Instant::now();
+			for _ in 0..iters {
+				op();
+			}
+			if start.elapsed() >= SAMPLE_TIME {
+				break;
+			}
+			iters *= 2;
+		}
+
+		let samples = (0..self.args.samples.get())
+			.map(|_| {
+				let start = Instant::now();
+				for _ in 0..iters {
+					op();
+				}
+				start.elapsed().as_nanos() as f64 / (iters * ops) as f64
+			})
+			.collect();
+		self.record(name, samples, None);
+	}
+
+	fn record(&mut self, name: &str, mut samples: Vec<f64>, instructions: Option<u64>) {
+		samples.sort_by(f64::total_cmp);
+		let median = samples[samples.len() / 2];
+		// UNWRAP: there's at least one sample
+		let spread = (samples.last().unwrap() - samples[0]) / 2.0 / median * 100.0;
+		self.results.push(Measurement {
+			name: name.to_owned(),
+			ns: median,
+			spread,
+			instructions,
+		});
+	}
+
+	fn micro(&mut self) {
+		const EXT: u64 = SupportedExtensions::RV64IMAFC.bits();
+		let mut cpu = micro_cpu();
+
+		self.measure("decode/insn16", PARCELS_16.len() as u64, || {
+			for parcel in PARCELS_16 {
+				let _ = black_box(crate::insn16::parse(&mut cpu, black_box(parcel)));
+			}
+		});
+		self.measure("decode/insn32", PARCELS_32.len() as u64, || {
+			for parcel in PARCELS_32 {
+				let _ = black_box(crate::insn32::parse::<EXT>(&mut cpu, black_box(parcel)));
+			}
+		});
+
+		let pages = [
+			("phys", crate::DRAM_BASE + 0x100),
+			("bootrom", crate::BOOTROM_OFFSET + 0x100),
+			("device", DEVICE_ADDR),
+			("unmapped", UNMAPPED_ADDR),
+		];
+		for (page, addr) in pages {
+			self.measure(&format!("mem/read_u64/{page}"), 1, || {
+				let _ = black_box(cpu.mem.read_u64(black_box(addr)));
+			});
+			self.measure(&format!("mem/write_u64/{page}"), 1, || {
+				let _ = black_box(cpu.mem.write_u64(black_box(addr), black_box(0x0123_4567_89AB_CDEF)));
+			});
+		}
+
+		let a2 = GPRegisterIndex::from_bits(12);
+		cpu.registers.set(a2, crate::DRAM_BASE + 0x200);
+		for (name, parcel) in AMOS {
+			let insn = decode(&mut cpu, parcel);
+			self.measure(&format!("amo/{name}"), 1, || {
+				cpu.execute_insn(black_box(insn), cpu.pc);
+			});
+		}
+		let [lr, sc] = LR_SC.map(|parcel| decode(&mut cpu, parcel));
+		self.measure("amo/lr.d+sc.d", 2, || {
+			cpu.execute_insn(black_box(lr), cpu.pc);
+			cpu.execute_insn(black_box(sc), cpu.pc);
+		});
+
+		let rm = RoundingMode::RoundToNearestTieEven;
+		let (lhs, rhs, add) = (
+			SoftFloat::from_f32(1.1),
+			SoftFloat::from_f32(3.3),
+			SoftFloat::from_f32(0.7),
+		);
+		for (path, exact) in [("host", false), ("soft", true)] {
+			cpu.exact_float = exact;
+			self.measure(&format!("float/add.s/{path}"), 1, || {
+				black_box(black_box(lhs).add(&rhs, rm, &mut cpu));
+			});
+			self.measure(&format!("float/mul.s/{path}"), 1, || {
+				black_box(black_box(lhs).mul(&rhs, rm, &mut cpu));
+			});
+			self.measure(&format!("float/div.s/{path}"), 1, || {
+				black_box(black_box(lhs).div(&rhs, rm, &mut cpu));
+			});
+			self.measure(&format!("float/sqrt.s/{path}"), 1, || {
+				black_box(black_box(rhs).sqrt(rm, &mut cpu));
+			});
+			self.measure(&format!("float/fmadd.s/{path}"), 1, || {
+				black_box(black_box(lhs).mul_add(&rhs, &add, rm, &mut cpu));
+			});
+		}
+		cpu.exact_float = false;
+		// doubles always go through softfloat
+		let (lhs, rhs) = (SoftDouble::from_f64(1.1), SoftDouble::from_f64(3.3));
+		self.measure("float/add.d/soft", 1, || {
+			black_box(black_box(lhs).add(&rhs, rm, &mut cpu));
+		});
+		self.measure("float/div.d/soft", 1, || {
+			black_box(black_box(lhs).div(&rhs, rm, &mut cpu));
+		});
+	}
+
+	fn kernel(&mut self, bootrom: BootromImage, kernel: &std::path::Path) {
+		let name = format!(
+			"kernel/{}",
+			kernel.file_stem().unwrap_or(kernel.as_os_str()).to_string_lossy()
+		);
+		if !self.selected(&name) {
+			return;
+		}
+
+		let mut samples = Vec::with_capacity(self.args.samples.get());
+		let mut instructions = None;
+		for _ in 0..self.args.samples.get() {
+			let mut cpu = crate::init_cpu(
+				bootrom.clone(),
+				kernel,
+				crate::mem::PhysBacking::Anonymous,
+				1,
+				None,
+				Arc::new(Uart::new(Box::new(io::sink()))),
+				None,
+			);
+			if self.args.jit {
+				crate::enable_jit(&mut cpu);
+			}
+			cpu.exec_state = WhiskerExecState::Running;
+
+			let start = Instant::now();
+			let status = crate::batch::run_to_completion(&mut cpu, self.args.max_instructions);
+			let elapsed = start.elapsed();
+			match status {
+				KernelStatus::Halted | KernelStatus::BudgetExhausted | KernelStatus::Exited(GuestExit::Pass) => {}
+				KernelStatus::Exited(GuestExit::Fail(code)) => {
+					error!("{} failed: exited with code {code}", kernel.display());
+					self.ok = false;
+					return;
+				}
+				KernelStatus::Failed(reason) => {
+					error!("{} failed: {reason}", kernel.display());
+					self.ok = false;
+					return;
+				}
+			}
+			// the cpu is deterministic, a different count means the runs aren't comparable
+			if instructions.is_some_and(|count| count != cpu.cycles) {
+				warn!(
+					"{} ran a different number of instructions than before",
+					kernel.display()
+				);
+			}
+			instructions = Some(cpu.cycles);
+			samples.push(elapsed.as_nanos() as f64 / cpu.cycles.max(1) as f64);
+		}
+		self.record(&name, samples, instructions);
+	}
+}
+
+/// ignores writes and reads as 0, for timing the device path without the cost of a real device
+struct NullDevice;
+
+impl Device for NullDevice {
+	fn read(&self, _offset: u64, _width: u8) -> u64 {
+		0
+	}
+
+	fn write(&self, _offset: u64, _width: u8, _val: u64) {}
+}
+
+/// a cpu with memory laid out like [crate::init_cpu] does, plus a device, but with nothing loaded
+fn micro_cpu() -> WhiskerCpu {
+	let mem = MemoryBuilder::default()
+		.bootrom(
+			BootromImage::new(vec![0; 0x1000]),
+			PageBase::from_addr(crate::BOOTROM_OFFSET),
+		)
+		.physical_size(0x10_0000)
+		.phys_mapping(PageBase::from_addr(crate::DRAM_BASE), PageBase::from_addr(0), 0x10_0000)
+		.device(DEVICE_ADDR, 0x100, NullDevice)
+		.build();
+	let mut cpu = WhiskerCpu::new(0, SupportedExtensions::RV64IMAFC, mem, None);
+	cpu.pc = crate::DRAM_BASE;
+	cpu
+}
+
+fn decode(cpu: &mut WhiskerCpu, parcel: u32) -> Instruction {
+	const EXT: u64 = SupportedExtensions::RV64IMAFC.bits();
+	crate::insn32::parse::<EXT>(cpu, parcel).unwrap_or_else(|()| panic!("could not decode {parcel:#010X}"))
+}
@@ -0,0 +1,243 @@
+//! A SiFive style CLINT, with a software interrupt and a timer for every hart and the mtime they share.
+//!
+//! Time is virtual so runs stay deterministic: a hart's clock counts the instructions it retired plus the time it
+//! skipped in WFI, and mtime is the furthest any hart's clock has got. harts only publish their clock and look for
+//! interrupts about every [crate::cpu::CLINT_SYNC_INTERVAL] instructions, so mtime moves in steps of that much and
+//! interrupts can be taken that late. writes to mtime are ignored.
+//!
+//! A hart in WFI doesn't spin until its timer fires, it skips straight to the next timer event. With several harts
+//! that's only possible once every one of them waits, until then a waiting hart parks its thread until the others'
+//! clocks reach its timer or another hart raises its software interrupt.
+
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Condvar, Mutex};
+use std::time::Duration;
+
+use tracing::*;
+
+use crate::csr::{MIP_MSIP, MIP_MTIP};
+use crate::mem::Device;
+
+const MSIP: u64 = 0x0000;
+const MTIMECMP: u64 = 0x4000;
+const MTIME: u64 = 0xBFF8;
+
+/// how often a parked hart looks at the other harts' clocks and whether it should stop. raising an interrupt wakes it
+/// right away
+const POLL_INTERVAL: Duration = Duration::from_millis(1);
+
+// every hart writes its own clock all the time, so they each get a cache line
+#[derive(Debug)]
+#[repr(align(64))]
+struct HartTimer {
+	mtimecmp: AtomicU64,
+	msip: AtomicBool,
+	clock: AtomicU64,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum HartState {
+	Running,
+	/// in WFI, until one of these mip bits is pending
+	Waiting(u64),
+	/// won't run again
+	Stopped,
+}
+
+#[derive(Debug)]
+pub struct Clint {
+	harts: Box<[HartTimer]>,
+	states: Mutex<Vec<HartState>>,
+	wake: Condvar,
+}
+
+impl Clint {
+	pub fn new(harts: usize) -> Self {
+		Self {
+			harts: (0..harts)
+				.map(|_| HartTimer {
+					mtimecmp: AtomicU64::new(u64::MAX),
+					msip: AtomicBool::new(false),
+					clock: AtomicU64::new(0),
+				})
+				.collect(),
+			states: Mutex::new(vec![HartState::Running; harts]),
+			wake: Condvar::new(),
+		}
+	}
+
+	pub fn mtime(&self) -> u64 {
+		self.harts
+			.iter()
+			.map(|timer| timer.clock.load(Ordering::Relaxed))
+			.max()
+			.unwrap_or(0)
+	}
+
+	/// tells the others how far `hart` has got, and returns the interrupts pending for it (as mip bits) if its clock
+	/// is at `clock`
+	#[inline]
+	pub fn sync(&self, hart: usize, clock: u64) -> u64 {
+		let timer = &self.harts[hart];
+		timer.clock.store(clock, Ordering::Relaxed);
+		self.pending(hart, clock)
+	}
+
+	#[inline]
+	fn pending(&self, hart: usize, clock: u64) -> u64 {
+		let timer = &self.harts[hart];
+		let mut pending = 0;
+		if timer.msip.load(Ordering::Relaxed) {
+			pending |= MIP_MSIP;
+		}
+		if clock >= timer.mtimecmp.load(Ordering::Relaxed) {
+			pending |= MIP_MTIP;
+		}
+		pending
+	}
+
+	/// WFI on `hart`, whose clock is at `clock`. returns the clock once one of the `enabled` interrupts is pending,
+	/// or right away if nothing could ever raise one or `stop` says the hart has to stop
+	pub fn wait(&self, hart: usize, clock: u64, enabled: u64, stop: impl Fn() -> bool) -> u64 {
+		// UNWRAP: a hart only panics while holding the lock if the process is going down anyway
+		let mut states = self.states.lock().unwrap();
+		states[hart] = HartState::Waiting(enabled);
+		let clock = loop {
+			let now = clock.max(self.mtime());
+			if self.pending(hart, now) & enabled != 0 || stop() {
+				break now;
+			}
+			if states.iter().all(|state| *state != HartState::Running) {
+				// nobody is left to move time forward or raise an interrupt, so time skips to the next timer event
+				let Some(next) = self.next_event(&states) else {
+					debug!("hart {hart} waits for an interrupt nothing can raise");
+					break now;
+				};
+				if next > now {
+					trace!("skipping {} ticks on hart {hart}", next - now);
+					self.harts[hart].clock.store(next, Ordering::Relaxed);
+					self.wake.notify_all();
+					continue;
+				}
+			}
+			// UNWRAP: see above
+			states = self.wake.wait_timeout(states, POLL_INTERVAL).unwrap().0;
+		};
+		states[hart] = HartState::Running;
+		clock
+	}
+
+	/// `hart` won't run anymore, so the others don't wait for it to move time forward
+	pub fn stop(&self, hart: usize) {
+		// UNWRAP: see Self::wait
+		self.states.lock().unwrap()[hart] = HartState::Stopped;
+		self.wake.notify_all();
+	}
+
+	/// the earliest timer a waiting hart waits for
+	fn next_event(&self, states: &[HartState]) -> Option<u64> {
+		states
+			.iter()
+			.zip(&self.harts)
+			.filter_map(|(state, timer)| match *state {
+				HartState::Waiting(enabled) if enabled & MIP_MTIP != 0 => Some(timer.mtimecmp.load(Ordering::Relaxed)),
+				_ => None,
+			})
+			.filter(|mtimecmp| *mtimecmp != u64::MAX)
+			.min()
+	}
+
+	/// mtimecmp and msip of `hart`, for snapshots
+	pub fn registers(&self, hart: usize) -> (u64, bool) {
+		let timer = &self.harts[hart];
+		(
+			timer.mtimecmp.load(Ordering::Relaxed),
+			timer.msip.load(Ordering::Relaxed),
+		)
+	}
+
+	pub fn restore_registers(&self, hart: usize, mtimecmp: u64, msip: bool) {
+		let timer = &self.harts[hart];
+		timer.mtimecmp.store(mtimecmp, Ordering::Relaxed);
+		timer.msip.store(msip, Ordering::Relaxed);
+	}
+
+	/// the register at `offset`, as how far into it `offset` is and its size
+	fn register(&self, offset: u64) -> Option<(Register, u64, u64)> {
+		let harts = self.harts.len() as u64;
+		match offset {
+			MSIP..MTIMECMP if (offset - MSIP) / 4 < harts => {
+				Some((Register::Msip((offset - MSIP) as usize / 4), offset % 4, 4))
+			}
+			MTIMECMP..MTIME if (offset - MTIMECMP) / 8 < harts => {
+				Some((Register::Mtimecmp((offset - MTIMECMP) as usize / 8), offset % 8, 8))
+			}
+			MTIME..=0xBFFF => Some((Register::Mtime, offset - MTIME, 8)),
+			_ => None,
+		}
+	}
+}
+
+#[derive(Debug, Clone, Copy)]
+enum Register {
+	Msip(usize),
+	Mtimecmp(usize),
+	Mtime,
+}
+
+impl Device for Clint {
+	fn read(&self, offset: u64, width: u8) -> u64 {
+		let Some((reg, shift, size)) = self.register(offset) else {
+			return 0;
+		};
+		if shift + u64::from(width) > size {
+			return 0;
+		}
+		let val = match reg {
+			Register::Msip(hart) => u64::from(self.harts[hart].msip.load(Ordering::Relaxed)),
+			Register::Mtimecmp(hart) => self.harts[hart].mtimecmp.load(Ordering::Relaxed),
+			Register::Mtime => self.mtime(),
+		};
+		let val = val >> (shift * 8);
+		match width {
+			8 => val,
+			width => val & ((1 << (u64::from(width) * 8)) - 1),
+		}
+	}
+
+	// a replay restores the registers from its checkpoints and runs the hart's writes to them again
+	fn replays_writes(&self) -> bool {
+		true
+	}
+
+	fn write(&self, offset: u64, width: u8, val: u64) {
+		let Some((reg, shift, size)) = self.register(offset) else {
+			return;
+		};
+		if shift + u64::from(width) > size {
+			return;
+		}
+		match reg {
+			Register::Msip(hart) => {
+				if shift == 0 {
+					self.harts[hart].msip.store(val & 1 != 0, Ordering::Relaxed);
+				}
+			}
+			Register::Mtimecmp(hart) => {
+				let mtimecmp = &self.harts[hart].mtimecmp;
+				let mask = match width {
+					8 => u64::MAX,
+					width => ((1 << (u64::from(width) * 8)) - 1) << (shift * 8),
+				};
+				let prev = mtimecmp.load(Ordering::Relaxed);
+				mtimecmp.store((prev & !mask) | ((val << (shift * 8)) & mask), Ordering::Relaxed);
+			}
+			Register::Mtime => {
+				warn!("ignoring a write to mtime, it follows the harts' clocks");
+				return;
+			}
+		}
+		// a waiting hart may have to wake up now, or wait for a different timer
+		self.wake.notify_all();
+	}
+}
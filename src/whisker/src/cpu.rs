@@ -1,130 +1,362 @@
 use std::cmp::Ordering;
 use std::collections::HashSet;
-use std::fmt::Write as _;
-use std::fs::{File, OpenOptions};
-use std::io::Write as _;
 use std::path::PathBuf;
+use std::sync::atomic::AtomicBool;
+use std::sync::{atomic, Arc};
 
 use tracing::*;
 
-use crate::csr::ControlStatusRegisters;
+use crate::clint::Clint;
+use crate::csr::{
+	CSRPrivilege, ControlStatusRegisters, MIP_MSIP, MIP_MTIP, MSTATUS_MIE, MSTATUS_MPIE, MSTATUS_MPP,
+	MSTATUS_MPP_SHIFT, MSTATUS_MPRV,
+};
+use crate::finisher::{ExitLatch, GuestExit};
 use crate::insn::atomic::AtomicInstruction;
 use crate::insn::compressed::CompressedInstruction;
 use crate::insn::csr::CSRInstruction;
 use crate::insn::float::FloatInstruction;
 use crate::insn::int::IntInstruction;
 use crate::insn::multiply::MultiplyInstruction;
-use crate::insn::Instruction;
-use crate::mem::Memory;
+use crate::insn::uop::MicroOp;
+use crate::insn::{Decoder, Instruction};
+#[cfg(target_arch = "x86_64")]
+use crate::jit::Jit;
+use crate::mem::{amo_ordering, satp_mode_supported, Access, AmoOp, Memory, Translation, WatchHit};
 use crate::regs::{FPRegisters, GPRegisters};
+use crate::replay::Replay;
 use crate::soft::ExceptionFlags;
+use crate::threaded::{self, BlockCache, MAX_BLOCK_LEN};
+use crate::trace::{TraceCycle, TraceWindow, Tracer};
 use crate::ty::{GPRegisterIndex, SupportedExtensions, TrapIdx};
 
+/// how many instructions apart a hart tells the CLINT its clock and looks for interrupts, at the next block boundary
+pub const CLINT_SYNC_INTERVAL: u64 = 1024;
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
 pub enum WhiskerExecState {
 	Step,
 	Running,
 	Paused,
+	/// only with a [Replay]
+	ReverseStep,
+	ReverseRunning,
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 pub enum WhiskerExecStatus {
-	Stepped,
 	HitBreakpoint,
-	Paused,
+}
+
+/// why [WhiskerCpu::run] returned
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum StopReason {
+	/// the guest asked to exit through the test finisher
+	Exited(GuestExit),
+	HitBreakpoint,
+	/// the last instruction hit a watchpoint, see [Memory::add_watchpoint]
+	HitWatchpoint(WatchHit),
+	/// [WhiskerCpu::interrupt] was set
+	Interrupted,
+	/// a trap is pending, traps can't be taken yet so the run can't go on
+	Trap {
+		mcause: u64,
+		mtval: u64,
+	},
+	BudgetExhausted,
+}
+
+/// Everything about a hart's timer that depends on what the hart did, see [WhiskerCpu::timer_state]
+#[derive(Debug, Clone, Copy)]
+pub struct TimerState {
+	skipped_time: u64,
+	clint_synced: u64,
+	mtimecmp: u64,
+	msip: bool,
 }
 
 #[derive(Debug)]
 pub struct WhiskerCpu {
-	logfile: Option<File>,
+	tracer: Option<Tracer>,
+	// whether the current cycle is being traced
+	recording: bool,
 
 	pub supported_extensions: SupportedExtensions,
+	// picked once from supported_extensions, see Instruction::decoder
+	pub decoder: Decoder,
 	pub mem: Memory,
 	pub registers: GPRegisters,
 	pub fp_registers: FPRegisters,
+	/// always compute floats with softfloat, instead of the host fpu where it gives the same result
+	pub exact_float: bool,
 
 	should_trap: bool,
 
 	pub csrs: ControlStatusRegisters,
+	/// the privilege mode the hart runs in, memory has to hear about changes through [Self::update_translation]
+	pub privilege: CSRPrivilege,
 
 	pub pc: u64,
 	pub cycles: u64,
+	/// ticks skipped waiting in WFI, the hart's clock is at cycles plus this. see [crate::clint]
+	pub skipped_time: u64,
+	// the cycle the clint was last synced at, see run_block
+	clint_synced: u64,
 	pub exec_state: WhiskerExecState,
-
-	pub breakpoints: HashSet<u64>,
+	/// shared by every hart, set once the guest asks to exit
+	pub exit: Arc<ExitLatch>,
+	/// shared by every hart, None on a machine without timers
+	pub clint: Option<Arc<Clint>>,
+	/// set from another thread to stop [Self::run] at the next block boundary, see [crate::gdb::GdbConnection]
+	pub interrupt: Arc<AtomicBool>,
+	/// the recording GDB steps and continues backwards through, see [crate::replay]
+	pub replay: Option<Box<Replay>>,
+
+	// see add_breakpoint
+	breakpoints: HashSet<u64>,
+
+	// taken out while a block runs, see execute_block
+	blocks: Option<Box<BlockCache>>,
+	#[cfg(target_arch = "x86_64")]
+	jit: Option<Jit>,
+	// whether the last instruction jumped (or trapped) here, or the last block ended here. only those pcs start blocks
+	at_block_head: bool,
 }
 
-macro_rules! log {
-    ($self:ident, $($arg:tt)*) => {
-        if let Some(logfile) = $self.logfile.as_mut() {
-            trace!($($arg)*);
-            logfile.write_fmt(format_args!($($arg)*)).expect("failed to write to log");
-            writeln!(logfile).expect("failed to write to log");
-            logfile.flush().expect("failed to write to log");
-        }
-    };
+/// records an event when `$trace` is set, which is a constant everywhere but request_trap
+macro_rules! record {
+	($trace:expr, $self:ident, $event:ident($($arg:expr),*)) => {
+		if $trace {
+			if let Some(tracer) = $self.tracer.as_mut() {
+				tracer.$event($($arg),*);
+			}
+		}
+	};
 }
 
 impl WhiskerCpu {
-	pub fn new(supported_extensions: SupportedExtensions, mem: Memory, logfile: Option<PathBuf>) -> Self {
-		let logfile = logfile.map(|path| {
-			OpenOptions::new()
-				.write(true)
-				.create(true)
-				.truncate(true)
-				.open(&path)
-				.unwrap_or_else(|e| panic!("failed to create logfile {}: {:?}", path.display(), e))
+	/// `trace` is where to write a binary execution trace and which part of the run it covers, see [crate::trace]
+	pub fn new(
+		hart_id: usize,
+		supported_extensions: SupportedExtensions,
+		mut mem: Memory,
+		trace: Option<(PathBuf, TraceWindow)>,
+	) -> Self {
+		let tracer = trace.map(|(path, window)| {
+			let mut tracer = Tracer::create(&path, supported_extensions, window)
+				.unwrap_or_else(|e| panic!("failed to create trace {}: {:?}", path.display(), e));
+			tracer.sync(0, 0, &[0; 32], &[0; 32]);
+			tracer
 		});
+		let mut csrs = ControlStatusRegisters::new();
+		csrs.write_mhartid(hart_id as u64);
+		// blocks are built from decoded instructions, so they have to hear about them being thrown away
+		mem.icache.track_invalidations();
 		Self {
-			logfile,
+			tracer,
+			recording: false,
 
 			supported_extensions,
+			decoder: Instruction::decoder(supported_extensions),
 			mem,
 			registers: GPRegisters::default(),
 			fp_registers: FPRegisters::default(),
+			exact_float: false,
 
 			should_trap: false,
-			csrs: ControlStatusRegisters::new(),
+			csrs,
+			privilege: CSRPrivilege::Machine,
 
 			pc: 0,
 			cycles: 0,
+			skipped_time: 0,
+			clint_synced: 0,
 			exec_state: WhiskerExecState::Paused,
+			exit: Arc::default(),
+			clint: None,
+			interrupt: Arc::default(),
+			replay: None,
 			breakpoints: HashSet::default(),
+
+			blocks: Some(Box::default()),
+			#[cfg(target_arch = "x86_64")]
+			jit: None,
+			at_block_head: true,
+		}
+	}
+
+	/// whether a decoder instantiated for `EXT` accepts instructions from `ext`, see [Instruction::decoder]
+	#[inline(always)]
+	pub fn supports<const EXT: u64>(&self, ext: SupportedExtensions) -> bool {
+		if EXT == SupportedExtensions::DYNAMIC {
+			self.supported_extensions.has(ext)
+		} else {
+			SupportedExtensions::from_bits(EXT).has(ext)
+		}
+	}
+
+	/// translates hot blocks to native code from now on, see [crate::jit]. breakpoints and tracing are not honoured
+	/// while translated code runs
+	#[cfg(target_arch = "x86_64")]
+	pub fn enable_jit(&mut self) -> std::io::Result<()> {
+		self.jit = Some(Jit::new()?);
+		Ok(())
+	}
+
+	/// runs a whole block starting at pc if there is one (or it's worth building now), natively if the jit is enabled
+	/// and it's hot enough, see [crate::threaded] and [crate::jit]. otherwise executes a single cycle like
+	/// [Self::execute_one]. blocks are never used while tracing, with watchpoints set (a hit has to stop right after
+	/// its instruction), or with less than a whole block of `budget` left
+	#[inline]
+	fn execute_block(&mut self, budget: u64) -> Result<(), WhiskerExecStatus> {
+		if self.mem.icache.has_invalidations() {
+			let invalidations = self.mem.icache.take_invalidations();
+			// UNWRAP: only taken out while a block runs
+			self.blocks.as_mut().unwrap().invalidate(&invalidations);
+			#[cfg(target_arch = "x86_64")]
+			if let Some(jit) = &mut self.jit {
+				jit.invalidate(&invalidations);
+			}
+		}
+
+		if self.at_block_head
+			&& !self.should_trap
+			&& self.tracer.is_none()
+			&& budget > MAX_BLOCK_LEN as u64
+			&& !self.mem.has_watchpoints()
+		{
+			#[cfg(target_arch = "x86_64")]
+			if let Some(mut jit) = self.jit.take() {
+				let run = jit
+					.block_at(self.pc, &mut self.mem)
+					.map(|entry| jit.enter(entry, self, budget));
+				self.jit = Some(jit);
+				if let Some(run) = run {
+					self.cycles += run.retired;
+					self.pc = run.pc;
+					return Ok(());
+				}
+			}
+
+			// UNWRAP: see above
+			let mut blocks = self.blocks.take().unwrap();
+			let retired = blocks.run(self);
+			self.blocks = Some(blocks);
+			if let Some(retired) = retired {
+				self.cycles += retired;
+				return Ok(());
+			}
+		}
+
+		let start_pc = self.pc;
+		let result = self.execute_one();
+		self.at_block_head = !matches!(self.pc.wrapping_sub(start_pc), 2 | 4);
+		result
+	}
+
+	/// executes up to `budget` instructions, a block at a time where possible. stops early once the guest exits,
+	/// hits a breakpoint or watchpoint, is interrupted or is about to take a trap
+	pub fn run(&mut self, budget: u64) -> StopReason {
+		let end = self.cycles.saturating_add(budget);
+		loop {
+			if let Some(reason) = self.run_block(end) {
+				return reason;
+			}
+		}
+	}
+
+	/// a single step of [Self::run] that executes at most one block, for callers that check something in between.
+	/// `end` is the cycle count to stop at
+	pub fn run_block(&mut self, end: u64) -> Option<StopReason> {
+		if let Some(exit) = self.exit.get() {
+			return Some(StopReason::Exited(exit));
+		}
+		if self.interrupt.load(atomic::Ordering::Relaxed) {
+			return Some(StopReason::Interrupted);
+		}
+		if self.cycles.wrapping_sub(self.clint_synced) >= CLINT_SYNC_INTERVAL
+			&& self.clint.is_some()
+			&& !self.should_trap
+		{
+			self.sync_clint();
+			self.check_interrupts();
+		}
+		if self.should_trap {
+			return Some(StopReason::Trap {
+				mcause: self.csrs.read_mcause(),
+				mtval: self.csrs.read_mtval(),
+			});
+		}
+		if self.cycles >= end {
+			return Some(StopReason::BudgetExhausted);
+		}
+		match self.execute_block(end - self.cycles) {
+			Err(WhiskerExecStatus::HitBreakpoint) => Some(StopReason::HitBreakpoint),
+			Ok(()) => self.mem.take_watch_hit().map(StopReason::HitWatchpoint),
 		}
 	}
 
 	pub fn execute_one(&mut self) -> Result<(), WhiskerExecStatus> {
+		if let Some(tracer) = self.tracer.as_mut() {
+			match tracer.begin_cycle(self.cycles + 1, self.pc) {
+				TraceCycle::Record => {
+					self.recording = true;
+					let result = self.step::<true>();
+					self.recording = false;
+					return result;
+				}
+				TraceCycle::Skip => {}
+				// dropping the tracer finishes writing the trace
+				TraceCycle::Finished => self.tracer = None,
+			}
+		}
+		self.step::<false>()
+	}
+
+	/// executes a single cycle, everything to do with tracing compiles away unless `TRACE` is set
+	#[inline(always)]
+	fn step<const TRACE: bool>(&mut self) -> Result<(), WhiskerExecStatus> {
 		self.cycles += 1;
-		log!(self, "cycle {}", self.cycles);
+		record!(TRACE, self, cycle(self.cycles, self.pc));
 
 		if self.should_trap {
-			log!(self, "  trapping");
+			record!(TRACE, self, trapping());
 			return self.exec_trap();
 		}
 
 		// some instructions (particularly jumps) need the program counter at the start of the instruction
 		let start_pc = self.pc;
 
-		if self.breakpoints.contains(&start_pc) {
-			log!(self, "  reached breakpoint at {:#018X}", start_pc);
-			return Err(WhiskerExecStatus::HitBreakpoint);
-		}
-
-		match Instruction::fetch_instruction(self) {
-			Ok((inst, size)) => {
-				log!(self, "  {:#018X}: fetched {:?}", start_pc, inst);
-				self.pc = self.pc.wrapping_add(size);
-				match inst {
-					Instruction::IntExtension(insn) => self.execute_i_insn(insn, start_pc),
-					Instruction::FloatExtension(insn) => self.execute_f_insn(insn, start_pc),
-					Instruction::Csr(insn) => self.exec_csr(insn, start_pc),
-					Instruction::CompressedExtension(insn) => self.exec_compressed_insn(insn, start_pc),
-					Instruction::AtomicExtension(insn) => self.exec_atomic_insn(insn, start_pc),
-					Instruction::MultiplyInstruction(insn) => self.exec_multiply_insn(insn, start_pc),
+		let fetched = match self.mem.decoded(start_pc) {
+			Some(cached) => Ok(cached),
+			// instructions with a breakpoint on them are never cached, so we only have to look for them on a miss
+			None if self.breakpoints.contains(&start_pc) => {
+				record!(TRACE, self, breakpoint());
+				// nothing was executed, so the cycle count stays the same with or without breakpoints
+				self.cycles -= 1;
+				return Err(WhiskerExecStatus::HitBreakpoint);
+			}
+			None => Instruction::fetch_instruction(self),
+		};
+
+		match fetched {
+			Ok(op) => {
+				if TRACE {
+					// UNWRAPS: the instruction was just fetched from here
+					let raw = match op.size {
+						2 => u32::from(self.mem.fetch_u16(start_pc).unwrap()),
+						_ => self.mem.fetch_u32(start_pc).unwrap(),
+					};
+					record!(TRACE, self, fetched(raw));
 				}
+				self.pc = self.pc.wrapping_add(op.len());
+				self.execute_uop(&op, start_pc);
 
-				log!(self, "state after cycle {}", self.cycles);
-				self.dump();
+				record!(
+					TRACE,
+					self,
+					state(self.pc, self.registers.regs(), self.fp_registers.get_all_raw())
+				);
 
 				Ok(())
 			}
@@ -135,48 +367,164 @@ impl WhiskerCpu {
 		}
 	}
 
+	/// executes a decoded instruction through the same handlers blocks run, the pc has to point past it already
+	#[inline(always)]
+	pub fn execute_uop(&mut self, op: &MicroOp, start_pc: u64) {
+		threaded::dispatch(self, op, start_pc);
+	}
+
+	/// executes a decoded instruction, the pc has to point past it already
+	#[inline(always)]
+	pub fn execute_insn(&mut self, inst: Instruction, start_pc: u64) {
+		match inst {
+			Instruction::IntExtension(insn) => self.execute_i_insn(insn, start_pc),
+			Instruction::FloatExtension(insn) => self.execute_f_insn(insn, start_pc),
+			Instruction::Csr(insn) => self.exec_csr(insn, start_pc),
+			Instruction::CompressedExtension(insn) => self.exec_compressed_insn(insn, start_pc),
+			Instruction::AtomicExtension(insn) => self.exec_atomic_insn(insn, start_pc),
+			Instruction::MultiplyInstruction(insn) => self.exec_multiply_insn(insn, start_pc),
+		}
+	}
+
+	/// whether a trap has been requested and will be taken on the next cycle
+	pub fn trap_pending(&self) -> bool {
+		self.should_trap
+	}
+
+	/// breakpoints live outside of the decoded instruction cache, the instruction at `pc` is evicted from it and won't
+	/// be cached again until the breakpoint is removed. with paging on, the same code mapped at another address
+	/// can still cache it
+	pub fn add_breakpoint(&mut self, pc: u64) {
+		self.breakpoints.insert(pc);
+		self.mem.remove_decoded(pc);
+	}
+
+	pub fn remove_breakpoint(&mut self, pc: u64) {
+		self.breakpoints.remove(&pc);
+	}
+
+	pub fn clear_breakpoints(&mut self) {
+		self.breakpoints.clear();
+	}
+
+	/// takes every breakpoint out until they're put back with [Self::restore_breakpoints]
+	pub fn suspend_breakpoints(&mut self) -> HashSet<u64> {
+		std::mem::take(&mut self.breakpoints)
+	}
+
+	pub fn restore_breakpoints(&mut self, breakpoints: HashSet<u64>) {
+		// they may have been decoded and cached in the meantime
+		for pc in breakpoints {
+			self.add_breakpoint(pc);
+		}
+	}
+
+	pub fn has_breakpoint(&self, pc: u64) -> bool {
+		!self.breakpoints.is_empty() && self.breakpoints.contains(&pc)
+	}
+
+	/// the hart's view of mtime
+	#[inline]
+	pub fn clock(&self) -> u64 {
+		self.cycles + self.skipped_time
+	}
+
+	/// the hart's clock and its CLINT registers, for checkpoints. on a single hart machine that's all the CLINT
+	/// state, so restoring it makes the timer behave exactly like it did the first time
+	pub fn timer_state(&self) -> TimerState {
+		let (mtimecmp, msip) = match &self.clint {
+			Some(clint) => clint.registers(self.csrs.read_mhartid() as usize),
+			None => (u64::MAX, false),
+		};
+		TimerState {
+			skipped_time: self.skipped_time,
+			clint_synced: self.clint_synced,
+			mtimecmp,
+			msip,
+		}
+	}
+
+	/// puts the timer back like [Self::timer_state] saw it, `cycles` has to be restored already
+	pub fn restore_timer_state(&mut self, state: &TimerState) {
+		self.skipped_time = state.skipped_time;
+		self.clint_synced = state.clint_synced;
+		if let Some(clint) = &self.clint {
+			let hart = self.csrs.read_mhartid() as usize;
+			clint.restore_registers(hart, state.mtimecmp, state.msip);
+			// mtime follows the hart's clock back, mip was restored with the other CSRs
+			clint.sync(hart, self.clock());
+		}
+	}
+
+	/// tells the CLINT how far the hart has got, and puts the interrupts it raises for the hart into mip
+	#[inline]
+	fn sync_clint(&mut self) {
+		let Some(clint) = &self.clint else {
+			return;
+		};
+		self.clint_synced = self.cycles;
+		let pending = clint.sync(self.csrs.read_mhartid() as usize, self.clock());
+		let mip = self.csrs.read_mip();
+		self.csrs.write_mip((mip & !(MIP_MSIP | MIP_MTIP)) | pending);
+	}
+
+	/// requests a trap for the most important interrupt that is pending and enabled, if the hart takes interrupts
+	#[inline]
+	fn check_interrupts(&mut self) {
+		let pending = self.csrs.read_mip() & self.csrs.read_mie();
+		// machine interrupts are always taken in lower privilege modes
+		if pending == 0 || (self.privilege == CSRPrivilege::Machine && self.csrs.read_mstatus() & MSTATUS_MIE == 0) {
+			return;
+		}
+		let cause = if pending & MIP_MSIP != 0 {
+			TrapIdx::MACHINE_SOFTWARE_INTERRUPT
+		} else {
+			TrapIdx::MACHINE_TIMER_INTERRUPT
+		};
+		self.request_trap(cause, 0);
+	}
+
+	/// WFI, skips ahead or parks the thread until an enabled interrupt is pending. see [Clint::wait]
+	fn wait_for_interrupt(&mut self) {
+		let Some(clint) = &self.clint else {
+			// nothing could ever wake the hart, so it's a nop
+			return;
+		};
+		let clock = self.clock();
+		let (exit, interrupt) = (&self.exit, &self.interrupt);
+		// when the hart wakes depends on the other harts and on being stopped, so a replay wakes when the run it
+		// replays did
+		let woke = self.mem.logged_input(|| {
+			clint.wait(self.csrs.read_mhartid() as usize, clock, self.csrs.read_mie(), || {
+				exit.get().is_some() || interrupt.load(atomic::Ordering::Relaxed)
+			})
+		});
+		self.skipped_time += woke - clock;
+		self.sync_clint();
+	}
+
+	/// tells memory how to translate addresses after the privilege mode, mstatus or satp changed
+	pub fn update_translation(&mut self) {
+		let translation = Translation::new(self.privilege, self.csrs.read_mstatus(), self.csrs.read_satp());
+		self.mem.set_translation(translation);
+	}
+
 	pub fn request_trap(&mut self, trap: TrapIdx, mtval: u64) {
-		log!(
-			self,
-			"  requesting trap kind cause={:#018X} mtval={:#018X}",
-			trap.inner(),
-			mtval,
-		);
+		// traps can open the trace window, so the tracer has to hear about them even while it isn't recording
+		record!(true, self, request_trap(self.recording, trap.inner(), mtval));
 		// trap causes have the high bit set if they are an interrupt, or unset for exceptions
 		self.csrs.write_mcause(trap.inner());
 		self.csrs.write_mtval(mtval);
 		self.should_trap = true;
 	}
-
-	/// If this routine returns [None] then there's incoming GDB data
-	/// otherwise it returns the status of executing the cpu.
-	/// this function may block until data comes from GDB
-	pub fn exec_gdb<F: FnMut() -> bool>(&mut self, mut poll_incoming_data: F) -> Option<WhiskerExecStatus> {
-		match self.exec_state {
-			WhiskerExecState::Step => match self.execute_one() {
-				Ok(()) => Some(WhiskerExecStatus::Stepped),
-				Err(e) => Some(e),
-			},
-			WhiskerExecState::Running => loop {
-				if self.should_poll() && poll_incoming_data() {
-					return None;
-				}
-
-				if let Err(e) = self.execute_one() {
-					return Some(e);
-				}
-			},
-			WhiskerExecState::Paused => Some(WhiskerExecStatus::Paused),
-		}
-	}
 }
 
 macro_rules! read_mem_u8 {
 	($self:ident, $offset:ident) => {
 		match $self.mem.read_u8($offset) {
 			Ok(val) => val,
-			Err(addr) => {
-				$self.request_trap(TrapIdx::LOAD_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Load), fault.addr);
 				return;
 			}
 		}
@@ -187,8 +535,8 @@ macro_rules! read_mem_u16 {
 	($self:ident, $offset:ident) => {
 		match $self.mem.read_u16($offset) {
 			Ok(val) => val,
-			Err(addr) => {
-				$self.request_trap(TrapIdx::LOAD_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Load), fault.addr);
 				return;
 			}
 		}
@@ -199,8 +547,8 @@ macro_rules! read_mem_u32 {
 	($self:ident, $offset:ident) => {
 		match $self.mem.read_u32($offset) {
 			Ok(val) => val,
-			Err(addr) => {
-				$self.request_trap(TrapIdx::LOAD_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Load), fault.addr);
 				return;
 			}
 		}
@@ -211,8 +559,8 @@ macro_rules! read_mem_u64 {
 	($self:ident, $offset:ident) => {
 		match $self.mem.read_u64($offset) {
 			Ok(val) => val,
-			Err(addr) => {
-				$self.request_trap(TrapIdx::LOAD_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Load), fault.addr);
 				return;
 			}
 		}
@@ -223,8 +571,8 @@ macro_rules! read_mem_float {
 	($self:ident, $offset:ident) => {
 		match $self.mem.read_soft_float($offset) {
 			Ok(val) => val,
-			Err(addr) => {
-				$self.request_trap(TrapIdx::LOAD_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Load), fault.addr);
 				return;
 			}
 		}
@@ -236,8 +584,8 @@ macro_rules! read_mem_double {
 	($self:ident, $offset:ident) => {
 		match $self.mem.read_soft_double($offset) {
 			Ok(val) => val,
-			Err(addr) => {
-				$self.request_trap(TrapIdx::LOAD_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Load), fault.addr);
 				return;
 			}
 		}
@@ -248,8 +596,8 @@ macro_rules! write_mem_u8 {
 	($self:ident, $offset:ident, $val:ident) => {
 		match $self.mem.write_u8($offset, $val) {
 			Ok(()) => (),
-			Err(addr) => {
-				$self.request_trap(TrapIdx::STORE_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Store), fault.addr);
 				return;
 			}
 		}
@@ -260,8 +608,8 @@ macro_rules! write_mem_u16 {
 	($self:ident, $offset:ident, $val:ident) => {
 		match $self.mem.write_u16($offset, $val) {
 			Ok(()) => (),
-			Err(addr) => {
-				$self.request_trap(TrapIdx::STORE_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Store), fault.addr);
 				return;
 			}
 		}
@@ -272,8 +620,8 @@ macro_rules! write_mem_u32 {
 	($self:ident, $offset:ident, $val:ident) => {
 		match $self.mem.write_u32($offset, $val) {
 			Ok(()) => (),
-			Err(addr) => {
-				$self.request_trap(TrapIdx::STORE_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Store), fault.addr);
 				return;
 			}
 		}
@@ -284,8 +632,8 @@ macro_rules! write_mem_u64 {
 	($self:ident, $offset:ident, $val:ident) => {
 		match $self.mem.write_u64($offset, $val) {
 			Ok(()) => (),
-			Err(addr) => {
-				$self.request_trap(TrapIdx::STORE_PAGE_FAULT, addr);
+			Err(fault) => {
+				$self.request_trap(fault.cause(Access::Store), fault.addr);
 				return;
 			}
 		}
@@ -293,13 +641,12 @@ macro_rules! write_mem_u64 {
 }
 
 /// gets a reference to the CSR specified by $addr
-/// raises an illegal instruction exception if the CSR does not exist
+/// raises an illegal instruction exception if the CSR does not exist or could not be read at the current privilege
 macro_rules! get_csr {
 	($self:ident, $addr:ident) => {
 		match $self.csrs.get($addr) {
-			// FIXME: check privilege
-			Some(info) => info,
-			None => {
+			Some(info) if info.privilege() <= $self.privilege => info,
+			_ => {
 				$self.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
 				return;
 			}
@@ -313,9 +660,8 @@ macro_rules! get_csr {
 macro_rules! get_csr_mut {
 	($self:ident, $addr:ident) => {
 		match $self.csrs.get_mut($addr) {
-			// FIXME: check privilege
 			Some(info) => {
-				if !info.is_rw() {
+				if !info.is_rw() || info.privilege() > $self.privilege {
 					$self.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
 					return;
 				}
@@ -330,41 +676,6 @@ macro_rules! get_csr_mut {
 }
 
 impl WhiskerCpu {
-	pub fn dump(&self) {
-		if let Some(mut f) = self.logfile.as_ref() {
-			// UNWRAPS: writing to string cannot fail
-
-			let mut out = String::new();
-			writeln!(&mut out, "    pc: {:#018X}\n", self.pc).unwrap();
-			let regs = self.registers.regs();
-			for idx in 0..32 {
-				let val = regs[idx as usize];
-				// we do this for pretty display purposes
-				let idx = GPRegisterIndex::new(idx).unwrap();
-				writeln!(&mut out, "  {:>4}: {val:#018X} ({val:})", idx.display(),).unwrap();
-			}
-
-			writeln!(&mut out).unwrap();
-			let fpregs = self.fp_registers.get_all_raw();
-			for idx in 0..32 {
-				let val = u64::from_le_bytes(fpregs[idx].to_le_bytes());
-				writeln!(
-					&mut out,
-					"  {:>4}: {:#018X} (f64: {}, f32: {})",
-					format!("fp{idx}"),
-					val,
-					f64::from_bits(val),
-					f32::from_bits(val as u32)
-				)
-				.unwrap();
-			}
-			out.push_str("\n\n");
-
-			write!(f, "{}", out).expect("unable to write to logfile");
-			f.flush().expect("unable to flush logfile");
-		}
-	}
-
 	fn exec_trap(&mut self) -> Result<(), WhiskerExecStatus> {
 		let cause = self.csrs.read_mcause();
 		let mtval = self.csrs.read_mtval();
@@ -641,14 +952,64 @@ impl WhiskerCpu {
 			// =========
 			// SYSTEM
 			// =========
+			IntInstruction::Fence => std::sync::atomic::fence(std::sync::atomic::Ordering::SeqCst),
+			IntInstruction::FenceInstructions => {
+				// other harts' stores have to be visible before we decode anything again
+				std::sync::atomic::fence(std::sync::atomic::Ordering::Acquire);
+				self.mem.icache.clear();
+			}
 			IntInstruction::ECall => {
-				// TODO: handle different modes
-				self.request_trap(TrapIdx::ECALL_MMODE, 0);
+				let cause = match self.privilege {
+					CSRPrivilege::User => TrapIdx::ECALL_UMODE,
+					CSRPrivilege::Supervisor => TrapIdx::ECALL_SMODE,
+					CSRPrivilege::Hypervisor | CSRPrivilege::Machine => TrapIdx::ECALL_MMODE,
+				};
+				self.request_trap(cause, 0);
 			}
 			IntInstruction::EBreak => {
 				// TODO: should this do anything else?
 				self.request_trap(TrapIdx::BREAKPOINT, 0);
 			}
+			IntInstruction::MachineReturn => {
+				if self.privilege != CSRPrivilege::Machine {
+					self.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
+					return;
+				}
+				let mstatus = self.csrs.read_mstatus();
+				self.privilege = match (mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT {
+					0b00 => CSRPrivilege::User,
+					0b01 => CSRPrivilege::Supervisor,
+					_ => CSRPrivilege::Machine,
+				};
+				// MIE = MPIE, MPIE = 1, MPP = U, MPRV is cleared when leaving M-mode
+				let mpie = mstatus & MSTATUS_MPIE != 0;
+				let mut mstatus = (mstatus & !(MSTATUS_MIE | MSTATUS_MPP)) | MSTATUS_MPIE;
+				if mpie {
+					mstatus |= MSTATUS_MIE;
+				}
+				if self.privilege != CSRPrivilege::Machine {
+					mstatus &= !MSTATUS_MPRV;
+				}
+				self.csrs.write_mstatus(mstatus);
+				self.pc = self.csrs.read_mepc();
+				self.update_translation();
+			}
+			IntInstruction::WaitForInterrupt => {
+				if self.privilege == CSRPrivilege::User {
+					self.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
+					return;
+				}
+				self.wait_for_interrupt();
+			}
+			IntInstruction::SFenceVma { vaddr, asid } => {
+				if self.privilege == CSRPrivilege::User {
+					self.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
+					return;
+				}
+				let vaddr = (vaddr != GPRegisterIndex::ZERO).then(|| self.registers.get(vaddr));
+				let asid = (asid != GPRegisterIndex::ZERO).then(|| self.registers.get(asid) as u16);
+				self.mem.sfence_vma(vaddr, asid);
+			}
 		}
 	}
 
@@ -786,6 +1147,39 @@ impl WhiskerCpu {
 	}
 
 	fn exec_csr(&mut self, insn: CSRInstruction, _start_pc: u64) {
+		let prev_satp = self.csrs.read_satp();
+		let prev_mstatus = self.csrs.read_mstatus();
+		match insn.csr() {
+			ControlStatusRegisters::TIME => {
+				let time = self.clint.as_ref().map_or(0, |clint| clint.mtime()).max(self.clock());
+				self.csrs.write_time(time);
+			}
+			ControlStatusRegisters::MIP => self.sync_clint(),
+			_ => {}
+		}
+		self.exec_csr_access(insn);
+		match insn.csr() {
+			ControlStatusRegisters::SATP => {
+				// writes with an unsupported mode have no effect
+				if !satp_mode_supported(self.csrs.read_satp()) {
+					self.csrs.write_satp(prev_satp);
+				}
+				self.update_translation();
+			}
+			ControlStatusRegisters::MSTATUS => {
+				// MPP is WARL and there's no H-mode to return to
+				let mstatus = self.csrs.read_mstatus();
+				if (mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT == CSRPrivilege::Hypervisor as u64 {
+					self.csrs
+						.write_mstatus((mstatus & !MSTATUS_MPP) | (prev_mstatus & MSTATUS_MPP));
+				}
+				self.update_translation();
+			}
+			_ => {}
+		}
+	}
+
+	fn exec_csr_access(&mut self, insn: CSRInstruction) {
 		// FIXME: ordering of effects on registers and traps???
 		match insn {
 			CSRInstruction::CSRReadWrite { dst, src, csr } => {
@@ -860,33 +1254,40 @@ impl WhiskerCpu {
 	}
 
 	fn exec_atomic_insn(&mut self, insn: AtomicInstruction, _start_pc: u64) {
-		// TODO: For now we'll be ignoring the aq: _ and rl: _ bits as it requires fencing logic and other things we do-
-		// not currently implement.
-		const HART_ID: usize = 0;
 		match insn {
-			AtomicInstruction::LoadReservedWord { src, dst, _aq, _rl } => {
+			AtomicInstruction::LoadReservedWord { src, dst, aq, rl } => {
 				let addr = self.registers.get(src);
 
-				let val = self
-					.mem
-					.load_reserved_word(addr, HART_ID)
-					.expect("addr to be in physmem");
+				release_fence(rl);
+				let val = match self.mem.load_reserved_word(addr) {
+					Ok(val) => val,
+					Err(fault) => {
+						self.request_trap(fault.cause(Access::Load), fault.addr);
+						return;
+					}
+				};
+				acquire_fence(aq);
 
-				self.registers.set(dst, val as u64);
+				self.registers.set(dst, val as i32 as u64);
 			}
 			AtomicInstruction::StoreConditionalWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
+				aq,
+				rl,
 			} => {
 				let addr = self.registers.get(src1);
 				let val = self.registers.get(src2) as u32;
-				let success = self
-					.mem
-					.store_conditional_word(addr, HART_ID, val)
-					.expect("addr to be in physmem");
+				release_fence(rl);
+				let success = match self.mem.store_conditional_word(addr, val) {
+					Ok(success) => success,
+					Err(fault) => {
+						self.request_trap(fault.cause(Access::Store), fault.addr);
+						return;
+					}
+				};
+				acquire_fence(aq);
 				if success {
 					self.registers.set(dst, 0);
 				} else {
@@ -899,189 +1300,78 @@ impl WhiskerCpu {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// swap src2 to (src1)
-						let src2_val = self.registers.get(src2);
-						Some(src2_val as u32)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::Swap, src1, src2, dst, aq, rl),
 			AtomicInstruction::AddWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// add src2 value to (src1)
-						let src2_val = self.registers.get(src2) as u32;
-						let new_val = word.wrapping_add(src2_val);
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::Add, src1, src2, dst, aq, rl),
 			AtomicInstruction::XorWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// xor src2 value with (src1)
-						let src2_val = self.registers.get(src2) as u32;
-						let new_val = word ^ src2_val;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::Xor, src1, src2, dst, aq, rl),
 			AtomicInstruction::AndWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// and src2 value with (src1)
-						let src2_val = self.registers.get(src2) as u32;
-						let new_val = word & src2_val;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::And, src1, src2, dst, aq, rl),
 			AtomicInstruction::OrWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// or src2 value with (src1)
-						let src2_val = self.registers.get(src2) as u32;
-						let new_val = word | src2_val;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::Or, src1, src2, dst, aq, rl),
 			AtomicInstruction::MinWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// min of src2 value and (src1) (signed)
-						let src2_val = self.registers.get(src2) as i32;
-						let new_val = std::cmp::min(word as i32, src2_val) as u32;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::Min, src1, src2, dst, aq, rl),
 			AtomicInstruction::MaxWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// max of src2 value and (src1) (signed)
-						let src2_val = self.registers.get(src2) as i32;
-						let new_val = std::cmp::max(word as i32, src2_val) as u32;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::Max, src1, src2, dst, aq, rl),
 			AtomicInstruction::MinUnsignedWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
-
-						// min of src2 value and (src1) (unsigned)
-						let src2_val = self.registers.get(src2) as u32;
-						let new_val = std::cmp::min(word, src2_val);
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::MinUnsigned, src1, src2, dst, aq, rl),
 			AtomicInstruction::MaxUnsignedWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_word(addr, |word| {
-						// put (src1) value into rd
-						self.registers.set(dst, u64::from(word));
+				aq,
+				rl,
+			} => self.exec_amo_word(AmoOp::MaxUnsigned, src1, src2, dst, aq, rl),
 
-						// max of src2 value and (src1) (unsigned)
-						let src2_val = self.registers.get(src2) as u32;
-						let new_val = std::cmp::max(word, src2_val);
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
-
-			AtomicInstruction::LoadReservedDoubleWord { src, dst, _aq, _rl } => {
+			AtomicInstruction::LoadReservedDoubleWord { src, dst, aq, rl } => {
 				let addr = self.registers.get(src);
 
-				let val = self
-					.mem
-					.load_reserved_dword(addr, HART_ID)
-					.expect("addr to be in physmem");
+				release_fence(rl);
+				let val = match self.mem.load_reserved_dword(addr) {
+					Ok(val) => val,
+					Err(fault) => {
+						self.request_trap(fault.cause(Access::Load), fault.addr);
+						return;
+					}
+				};
+				acquire_fence(aq);
 
 				self.registers.set(dst, val);
 			}
@@ -1089,15 +1379,20 @@ impl WhiskerCpu {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
+				aq,
+				rl,
 			} => {
 				let addr = self.registers.get(src1);
 				let val = self.registers.get(src2);
-				let success = self
-					.mem
-					.store_conditional_dword(addr, HART_ID, val)
-					.expect("addr to be in physmem");
+				release_fence(rl);
+				let success = match self.mem.store_conditional_dword(addr, val) {
+					Ok(success) => success,
+					Err(fault) => {
+						self.request_trap(fault.cause(Access::Store), fault.addr);
+						return;
+					}
+				};
+				acquire_fence(aq);
 				if success {
 					self.registers.set(dst, 0);
 				} else {
@@ -1110,184 +1405,114 @@ impl WhiskerCpu {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// swap src2 to (src1)
-						let src2_val = self.registers.get(src2);
-						Some(src2_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::Swap, src1, src2, dst, aq, rl),
 			AtomicInstruction::AddDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// add src2 value to (src1)
-						let src2_val = self.registers.get(src2);
-						let new_val = dword.wrapping_add(src2_val);
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::Add, src1, src2, dst, aq, rl),
 			AtomicInstruction::XorDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// xor src2 value with (src1)
-						let src2_val = self.registers.get(src2);
-						let new_val = dword ^ src2_val;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::Xor, src1, src2, dst, aq, rl),
 			AtomicInstruction::AndDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// and src2 value with (src1)
-						let src2_val = self.registers.get(src2);
-						let new_val = dword & src2_val;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::And, src1, src2, dst, aq, rl),
 			AtomicInstruction::OrDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// or src2 value with (src1)
-						let src2_val = self.registers.get(src2);
-						let new_val = dword | src2_val;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::Or, src1, src2, dst, aq, rl),
 			AtomicInstruction::MinDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// min of src2 value and (src1) (signed)
-						let src2_val = self.registers.get(src2) as i64;
-						let new_val = std::cmp::min(dword as i64, src2_val) as u64;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::Min, src1, src2, dst, aq, rl),
 			AtomicInstruction::MaxDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// max of src2 value and (src1) (signed)
-						let src2_val = self.registers.get(src2) as i64;
-						let new_val = std::cmp::max(dword as i64, src2_val) as u64;
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::Max, src1, src2, dst, aq, rl),
 			AtomicInstruction::MinUnsignedDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// min of src2 value and (src1) (unsigned)
-						let src2_val = self.registers.get(src2);
-						let new_val = std::cmp::min(dword, src2_val);
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::MinUnsigned, src1, src2, dst, aq, rl),
 			AtomicInstruction::MaxUnsignedDoubleWord {
 				src1,
 				src2,
 				dst,
-				_aq,
-				_rl,
-			} => {
-				let addr = self.registers.get(src1);
-				self.mem
-					.atomic_op_dword(addr, |dword| {
-						// put (src1) value into rd
-						self.registers.set(dst, dword);
-
-						// max of src2 value and (src1) (unsigned)
-						let src2_val = self.registers.get(src2);
-						let new_val = std::cmp::max(dword, src2_val);
-						Some(new_val)
-					})
-					.expect("addr to be in physmem");
-			}
+				aq,
+				rl,
+			} => self.exec_amo_dword(AmoOp::MaxUnsigned, src1, src2, dst, aq, rl),
 		}
 	}
 
+	fn exec_amo_word(
+		&mut self,
+		op: AmoOp,
+		src1: GPRegisterIndex,
+		src2: GPRegisterIndex,
+		dst: GPRegisterIndex,
+		aq: bool,
+		rl: bool,
+	) {
+		let addr = self.registers.get(src1);
+		let val = self.registers.get(src2) as u32;
+		let word = match self.mem.amo_word(addr, op, val, amo_ordering(aq, rl)) {
+			Ok(word) => word,
+			// AMOs fault like stores
+			Err(fault) => {
+				self.request_trap(fault.cause(Access::Store), fault.addr);
+				return;
+			}
+		};
+		// put (src1) value into rd, sign extended like every other word result
+		self.registers.set(dst, word as i32 as u64);
+	}
+
+	fn exec_amo_dword(
+		&mut self,
+		op: AmoOp,
+		src1: GPRegisterIndex,
+		src2: GPRegisterIndex,
+		dst: GPRegisterIndex,
+		aq: bool,
+		rl: bool,
+	) {
+		let addr = self.registers.get(src1);
+		let val = self.registers.get(src2);
+		let dword = match self.mem.amo_dword(addr, op, val, amo_ordering(aq, rl)) {
+			Ok(dword) => dword,
+			// AMOs fault like stores
+			Err(fault) => {
+				self.request_trap(fault.cause(Access::Store), fault.addr);
+				return;
+			}
+		};
+		// put (src1) value into rd
+		self.registers.set(dst, dword);
+	}
+
 	fn exec_multiply_insn(&mut self, insn: MultiplyInstruction, _start_pc: u64) {
 		match insn {
 			MultiplyInstruction::Multiply { lhs, rhs, dst } => {
@@ -1431,8 +1656,20 @@ impl WhiskerCpu {
 			}
 		}
 	}
+}
+
+/// orders everything before an LR/SC with the rl bit set before it
+#[inline(always)]
+fn release_fence(rl: bool) {
+	if rl {
+		std::sync::atomic::fence(std::sync::atomic::Ordering::Release);
+	}
+}
 
-	fn should_poll(&self) -> bool {
-		self.cycles % 1024 == 0
+/// orders everything after an LR/SC with the aq bit set after it
+#[inline(always)]
+fn acquire_fence(aq: bool) {
+	if aq {
+		std::sync::atomic::fence(std::sync::atomic::Ordering::Acquire);
 	}
 }
@@ -1,8 +1,20 @@
-use std::collections::HashMap;
 use std::fmt::Debug;
 
 pub const NUM_CSRS: u16 = 4096;
 
+// mstatus fields
+pub const MSTATUS_MIE: u64 = 1 << 3;
+pub const MSTATUS_MPIE: u64 = 1 << 7;
+pub const MSTATUS_MPP_SHIFT: u32 = 11;
+pub const MSTATUS_MPP: u64 = 0b11 << MSTATUS_MPP_SHIFT;
+pub const MSTATUS_MPRV: u64 = 1 << 17;
+pub const MSTATUS_SUM: u64 = 1 << 18;
+pub const MSTATUS_MXR: u64 = 1 << 19;
+
+// mip and mie fields
+pub const MIP_MSIP: u64 = 1 << 3;
+pub const MIP_MTIP: u64 = 1 << 7;
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 #[repr(u8)]
 #[allow(dead_code)]
@@ -57,34 +69,51 @@ impl Debug for CSRInfo {
 
 macro_rules! define_csrs {
     ($($name:ident, $addr:literal, $rw:ident, $priv:ident $(, $init:literal)?),*$(,)*) => {
+		/// position of every defined CSR in [ControlStatusRegisters::regs]
+		#[allow(non_camel_case_types)]
+		#[repr(u8)]
+		enum CSRIndex {
+			$($name,)*
+			Count,
+		}
+
+		/// CSR address -> position in [ControlStatusRegisters::regs], or [ControlStatusRegisters::UNDEFINED]
+		static CSR_INDEX: [u8; NUM_CSRS as usize] = {
+			assert!((CSRIndex::Count as u8) < ControlStatusRegisters::UNDEFINED, "too many CSRs");
+			let mut table = [ControlStatusRegisters::UNDEFINED; NUM_CSRS as usize];
+			$(
+				assert!(table[$addr] == ControlStatusRegisters::UNDEFINED, "CSR address defined twice");
+				table[$addr] = CSRIndex::$name as u8;
+			)*
+			table
+		};
+
 		#[derive(Debug)]
 		pub struct ControlStatusRegisters {
-		    regs: HashMap<u16, CSRInfo>,
+			// only the CSRs that exist, in definition order
+			regs: [CSRInfo; CSRIndex::Count as usize],
 		}
 
 		#[allow(unused)]
 		impl ControlStatusRegisters {
-    		pub fn new() -> Self {
-    		    Self {
-                    regs: {
-                        let mut map = HashMap::new();
-                        $(map.insert(
-                            $addr,
-                            CSRInfo {
-                                val: {
-                                    let mut val = 0;
-                                    $( val = $init; )?
-                                    val
-                                },
-                                addr: $addr,
-                                rw: $rw,
-                                privilege: CSRPrivilege::$priv,
-                            },
-                        );)*
-                        map
-                    }
-    			}
-    		}
+			const UNDEFINED: u8 = u8::MAX;
+
+			pub fn new() -> Self {
+				Self {
+					regs: [$(
+						CSRInfo {
+							val: {
+								let mut val = 0;
+								$( val = $init; )?
+								val
+							},
+							addr: $addr,
+							rw: $rw,
+							privilege: CSRPrivilege::$priv,
+						},
+					)*],
+				}
+			}
 		}
 
 		paste::paste!{
@@ -92,12 +121,14 @@ macro_rules! define_csrs {
 		impl ControlStatusRegisters {$(
 		    pub const [< $name:snake:upper >]: u16 = $addr;
 
+			#[inline]
 			pub fn [< read_ $name >](&self) -> u64 {
-			    self.regs.get(&$addr).unwrap().val
+			    self.regs[CSRIndex::$name as usize].val
 			}
 
+			#[inline]
 			pub fn [< write_ $name >](&mut self, val: u64) {
-			    self.regs.get_mut(&$addr).unwrap().val = val;
+			    self.regs[CSRIndex::$name as usize].val = val;
 			}
 		)*}
 		}
@@ -105,14 +136,27 @@ macro_rules! define_csrs {
 }
 
 impl ControlStatusRegisters {
+	#[inline]
 	pub fn get(&self, reg: u16) -> Option<&CSRInfo> {
 		assert!(reg < NUM_CSRS);
-		self.regs.get(&reg)
+		match CSR_INDEX[usize::from(reg)] {
+			Self::UNDEFINED => None,
+			idx => Some(&self.regs[usize::from(idx)]),
+		}
 	}
 
+	#[inline]
 	pub fn get_mut(&mut self, reg: u16) -> Option<&mut CSRInfo> {
 		assert!(reg < NUM_CSRS);
-		self.regs.get_mut(&reg)
+		match CSR_INDEX[usize::from(reg)] {
+			Self::UNDEFINED => None,
+			idx => Some(&mut self.regs[usize::from(idx)]),
+		}
+	}
+
+	/// every CSR that exists, in definition order
+	pub fn iter(&self) -> impl Iterator<Item = &CSRInfo> {
+		self.regs.iter()
 	}
 }
 
@@ -124,11 +168,18 @@ define_csrs!(
     mvendorid, 0xF11, RO, Machine, 0,
     marchid,   0xF12, RO, Machine, 0,
     mimpid,    0xF13, RO, Machine, 0,
+    mhartid,   0xF14, RO, Machine,
 
+    mstatus,   0x300, RW, Machine,
+    mie,       0x304, RW, Machine,
     mtvec,     0x305, RW, Machine, 0x4000_0000,
     mepc,      0x341, RW, Machine,
     mcause,    0x342, RW, Machine,
     mtval,     0x343, RW, Machine,
+    mip,       0x344, RW, Machine,
+
+    satp,      0x180, RW, Supervisor,
 
     fcsr,      0x003, RW, User,
+    time,      0xC01, RO, User,
 );
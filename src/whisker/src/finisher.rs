@@ -0,0 +1,80 @@
+//! A SiFive style test finisher, which lets the guest end the run.
+//!
+//! A write of `0x5555` to its register passes, `code << 16 | 0x3333` fails with `code`. Anything else (like the
+//! reset command) is ignored. Every hart polls the same [ExitLatch] and stops once it's set.
+
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+
+use tracing::*;
+
+use crate::mem::Device;
+
+const PASS: u32 = 0x5555;
+const FAIL: u32 = 0x3333;
+
+/// how the guest asked to exit
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum GuestExit {
+	Pass,
+	Fail(u16),
+}
+
+impl GuestExit {
+	/// the exit code for the host process, a failure with code 0 still fails
+	pub fn exit_code(self) -> i32 {
+		match self {
+			Self::Pass => 0,
+			Self::Fail(0) => 1,
+			Self::Fail(code) => i32::from(code),
+		}
+	}
+}
+
+/// Set once by the finisher, it holds the register value that was written or 0
+#[derive(Debug, Default)]
+pub struct ExitLatch(AtomicU32);
+
+impl ExitLatch {
+	#[inline]
+	pub fn get(&self) -> Option<GuestExit> {
+		let val = self.0.load(Ordering::Relaxed);
+		match val & 0xFFFF {
+			0 => None,
+			PASS => Some(GuestExit::Pass),
+			_ => Some(GuestExit::Fail((val >> 16) as u16)),
+		}
+	}
+
+	/// takes back an exit, for going back to before the guest asked for it
+	pub fn clear(&self) {
+		self.0.store(0, Ordering::Relaxed);
+	}
+
+	fn set(&self, val: u32) {
+		// the first exit wins if several harts race to it
+		let _ = self.0.compare_exchange(0, val, Ordering::Relaxed, Ordering::Relaxed);
+	}
+}
+
+pub struct TestFinisher(pub Arc<ExitLatch>);
+
+impl Device for TestFinisher {
+	fn read(&self, _offset: u64, _width: u8) -> u64 {
+		0
+	}
+
+	fn write(&self, offset: u64, _width: u8, val: u64) {
+		if offset != 0 {
+			return;
+		}
+		let val = val as u32;
+		match val & 0xFFFF {
+			PASS | FAIL => {
+				debug!("guest exit requested with {val:#010X}");
+				self.0.set(val);
+			}
+			_ => warn!("ignoring test finisher command {val:#010X}"),
+		}
+	}
+}
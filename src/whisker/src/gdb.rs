@@ -1,25 +1,35 @@
+use std::io::{self, ErrorKind};
 use std::net::{TcpListener, TcpStream};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread::{self, Thread};
 
 use gdbstub::arch::{Arch, Registers};
 use gdbstub::target::TargetError;
 use gdbstub::{
 	common::Signal,
-	conn::ConnectionExt,
+	conn::{Connection, ConnectionExt},
 	stub::{
 		run_blocking::{BlockingEventLoop, Event, WaitForStopReasonError},
 		SingleThreadStopReason,
 	},
 	target::{
 		ext::{
-			base::singlethread::{SingleThreadBase, SingleThreadResume, SingleThreadSingleStep},
-			breakpoints::{Breakpoints, SwBreakpoint},
+			base::{
+				reverse_exec::{ReplayLogPosition, ReverseCont, ReverseStep},
+				singlethread::{SingleThreadBase, SingleThreadResume, SingleThreadSingleStep},
+			},
+			breakpoints::{Breakpoints, HwWatchpoint, SwBreakpoint, WatchKind},
 		},
 		Target,
 	},
 };
 use gdbstub_arch::riscv::reg::id::RiscvRegId;
 
-use crate::cpu::{WhiskerExecState, WhiskerExecStatus};
+use crate::cpu::{StopReason, WhiskerExecState, WhiskerExecStatus};
+use crate::mem::{self, WatchHit};
+use crate::replay::{Replay, ReverseStop};
+use crate::ty::TrapIdx;
 use crate::WhiskerCpu;
 
 pub fn wait_for_tcp() -> Result<TcpStream, std::io::Error> {
@@ -33,6 +43,95 @@ pub fn wait_for_tcp() -> Result<TcpStream, std::io::Error> {
 	Ok(stream)
 }
 
+/// The connection to GDB. While the target runs, a separate thread waits for GDB to send something (usually a
+/// Ctrl-C) and sets the cpu's [WhiskerCpu::interrupt] flag, so the cpu only checks an atomic between blocks instead
+/// of peeking at the socket every so many instructions
+pub struct GdbConnection {
+	stream: TcpStream,
+	interrupt: Arc<AtomicBool>,
+	poller: Thread,
+}
+
+impl GdbConnection {
+	pub fn new(stream: TcpStream, interrupt: Arc<AtomicBool>) -> io::Result<Self> {
+		let watched = stream.try_clone()?;
+		let flag = Arc::clone(&interrupt);
+		let poller = thread::Builder::new()
+			.name("gdb-poll".into())
+			.spawn(move || poll_connection(watched, flag))?
+			.thread()
+			.clone();
+		Ok(Self {
+			stream,
+			interrupt,
+			poller,
+		})
+	}
+
+	/// clears the interrupt flag, returns whether GDB actually sent something. the flag can also be left over from
+	/// packets that were read while the target was stopped
+	fn take_interrupt(&mut self) -> io::Result<bool> {
+		self.interrupt.store(false, Ordering::Relaxed);
+		self.poller.unpark();
+		Ok(ConnectionExt::peek(&mut self.stream)?.is_some())
+	}
+}
+
+/// sets `interrupt` whenever there's data to read, and waits for it to be cleared before looking again since the
+/// data stays there until the main thread reads it
+fn poll_connection(stream: TcpStream, interrupt: Arc<AtomicBool>) {
+	let mut byte = [0];
+	loop {
+		let closed = match stream.peek(&mut byte) {
+			Ok(len) => len == 0,
+			// the main thread briefly makes the socket non-blocking whenever it peeks itself
+			Err(e) if matches!(e.kind(), ErrorKind::WouldBlock | ErrorKind::Interrupted) => {
+				thread::yield_now();
+				continue;
+			}
+			Err(_) => true,
+		};
+		interrupt.store(true, Ordering::Relaxed);
+		// the main thread runs into the closed connection on its own once it reads from it
+		if closed {
+			return;
+		}
+		while interrupt.load(Ordering::Relaxed) {
+			thread::park();
+		}
+	}
+}
+
+impl Connection for GdbConnection {
+	type Error = io::Error;
+
+	fn write(&mut self, byte: u8) -> Result<(), Self::Error> {
+		Connection::write(&mut self.stream, byte)
+	}
+
+	fn write_all(&mut self, buf: &[u8]) -> Result<(), Self::Error> {
+		Connection::write_all(&mut self.stream, buf)
+	}
+
+	fn flush(&mut self) -> Result<(), Self::Error> {
+		Connection::flush(&mut self.stream)
+	}
+
+	fn on_session_start(&mut self) -> Result<(), Self::Error> {
+		Connection::on_session_start(&mut self.stream)
+	}
+}
+
+impl ConnectionExt for GdbConnection {
+	fn read(&mut self) -> Result<u8, Self::Error> {
+		ConnectionExt::read(&mut self.stream)
+	}
+
+	fn peek(&mut self) -> Result<Option<u8>, Self::Error> {
+		ConnectionExt::peek(&mut self.stream)
+	}
+}
+
 pub struct Rv64Arch;
 
 #[derive(Debug, Copy, Clone, PartialEq, PartialOrd, Default)]
@@ -157,6 +256,7 @@ impl SingleThreadBase for WhiskerCpu {
 		self.registers.set_all(&regs.x);
 		self.fp_registers.set_all_raw(&regs.f.map(f64::to_bits));
 		self.pc = regs.pc;
+		with_replay(self, Replay::rewrite_history);
 		Ok(())
 	}
 
@@ -165,10 +265,10 @@ impl SingleThreadBase for WhiskerCpu {
 		start_addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
 		data: &mut [u8],
 	) -> gdbstub::target::TargetResult<usize, Self> {
-		match self.mem.read_slice(start_addr, data) {
+		match self.mem.debug_read_slice(start_addr, data) {
 			Ok(()) => Ok(data.len()),
 			// FIXME: does this do what we want
-			Err(addr) => Ok((addr - start_addr) as usize),
+			Err(fault) => Ok((fault.addr - start_addr) as usize),
 		}
 	}
 
@@ -177,10 +277,13 @@ impl SingleThreadBase for WhiskerCpu {
 		start_addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
 		data: &[u8],
 	) -> gdbstub::target::TargetResult<(), Self> {
-		match self.mem.write_slice(start_addr, data) {
-			Ok(()) => Ok(()),
+		match self.mem.debug_write_slice(start_addr, data) {
+			Ok(()) => {
+				with_replay(self, Replay::rewrite_history);
+				Ok(())
+			}
 			// EREMOTEIO - causes gdb to report "cannot access memory at <start_addr>"
-			Err(_addr) => Err(TargetError::Errno(121)),
+			Err(_fault) => Err(TargetError::Errno(121)),
 		}
 	}
 
@@ -200,6 +303,18 @@ impl SingleThreadResume for WhiskerCpu {
 	) -> Option<gdbstub::target::ext::base::singlethread::SingleThreadSingleStepOps<'_, Self>> {
 		Some(self)
 	}
+
+	fn support_reverse_step(
+		&mut self,
+	) -> Option<gdbstub::target::ext::base::reverse_exec::ReverseStepOps<'_, (), Self>> {
+		self.replay.is_some().then_some(self)
+	}
+
+	fn support_reverse_cont(
+		&mut self,
+	) -> Option<gdbstub::target::ext::base::reverse_exec::ReverseContOps<'_, (), Self>> {
+		self.replay.is_some().then_some(self)
+	}
 }
 
 impl SingleThreadSingleStep for WhiskerCpu {
@@ -209,6 +324,28 @@ impl SingleThreadSingleStep for WhiskerCpu {
 	}
 }
 
+impl ReverseStep<()> for WhiskerCpu {
+	fn reverse_step(&mut self, _tid: ()) -> Result<(), Self::Error> {
+		self.exec_state = WhiskerExecState::ReverseStep;
+		Ok(())
+	}
+}
+
+impl ReverseCont<()> for WhiskerCpu {
+	fn reverse_cont(&mut self) -> Result<(), Self::Error> {
+		self.exec_state = WhiskerExecState::ReverseRunning;
+		Ok(())
+	}
+}
+
+/// runs `f` on the recording, if there is one. it's taken out of the cpu for as long as `f` runs
+fn with_replay<R>(cpu: &mut WhiskerCpu, f: impl FnOnce(&mut Replay, &mut WhiskerCpu) -> R) -> Option<R> {
+	let mut replay = cpu.replay.take()?;
+	let result = f(&mut replay, cpu);
+	cpu.replay = Some(replay);
+	Some(result)
+}
+
 impl Breakpoints for WhiskerCpu {
 	fn support_sw_breakpoint(&mut self) -> Option<gdbstub::target::ext::breakpoints::SwBreakpointOps<'_, Self>> {
 		Some(self)
@@ -219,7 +356,7 @@ impl Breakpoints for WhiskerCpu {
 	}
 
 	fn support_hw_watchpoint(&mut self) -> Option<gdbstub::target::ext::breakpoints::HwWatchpointOps<'_, Self>> {
-		None
+		Some(self)
 	}
 }
 
@@ -229,7 +366,7 @@ impl SwBreakpoint for WhiskerCpu {
 		addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
 		_kind: <Self::Arch as gdbstub::arch::Arch>::BreakpointKind,
 	) -> gdbstub::target::TargetResult<bool, Self> {
-		self.breakpoints.insert(addr);
+		self.add_breakpoint(addr);
 		Ok(true)
 	}
 
@@ -238,15 +375,63 @@ impl SwBreakpoint for WhiskerCpu {
 		addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
 		_kind: <Self::Arch as gdbstub::arch::Arch>::BreakpointKind,
 	) -> gdbstub::target::TargetResult<bool, Self> {
-		self.breakpoints.remove(&addr);
+		self.remove_breakpoint(addr);
 		Ok(true)
 	}
 }
 
+impl HwWatchpoint for WhiskerCpu {
+	fn add_hw_watchpoint(
+		&mut self,
+		addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
+		len: <Self::Arch as gdbstub::arch::Arch>::Usize,
+		kind: WatchKind,
+	) -> gdbstub::target::TargetResult<bool, Self> {
+		self.mem.add_watchpoint(addr, len, watch_kind(kind));
+		Ok(true)
+	}
+
+	fn remove_hw_watchpoint(
+		&mut self,
+		addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
+		len: <Self::Arch as gdbstub::arch::Arch>::Usize,
+		kind: WatchKind,
+	) -> gdbstub::target::TargetResult<bool, Self> {
+		Ok(self.mem.remove_watchpoint(addr, len, watch_kind(kind)))
+	}
+}
+
+fn watch_kind(kind: WatchKind) -> mem::WatchKind {
+	match kind {
+		WatchKind::Write => mem::WatchKind::Write,
+		WatchKind::Read => mem::WatchKind::Read,
+		WatchKind::ReadWrite => mem::WatchKind::Access,
+	}
+}
+
+fn watch_stop(hit: WatchHit) -> SingleThreadStopReason<u64> {
+	let kind = match hit.kind {
+		mem::WatchKind::Write => WatchKind::Write,
+		mem::WatchKind::Read => WatchKind::Read,
+		mem::WatchKind::Access => WatchKind::ReadWrite,
+	};
+	SingleThreadStopReason::Watch {
+		tid: (),
+		kind,
+		addr: hit.addr,
+	}
+}
+
+/// GDB shows this as "No more reverse-execution history"
+const BEGIN: SingleThreadStopReason<u64> = SingleThreadStopReason::ReplayLog {
+	tid: None,
+	pos: ReplayLogPosition::Begin,
+};
+
 impl BlockingEventLoop for WhiskerEventLoop {
 	type Target = WhiskerCpu;
 
-	type Connection = Box<dyn ConnectionExt<Error = std::io::Error>>;
+	type Connection = GdbConnection;
 
 	type StopReason = SingleThreadStopReason<u64>;
 
@@ -260,21 +445,48 @@ impl BlockingEventLoop for WhiskerEventLoop {
 			<Self::Connection as gdbstub::conn::Connection>::Error,
 		>,
 	> {
-		let poll_incoming_data = || conn.peek().map(|b| b.is_some()).unwrap_or(true);
-		match target.exec_gdb(poll_incoming_data) {
-			None => {
-				let data = conn.read().map_err(WaitForStopReasonError::Connection)?;
-				Ok(Event::IncomingData(data))
-			}
-			Some(res) => {
-				let reason = match res {
-					WhiskerExecStatus::Stepped => SingleThreadStopReason::DoneStep,
-					WhiskerExecStatus::Paused => SingleThreadStopReason::Signal(Signal::SIGINT),
-					WhiskerExecStatus::HitBreakpoint => SingleThreadStopReason::SwBreak(()),
-				};
-				Ok(Event::TargetStopped(reason))
-			}
-		}
+		let reason = match target.exec_state {
+			WhiskerExecState::Step => match with_replay(target, Replay::step).unwrap_or_else(|| target.execute_one()) {
+				Ok(()) => target
+					.mem
+					.take_watch_hit()
+					.map_or(SingleThreadStopReason::DoneStep, watch_stop),
+				Err(WhiskerExecStatus::HitBreakpoint) => SingleThreadStopReason::SwBreak(()),
+			},
+			WhiskerExecState::Paused => SingleThreadStopReason::Signal(Signal::SIGINT),
+			// runs at full speed until something stops it, GDB only gets a look in through the interrupt flag
+			WhiskerExecState::Running => loop {
+				match with_replay(target, |replay, cpu| replay.run(cpu, u64::MAX))
+					.unwrap_or_else(|| target.run(u64::MAX))
+				{
+					StopReason::Interrupted => {
+						if conn.take_interrupt().map_err(WaitForStopReasonError::Connection)? {
+							let data = conn.read().map_err(WaitForStopReasonError::Connection)?;
+							return Ok(Event::IncomingData(data));
+						}
+					}
+					StopReason::HitBreakpoint => break SingleThreadStopReason::SwBreak(()),
+					StopReason::HitWatchpoint(hit) => break watch_stop(hit),
+					// the exit code is all GDB can show for it, failures with codes past 255 are folded into 1
+					StopReason::Exited(exit) => {
+						break SingleThreadStopReason::Exited(u8::try_from(exit.exit_code()).unwrap_or(1))
+					}
+					StopReason::Trap { mcause, .. } => break SingleThreadStopReason::Signal(trap_signal(mcause)),
+					StopReason::BudgetExhausted => {}
+				}
+			},
+			// GDB only asks for these if there's a recording
+			WhiskerExecState::ReverseStep => match with_replay(target, Replay::reverse_step) {
+				Some(true) => SingleThreadStopReason::DoneStep,
+				_ => BEGIN,
+			},
+			WhiskerExecState::ReverseRunning => match with_replay(target, Replay::reverse_continue) {
+				Some(ReverseStop::Breakpoint) => SingleThreadStopReason::SwBreak(()),
+				Some(ReverseStop::Watchpoint(hit)) => watch_stop(hit),
+				Some(ReverseStop::Begin) | None => BEGIN,
+			},
+		};
+		Ok(Event::TargetStopped(reason))
 	}
 
 	fn on_interrupt(
@@ -284,3 +496,14 @@ impl BlockingEventLoop for WhiskerEventLoop {
 		Ok(Some(SingleThreadStopReason::Signal(Signal::SIGINT)))
 	}
 }
+
+/// the signal GDB reports for a trap the target can't take
+fn trap_signal(mcause: u64) -> Signal {
+	if mcause == TrapIdx::ILLEGAL_INSTRUCTION.inner() {
+		Signal::SIGILL
+	} else if mcause == TrapIdx::BREAKPOINT.inner() {
+		Signal::SIGTRAP
+	} else {
+		Signal::SIGSEGV
+	}
+}
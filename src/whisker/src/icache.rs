@@ -0,0 +1,193 @@
+use std::collections::HashMap;
+use std::fmt::Debug;
+
+use tracing::*;
+
+use crate::insn::uop::MicroOp;
+use crate::mem::{PageBase, PAGE_SIZE};
+
+// instructions are at least 2 byte aligned (with the C extension), so that's the finest granularity we need
+const SLOTS_PER_PAGE: usize = (PAGE_SIZE / 2) as usize;
+
+/// decoded instructions for a single page, indexed by (pc & page mask) / 2
+struct DecodedPage {
+	slots: Box<[Option<MicroOp>]>,
+}
+
+impl DecodedPage {
+	fn new() -> Self {
+		Self {
+			slots: vec![None; SLOTS_PER_PAGE].into_boxed_slice(),
+		}
+	}
+
+	#[inline(always)]
+	fn slot(pc: u64) -> usize {
+		((pc & (PAGE_SIZE - 1)) >> 1) as usize
+	}
+}
+
+/// A cache of decoded instructions keyed by the physical address they were fetched from, see
+/// [crate::mem::Memory::decoded]. with paging off that's the pc.
+///
+/// The cache is organized per page so any write to a page that holds decoded instructions throws away every
+/// instruction decoded from it, which keeps self modifying code (and writes into the bootrom) working.
+/// Instructions that cross a page boundary are never cached, so a write only ever needs to look at the pages it
+/// touches.
+pub struct InstructionCache {
+	pages: HashMap<PageBase, DecodedPage>,
+	// the page we're currently executing from is kept out of the map so that straight line code and tight loops do
+	// not have to hash anything on a hit
+	hot: Option<(PageBase, DecodedPage)>,
+	// only kept once someone translating decoded instructions asks for them, see track_invalidations
+	invalidations: Option<Invalidations>,
+}
+
+/// physical pages whose decoded instructions were thrown away
+#[derive(Debug, Default)]
+pub struct Invalidations {
+	pub pages: Vec<PageBase>,
+	/// everything was thrown away, or virtual addresses may have been mapped somewhere else. `pages` is empty
+	pub all: bool,
+}
+
+impl Debug for InstructionCache {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("InstructionCache")
+			.field("pages", &(self.pages.len() + usize::from(self.hot.is_some())))
+			.finish_non_exhaustive()
+	}
+}
+
+impl InstructionCache {
+	pub fn new() -> Self {
+		Self {
+			pages: HashMap::new(),
+			hot: None,
+			invalidations: None,
+		}
+	}
+
+	/// starts recording which pages get invalidated, for anything that holds on to instructions decoded from them
+	pub fn track_invalidations(&mut self) {
+		self.invalidations.get_or_insert_default();
+	}
+
+	/// whether anything was invalidated since the last take_invalidations
+	#[inline]
+	pub fn has_invalidations(&self) -> bool {
+		self.invalidations
+			.as_ref()
+			.is_some_and(|inv| inv.all || !inv.pages.is_empty())
+	}
+
+	pub fn take_invalidations(&mut self) -> Invalidations {
+		self.invalidations.as_mut().map(std::mem::take).unwrap_or_default()
+	}
+
+	/// makes `base` the hot page, returns None if nothing has been decoded from it yet
+	#[inline]
+	fn make_hot(&mut self, base: PageBase) -> Option<&mut DecodedPage> {
+		if !matches!(self.hot, Some((hot_base, _)) if hot_base == base) {
+			let page = self.pages.remove(&base)?;
+			if let Some((prev_base, prev)) = self.hot.replace((base, page)) {
+				self.pages.insert(prev_base, prev);
+			}
+		}
+		self.hot.as_mut().map(|(_, page)| page)
+	}
+
+	/// returns the decoded instruction if the instruction at `pc` has been decoded before
+	#[inline]
+	pub fn get(&mut self, pc: u64) -> Option<MicroOp> {
+		let page = self.make_hot(PageBase::from_addr(pc))?;
+		page.slots[DecodedPage::slot(pc)]
+	}
+
+	pub fn insert(&mut self, pc: u64, op: MicroOp) {
+		let base = PageBase::from_addr(pc);
+		if PageBase::from_addr(pc.wrapping_add(op.len() - 1)) != base {
+			// this instruction would need to be invalidated by writes to either page, don't bother
+			return;
+		}
+
+		if self.make_hot(base).is_none() {
+			if let Some((prev_base, prev)) = self.hot.replace((base, DecodedPage::new())) {
+				self.pages.insert(prev_base, prev);
+			}
+		}
+		// UNWRAP: the page was just made hot
+		let (_, page) = self.hot.as_mut().unwrap();
+		page.slots[DecodedPage::slot(pc)] = Some(op);
+	}
+
+	/// drops the decoded instruction at `pc`, if any
+	pub fn remove(&mut self, pc: u64) {
+		let base = PageBase::from_addr(pc);
+		let page = match &mut self.hot {
+			Some((hot_base, page)) if *hot_base == base => Some(page),
+			_ => self.pages.get_mut(&base),
+		};
+		if let Some(page) = page {
+			page.slots[DecodedPage::slot(pc)] = None;
+			if let Some(invalidations) = &mut self.invalidations {
+				if !invalidations.all {
+					invalidations.pages.push(base);
+				}
+			}
+		}
+	}
+
+	/// drops every decoded instruction
+	pub fn clear(&mut self) {
+		trace!("invalidating all decoded instructions");
+		self.pages.clear();
+		self.hot = None;
+		if let Some(invalidations) = &mut self.invalidations {
+			invalidations.pages.clear();
+			invalidations.all = true;
+		}
+	}
+
+	/// keeps the decoded instructions, but tells whoever holds on to them by virtual address that they may be at
+	/// different addresses now
+	pub fn forget_addresses(&mut self) {
+		if let Some(invalidations) = &mut self.invalidations {
+			invalidations.pages.clear();
+			invalidations.all = true;
+		}
+	}
+
+	/// drops every decoded instruction on the pages overlapping `addr..addr + len`
+	#[inline]
+	pub fn invalidate_range(&mut self, addr: u64, len: u64) {
+		if len == 0 || (self.hot.is_none() && self.pages.is_empty()) {
+			return;
+		}
+
+		let last = PageBase::from_addr(addr.saturating_add(len - 1));
+		let mut base = PageBase::from_addr(addr);
+		loop {
+			self.invalidate_page(base);
+			if base == last {
+				break;
+			}
+			base = PageBase::from_addr(base.addr() + PAGE_SIZE);
+		}
+	}
+
+	fn invalidate_page(&mut self, base: PageBase) {
+		if matches!(self.hot, Some((hot_base, _)) if hot_base == base) {
+			self.hot = None;
+		} else if self.pages.remove(&base).is_none() {
+			return;
+		}
+
+		trace!("invalidating decoded instructions for {:?}", base);
+		if let Some(invalidations) = &mut self.invalidations {
+			if !invalidations.all {
+				invalidations.pages.push(base);
+			}
+		}
+	}
+}
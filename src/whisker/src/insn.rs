@@ -4,19 +4,22 @@ pub mod csr;
 pub mod float;
 pub mod int;
 pub mod multiply;
+pub mod uop;
 
 use atomic::AtomicInstruction;
 use compressed::CompressedInstruction;
 use float::FloatInstruction;
 use int::IntInstruction;
 use multiply::MultiplyInstruction;
+use uop::MicroOp;
 
 use crate::insn::csr::CSRInstruction;
+use crate::mem::Access;
 use crate::ty::{SupportedExtensions, TrapIdx};
 use crate::util::extract_bits_16;
 use crate::{insn16, insn32, WhiskerCpu};
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 pub enum Instruction {
 	IntExtension(IntInstruction),
 	FloatExtension(FloatInstruction),
@@ -26,16 +29,46 @@ pub enum Instruction {
 	MultiplyInstruction(MultiplyInstruction),
 }
 
+/// reads and decodes the instruction at the pc, see [Instruction::decoder]
+pub type Decoder = fn(&mut WhiskerCpu) -> Result<(Instruction, u64), ()>;
+
 impl Instruction {
+	/// picks the decoder for a cpu supporting `supported`. the usual configuration gets one with every extension
+	/// check resolved at compile time, so disabled extensions are compiled out. anything else checks at runtime
+	pub fn decoder(supported: SupportedExtensions) -> Decoder {
+		const RV64IMAFC: u64 = SupportedExtensions::RV64IMAFC.bits();
+		match supported.bits() {
+			RV64IMAFC => Self::decode_instruction::<RV64IMAFC>,
+			_ => Self::decode_instruction::<{ SupportedExtensions::DYNAMIC }>,
+		}
+	}
+
 	/// tries to fetch an instruction, or returns Err if a trap happened during the fetch
-	pub fn fetch_instruction(cpu: &mut WhiskerCpu) -> Result<(Instruction, u64), ()> {
+	/// instructions that were decoded before are served from the decoded instruction cache
+	pub fn fetch_instruction(cpu: &mut WhiskerCpu) -> Result<MicroOp, ()> {
+		let pc = cpu.pc;
+		if let Some(cached) = cpu.mem.decoded(pc) {
+			return Ok(cached);
+		}
+
+		let (insn, size) = (cpu.decoder)(cpu)?;
+		let op = MicroOp::new(insn, size);
+		// the cpu only checks for breakpoints when an instruction isn't cached
+		if !cpu.has_breakpoint(pc) {
+			cpu.mem.cache_decoded(pc, op);
+		}
+		Ok(op)
+	}
+
+	/// reads and decodes the instruction at the pc, or returns Err if a trap happened during the fetch
+	fn decode_instruction<const EXT: u64>(cpu: &mut WhiskerCpu) -> Result<(Instruction, u64), ()> {
 		let pc = cpu.pc;
-		let support_compressed = cpu.supported_extensions.has(SupportedExtensions::COMPRESSED);
+		let support_compressed = cpu.supports::<EXT>(SupportedExtensions::COMPRESSED);
 
-		let parcel1 = match cpu.mem.read_u16(pc) {
+		let parcel1 = match cpu.mem.fetch_u16(pc) {
 			Ok(parcel1) => parcel1,
-			Err(addr) => {
-				cpu.request_trap(TrapIdx::INSTRUCTION_PAGE_FAULT, addr);
+			Err(fault) => {
+				cpu.request_trap(fault.cause(Access::Fetch), fault.addr);
 				return Err(());
 			}
 		};
@@ -49,14 +82,14 @@ impl Instruction {
 				Err(())
 			}
 		} else if extract_bits_16(parcel1, 2, 4) != 0b111 {
-			let full_parcel = match cpu.mem.read_u32(pc) {
+			let full_parcel = match cpu.mem.fetch_u32(pc) {
 				Ok(p) => p,
-				Err(addr) => {
-					cpu.request_trap(TrapIdx::INSTRUCTION_PAGE_FAULT, addr);
+				Err(fault) => {
+					cpu.request_trap(fault.cause(Access::Fetch), fault.addr);
 					return Err(());
 				}
 			};
-			let insn = insn32::parse(cpu, full_parcel)?;
+			let insn = insn32::parse::<EXT>(cpu, full_parcel)?;
 			Ok((insn, 4))
 		} else if extract_bits_16(parcel1, 0, 5) == 0b011111 {
 			if support_compressed {
@@ -2,160 +2,160 @@ use crate::ty::GPRegisterIndex;
 
 use super::Instruction;
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 pub enum AtomicInstruction {
 	LoadReservedWord {
 		src: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	StoreConditionalWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	SwapWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	AddWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	XorWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	AndWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	OrWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MinWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MaxWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MinUnsignedWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MaxUnsignedWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 
 	LoadReservedDoubleWord {
 		src: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	StoreConditionalDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	SwapDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	AddDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	XorDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	AndDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	OrDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MinDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MaxDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MinUnsignedDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 	MaxUnsignedDoubleWord {
 		src1: GPRegisterIndex,
 		src2: GPRegisterIndex,
 		dst: GPRegisterIndex,
-		_aq: bool,
-		_rl: bool,
+		aq: bool,
+		rl: bool,
 	},
 }
 
@@ -1,6 +1,6 @@
 use super::Instruction;
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 pub enum CompressedInstruction {
 	Nop,
 }
@@ -1,7 +1,7 @@
 use crate::insn::Instruction;
 use crate::ty::GPRegisterIndex;
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 pub enum CSRInstruction {
 	CSRReadWrite {
 		dst: GPRegisterIndex,
@@ -35,6 +35,20 @@ pub enum CSRInstruction {
 	},
 }
 
+impl CSRInstruction {
+	/// the address of the CSR this accesses
+	pub fn csr(&self) -> u16 {
+		match *self {
+			Self::CSRReadWrite { csr, .. }
+			| Self::CSRReadAndSet { csr, .. }
+			| Self::CSRReadAndClear { csr, .. }
+			| Self::CSRReadWriteImm { csr, .. }
+			| Self::CSRReadAndSetImm { csr, .. }
+			| Self::CSRReadAndClearImm { csr, .. } => csr,
+		}
+	}
+}
+
 impl Into<Instruction> for CSRInstruction {
 	fn into(self) -> Instruction {
 		Instruction::Csr(self)
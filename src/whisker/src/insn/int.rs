@@ -2,7 +2,7 @@ use crate::ty::GPRegisterIndex;
 
 use super::Instruction;
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 pub enum IntInstruction {
 	LoadUpperImmediate {
 		dst: GPRegisterIndex,
@@ -249,11 +249,27 @@ pub enum IntInstruction {
 		dst: GPRegisterIndex,
 	},
 
+	// =========
+	// MISC-MEM
+	// =========
+	Fence,
+	/// FENCE.I
+	FenceInstructions,
+
 	// =========
 	// SYSTEM
 	// =========
 	ECall,
 	EBreak,
+	/// MRET
+	MachineReturn,
+	/// WFI
+	WaitForInterrupt,
+	/// SFENCE.VMA, x0 in either register means all addresses or all address spaces
+	SFenceVma {
+		vaddr: GPRegisterIndex,
+		asid: GPRegisterIndex,
+	},
 }
 
 impl Into<Instruction> for IntInstruction {
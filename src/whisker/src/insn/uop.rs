@@ -0,0 +1,332 @@
+//! A fixed size form of [Instruction] for everything that keeps decoded instructions around.
+//!
+//! [Instruction] nests an enum per extension with differently typed fields, so it's a lot bigger than it needs to be
+//! and telling what it is takes a match per level. A [MicroOp] is the same instruction flattened into an opcode and
+//! a handful of register and immediate slots, 16 bytes with the length of the instruction included. Converting one
+//! way and back always gives the same instruction.
+
+use crate::insn::atomic::AtomicInstruction;
+use crate::insn::compressed::CompressedInstruction;
+use crate::insn::csr::CSRInstruction;
+use crate::insn::float::FloatInstruction;
+use crate::insn::int::IntInstruction;
+use crate::insn::multiply::MultiplyInstruction;
+use crate::insn::Instruction;
+use crate::soft::RoundingMode;
+use crate::ty::{FPRegisterIndex, GPRegisterIndex};
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct MicroOp {
+	pub opcode: Opcode,
+	/// length of the instruction in bytes
+	pub size: u8,
+	pub rd: u8,
+	pub rs1: u8,
+	pub rs2: u8,
+	pub rs3: u8,
+	/// small extra operands: the rounding mode of floating point ops, or the aq and rl bits of atomics
+	pub aux: [u8; 2],
+	pub imm: i64,
+}
+
+const _: () = assert!(size_of::<MicroOp>() == 16);
+// so the decoded instruction cache doesn't need any room for a tag
+const _: () = assert!(size_of::<Option<MicroOp>>() == 16);
+
+impl std::fmt::Debug for MicroOp {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		self.instruction().fmt(f)
+	}
+}
+
+impl MicroOp {
+	#[inline(always)]
+	fn empty(opcode: Opcode, size: u64) -> Self {
+		Self {
+			opcode,
+			size: size as u8,
+			rd: 0,
+			rs1: 0,
+			rs2: 0,
+			rs3: 0,
+			aux: [0; 2],
+			imm: 0,
+		}
+	}
+
+	#[inline(always)]
+	pub fn rd(&self) -> GPRegisterIndex {
+		GPRegisterIndex::from_bits(self.rd)
+	}
+
+	#[inline(always)]
+	pub fn rs1(&self) -> GPRegisterIndex {
+		GPRegisterIndex::from_bits(self.rs1)
+	}
+
+	#[inline(always)]
+	pub fn rs2(&self) -> GPRegisterIndex {
+		GPRegisterIndex::from_bits(self.rs2)
+	}
+
+	#[inline(always)]
+	pub fn len(&self) -> u64 {
+		u64::from(self.size)
+	}
+}
+
+/// how a field of an [Instruction] is stored in a [MicroOp] slot
+trait Slot<Raw>: Sized {
+	fn pack(self) -> Raw;
+	fn unpack(raw: Raw) -> Self;
+}
+
+impl Slot<u8> for GPRegisterIndex {
+	fn pack(self) -> u8 {
+		self.as_usize() as u8
+	}
+
+	fn unpack(raw: u8) -> Self {
+		Self::from_bits(raw)
+	}
+}
+
+impl Slot<u8> for FPRegisterIndex {
+	fn pack(self) -> u8 {
+		self.as_usize() as u8
+	}
+
+	fn unpack(raw: u8) -> Self {
+		Self::from_bits(raw)
+	}
+}
+
+impl Slot<u8> for bool {
+	fn pack(self) -> u8 {
+		u8::from(self)
+	}
+
+	fn unpack(raw: u8) -> Self {
+		raw != 0
+	}
+}
+
+impl Slot<u8> for RoundingMode {
+	fn pack(self) -> u8 {
+		self.to_u8()
+	}
+
+	fn unpack(raw: u8) -> Self {
+		// UNWRAP: only ever packed from a valid rounding mode
+		Self::from_u8(raw).unwrap()
+	}
+}
+
+/// the 5 bit immediates of the CSR instructions
+impl Slot<u8> for u64 {
+	fn pack(self) -> u8 {
+		debug_assert!(self <= 0b11111);
+		self as u8
+	}
+
+	fn unpack(raw: u8) -> Self {
+		u64::from(raw)
+	}
+}
+
+impl Slot<i64> for i64 {
+	fn pack(self) -> i64 {
+		self
+	}
+
+	fn unpack(raw: i64) -> Self {
+		raw
+	}
+}
+
+macro_rules! impl_imm_slot {
+	($($ty:ty),*) => {$(
+		impl Slot<i64> for $ty {
+			fn pack(self) -> i64 {
+				i64::from(self)
+			}
+
+			fn unpack(raw: i64) -> Self {
+				raw as $ty
+			}
+		}
+	)*};
+}
+
+impl_imm_slot!(i32, u32, u16);
+
+/// declares an opcode per instruction and where each of its fields goes in a [MicroOp]
+macro_rules! micro_ops {
+	($($ext:ident($ty:ident) {
+		$($opcode:ident => $variant:ident $({ $($field:ident: $slot:ident $([$idx:literal])?),* $(,)? })?,)*
+	})*) => {
+		#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+		#[repr(u8)]
+		pub enum Opcode {
+			$($($opcode,)*)*
+		}
+
+		impl Opcode {
+			pub const COUNT: usize = [$($(Opcode::$opcode,)*)*].len();
+		}
+
+		impl MicroOp {
+			/// flattens `insn`, which is `size` bytes long
+			pub fn new(insn: Instruction, size: u64) -> Self {
+				match insn {
+					$($(
+						#[allow(unused_mut)]
+						Instruction::$ext($ty::$variant $({ $($field),* })?) => {
+							let mut op = Self::empty(Opcode::$opcode, size);
+							$($(op.$slot $([$idx])? = Slot::pack($field);)*)?
+							op
+						}
+					)*)*
+				}
+			}
+
+			/// turns this back into the instruction it was made from
+			pub fn instruction(&self) -> Instruction {
+				match self.opcode {
+					$($(
+						Opcode::$opcode => Instruction::$ext($ty::$variant $({
+							$($field: Slot::unpack(self.$slot $([$idx])?)),*
+						})?),
+					)*)*
+				}
+			}
+		}
+	};
+}
+
+micro_ops! {
+	IntExtension(IntInstruction) {
+		Lui => LoadUpperImmediate { dst: rd, val: imm },
+		Auipc => AddUpperImmediateToPc { dst: rd, val: imm },
+		Sb => StoreByte { dst: rs1, dst_offset: imm, src: rs2 },
+		Sh => StoreHalf { dst: rs1, dst_offset: imm, src: rs2 },
+		Sw => StoreWord { dst: rs1, dst_offset: imm, src: rs2 },
+		Sd => StoreDoubleWord { dst: rs1, dst_offset: imm, src: rs2 },
+		Lb => LoadByte { dst: rd, src: rs1, src_offset: imm },
+		Lh => LoadHalf { dst: rd, src: rs1, src_offset: imm },
+		Lw => LoadWord { dst: rd, src: rs1, src_offset: imm },
+		Ld => LoadDoubleWord { dst: rd, src: rs1, src_offset: imm },
+		Lbu => LoadByteZeroExtend { dst: rd, src: rs1, src_offset: imm },
+		Lhu => LoadHalfZeroExtend { dst: rd, src: rs1, src_offset: imm },
+		Lwu => LoadWordZeroExtend { dst: rd, src: rs1, src_offset: imm },
+		Add => Add { dst: rd, lhs: rs1, rhs: rs2 },
+		Sub => Sub { dst: rd, lhs: rs1, rhs: rs2 },
+		Xor => Xor { dst: rd, lhs: rs1, rhs: rs2 },
+		Or => Or { dst: rd, lhs: rs1, rhs: rs2 },
+		And => And { dst: rd, lhs: rs1, rhs: rs2 },
+		Sll => ShiftLeftLogical { dst: rd, lhs: rs1, rhs: rs2 },
+		Srl => ShiftRightLogical { dst: rd, lhs: rs1, rhs: rs2 },
+		Sra => ShiftRightArithmetic { dst: rd, lhs: rs1, rhs: rs2 },
+		Slt => SetLessThan { dst: rd, lhs: rs1, rhs: rs2 },
+		Sltu => SetLessThanUnsigned { dst: rd, lhs: rs1, rhs: rs2 },
+		Addi => AddImmediate { dst: rd, lhs: rs1, rhs: imm },
+		Xori => XorImmediate { dst: rd, lhs: rs1, rhs: imm },
+		Ori => OrImmediate { dst: rd, lhs: rs1, rhs: imm },
+		Andi => AndImmediate { dst: rd, lhs: rs1, rhs: imm },
+		Slli => ShiftLeftLogicalImmediate { dst: rd, lhs: rs1, shift_amt: imm },
+		Srli => ShiftRightLogicalImmediate { dst: rd, lhs: rs1, shift_amt: imm },
+		Srai => ShiftRightArithmeticImmediate { dst: rd, lhs: rs1, shift_amt: imm },
+		Slti => SetLessThanImmediate { dst: rd, lhs: rs1, rhs: imm },
+		Sltiu => SetLessThanUnsignedImmediate { dst: rd, lhs: rs1, rhs: imm },
+		Jal => JumpAndLink { link_reg: rd, jmp_off: imm },
+		Jalr => JumpAndLinkRegister { link_reg: rd, jmp_reg: rs1, jmp_off: imm },
+		Beq => BranchEqual { lhs: rs1, rhs: rs2, imm: imm },
+		Bne => BranchNotEqual { lhs: rs1, rhs: rs2, imm: imm },
+		Blt => BranchLessThan { lhs: rs1, rhs: rs2, imm: imm },
+		Bge => BranchGreaterEqual { lhs: rs1, rhs: rs2, imm: imm },
+		Bltu => BranchLessThanUnsigned { lhs: rs1, rhs: rs2, imm: imm },
+		Bgeu => BranchGreaterEqualUnsigned { lhs: rs1, rhs: rs2, imm: imm },
+		Addiw => AddImmediateWord { dst: rd, lhs: rs1, rhs: imm },
+		Slliw => ShiftLeftLogicalImmediateWord { dst: rd, lhs: rs1, shift_amt: imm },
+		Srliw => ShiftRightLogicalImmediateWord { dst: rd, lhs: rs1, shift_amt: imm },
+		Sraiw => ShiftRightArithmeticImmediateWord { dst: rd, lhs: rs1, shift_amt: imm },
+		Addw => AddWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Subw => SubWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Sllw => ShiftLeftLogicalWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Srlw => ShiftRightLogicalWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Sraw => ShiftRightArithmeticWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Fence => Fence,
+		FenceI => FenceInstructions,
+		Ecall => ECall,
+		Ebreak => EBreak,
+		Mret => MachineReturn,
+		Wfi => WaitForInterrupt,
+		SfenceVma => SFenceVma { vaddr: rs1, asid: rs2 },
+	}
+	FloatExtension(FloatInstruction) {
+		Flw => LoadWord { dst: rd, src: rs1, src_offset: imm },
+		Fsw => StoreWord { dst: rs1, dst_offset: imm, src: rs2 },
+		FaddS => Add { dst: rd, lhs: rs1, rhs: rs2, rm: aux[0] },
+		FsubS => Sub { dst: rd, lhs: rs1, rhs: rs2, rm: aux[0] },
+		FmulS => Mul { dst: rd, lhs: rs1, rhs: rs2, rm: aux[0] },
+		FdivS => Div { dst: rd, lhs: rs1, rhs: rs2, rm: aux[0] },
+		FsqrtS => Sqrt { dst: rd, val: rs1, rm: aux[0] },
+		FminS => Min { dst: rd, lhs: rs1, rhs: rs2 },
+		FmaxS => Max { dst: rd, lhs: rs1, rhs: rs2 },
+		FeqS => Equal { dst: rd, lhs: rs1, rhs: rs2 },
+		FltS => LessThan { dst: rd, lhs: rs1, rhs: rs2 },
+		FleS => LessOrEqual { dst: rd, lhs: rs1, rhs: rs2 },
+		FmaddS => MulAdd { dst: rd, mul_lhs: rs1, mul_rhs: rs2, add: rs3, rm: aux[0] },
+	}
+	Csr(CSRInstruction) {
+		Csrrw => CSRReadWrite { dst: rd, src: rs1, csr: imm },
+		Csrrs => CSRReadAndSet { dst: rd, mask: rs1, csr: imm },
+		Csrrc => CSRReadAndClear { dst: rd, mask: rs1, csr: imm },
+		Csrrwi => CSRReadWriteImm { dst: rd, src: rs1, csr: imm },
+		Csrrsi => CSRReadAndSetImm { dst: rd, mask: rs1, csr: imm },
+		Csrrci => CSRReadAndClearImm { dst: rd, mask: rs1, csr: imm },
+	}
+	CompressedExtension(CompressedInstruction) {
+		CNop => Nop,
+	}
+	AtomicExtension(AtomicInstruction) {
+		LrW => LoadReservedWord { src: rs1, dst: rd, aq: aux[0], rl: aux[1] },
+		ScW => StoreConditionalWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoswapW => SwapWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoaddW => AddWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoxorW => XorWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoandW => AndWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoorW => OrWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmominW => MinWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmomaxW => MaxWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmominuW => MinUnsignedWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmomaxuW => MaxUnsignedWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		LrD => LoadReservedDoubleWord { src: rs1, dst: rd, aq: aux[0], rl: aux[1] },
+		ScD => StoreConditionalDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoswapD => SwapDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoaddD => AddDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoxorD => XorDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoandD => AndDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmoorD => OrDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmominD => MinDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmomaxD => MaxDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmominuD => MinUnsignedDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+		AmomaxuD => MaxUnsignedDoubleWord { src1: rs1, src2: rs2, dst: rd, aq: aux[0], rl: aux[1] },
+	}
+	MultiplyInstruction(MultiplyInstruction) {
+		Mul => Multiply { dst: rd, lhs: rs1, rhs: rs2 },
+		Mulh => MultiplyHigh { dst: rd, lhs: rs1, rhs: rs2 },
+		Mulhsu => MultiplyHighSignedUnsigned { dst: rd, lhs: rs1, rhs: rs2 },
+		Mulhu => MultiplyHighUnsigned { dst: rd, lhs: rs1, rhs: rs2 },
+		Div => Divide { dst: rd, lhs: rs1, rhs: rs2 },
+		Divu => DivideUnsigned { dst: rd, lhs: rs1, rhs: rs2 },
+		Rem => Remainder { dst: rd, lhs: rs1, rhs: rs2 },
+		Remu => RemainderUnsigned { dst: rd, lhs: rs1, rhs: rs2 },
+		Mulw => MultiplyWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Divw => DivideWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Divuw => DivideUnsignedWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Remw => RemainderWord { dst: rd, lhs: rs1, rhs: rs2 },
+		Remuw => RemainderUnsignedWord { dst: rd, lhs: rs1, rhs: rs2 },
+	}
+}
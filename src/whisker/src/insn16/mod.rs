@@ -1,16 +1,23 @@
+use std::sync::LazyLock;
+
 use tracing::trace;
 
 use crate::insn16::ty::CWideImmType;
 use crate::{
 	cpu::WhiskerCpu,
-	insn::{compressed::CompressedInstruction, int::IntInstruction, Instruction},
+	insn::{
+		compressed::CompressedInstruction,
+		int::IntInstruction,
+		uop::{MicroOp, Opcode},
+		Instruction,
+	},
 	insn16::ty::{CAType, CBArithType, CBranchType, CImmType, CJType, CLoadType, CRType, CStackStoreType, CStoreType},
 	ty::{GPRegisterIndex, TrapIdx},
 	util::extract_bits_16,
 };
 
 impl CompressedInstruction {
-	pub fn parse_c0(cpu: &mut WhiskerCpu, parcel: u16) -> Result<Instruction, ()> {
+	fn parse_c0(parcel: u16) -> Result<Instruction, DecodeError> {
 		use consts::opcode::c0::*;
 
 		let ty = extract_bits_16(parcel, 13, 15) as u8;
@@ -18,8 +25,7 @@ impl CompressedInstruction {
 			ADDI4SPN => {
 				let iw = CWideImmType::parse(parcel);
 				if iw.imm() == 0 {
-					cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-					Err(())
+					Err(DecodeError::Illegal)
 				} else {
 					Ok(IntInstruction::AddImmediate {
 						dst: iw.dst(),
@@ -29,9 +35,7 @@ impl CompressedInstruction {
 					.into())
 				}
 			}
-			FLD => {
-				todo!("FLD (D ext)")
-			}
+			FLD => Err(DecodeError::Unimplemented("FLD (D ext)")),
 			LOAD_WORD => {
 				let cl = CLoadType::parse(parcel);
 				Ok(IntInstruction::LoadWord {
@@ -52,13 +56,8 @@ impl CompressedInstruction {
 				}
 				.into())
 			}
-			RESERVED => {
-				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-				Err(())
-			}
-			FSD => {
-				todo!("FSD (D ext)")
-			}
+			RESERVED => Err(DecodeError::Illegal),
+			FSD => Err(DecodeError::Unimplemented("FSD (D ext)")),
 			STORE_WORD => {
 				let cs = CStoreType::parse(parcel);
 				Ok(IntInstruction::StoreWord {
@@ -83,7 +82,7 @@ impl CompressedInstruction {
 		}
 	}
 
-	pub fn parse_c1(cpu: &mut WhiskerCpu, parcel: u16) -> Result<Instruction, ()> {
+	fn parse_c1(parcel: u16) -> Result<Instruction, DecodeError> {
 		let func3 = extract_bits_16(parcel, 13, 15) as u8;
 
 		use consts::opcode::c1::*;
@@ -105,8 +104,7 @@ impl CompressedInstruction {
 				let im = CImmType::parse(parcel);
 				if im.reg() == GPRegisterIndex::ZERO {
 					// reserved
-					cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-					Err(())
+					Err(DecodeError::Illegal)
 				} else {
 					Ok(IntInstruction::AddImmediateWord {
 						dst: im.reg(),
@@ -119,7 +117,7 @@ impl CompressedInstruction {
 			LI => {
 				let im = CImmType::parse(parcel);
 				if im.reg() == GPRegisterIndex::ZERO {
-					todo!("HINT")
+					Err(DecodeError::Unimplemented("HINT"))
 				} else {
 					Ok(IntInstruction::AddImmediate {
 						dst: im.reg(),
@@ -133,10 +131,9 @@ impl CompressedInstruction {
 				let im = CImmType::parse(parcel);
 				if im.imm() == 0 {
 					// reserved
-					cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-					Err(())
+					Err(DecodeError::Illegal)
 				} else if im.reg() == GPRegisterIndex::ZERO {
-					todo!("HINT")
+					Err(DecodeError::Unimplemented("HINT"))
 				} else if im.reg().as_usize() == 2 {
 					Ok(IntInstruction::AddImmediate {
 						dst: im.reg(),
@@ -185,7 +182,7 @@ impl CompressedInstruction {
 				match func2 {
 					func2::SRLI => {
 						if cb.imm() == 0 {
-							todo!("HINT")
+							Err(DecodeError::Unimplemented("HINT"))
 						} else {
 							Ok(IntInstruction::ShiftRightLogicalImmediate {
 								dst: cb.reg(),
@@ -197,7 +194,7 @@ impl CompressedInstruction {
 					}
 					func2::SRAI => {
 						if cb.imm() == 0 {
-							todo!("HINT")
+							Err(DecodeError::Unimplemented("HINT"))
 						} else {
 							Ok(IntInstruction::ShiftRightArithmeticImmediate {
 								dst: cb.reg(),
@@ -219,16 +216,11 @@ impl CompressedInstruction {
 						let sub_func2 = extract_bits_16(parcel, 5, 6) as u8;
 						if is_word {
 							match sub_func2 {
-								SUBW => {
-									todo!("SUBW (OP-32)")
-								}
-								ADDW => {
-									todo!("ADDW (OP-32)")
-								}
+								SUBW => Err(DecodeError::Unimplemented("SUBW (OP-32)")),
+								ADDW => Err(DecodeError::Unimplemented("ADDW (OP-32)")),
 								_ => {
 									// RESERVED
-									cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-									Err(())
+									Err(DecodeError::Illegal)
 								}
 							}
 						} else {
@@ -265,20 +257,20 @@ impl CompressedInstruction {
 				}
 			}
 
-			_ => todo!("C1 func3 {func3:#05b}"),
+			_ => Err(DecodeError::Unimplemented("C1 func3")),
 		}
 	}
 
-	pub fn parse_c2(cpu: &mut WhiskerCpu, parcel: u16) -> Result<Instruction, ()> {
+	fn parse_c2(parcel: u16) -> Result<Instruction, DecodeError> {
 		use consts::opcode::c2::*;
 		let func3 = extract_bits_16(parcel, 13, 15) as u8;
 		match func3 {
 			SLLI => {
 				let im = CImmType::parse(parcel);
 				if im.reg() == GPRegisterIndex::ZERO {
-					todo!("HINT")
+					Err(DecodeError::Unimplemented("HINT"))
 				} else if im.imm() == 0 {
-					todo!("HINT")
+					Err(DecodeError::Unimplemented("HINT"))
 				} else {
 					Ok(IntInstruction::ShiftLeftLogicalImmediate {
 						dst: im.reg(),
@@ -288,15 +280,12 @@ impl CompressedInstruction {
 					.into())
 				}
 			}
-			FLDSP => {
-				todo!("FLDSP (F extension)")
-			}
+			FLDSP => Err(DecodeError::Unimplemented("FLDSP (F extension)")),
 			LWSP => {
 				let im = CImmType::parse(parcel);
 				if im.reg() == GPRegisterIndex::ZERO {
 					// reserved
-					cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-					Err(())
+					Err(DecodeError::Illegal)
 				} else {
 					Ok(IntInstruction::LoadWord {
 						dst: im.reg(),
@@ -310,8 +299,7 @@ impl CompressedInstruction {
 				let im = CImmType::parse(parcel);
 				if im.reg() == GPRegisterIndex::ZERO {
 					// reserved
-					cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-					Err(())
+					Err(DecodeError::Illegal)
 				} else {
 					Ok(IntInstruction::LoadDoubleWord {
 						dst: im.reg(),
@@ -329,12 +317,9 @@ impl CompressedInstruction {
 						match (crtype.src1(), crtype.src2()) {
 							(GPRegisterIndex::ZERO, GPRegisterIndex::ZERO) => {
 								// reserved
-								cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
-								Err(())
-							}
-							(GPRegisterIndex::ZERO, _rs2) => {
-								todo!("HINT")
+								Err(DecodeError::Illegal)
 							}
+							(GPRegisterIndex::ZERO, _rs2) => Err(DecodeError::Unimplemented("HINT")),
 							(rs1, GPRegisterIndex::ZERO) => Ok(IntInstruction::JumpAndLinkRegister {
 								link_reg: GPRegisterIndex::ZERO,
 								jmp_reg: rs1,
@@ -351,9 +336,7 @@ impl CompressedInstruction {
 					}
 					JALR_EBREAK_ADD => match (crtype.src1(), crtype.src2()) {
 						(GPRegisterIndex::ZERO, GPRegisterIndex::ZERO) => Ok(IntInstruction::EBreak.into()),
-						(GPRegisterIndex::ZERO, _rs2) => {
-							todo!("HINT")
-						}
+						(GPRegisterIndex::ZERO, _rs2) => Err(DecodeError::Unimplemented("HINT")),
 						(rs1, GPRegisterIndex::ZERO) => Ok(IntInstruction::JumpAndLinkRegister {
 							link_reg: GPRegisterIndex::LINK_REG,
 							jmp_reg: rs1,
@@ -370,9 +353,7 @@ impl CompressedInstruction {
 					_ => unreachable!(),
 				}
 			}
-			FSDSP => {
-				todo!("FSDSP (D extension)")
-			}
+			FSDSP => Err(DecodeError::Unimplemented("FSDSP (D extension)")),
 			SWSP => {
 				let ss = CStackStoreType::parse(parcel);
 				Ok(IntInstruction::StoreWord {
@@ -396,19 +377,95 @@ impl CompressedInstruction {
 	}
 }
 
-pub fn parse(cpu: &mut WhiskerCpu, parcel: u16) -> Result<Instruction, ()> {
-	use consts::opcode::*;
+/// why a compressed parcel didn't decode to an instruction
+#[derive(Debug, Clone, Copy)]
+enum DecodeError {
+	/// raises an illegal instruction exception
+	Illegal,
+	/// a valid encoding we don't support yet
+	Unimplemented(&'static str),
+}
+
+/// a decoded compressed instruction in 8 bytes. it's a [MicroOp] without the slots compressed instructions never use:
+/// none of them have a third source or aux operands, and all their immediates fit in 32 bits
+#[derive(Debug, Clone, Copy)]
+struct PackedOp {
+	opcode: Opcode,
+	rd: u8,
+	rs1: u8,
+	rs2: u8,
+	imm: i32,
+}
 
-	let opcode_ty = extract_bits_16(parcel, 0, 1) as u8;
+// so the table below is half a MiB, with illegal and unimplemented parcels as None
+const _: () = assert!(size_of::<Option<PackedOp>>() == 8);
+
+impl PackedOp {
+	fn new(insn: Instruction) -> Self {
+		let op = MicroOp::new(insn, 2);
+		debug_assert!(op.rs3 == 0 && op.aux == [0; 2]);
+		Self {
+			opcode: op.opcode,
+			rd: op.rd,
+			rs1: op.rs1,
+			rs2: op.rs2,
+			// UNWRAP: compressed immediates are at most 18 bits
+			imm: op.imm.try_into().unwrap(),
+		}
+	}
+
+	fn instruction(self) -> Instruction {
+		MicroOp {
+			opcode: self.opcode,
+			size: 2,
+			rd: self.rd,
+			rs1: self.rs1,
+			rs2: self.rs2,
+			rs3: 0,
+			aux: [0; 2],
+			imm: i64::from(self.imm),
+		}
+		.instruction()
+	}
+}
+
+fn decode(parcel: u16) -> Result<Instruction, DecodeError> {
+	match extract_bits_16(parcel, 0, 1) as u8 {
+		consts::opcode::C0 => CompressedInstruction::parse_c0(parcel),
+		consts::opcode::C1 => CompressedInstruction::parse_c1(parcel),
+		consts::opcode::C2 => CompressedInstruction::parse_c2(parcel),
+		_ => Err(DecodeError::Illegal),
+	}
+}
+
+/// every 16 bit parcel decoded up front, so decoding a compressed instruction is a single load.
+/// it's filled in the first time a compressed instruction is decoded, from the same decoder that used to run on every
+/// parcel. parcels that don't decode are run through the decoder again to find out why, which only happens right
+/// before a trap or a panic. parcels with both low bits set aren't compressed instructions and are never looked up
+// an array rather than a slice so indexing it with a parcel needs no bounds check
+static DECODED: LazyLock<Box<[Option<PackedOp>; 1 << 16]>> = LazyLock::new(|| {
+	let decoded = (0..=u16::MAX)
+		.map(|parcel| decode(parcel).ok().map(PackedOp::new))
+		.collect::<Box<[_]>>();
+	// UNWRAP: there's exactly one entry per parcel
+	decoded.try_into().unwrap()
+});
+
+pub fn parse(cpu: &mut WhiskerCpu, parcel: u16) -> Result<Instruction, ()> {
 	trace!("(C-ext) parcel={parcel:#018b}");
 	if parcel.count_zeros() == u16::BITS {
 		panic!("Invalid 16-bit instruction. Cannot be all zero bits");
 	}
-	match opcode_ty {
-		C0 => CompressedInstruction::parse_c0(cpu, parcel),
-		C1 => CompressedInstruction::parse_c1(cpu, parcel),
-		C2 => CompressedInstruction::parse_c2(cpu, parcel),
-		_ => unreachable!(),
+	if let Some(op) = DECODED[usize::from(parcel)] {
+		return Ok(op.instruction());
+	}
+	match decode(parcel) {
+		Ok(_) => unreachable!("parcel {parcel:#06x} decodes but isn't in the table"),
+		Err(DecodeError::Illegal) => {
+			cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
+			Err(())
+		}
+		Err(DecodeError::Unimplemented(what)) => todo!("{what}"),
 	}
 }
 
@@ -25,79 +25,79 @@ impl AtomicInstruction {
 				Self::LoadReservedWord {
 					src: rtype.src1().to_gp(),
 					dst: rtype.dst().to_gp(),
-					_aq: aq,
-					_rl: rl,
+					aq,
+					rl,
 				}
 			}
 			STORE_CONDITIONAL => Self::StoreConditionalWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			SWAP => Self::SwapWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			ADD => Self::AddWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			XOR => Self::XorWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			AND => Self::AndWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			OR => Self::OrWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MIN => Self::MinWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MAX => Self::MaxWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MIN_UNSIGNED => Self::MinUnsignedWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MAX_UNSIGNED => Self::MaxUnsignedWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			_ => unreachable!(),
 		})
@@ -121,89 +121,89 @@ impl AtomicInstruction {
 				Self::LoadReservedDoubleWord {
 					src: rtype.src1().to_gp(),
 					dst: rtype.dst().to_gp(),
-					_aq: aq,
-					_rl: rl,
+					aq,
+					rl,
 				}
 			}
 			STORE_CONDITIONAL => Self::StoreConditionalDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			SWAP => Self::SwapDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			ADD => Self::AddDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			XOR => Self::XorDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			AND => Self::AndDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			OR => Self::OrDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MIN => Self::MinDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MAX => Self::MaxDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MIN_UNSIGNED => Self::MinUnsignedDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			MAX_UNSIGNED => Self::MaxUnsignedDoubleWord {
 				src1: rtype.src1().to_gp(),
 				src2: rtype.src2().to_gp(),
 				dst: rtype.dst().to_gp(),
-				_aq: aq,
-				_rl: rl,
+				aq,
+				rl,
 			},
 			_ => unreachable!(),
 		})
 	}
 }
 
-pub fn parse_amo(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_amo<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
-	if !cpu.supported_extensions.has(SupportedExtensions::ATOMIC) {
+	if !cpu.supports::<EXT>(SupportedExtensions::ATOMIC) {
 		cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
 		return Err(());
 	}
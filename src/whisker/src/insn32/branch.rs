@@ -5,7 +5,7 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_branch(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_branch<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let btype = BType::parse(parcel);
@@ -16,7 +16,7 @@ pub fn parse_branch(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()
 		| BRANCH_GREATER_EQ
 		| BRANCH_LESS_THAN_UNSIGNED
 		| BRANCH_GREATER_EQ_UNSIGNED => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
 				let insn = IntInstruction::parse_branch(btype);
 				Ok(insn.into())
 			} else {
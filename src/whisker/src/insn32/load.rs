@@ -5,7 +5,7 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_load(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_load<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let itype = IType::parse(parcel);
@@ -17,7 +17,7 @@ pub fn parse_load(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()>
 		| LOAD_BYTE_ZERO_EXTEND
 		| LOAD_HALF_ZERO_EXTEND
 		| LOAD_WORD_ZERO_EXTEND => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
 				Ok(IntInstruction::parse_load(itype).into())
 			} else {
 				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
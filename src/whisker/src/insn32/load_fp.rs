@@ -5,13 +5,13 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_load_fp(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_load_fp<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let itype = IType::parse(parcel);
 	match itype.func() {
 		FLOAT_LOAD_WORD => {
-			if cpu.supported_extensions.has(SupportedExtensions::FLOAT) {
+			if cpu.supports::<EXT>(SupportedExtensions::FLOAT) {
 				Ok(FloatInstruction::parse_load_fp(itype).into())
 			} else {
 				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
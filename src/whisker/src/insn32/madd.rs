@@ -6,12 +6,12 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_madd(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_madd<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use crate::insn32::consts::*;
 
 	// MADD type is reserved for standard F extension only
 	// all opcodes in this type require F (and D requires F)
-	if !cpu.supported_extensions.has(SupportedExtensions::FLOAT) {
+	if !cpu.supports::<EXT>(SupportedExtensions::FLOAT) {
 		cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
 		return Err(());
 	}
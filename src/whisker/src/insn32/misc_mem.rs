@@ -0,0 +1,26 @@
+use crate::{
+	cpu::WhiskerCpu,
+	insn::{int::IntInstruction, Instruction},
+	insn32::IType,
+	ty::TrapIdx,
+};
+
+pub fn parse_misc_mem(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+	use consts::*;
+
+	let itype = IType::parse(parcel);
+	match itype.func() {
+		// the predecessor/successor sets and FENCE.TSO/PAUSE are all treated as a full fence
+		FENCE => Ok(IntInstruction::Fence.into()),
+		FENCE_I => Ok(IntInstruction::FenceInstructions.into()),
+		_ => {
+			cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, u64::from(parcel));
+			Err(())
+		}
+	}
+}
+
+pub mod consts {
+	pub const FENCE: u8 = 0b000;
+	pub const FENCE_I: u8 = 0b001;
+}
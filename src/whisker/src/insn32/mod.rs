@@ -6,6 +6,7 @@ pub mod jalr;
 pub mod load;
 pub mod load_fp;
 pub mod madd;
+pub mod misc_mem;
 pub mod multiply;
 pub mod op;
 pub mod op_32;
@@ -25,15 +26,15 @@ use crate::{
 	util::extract_bits_32,
 };
 
-pub fn parse(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	let opcode_ty = extract_bits_32(parcel, 2, 6);
 	use consts::opcode::*;
 	match opcode_ty {
-		LOAD => load::parse_load(cpu, parcel),
-		LOAD_FP => load_fp::parse_load_fp(cpu, parcel),
+		LOAD => load::parse_load::<EXT>(cpu, parcel),
+		LOAD_FP => load_fp::parse_load_fp::<EXT>(cpu, parcel),
 		CUSTOM_0 => todo!("CUSTOM_0"),
-		MISC_MEM => todo!("MISC_MEM"),
-		OP_IMM => op_imm::parse_op_imm(cpu, parcel),
+		MISC_MEM => misc_mem::parse_misc_mem(cpu, parcel),
+		OP_IMM => op_imm::parse_op_imm::<EXT>(cpu, parcel),
 		AUIPC => {
 			let utype = UType::parse(parcel);
 			Ok(IntInstruction::AddUpperImmediateToPc {
@@ -42,13 +43,13 @@ pub fn parse(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 			}
 			.into())
 		}
-		OP_IMM_32 => op_imm_32::parse_op_imm_32(cpu, parcel),
+		OP_IMM_32 => op_imm_32::parse_op_imm_32::<EXT>(cpu, parcel),
 		UNK_48B => todo!("UNK_48B"),
-		STORE => store::parse_store(cpu, parcel),
-		STORE_FP => store_fp::parse_store_fp(cpu, parcel),
+		STORE => store::parse_store::<EXT>(cpu, parcel),
+		STORE_FP => store_fp::parse_store_fp::<EXT>(cpu, parcel),
 		CUSTOM_1 => todo!("CUSTOM_1"),
-		AMO => amo::parse_amo(cpu, parcel),
-		OP => op::parse_op(cpu, parcel),
+		AMO => amo::parse_amo::<EXT>(cpu, parcel),
+		OP => op::parse_op::<EXT>(cpu, parcel),
 		LUI => {
 			let utype = UType::parse(parcel);
 			Ok(IntInstruction::LoadUpperImmediate {
@@ -57,17 +58,17 @@ pub fn parse(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 			}
 			.into())
 		}
-		OP_32 => op_32::parse_op_32(cpu, parcel),
+		OP_32 => op_32::parse_op_32::<EXT>(cpu, parcel),
 		UNK_64B => todo!("UNK_64B"),
-		MADD => madd::parse_madd(cpu, parcel),
+		MADD => madd::parse_madd::<EXT>(cpu, parcel),
 		MSUB => todo!("MSUB"),
 		NMSUB => todo!("NMSUB"),
 		NMADD => todo!("NMADD"),
-		OP_FP => op_fp::parse_op_fp(cpu, parcel),
+		OP_FP => op_fp::parse_op_fp::<EXT>(cpu, parcel),
 		OP_V => todo!("OP_V"),
 		CUSTOM_2 => todo!("CUSTOM_2"),
 		UNK_48B2 => todo!("UNK_48B2"),
-		BRANCH => branch::parse_branch(cpu, parcel),
+		BRANCH => branch::parse_branch::<EXT>(cpu, parcel),
 		JALR => jalr::parse_jalr(cpu, parcel),
 		RESERVED => todo!("RESERVED"),
 		JAL => {
@@ -78,7 +79,7 @@ pub fn parse(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 			}
 			.into())
 		}
-		SYSTEM => system::parse_system(cpu, parcel),
+		SYSTEM => system::parse_system::<EXT>(cpu, parcel),
 		OP_VE => todo!("OP_VE"),
 		CUSTOM_3 => todo!("CUSTOM_3"),
 		UNK_80B => todo!("UNK_80B"),
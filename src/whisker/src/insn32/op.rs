@@ -5,7 +5,7 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_op(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_op<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let rtype = RType::parse(parcel);
@@ -20,7 +20,7 @@ pub fn parse_op(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 		| XOR
 		| SET_LESS_THAN
 		| SET_LESS_THAN_UNSIGNED => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
 				let insn = IntInstruction::parse_op(rtype);
 				Ok(insn.into())
 			} else {
@@ -30,7 +30,7 @@ pub fn parse_op(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 		}
 
 		MUL | MULH | MULHSU | MULHU | DIV | DIVU | REM | REMU => {
-			if cpu.supported_extensions.has(SupportedExtensions::MULTIPLY) {
+			if cpu.supports::<EXT>(SupportedExtensions::MULTIPLY) {
 				let insn = MultiplyInstruction::parse_op(cpu, rtype)?;
 				Ok(insn.into())
 			} else {
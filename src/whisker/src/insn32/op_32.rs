@@ -5,13 +5,13 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_op_32(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_op_32<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let rtype = RType::parse(parcel);
 	match rtype.func() {
 		ADD_WORD | SUB_WORD | SHIFT_LOGICAL_LEFT_WORD | SHIFT_LOGICAL_RIGHT_WORD | SHIFT_ARITHMETIC_RIGHT_WORD => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
 				let insn = IntInstruction::parse_op_32(rtype);
 				Ok(insn.into())
 			} else {
@@ -21,7 +21,7 @@ pub fn parse_op_32(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()>
 		}
 
 		MUL_WORD | DIV_WORD | DIV_UNSIGNED_WORD | REM_WORD | REM_UNSIGNED_WORD => {
-			if cpu.supported_extensions.has(SupportedExtensions::MULTIPLY) {
+			if cpu.supports::<EXT>(SupportedExtensions::MULTIPLY) {
 				let insn = MultiplyInstruction::parse_op_32(cpu, rtype)?;
 				Ok(insn.into())
 			} else {
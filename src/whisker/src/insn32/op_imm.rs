@@ -5,7 +5,7 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_op_imm(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_op_imm<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let itype = IType::parse(parcel);
@@ -18,7 +18,7 @@ pub fn parse_op_imm(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()
 		| SHIFT_RIGHT_IMM
 		| SET_LESS_THAN_IMM
 		| SET_LESS_THAN_UNSIGNED_IMM => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
 				Ok(IntInstruction::parse_op_imm(itype).into())
 			} else {
 				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
@@ -5,13 +5,13 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_op_imm_32(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_op_imm_32<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let itype = IType::parse(parcel);
 	match itype.func() {
 		ADD_IMM_WORD | SHIFT_LEFT_IMM_WORD | SHIFT_RIGHT_IMM_WORD => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
 				Ok(IntInstruction::parse_op_imm_32(itype).into())
 			} else {
 				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
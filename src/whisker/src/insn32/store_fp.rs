@@ -5,13 +5,13 @@ use crate::{
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_store_fp(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_store_fp<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let stype = SType::parse(parcel);
 	match stype.func() {
 		FLOAT_STORE_WORD => {
-			if cpu.supported_extensions.has(SupportedExtensions::FLOAT) {
+			if cpu.supports::<EXT>(SupportedExtensions::FLOAT) {
 				Ok(FloatInstruction::parse_store_fp(stype).into())
 			} else {
 				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
@@ -1,18 +1,18 @@
 use crate::{
 	cpu::WhiskerCpu,
 	insn::{csr::CSRInstruction, int::IntInstruction, Instruction},
-	insn32::IType,
+	insn32::{IType, RType},
 	ty::{SupportedExtensions, TrapIdx},
 };
 
-pub fn parse_system(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
+pub fn parse_system<const EXT: u64>(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()> {
 	use consts::*;
 
 	let itype = IType::parse(parcel);
 	match itype.func() {
 		funcs::E_CALL_BREAK => {
-			if cpu.supported_extensions.has(SupportedExtensions::INTEGER) {
-				Ok(parse_call_break(itype).into())
+			if cpu.supports::<EXT>(SupportedExtensions::INTEGER) {
+				Ok(parse_call_break(parcel).into())
 			} else {
 				cpu.request_trap(TrapIdx::ILLEGAL_INSTRUCTION, 0);
 				Err(())
@@ -27,11 +27,22 @@ pub fn parse_system(cpu: &mut WhiskerCpu, parcel: u32) -> Result<Instruction, ()
 	}
 }
 
-fn parse_call_break(itype: IType) -> IntInstruction {
+fn parse_call_break(parcel: u32) -> IntInstruction {
+	let itype = IType::parse(parcel);
 	match (itype.dst().to_gp().as_usize(), itype.src().to_gp().as_usize()) {
-		(0, 0) => match itype.imm() {
+		// SFENCE.VMA is an R-type, the only one here with source registers
+		(0, _) if RType::parse(parcel).func7() == 0b0001001 => {
+			let rtype = RType::parse(parcel);
+			IntInstruction::SFenceVma {
+				vaddr: rtype.src1().to_gp(),
+				asid: rtype.src2().to_gp(),
+			}
+		}
+		(0, 0) => match imm_to_csr(itype.imm()) {
 			0b000000000000 => IntInstruction::ECall,
 			0b000000000001 => IntInstruction::EBreak,
+			0b001100000010 => IntInstruction::MachineReturn,
+			0b000100000101 => IntInstruction::WaitForInterrupt,
 			imm => unimplemented!("SYSTEM func=0b000 rd=0b00000 rs1=0b00000 imm={imm:#014b}"),
 		},
 		(rd, rs1) => unimplemented!("SYSTEM func=0b000 rd={rd:#07b} rs1={rs1:#07b}"),
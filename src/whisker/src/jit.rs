@@ -0,0 +1,815 @@
+//! Translation of hot basic blocks to x86-64 machine code.
+//!
+//! Blocks are straight line runs of instructions that were already decoded into the instruction cache, ending at the
+//! first branch or jump. The integer instructions that make up most hot loops are translated to native code that works
+//! on the guest registers in place, everything else (loads, stores, floating point, CSRs, ...) calls back into the
+//! interpreter for that one instruction. A block is left early whenever such a call requests a trap or throws away
+//! decoded instructions, so traps, MMIO and self modifying code all end up being handled by the interpreter.
+//!
+//! Exits to a fixed pc jump straight into the block there once it has been translated. Every exit counts the
+//! instructions it retired against a budget so chained blocks always hand control back eventually.
+
+use std::collections::HashMap;
+use std::io;
+use std::mem::{offset_of, size_of};
+use std::ops::Range;
+use std::ptr::{self, NonNull};
+
+use tracing::*;
+
+use crate::cpu::WhiskerCpu;
+use crate::icache::Invalidations;
+use crate::insn::compressed::CompressedInstruction;
+use crate::insn::int::IntInstruction;
+use crate::insn::multiply::MultiplyInstruction;
+use crate::insn::uop::MicroOp;
+use crate::insn::Instruction;
+use crate::mem::{host_page_size, Memory, PageBase};
+use crate::regs::GPRegisters;
+use crate::threaded;
+use crate::ty::GPRegisterIndex;
+
+/// how many times a block has to start executing in the interpreter before it's translated
+const HOT_THRESHOLD: u32 = 64;
+const MAX_BLOCK_INSNS: usize = 64;
+/// generous upper bound on the machine code for one block, the buffer is flushed when less than this is left
+const MAX_BLOCK_BYTES: usize = MAX_BLOCK_INSNS * 96 + 256;
+const CODE_SIZE: usize = 16 * 1024 * 1024;
+/// instructions a single call into translated code may retire, across however many blocks it chains through
+const BUDGET: i64 = 1 << 14;
+
+/// what translated code hands back, in rax:rdx
+#[repr(C)]
+struct BlockExit {
+	pc: u64,
+	budget_left: i64,
+}
+
+type BlockFn = unsafe extern "sysv64" fn(cpu: *mut WhiskerCpu, budget: i64) -> BlockExit;
+
+/// an instruction executed by calling back into the interpreter, referenced from translated code by address
+struct Fallback {
+	op: MicroOp,
+	pc: u64,
+}
+
+struct Block {
+	/// offset of the entry that sets up the stack frame, called from rust
+	entry: usize,
+	/// offset right past the frame setup, chained to from other blocks
+	body: usize,
+	pages: Vec<PageBase>,
+	/// jumps in other blocks that have been chained to this one
+	incoming: Vec<usize>,
+	/// chainable jumps out of this block, and the pc they go to
+	outgoing: Vec<(u64, usize)>,
+	// boxed so their addresses stay put, translated code points at them
+	_fallbacks: Box<[Fallback]>,
+}
+
+/// a translated block, only valid until the next [Jit::invalidate] or translation
+#[derive(Debug, Clone, Copy)]
+pub struct BlockEntry(usize);
+
+#[derive(Debug, Clone, Copy)]
+pub struct JitRun {
+	pub pc: u64,
+	pub retired: u64,
+}
+
+pub struct Jit {
+	code: CodeBuffer,
+	blocks: HashMap<u64, Block>,
+	/// how often a block head that isn't translated yet has started executing
+	heat: HashMap<u64, u32>,
+	/// block start pcs by every page they have instructions on
+	pages: HashMap<PageBase, Vec<u64>>,
+	/// chainable jumps to pcs that have no block yet
+	pending: HashMap<u64, Vec<usize>>,
+}
+
+impl std::fmt::Debug for Jit {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("Jit")
+			.field("blocks", &self.blocks.len())
+			.field("code_used", &self.code.used)
+			.finish_non_exhaustive()
+	}
+}
+
+impl Jit {
+	pub fn new() -> io::Result<Self> {
+		Ok(Self {
+			code: CodeBuffer::new(CODE_SIZE)?,
+			blocks: HashMap::new(),
+			heat: HashMap::new(),
+			pages: HashMap::new(),
+			pending: HashMap::new(),
+		})
+	}
+
+	/// drops every block built from instructions the cache has thrown away
+	pub fn invalidate(&mut self, invalidations: &Invalidations) {
+		if invalidations.all {
+			self.flush();
+			return;
+		}
+		for page in &invalidations.pages {
+			for pc in self.pages.remove(page).unwrap_or_default() {
+				self.remove_block(pc);
+			}
+		}
+		self.code.seal();
+	}
+
+	/// returns the block at `pc` if it's translated, or translates it if it has become hot.
+	/// returns None if the interpreter has to execute the instruction at `pc`
+	#[inline]
+	pub fn block_at(&mut self, pc: u64, mem: &mut Memory) -> Option<BlockEntry> {
+		if let Some(block) = self.blocks.get(&pc) {
+			return Some(BlockEntry(block.entry));
+		}
+
+		let heat = self.heat.entry(pc).or_default();
+		*heat += 1;
+		if *heat < HOT_THRESHOLD {
+			return None;
+		}
+		self.heat.remove(&pc);
+		self.translate(pc, mem).map(BlockEntry)
+	}
+
+	/// runs translated code starting at `entry` until it leaves to a pc that isn't translated (or chained to yet),
+	/// something has to be handled by the interpreter or the budget is used up. retires at most `budget` instructions,
+	/// which has to be more than a block can hold
+	pub fn enter(&self, entry: BlockEntry, cpu: &mut WhiskerCpu, budget: u64) -> JitRun {
+		debug_assert!(
+			self.code.unsealed.is_none(),
+			"running translated code that's still writable"
+		);
+		// the budget is only checked once a block is done
+		let budget = (budget - MAX_BLOCK_INSNS as u64 + 1).min(BUDGET as u64) as i64;
+		// SAFETY: entry points at a block translated by us which follows the BlockFn ABI, and cpu is valid for the
+		// whole call. translated code only touches the guest registers and otherwise goes through fallback.
+		// the blocks can't change while they run since we are borrowed
+		let exit = unsafe {
+			let block: BlockFn = std::mem::transmute(self.code.ptr.as_ptr().add(entry.0));
+			block(cpu, budget)
+		};
+		JitRun {
+			pc: exit.pc,
+			retired: (budget - exit.budget_left) as u64,
+		}
+	}
+
+	fn flush(&mut self) {
+		debug!("flushing {} translated blocks", self.blocks.len());
+		self.blocks.clear();
+		self.pages.clear();
+		self.pending.clear();
+		self.code.used = 0;
+	}
+
+	fn remove_block(&mut self, pc: u64) {
+		let Some(block) = self.blocks.remove(&pc) else {
+			return;
+		};
+		trace!("dropping translated block at {pc:#018X}");
+
+		for page in &block.pages {
+			if let Some(blocks) = self.pages.get_mut(page) {
+				blocks.retain(|block| *block != pc);
+			}
+		}
+
+		// anything chained to this block goes back to exiting to the dispatcher
+		for site in &block.incoming {
+			self.code.patch_jump(*site, *site + JUMP_LEN);
+		}
+		self.pending.entry(pc).or_default().extend(&block.incoming);
+
+		for (target, site) in block.outgoing {
+			if let Some(target) = self.blocks.get_mut(&target) {
+				target.incoming.retain(|incoming| *incoming != site);
+			} else if let Some(pending) = self.pending.get_mut(&target) {
+				pending.retain(|pending| *pending != site);
+			}
+		}
+	}
+
+	/// returns the entry of the new block, or None if nothing at `pc` could be translated
+	fn translate(&mut self, pc: u64, mem: &mut Memory) -> Option<usize> {
+		let mut insns = Vec::new();
+		let mut pages = Vec::new();
+		let mut next = pc;
+		while insns.len() < MAX_BLOCK_INSNS {
+			// decoded instructions never cross a page
+			let Some((op, page)) = mem.decoded_on_page(next) else {
+				break;
+			};
+			if threaded::reads_clock(op.opcode) {
+				break;
+			}
+			insns.push((op, next));
+			pages.push(page);
+			next = next.wrapping_add(op.len());
+			if threaded::ends_block(op.opcode) {
+				break;
+			}
+		}
+		if insns.is_empty() {
+			return None;
+		}
+
+		if self.code.remaining() < MAX_BLOCK_BYTES {
+			self.flush();
+		}
+
+		let base = self.code.used;
+		let code_base = self.code.ptr.as_ptr() as usize;
+		let chained = |target| self.blocks.get(&target).map(|block: &Block| code_base + block.body);
+		let mut asm = Assembler::new(self.code.ptr.as_ptr() as usize + base);
+		asm.prologue();
+		let body = asm.len();
+
+		// every instruction gets one so their indices line up, only the ones that aren't translated are used
+		let fallbacks = insns.iter().map(|&(op, pc)| Fallback { op, pc }).collect::<Box<[_]>>();
+		let mut exits = Vec::new();
+
+		let count = insns.len() as i32;
+		for (idx, &(op, pc)) in insns.iter().enumerate() {
+			let retired = idx as i32 + 1;
+			if !asm.native(op.instruction(), pc, op.len(), retired, &chained, &mut exits) {
+				asm.call_fallback(&fallbacks[idx], retired);
+			}
+		}
+		if !threaded::ends_block(insns[insns.len() - 1].0.opcode) {
+			asm.static_exit(next, count, chained(next), &mut exits);
+		}
+		asm.finish();
+
+		let code = asm.buf;
+		self.code.write(base, &code);
+		self.code.used += code.len();
+
+		pages.dedup();
+		for page in &pages {
+			self.pages.entry(*page).or_default().push(pc);
+		}
+
+		let outgoing = exits
+			.into_iter()
+			.map(|(target, site)| (target, base + site))
+			.collect::<Vec<_>>();
+		for &(target, site) in &outgoing {
+			match self.blocks.get_mut(&target) {
+				Some(target) => target.incoming.push(site),
+				None => self.pending.entry(target).or_default().push(site),
+			}
+		}
+
+		// chain everything that was waiting on this block
+		let body = base + body;
+		let incoming = self.pending.remove(&pc).unwrap_or_default();
+		for site in &incoming {
+			self.code.patch_jump(*site, body);
+		}
+		self.code.seal();
+
+		trace!(
+			"translated {} instructions at {pc:#018X} into {} bytes",
+			insns.len(),
+			code.len()
+		);
+		self.blocks.insert(
+			pc,
+			Block {
+				entry: base,
+				body,
+				pages,
+				incoming,
+				outgoing,
+				_fallbacks: fallbacks,
+			},
+		);
+		Some(base)
+	}
+}
+
+/// executes one instruction translated code can't handle itself.
+/// returns nonzero if the block has to be left right after it
+unsafe extern "sysv64" fn fallback(cpu: *mut WhiskerCpu, fallback: *const Fallback) -> u64 {
+	// SAFETY: translated code passes through the cpu it was called with and a fallback owned by its block
+	let (cpu, fallback) = unsafe { (&mut *cpu, &*fallback) };
+	let next = fallback.pc.wrapping_add(fallback.op.len());
+	cpu.pc = next;
+	cpu.execute_uop(&fallback.op, fallback.pc);
+	u64::from(cpu.trap_pending() || cpu.mem.icache.has_invalidations() || cpu.pc != next)
+}
+
+/// an executable mapping translated code is written into. it's never writable and executable at once: the pages
+/// being written to are made writable, and [Self::seal] makes them executable again before anything runs
+struct CodeBuffer {
+	ptr: NonNull<u8>,
+	len: usize,
+	used: usize,
+	/// the host pages that are writable right now
+	unsealed: Option<Range<usize>>,
+}
+
+// SAFETY: the mapping is owned by the buffer and only ever touched through it
+unsafe impl Send for CodeBuffer {}
+
+impl CodeBuffer {
+	fn new(len: usize) -> io::Result<Self> {
+		// SAFETY: we're asking for a fresh mapping, nothing existing is affected
+		let ptr = unsafe {
+			libc::mmap(
+				ptr::null_mut(),
+				len,
+				libc::PROT_READ | libc::PROT_EXEC,
+				libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+				-1,
+				0,
+			)
+		};
+		if ptr == libc::MAP_FAILED {
+			return Err(io::Error::last_os_error());
+		}
+		Ok(Self {
+			// UNWRAP: mmap never hands out the null page
+			ptr: NonNull::new(ptr.cast()).unwrap(),
+			len,
+			used: 0,
+			unsealed: None,
+		})
+	}
+
+	fn remaining(&self) -> usize {
+		self.len - self.used
+	}
+
+	fn write(&mut self, offset: usize, code: &[u8]) {
+		assert!(offset + code.len() <= self.len);
+		self.unseal(offset..offset + code.len());
+		// SAFETY: in bounds and writable, and no translated code is running while we're being written to
+		unsafe { ptr::copy_nonoverlapping(code.as_ptr(), self.ptr.as_ptr().add(offset), code.len()) };
+	}
+
+	/// makes the host pages `range` is on writable, along with any that already are
+	fn unseal(&mut self, range: Range<usize>) {
+		let page = host_page_size();
+		let start = range.start / page * page;
+		let end = range.end.next_multiple_of(page).min(self.len);
+		let pages = match &self.unsealed {
+			Some(unsealed) if unsealed.start <= start && end <= unsealed.end => return,
+			Some(unsealed) => unsealed.start.min(start)..unsealed.end.max(end),
+			None => start..end,
+		};
+		self.protect(pages.clone(), libc::PROT_READ | libc::PROT_WRITE);
+		self.unsealed = Some(pages);
+	}
+
+	/// makes everything written since the last seal executable again, has to happen before any of it runs
+	fn seal(&mut self) {
+		if let Some(pages) = self.unsealed.take() {
+			self.protect(pages, libc::PROT_READ | libc::PROT_EXEC);
+		}
+	}
+
+	fn protect(&self, pages: Range<usize>, prot: libc::c_int) {
+		// SAFETY: the pages are inside our mapping, and no translated code is running while they change
+		let res = unsafe { libc::mprotect(self.ptr.as_ptr().add(pages.start).cast(), pages.len(), prot) };
+		assert!(
+			res == 0,
+			"could not change the protection of translated code: {}",
+			io::Error::last_os_error()
+		);
+	}
+
+	/// points the `jmp rel32` at `site` to `target`
+	fn patch_jump(&mut self, site: usize, target: usize) {
+		let rel = (target as i64 - (site + JUMP_LEN) as i64) as i32;
+		self.write(site + 1, &rel.to_le_bytes());
+	}
+}
+
+impl Drop for CodeBuffer {
+	fn drop(&mut self) {
+		// SAFETY: we own ptr..ptr + len and nothing can be running in it anymore
+		unsafe { libc::munmap(self.ptr.as_ptr().cast(), self.len) };
+	}
+}
+
+const JUMP_LEN: usize = 5;
+
+// register numbers in the x86 encoding
+const RAX: u8 = 0;
+const RCX: u8 = 1;
+const RSI: u8 = 6;
+
+/// offset of guest register `idx` from rbx, which points at the register file while translated code runs
+fn reg_disp(reg: GPRegisterIndex) -> i32 {
+	(reg.as_usize() * size_of::<u64>()) as i32
+}
+
+/// Emits the machine code for one block.
+///
+/// while a block runs rbx points at the guest registers, r12 holds the cpu and r13 the instruction budget left.
+/// rax and rcx are scratch, nothing is kept in a register across instructions
+struct Assembler {
+	buf: Vec<u8>,
+	/// host address the code will be copied to
+	base: usize,
+	/// rel32 operands that have to point at the epilogue
+	epilogue_fixups: Vec<usize>,
+}
+
+impl Assembler {
+	fn new(base: usize) -> Self {
+		Self {
+			buf: Vec::with_capacity(MAX_BLOCK_BYTES),
+			base,
+			epilogue_fixups: Vec::new(),
+		}
+	}
+
+	fn len(&self) -> usize {
+		self.buf.len()
+	}
+
+	fn emit(&mut self, bytes: &[u8]) {
+		self.buf.extend_from_slice(bytes);
+	}
+
+	fn emit_i32(&mut self, val: i32) {
+		self.emit(&val.to_le_bytes());
+	}
+
+	fn emit_u64(&mut self, val: u64) {
+		self.emit(&val.to_le_bytes());
+	}
+
+	/// entered with the cpu in rdi and the budget in rsi. three pushes leave the stack 16 byte aligned for calls
+	fn prologue(&mut self) {
+		// push rbx; push r12; push r13
+		self.emit(&[0x53, 0x41, 0x54, 0x41, 0x55]);
+		// mov r12, rdi; mov r13, rsi
+		self.emit(&[0x49, 0x89, 0xFC, 0x49, 0x89, 0xF5]);
+		// lea rbx, [rdi + registers]
+		self.emit(&[0x48, 0x8D, 0x9F]);
+		self.emit_i32((offset_of!(WhiskerCpu, registers) + GPRegisters::X_OFFSET) as i32);
+	}
+
+	/// the shared exit, expects the next pc in rax
+	fn finish(&mut self) {
+		let epilogue = self.len();
+		for site in std::mem::take(&mut self.epilogue_fixups) {
+			let rel = (epilogue - (site + 4)) as i32;
+			self.buf[site..site + 4].copy_from_slice(&rel.to_le_bytes());
+		}
+		// mov rdx, r13; pop r13; pop r12; pop rbx; ret
+		self.emit(&[0x4C, 0x89, 0xEA, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3]);
+	}
+
+	fn jump_to_epilogue(&mut self) {
+		self.emit(&[0xE9]);
+		self.epilogue_fixups.push(self.len());
+		self.emit_i32(0);
+	}
+
+	/// mov r64, imm64
+	fn mov_imm(&mut self, reg: u8, val: u64) {
+		self.emit(&[0x48, 0xB8 + reg]);
+		self.emit_u64(val);
+	}
+
+	/// mov r64, [rbx + guest reg]
+	fn load(&mut self, reg: u8, src: GPRegisterIndex) {
+		self.emit(&[0x48, 0x8B, 0x83 | reg << 3]);
+		self.emit_i32(reg_disp(src));
+	}
+
+	/// mov [rbx + guest reg], rax
+	fn store_rax(&mut self, dst: GPRegisterIndex) {
+		if dst.as_usize() == 0 {
+			return;
+		}
+		self.emit(&[0x48, 0x89, 0x83]);
+		self.emit_i32(reg_disp(dst));
+	}
+
+	/// `op rax, imm` for one of the group 1 ops (/digit), through rcx if the immediate doesn't fit in 32 bits
+	fn alu_imm(&mut self, digit: u8, reg_op: u8, imm: i64) {
+		match i32::try_from(imm) {
+			Ok(imm) => {
+				self.emit(&[0x48, 0x81, 0xC0 | digit << 3]);
+				self.emit_i32(imm);
+			}
+			Err(_) => {
+				self.mov_imm(RCX, imm as u64);
+				self.emit(&[0x48, reg_op, 0xC8]);
+			}
+		}
+	}
+
+	/// rax = lhs, rcx = rhs
+	fn load_pair(&mut self, lhs: GPRegisterIndex, rhs: GPRegisterIndex) {
+		self.load(RAX, lhs);
+		self.load(RCX, rhs);
+	}
+
+	/// setcc al; movzx eax, al
+	fn set_rax(&mut self, cc: u8) {
+		self.emit(&[0x0F, 0x90 | cc, 0xC0, 0x0F, 0xB6, 0xC0]);
+	}
+
+	/// movsxd rax, eax
+	fn sign_extend_eax(&mut self) {
+		self.emit(&[0x48, 0x63, 0xC0]);
+	}
+
+	/// leaves for `target`, going straight to the block there if it's translated (or once it is)
+	fn static_exit(&mut self, target: u64, retired: i32, chained: Option<usize>, exits: &mut Vec<(u64, usize)>) {
+		// sub r13, retired
+		self.emit(&[0x49, 0x81, 0xED]);
+		self.emit_i32(retired);
+		// jle out (skips the chainable jump)
+		self.emit(&[0x0F, 0x8E]);
+		self.emit_i32(JUMP_LEN as i32);
+		let site = self.len();
+		self.emit(&[0xE9]);
+		let rel = match chained {
+			Some(body) => (body as i64 - (self.base + site + JUMP_LEN) as i64) as i32,
+			None => 0,
+		};
+		self.emit_i32(rel);
+		exits.push((target, site));
+		// out: mov rax, target
+		self.mov_imm(RAX, target);
+		self.jump_to_epilogue();
+	}
+
+	/// leaves for the pc in rax
+	fn dynamic_exit(&mut self, retired: i32) {
+		self.emit(&[0x49, 0x81, 0xED]);
+		self.emit_i32(retired);
+		self.jump_to_epilogue();
+	}
+
+	fn call_fallback(&mut self, fallback: &Fallback, retired: i32) {
+		// mov rdi, r12
+		self.emit(&[0x4C, 0x89, 0xE7]);
+		self.mov_imm(RSI, fallback as *const Fallback as u64);
+		self.mov_imm(RAX, self::fallback as usize as u64);
+		// call rax; test rax, rax; jz continue
+		self.emit(&[0xFF, 0xD0, 0x48, 0x85, 0xC0, 0x0F, 0x84]);
+		let skip = self.len();
+		self.emit_i32(0);
+		// mov rax, [r12 + pc], the instruction may have jumped
+		self.emit(&[0x49, 0x8B, 0x84, 0x24]);
+		self.emit_i32(offset_of!(WhiskerCpu, pc) as i32);
+		self.dynamic_exit(retired);
+		let rel = (self.len() - (skip + 4)) as i32;
+		self.buf[skip..skip + 4].copy_from_slice(&rel.to_le_bytes());
+	}
+
+	/// a conditional branch: `cmp rax, rcx` then `jcc` to the taken exit
+	fn branch(
+		&mut self,
+		cc: u8,
+		(lhs, rhs): (GPRegisterIndex, GPRegisterIndex),
+		(pc, size, imm): (u64, u64, i64),
+		retired: i32,
+		chained: &impl Fn(u64) -> Option<usize>,
+		exits: &mut Vec<(u64, usize)>,
+	) {
+		self.load_pair(lhs, rhs);
+		// cmp rax, rcx; jcc taken
+		self.emit(&[0x48, 0x39, 0xC8, 0x0F, 0x80 | cc]);
+		let taken = self.len();
+		self.emit_i32(0);
+		let next = pc.wrapping_add(size);
+		self.static_exit(next, retired, chained(next), exits);
+		let rel = (self.len() - (taken + 4)) as i32;
+		self.buf[taken..taken + 4].copy_from_slice(&rel.to_le_bytes());
+		let target = pc.wrapping_add_signed(imm);
+		self.static_exit(target, retired, chained(target), exits);
+	}
+
+	/// translates `insn` if it's one of the natively supported ones, this has to match the interpreter exactly.
+	/// returns false if it has to go through the interpreter instead.
+	/// `chained` gives the host address of the translated block at a pc, if there is one
+	fn native(
+		&mut self,
+		insn: Instruction,
+		pc: u64,
+		size: u64,
+		retired: i32,
+		chained: impl Fn(u64) -> Option<usize>,
+		exits: &mut Vec<(u64, usize)>,
+	) -> bool {
+		// x86 condition codes
+		const CC_B: u8 = 0x2;
+		const CC_AE: u8 = 0x3;
+		const CC_E: u8 = 0x4;
+		const CC_NE: u8 = 0x5;
+		const CC_L: u8 = 0xC;
+		const CC_GE: u8 = 0xD;
+
+		use IntInstruction::*;
+		let insn = match insn {
+			Instruction::CompressedExtension(CompressedInstruction::Nop) => return true,
+			Instruction::MultiplyInstruction(MultiplyInstruction::Multiply { lhs, rhs, dst }) => {
+				self.load_pair(lhs, rhs);
+				// imul rax, rcx
+				self.emit(&[0x48, 0x0F, 0xAF, 0xC1]);
+				self.store_rax(dst);
+				return true;
+			}
+			Instruction::MultiplyInstruction(MultiplyInstruction::MultiplyWord { lhs, rhs, dst }) => {
+				self.load_pair(lhs, rhs);
+				// imul eax, ecx
+				self.emit(&[0x0F, 0xAF, 0xC1]);
+				self.sign_extend_eax();
+				self.store_rax(dst);
+				return true;
+			}
+			Instruction::IntExtension(insn) => insn,
+			_ => return false,
+		};
+
+		match insn {
+			LoadUpperImmediate { dst, val } => {
+				self.mov_imm(RAX, val as u64);
+				self.store_rax(dst);
+			}
+			AddUpperImmediateToPc { dst, val } => {
+				self.mov_imm(RAX, pc.wrapping_add_signed(val));
+				self.store_rax(dst);
+			}
+
+			Add { dst, lhs, rhs }
+			| Sub { dst, lhs, rhs }
+			| Xor { dst, lhs, rhs }
+			| Or { dst, lhs, rhs }
+			| And { dst, lhs, rhs } => {
+				let op = match insn {
+					Add { .. } => 0x01,
+					Sub { .. } => 0x29,
+					Xor { .. } => 0x31,
+					Or { .. } => 0x09,
+					_ => 0x21,
+				};
+				self.load_pair(lhs, rhs);
+				self.emit(&[0x48, op, 0xC8]);
+				self.store_rax(dst);
+			}
+			ShiftLeftLogical { dst, lhs, rhs }
+			| ShiftRightLogical { dst, lhs, rhs }
+			| ShiftRightArithmetic { dst, lhs, rhs } => {
+				let digit = match insn {
+					ShiftLeftLogical { .. } => 4,
+					ShiftRightLogical { .. } => 5,
+					_ => 7,
+				};
+				self.load_pair(lhs, rhs);
+				// shift rax, cl. the hardware masks the count to 6 bits like wrapping_shl does
+				self.emit(&[0x48, 0xD3, 0xC0 | digit << 3]);
+				self.store_rax(dst);
+			}
+			SetLessThan { dst, lhs, rhs } | SetLessThanUnsigned { dst, lhs, rhs } => {
+				let cc = if matches!(insn, SetLessThan { .. }) { CC_L } else { CC_B };
+				self.load_pair(lhs, rhs);
+				self.emit(&[0x48, 0x39, 0xC8]);
+				self.set_rax(cc);
+				self.store_rax(dst);
+			}
+
+			AddImmediate { dst, lhs, rhs }
+			| XorImmediate { dst, lhs, rhs }
+			| OrImmediate { dst, lhs, rhs }
+			| AndImmediate { dst, lhs, rhs } => {
+				let (digit, reg_op) = match insn {
+					AddImmediate { .. } => (0, 0x01),
+					XorImmediate { .. } => (6, 0x31),
+					OrImmediate { .. } => (1, 0x09),
+					_ => (4, 0x21),
+				};
+				self.load(RAX, lhs);
+				self.alu_imm(digit, reg_op, rhs);
+				self.store_rax(dst);
+			}
+			ShiftLeftLogicalImmediate { dst, lhs, shift_amt }
+			| ShiftRightLogicalImmediate { dst, lhs, shift_amt }
+			| ShiftRightArithmeticImmediate { dst, lhs, shift_amt } => {
+				let digit = match insn {
+					ShiftLeftLogicalImmediate { .. } => 4,
+					ShiftRightLogicalImmediate { .. } => 5,
+					_ => 7,
+				};
+				self.load(RAX, lhs);
+				self.emit(&[0x48, 0xC1, 0xC0 | digit << 3, (shift_amt & 63) as u8]);
+				self.store_rax(dst);
+			}
+			SetLessThanImmediate { dst, lhs, rhs } | SetLessThanUnsignedImmediate { dst, lhs, rhs } => {
+				let cc = if matches!(insn, SetLessThanImmediate { .. }) {
+					CC_L
+				} else {
+					CC_B
+				};
+				self.load(RAX, lhs);
+				self.alu_imm(7, 0x39, rhs);
+				self.set_rax(cc);
+				self.store_rax(dst);
+			}
+
+			AddImmediateWord { dst, lhs, rhs } => {
+				self.load(RAX, lhs);
+				// add eax, imm32
+				self.emit(&[0x81, 0xC0]);
+				self.emit_i32(rhs);
+				self.sign_extend_eax();
+				self.store_rax(dst);
+			}
+			ShiftLeftLogicalImmediateWord { dst, lhs, shift_amt }
+			| ShiftRightLogicalImmediateWord { dst, lhs, shift_amt }
+			| ShiftRightArithmeticImmediateWord { dst, lhs, shift_amt } => {
+				let digit = match insn {
+					ShiftLeftLogicalImmediateWord { .. } => 4,
+					ShiftRightLogicalImmediateWord { .. } => 5,
+					_ => 7,
+				};
+				self.load(RAX, lhs);
+				// 32 bit shift, which zero extends
+				self.emit(&[0xC1, 0xC0 | digit << 3, (shift_amt & 31) as u8]);
+				// only the arithmetic shift goes through an i32 in the interpreter
+				if digit == 7 {
+					self.sign_extend_eax();
+				}
+				self.store_rax(dst);
+			}
+			AddWord { dst, lhs, rhs } | SubWord { dst, lhs, rhs } => {
+				let op = if matches!(insn, AddWord { .. }) { 0x01 } else { 0x29 };
+				self.load_pair(lhs, rhs);
+				// 32 bit op, which zero extends
+				self.emit(&[op, 0xC8]);
+				self.store_rax(dst);
+			}
+			ShiftLeftLogicalWord { dst, lhs, rhs }
+			| ShiftRightLogicalWord { dst, lhs, rhs }
+			| ShiftRightArithmeticWord { dst, lhs, rhs } => {
+				let digit = match insn {
+					ShiftLeftLogicalWord { .. } => 4,
+					ShiftRightLogicalWord { .. } => 5,
+					_ => 7,
+				};
+				self.load_pair(lhs, rhs);
+				// shift eax, cl. the hardware masks the count to 5 bits
+				self.emit(&[0xD3, 0xC0 | digit << 3]);
+				self.sign_extend_eax();
+				self.store_rax(dst);
+			}
+
+			JumpAndLink { link_reg, jmp_off } => {
+				self.mov_imm(RAX, pc + 4);
+				self.store_rax(link_reg);
+				let target = pc.wrapping_add_signed(jmp_off);
+				self.static_exit(target, retired, chained(target), exits);
+			}
+			JumpAndLinkRegister {
+				link_reg,
+				jmp_reg,
+				jmp_off,
+			} => {
+				// the link register is written before the target is read, like the interpreter does
+				self.mov_imm(RAX, pc + 4);
+				self.store_rax(link_reg);
+				self.load(RAX, jmp_reg);
+				self.alu_imm(0, 0x01, jmp_off);
+				// and rax, -2
+				self.emit(&[0x48, 0x83, 0xE0, 0xFE]);
+				self.dynamic_exit(retired);
+			}
+			BranchEqual { lhs, rhs, imm } => self.branch(CC_E, (lhs, rhs), (pc, size, imm), retired, &chained, exits),
+			BranchNotEqual { lhs, rhs, imm } => {
+				self.branch(CC_NE, (lhs, rhs), (pc, size, imm), retired, &chained, exits)
+			}
+			BranchLessThan { lhs, rhs, imm } => {
+				self.branch(CC_L, (lhs, rhs), (pc, size, imm), retired, &chained, exits)
+			}
+			BranchGreaterEqual { lhs, rhs, imm } => {
+				self.branch(CC_GE, (lhs, rhs), (pc, size, imm), retired, &chained, exits)
+			}
+			BranchLessThanUnsigned { lhs, rhs, imm } => {
+				self.branch(CC_B, (lhs, rhs), (pc, size, imm), retired, &chained, exits)
+			}
+			BranchGreaterEqualUnsigned { lhs, rhs, imm } => {
+				self.branch(CC_AE, (lhs, rhs), (pc, size, imm), retired, &chained, exits)
+			}
+
+			_ => return false,
+		}
+		true
+	}
+}
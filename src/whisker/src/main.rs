@@ -1,33 +1,59 @@
+mod batch;
+mod bench;
+mod clint;
 mod cpu;
 mod csr;
+mod finisher;
 mod gdb;
+mod icache;
 mod insn;
 mod insn16;
 mod insn32;
+#[cfg(target_arch = "x86_64")]
+mod jit;
 mod mem;
+mod profile;
 mod regs;
+mod replay;
+mod snapshot;
 mod soft;
+mod threaded;
+mod trace;
 mod ty;
+mod uart;
 mod util;
+mod virtio_blk;
 
 #[cfg(not(target_pointer_width = "64"))]
 compile_error!("whisker only supports 64bit architectures");
+#[cfg(not(target_endian = "little"))]
+compile_error!("whisker only supports little endian hosts, guest memory is accessed natively");
 
-use std::io::Write as _;
-use std::path::PathBuf;
-use std::{fs, io};
+use std::fs::{self, File};
+use std::io;
+use std::num::NonZeroUsize;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::thread;
 
 use clap::{command, Parser, Subcommand};
-use gdbstub::conn::ConnectionExt;
 use gdbstub::stub::GdbStub;
 use tracing::level_filters::LevelFilter;
+use tracing::{error, info, warn};
 use tracing_subscriber::layer::SubscriberExt as _;
 use tracing_subscriber::util::SubscriberInitExt as _;
 
-use crate::cpu::{WhiskerCpu, WhiskerExecState};
-use crate::gdb::WhiskerEventLoop;
-use crate::mem::{MemoryBuilder, PageBase, PageEntry};
+use crate::clint::Clint;
+use crate::cpu::{StopReason, WhiskerCpu, WhiskerExecState};
+use crate::finisher::{ExitLatch, TestFinisher};
+use crate::gdb::{GdbConnection, WhiskerEventLoop};
+use crate::mem::{BootromImage, MemoryBuilder, PageBase, PhysBacking};
+use crate::profile::{ProfileArgs, Profiler, Symbols};
+use crate::replay::Replay;
+use crate::trace::TraceWindow;
 use crate::ty::SupportedExtensions;
+use crate::uart::{Console, Uart};
+use crate::virtio_blk::VirtioBlk;
 
 #[derive(Debug, Parser)]
 #[command(version)]
@@ -39,14 +65,76 @@ struct CliArgs {
 #[derive(Debug, Subcommand)]
 enum Commands {
 	Run {
+		/// Write a binary execution trace here, it can be turned into text with `decode-trace`
 		#[arg(long)]
 		logfile: Option<PathBuf>,
+		#[command(flatten)]
+		trace_window: TraceWindow,
+		#[command(flatten)]
+		profile: ProfileArgs,
 		#[arg(short = 'g', long)]
 		use_gdb: bool,
+		/// Record the run so GDB can step and continue backwards through it. only works with a single hart
+		#[arg(long, requires = "use_gdb")]
+		record: bool,
+		/// How many instructions apart `--record` checkpoints the hart, more often makes going backwards faster but
+		/// takes more memory
+		#[arg(long, requires = "record", default_value_t = 10_000_000)]
+		checkpoint_interval: u64,
+		/// Back guest memory with huge pages
+		#[arg(long)]
+		hugepages: bool,
+		/// Back guest memory with this file, it's created if it doesn't exist
+		#[arg(long, conflicts_with = "hugepages")]
+		ram_file: Option<PathBuf>,
+		/// Number of harts, each runs on its own thread. only hart 0 is traced or controlled by GDB
+		#[arg(long, default_value_t = NonZeroUsize::MIN)]
+		harts: NonZeroUsize,
+		/// Translate hot code to native code, only supported on x86-64 hosts
+		#[arg(long, conflicts_with_all = ["use_gdb", "logfile"])]
+		jit: bool,
+		/// Compute every float operation with softfloat, not just the ones the host fpu can't do exactly
+		#[arg(long)]
+		exact_float: bool,
+		/// Where the UART output goes: a file, or `tcp:<address>` to connect to. defaults to stdout
+		#[arg(long, value_parser = Console::parse)]
+		console: Option<Console>,
+		/// Stop once hart 0 has executed this many instructions, and exit with 124
+		#[arg(long)]
+		max_instructions: Option<u64>,
+		/// Stop once hart 0 has executed this many instructions and write a snapshot of the machine to `--snapshot`.
+		/// only works with a single hart
+		#[arg(long, requires = "snapshot")]
+		snapshot_at: Option<u64>,
+		/// Where `--snapshot-at` writes the snapshot
+		#[arg(long, requires = "snapshot_at", conflicts_with_all = ["use_gdb", "profile"])]
+		snapshot: Option<PathBuf>,
+		/// Attach this image file as a virtio-mmio block device. the guest's writes go to the file
+		#[arg(long, conflicts_with_all = ["record", "snapshot", "restore"])]
+		disk: Option<PathBuf>,
+		/// Attach `--disk` read-only, the guest can't write to it
+		#[arg(long, requires = "disk")]
+		disk_read_only: bool,
+		/// Start from a snapshot written by `--snapshot` instead of the bootrom and kernel, which come from the
+		/// snapshot. only works with a single hart
+		#[arg(long, conflicts_with_all = ["bootrom", "kernel", "logfile"])]
+		restore: Option<PathBuf>,
+		#[arg(required_unless_present = "restore")]
+		bootrom: Option<PathBuf>,
+		#[arg(required_unless_present = "restore")]
+		kernel: Option<PathBuf>,
+	},
+	/// Runs many kernels in parallel, each with its own cpu and memory
+	Batch(batch::BatchArgs),
+	/// Times the hot paths of the emulator and, given a bootrom and kernels, whole runs of them
+	Bench(bench::BenchArgs),
+	/// Renders an execution trace written by `run --logfile` as text
+	DecodeTrace {
+		/// Where to write the text, defaults to stdout
+		#[arg(short, long)]
+		output: Option<PathBuf>,
 		#[arg()]
-		bootrom: PathBuf,
-		#[arg()]
-		kernel: PathBuf,
+		trace: PathBuf,
 	},
 }
 
@@ -65,17 +153,114 @@ fn main() {
 	match cli.command {
 		Commands::Run {
 			use_gdb: gdb,
+			record,
+			checkpoint_interval,
 			bootrom,
 			kernel,
 			logfile,
+			trace_window,
+			profile,
+			hugepages,
+			ram_file,
+			harts,
+			jit,
+			exact_float,
+			console,
+			max_instructions,
+			snapshot_at,
+			snapshot,
+			restore,
+			disk,
+			disk_read_only,
 		} => {
-			let cpu = init_cpu(bootrom, kernel, logfile);
-			if gdb {
-				run_gdb(cpu);
+			let backing = match ram_file {
+				Some(path) => PhysBacking::File(path),
+				None if hugepages => PhysBacking::HugePages,
+				None => PhysBacking::Anonymous,
+			};
+			let console = console.unwrap_or(Console::Stdout);
+			let uart = Arc::new(Uart::new(
+				console
+					.open()
+					.unwrap_or_else(|e| panic!("could not open console {console:?}: {e:?}")),
+			));
+			let disk = disk.map(|path| {
+				Arc::new(
+					VirtioBlk::open(&path, disk_read_only)
+						.unwrap_or_else(|e| panic!("could not open disk image {}: {e:?}", path.display())),
+				)
+			});
+			if harts.get() > 1 && (snapshot.is_some() || restore.is_some()) {
+				error!("snapshots only work with a single hart");
+				std::process::exit(1);
+			}
+			if harts.get() > 1 && record {
+				error!("recording only works with a single hart");
+				std::process::exit(1);
+			}
+			let mut cpu = match (&restore, bootrom, &kernel) {
+				(Some(path), ..) => snapshot::restore(path, backing, Arc::clone(&uart))
+					.unwrap_or_else(|e| panic!("could not restore snapshot {}: {e:?}", path.display())),
+				(None, Some(bootrom), Some(kernel)) => init_cpu(
+					read_bootrom(&bootrom),
+					kernel,
+					backing,
+					harts.get(),
+					logfile.map(|path| (path, trace_window)),
+					Arc::clone(&uart),
+					disk,
+				),
+				_ => unreachable!("clap requires a bootrom and kernel without --restore"),
+			};
+			cpu.exact_float = exact_float;
+			// the other harts are never joined, they run until the process exits
+			for hart_id in 1..harts.get() {
+				spawn_hart(&cpu, hart_id, jit);
+			}
+			if jit {
+				enable_jit(&mut cpu);
+			}
+			// a restored hart has already executed some instructions
+			let budget = max_instructions.map_or(u64::MAX, |max| max.saturating_sub(cpu.cycles));
+			let code = if let (Some(path), Some(at)) = (&snapshot, snapshot_at) {
+				run_to_snapshot(cpu, at, path)
+			} else if gdb {
+				if record {
+					cpu.replay = Some(Box::new(Replay::new(&mut cpu, checkpoint_interval)));
+				}
+				run_gdb(cpu, max_instructions.unwrap_or(u64::MAX))
+			} else if let Some(path) = &profile.profile {
+				// UNWRAP: there's always either a kernel or a snapshot
+				let kernel = kernel.as_deref().or(restore.as_deref()).unwrap();
+				run_profiled(cpu, budget, &profile, path, kernel)
 			} else {
-				run_normal(cpu);
+				run_normal(cpu, budget)
+			};
+			// other harts still hold on to the UART, so it isn't dropped before exiting
+			uart.flush();
+			std::process::exit(code);
+		}
+		Commands::Batch(args) => {
+			if !batch::run_batch(args) {
+				std::process::exit(1);
+			}
+		}
+		Commands::Bench(args) => {
+			if !bench::run_bench(args) {
+				std::process::exit(1);
 			}
 		}
+		Commands::DecodeTrace { output, trace } => {
+			let mut out: Box<dyn io::Write> = match output {
+				Some(path) => Box::new(
+					File::create(&path)
+						.unwrap_or_else(|e| panic!("could not create output file {}: {e:?}", path.display())),
+				),
+				None => Box::new(io::stdout().lock()),
+			};
+			trace::decode(&trace, &mut out)
+				.unwrap_or_else(|e| panic!("could not decode trace {}: {e:?}", trace.display()));
+		}
 	}
 }
 
@@ -84,65 +269,151 @@ const BOOTROM_OFFSET: u64 = 0x00001000;
 const DRAM_BASE: u64 = 0x8000_0000;
 const DRAM_SIZE: u64 = 0x1000_0000;
 const UART_ADDR: u64 = 0x1000_0000;
+const UART_SIZE: u64 = 0x100;
+const FINISHER_ADDR: u64 = 0x0010_0000;
+const FINISHER_SIZE: u64 = 0x1000;
+const CLINT_ADDR: u64 = 0x0200_0000;
+const CLINT_SIZE: u64 = 0x1_0000;
+const VIRTIO_BLK_ADDR: u64 = 0x1000_1000;
+const VIRTIO_BLK_SIZE: u64 = 0x1000;
 
-fn init_cpu(bootrom: PathBuf, kernel: PathBuf, logfile: Option<PathBuf>) -> WhiskerCpu {
-	let bootrom = fs::read(&bootrom).unwrap_or_else(|_| panic!("could not read bootrom file {}", bootrom.display()));
-	let kernel = fs::read(&kernel).unwrap_or_else(|_| panic!("could not read kernel file {}", kernel.display()));
+/// what `run` exits with when hart 0 tries to take a trap, those aren't supported yet
+const EXIT_TRAPPED: i32 = 2;
+/// what `run` exits with when --max-instructions is used up, like timeout(1)
+const EXIT_BUDGET_EXHAUSTED: i32 = 124;
 
-	let supported = SupportedExtensions::INTEGER
-		| SupportedExtensions::FLOAT
-		| SupportedExtensions::COMPRESSED
-		| SupportedExtensions::ATOMIC
-		| SupportedExtensions::MULTIPLY;
+fn read_bootrom(path: &Path) -> BootromImage {
+	let bootrom = fs::read(path).unwrap_or_else(|_| panic!("could not read bootrom file {}", path.display()));
+	BootromImage::new(bootrom)
+}
 
-	let mut mem = MemoryBuilder::default()
-		.bootrom(bootrom, PageBase::from_addr(BOOTROM_OFFSET))
-		.physical_size(DRAM_BASE)
-		.phys_mapping(PageBase::from_addr(DRAM_BASE), PageBase::from_addr(0), DRAM_SIZE)
-		// MMIO UART mapping
-		.add_mapping(
-			PageBase::from_addr(UART_ADDR),
-			PageEntry::MMIO {
-				on_read: Box::new(|_| unimplemented!("read from UART")),
-				on_write: Box::new(move |addr, val| {
-					if addr == UART_ADDR {
-						print!("{}", val as char);
-						io::stdout().flush().unwrap();
-					}
-				}),
-			},
-		)
-		.build();
+/// returns hart 0, the memory has room for `harts` harts (see [spawn_hart]).
+/// everything the guest writes to the UART goes to `uart`, and `disk` is attached as a virtio block device
+fn init_cpu(
+	bootrom: BootromImage,
+	kernel: &Path,
+	backing: PhysBacking,
+	harts: usize,
+	trace: Option<(PathBuf, TraceWindow)>,
+	uart: Arc<Uart>,
+	disk: Option<Arc<VirtioBlk>>,
+) -> WhiskerCpu {
+	let kernel = File::open(kernel).unwrap_or_else(|_| panic!("could not read kernel file {}", kernel.display()));
+
+	let supported = SupportedExtensions::RV64IMAFC;
+	let exit = Arc::default();
+	let clint = Arc::new(Clint::new(harts));
 
-	mem.write_slice(DRAM_BASE, kernel.as_slice())
-		.expect("unable to copy kernel to memory");
+	let mut layout = memory_layout(bootrom, backing, harts, uart, &exit, &clint);
+	if let Some(disk) = &disk {
+		layout = layout.device(VIRTIO_BLK_ADDR, VIRTIO_BLK_SIZE, Arc::clone(disk));
+	}
+	let mem = layout.image(PageBase::from_addr(DRAM_BASE), kernel).build();
+	if let Some(disk) = disk {
+		disk.attach(mem.dma());
+	}
 
-	let mut cpu = WhiskerCpu::new(supported, mem, logfile);
+	let mut cpu = WhiskerCpu::new(0, supported, mem, trace);
+	cpu.exit = exit;
+	cpu.clint = Some(clint);
 
 	cpu.pc = BOOTROM_OFFSET;
 	cpu
 }
 
-fn run_gdb(mut cpu: WhiskerCpu) {
-	let conn: Box<dyn ConnectionExt<Error = std::io::Error>> = Box::new(gdb::wait_for_tcp().expect("listener to bind"));
+/// the memory and devices every machine has, with nothing loaded into RAM yet. the test finisher reports to `exit`,
+/// `clint` has to have room for `harts` harts
+fn memory_layout(
+	bootrom: BootromImage,
+	backing: PhysBacking,
+	harts: usize,
+	uart: Arc<Uart>,
+	exit: &Arc<ExitLatch>,
+	clint: &Arc<Clint>,
+) -> MemoryBuilder {
+	MemoryBuilder::default()
+		.bootrom(bootrom, PageBase::from_addr(BOOTROM_OFFSET))
+		.phys_backing(backing)
+		.harts(harts)
+		.physical_size(DRAM_SIZE)
+		.phys_mapping(PageBase::from_addr(DRAM_BASE), PageBase::from_addr(0), DRAM_SIZE)
+		.device(UART_ADDR, UART_SIZE, uart)
+		.device(FINISHER_ADDR, FINISHER_SIZE, TestFinisher(Arc::clone(exit)))
+		.device(CLINT_ADDR, CLINT_SIZE, Arc::clone(clint))
+}
+
+/// starts another hart on its own thread, sharing memory with `cpu`. it starts from the bootrom like `cpu` did
+fn spawn_hart(cpu: &WhiskerCpu, hart_id: usize, jit: bool) -> thread::JoinHandle<()> {
+	let mut hart = WhiskerCpu::new(hart_id, cpu.supported_extensions, cpu.mem.new_hart(hart_id), None);
+	hart.pc = BOOTROM_OFFSET;
+	hart.exact_float = cpu.exact_float;
+	hart.exit = Arc::clone(&cpu.exit);
+	hart.clint = cpu.clint.clone();
+	if jit {
+		enable_jit(&mut hart);
+	}
+	thread::Builder::new()
+		.name(format!("hart{hart_id}"))
+		.spawn(move || {
+			hart.exec_state = WhiskerExecState::Running;
+			// the process exits once hart 0 stops, this only has to report what stopped the hart on its own
+			let reason = hart.run(u64::MAX);
+			if let Some(clint) = &hart.clint {
+				clint.stop(hart_id);
+			}
+			if let StopReason::Trap { mcause, mtval } = reason {
+				error!("hart {hart_id} can't take a trap, mcause={mcause:#X} mtval={mtval:#018X}");
+			}
+		})
+		.unwrap_or_else(|e| panic!("could not spawn a thread for hart {hart_id}: {e:?}"))
+}
+
+fn enable_jit(cpu: &mut WhiskerCpu) {
+	#[cfg(target_arch = "x86_64")]
+	if let Err(e) = cpu.enable_jit() {
+		warn!("could not set up the jit, interpreting everything: {e:?}");
+	}
+	#[cfg(not(target_arch = "x86_64"))]
+	{
+		let _ = cpu;
+		warn!("the jit is only supported on x86-64 hosts, interpreting everything");
+	}
+}
+
+/// returns what the process exits with, see [exit_code]. once GDB disconnects, hart 0 runs until it has executed
+/// `max` instructions in total
+fn run_gdb(mut cpu: WhiskerCpu, max: u64) -> i32 {
+	let stream = gdb::wait_for_tcp().expect("listener to bind");
+	let conn = GdbConnection::new(stream, Arc::clone(&cpu.interrupt)).expect("GDB connection poller to start");
 	let gdb = GdbStub::new(conn);
 	match gdb.run_blocking::<WhiskerEventLoop>(&mut cpu) {
 		Ok(dc_reason) => match dc_reason {
 			gdbstub::stub::DisconnectReason::TargetExited(result) => {
-				println!("Target exited: {result}")
+				println!("Target exited: {result}");
+				i32::from(result)
 			}
 			gdbstub::stub::DisconnectReason::TargetTerminated(signal) => {
 				println!("Target terminated: {signal:?}");
+				0
 			}
 			gdbstub::stub::DisconnectReason::Disconnect => {
+				// nothing can stop the run anymore, and the poller might still set the old flag as the connection goes
+				cpu.clear_breakpoints();
+				cpu.mem.clear_watchpoints();
+				cpu.interrupt = Arc::default();
 				cpu.exec_state = WhiskerExecState::Running;
-				loop {
-					// FIXME: handle this better
-					#[allow(unused_must_use)]
-					cpu.execute_one();
-				}
+				let budget = max.saturating_sub(cpu.cycles);
+				// the hart may be somewhere in the recording, the devices already saw what comes next
+				let reason = match cpu.replay.take() {
+					Some(mut replay) => replay.run(&mut cpu, budget),
+					None => cpu.run(budget),
+				};
+				exit_code(&cpu, reason)
+			}
+			gdbstub::stub::DisconnectReason::Kill => {
+				println!("(GDB) Received kill command");
+				0
 			}
-			gdbstub::stub::DisconnectReason::Kill => println!("(GDB) Received kill command"),
 		},
 		Err(err) => {
 			dbg!(&err);
@@ -157,15 +428,76 @@ fn run_gdb(mut cpu: WhiskerCpu) {
 			} else {
 				println!("gdbstub encountered a fatal error: {err:?}")
 			}
+			1
 		}
 	}
 }
 
-fn run_normal(mut cpu: WhiskerCpu) {
+/// runs hart 0 until the guest exits or `budget` instructions are used up, returns what the process exits with
+fn run_normal(mut cpu: WhiskerCpu, budget: u64) -> i32 {
 	cpu.exec_state = WhiskerExecState::Running;
-	loop {
-		// FIXME: handle this better
-		#[allow(unused_must_use)]
-		cpu.execute_one();
+	let reason = cpu.run(budget);
+	exit_code(&cpu, reason)
+}
+
+/// runs hart 0 until it has executed `at` instructions and writes a snapshot to `path`, returns what the process
+/// exits with. a guest that stops on its own first exits like it would have without a snapshot
+fn run_to_snapshot(mut cpu: WhiskerCpu, at: u64, path: &Path) -> i32 {
+	cpu.exec_state = WhiskerExecState::Running;
+	match cpu.run(at.saturating_sub(cpu.cycles)) {
+		StopReason::BudgetExhausted => match snapshot::write(&cpu, path) {
+			Ok(()) => {
+				info!(
+					"wrote a snapshot after {} instructions to {}",
+					cpu.cycles,
+					path.display()
+				);
+				0
+			}
+			Err(e) => {
+				error!("could not write the snapshot to {}: {e:?}", path.display());
+				1
+			}
+		},
+		reason => {
+			warn!("hart 0 stopped before the snapshot was taken");
+			exit_code(&cpu, reason)
+		}
+	}
+}
+
+/// [run_normal] with hart 0 sampled, the report is written to `path` once the run stops
+fn run_profiled(mut cpu: WhiskerCpu, budget: u64, args: &ProfileArgs, path: &Path, kernel: &Path) -> i32 {
+	let symbols = Symbols::for_kernel(args.profile_elf.as_deref(), kernel);
+	let mut profiler = Profiler::new(args.profile_interval);
+	cpu.exec_state = WhiskerExecState::Running;
+	let reason = profiler.run(&mut cpu, budget);
+	if let Err(e) = profiler.write_report(&mut cpu, path, &symbols) {
+		error!("could not write the profile to {}: {e:?}", path.display());
+	}
+	exit_code(&cpu, reason)
+}
+
+/// the guest's own exit code if it exited through the test finisher
+fn exit_code(cpu: &WhiskerCpu, reason: StopReason) -> i32 {
+	match reason {
+		StopReason::Exited(exit) => {
+			info!("guest exited after {} instructions: {exit:?}", cpu.cycles);
+			exit.exit_code()
+		}
+		StopReason::Trap { mcause, mtval } => {
+			error!(
+				"can't take a trap, mcause={mcause:#X} mtval={mtval:#018X} pc={:#018X}",
+				cpu.pc
+			);
+			EXIT_TRAPPED
+		}
+		StopReason::BudgetExhausted => {
+			warn!("stopping after {} instructions", cpu.cycles);
+			EXIT_BUDGET_EXHAUSTED
+		}
+		StopReason::HitBreakpoint | StopReason::HitWatchpoint(_) | StopReason::Interrupted => {
+			unreachable!("breakpoints, watchpoints and interrupts only come from GDB")
+		}
 	}
 }
@@ -1,55 +1,181 @@
+mod bus;
+mod io_log;
+mod mmu;
+mod phys;
+mod watch;
+
 use std::collections::HashMap;
 use std::fmt::Debug;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::fs::File;
+use std::io::{self, Read as _};
+use std::ops::Deref;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, RwLock, Weak};
 
 use tracing::*;
 
+use crate::icache::InstructionCache;
+use crate::insn::uop::MicroOp;
 use crate::soft::double::SoftDouble;
 use crate::soft::float::SoftFloat;
+use crate::ty::TrapIdx;
+
+pub use self::bus::Device;
+use self::bus::DeviceBus;
+use self::io_log::IoLog;
+use self::mmu::Tlb;
+pub use self::mmu::{satp_mode_supported, Access, Translation};
+use self::phys::PhysMemory;
+pub use self::phys::{host_page_size, PhysBacking};
+use self::watch::Watchpoints;
+pub use self::watch::{WatchHit, WatchKind};
 
+/// One reservation register per hart, holding the physical address of the reserved cache line with
+/// [MemoryReservations::VALID] set, or 0
 struct MemoryReservations {
-	// Physical address to hart id, this would be important if we ever do multithreading
-	reservations: HashMap<u64, usize>,
+	harts: Box<[AtomicU64]>,
+	// number of valid reservations, stores only look at the registers while somebody holds one
+	active: AtomicUsize,
 }
 
 impl MemoryReservations {
 	// For RV64 hardware I believe this is common
 	const CACHE_LINE_SIZE: u64 = 64;
+	// lines are aligned, so the low bit is free
+	const VALID: u64 = 1;
 
-	fn new() -> Self {
+	fn new(harts: usize) -> Self {
 		Self {
-			reservations: HashMap::with_capacity(1024),
+			harts: (0..harts).map(|_| AtomicU64::new(0)).collect(),
+			active: AtomicUsize::new(0),
+		}
+	}
+
+	fn line(phys_addr: u64) -> u64 {
+		phys_addr & !(Self::CACHE_LINE_SIZE - 1)
+	}
+
+	/// replaces the reservation `hart_id` holds, if any
+	fn reserve(&self, phys_addr: u64, hart_id: usize) {
+		let prev = self.harts[hart_id].swap(Self::line(phys_addr) | Self::VALID, Ordering::SeqCst);
+		if prev & Self::VALID == 0 {
+			self.active.fetch_add(1, Ordering::SeqCst);
+		}
+	}
+
+	/// clears the reservation of `hart_id`, returns whether it was on the line `phys_addr` is in
+	fn take(&self, phys_addr: u64, hart_id: usize) -> bool {
+		let prev = self.harts[hart_id].swap(0, Ordering::SeqCst);
+		if prev & Self::VALID != 0 {
+			self.active.fetch_sub(1, Ordering::SeqCst);
 		}
+		prev == Self::line(phys_addr) | Self::VALID
 	}
 
-	fn reserve(&mut self, phys_addr: u64, hart_id: usize) {
-		let aligned_addr = phys_addr & !(Self::CACHE_LINE_SIZE - 1);
-		self.reservations.insert(aligned_addr, hart_id);
+	fn unreserve(&self, phys_addr: u64) {
+		self.unreserve_range(phys_addr, 1);
 	}
 
-	fn unreserve(&mut self, phys_addr: u64) {
-		let aligned_addr = phys_addr & !(Self::CACHE_LINE_SIZE - 1);
-		self.reservations.remove(&aligned_addr);
+	/// the line `hart_id` holds a reservation on, if any
+	fn held(&self, hart_id: usize) -> Option<u64> {
+		let current = self.harts[hart_id].load(Ordering::Acquire);
+		(current & Self::VALID != 0).then_some(current & !Self::VALID)
 	}
 
-	fn is_reserved(&mut self, phys_addr: u64, hart_id: usize) -> bool {
-		let aligned_addr = phys_addr & !(Self::CACHE_LINE_SIZE - 1);
-		self.reservations
-			.get(&aligned_addr)
-			.is_some_and(|hart| *hart == hart_id)
+	/// unreserves every cache line overlapping phys_addr..phys_addr + len, for whichever hart holds it
+	#[inline(always)]
+	fn unreserve_range(&self, phys_addr: u64, len: u64) {
+		if self.active.load(Ordering::Acquire) == 0 {
+			return;
+		}
+
+		let first = Self::line(phys_addr);
+		let last = Self::line(phys_addr + len - 1);
+		for reservation in self.harts.iter() {
+			let current = reservation.load(Ordering::Acquire);
+			let line = current & !Self::VALID;
+			if current & Self::VALID != 0
+				&& (first..=last).contains(&line)
+				&& reservation
+					.compare_exchange(current, 0, Ordering::SeqCst, Ordering::Relaxed)
+					.is_ok()
+			{
+				self.active.fetch_sub(1, Ordering::SeqCst);
+			}
+		}
 	}
 }
 
-pub struct Memory {
-	phys: Box<[u8]>,
-	bootrom: Box<[u8]>,
+/// Everything about memory that is the same for every hart
+struct SharedMemory {
+	phys: PhysMemory,
+	bootrom: RwLock<BootromImage>,
 	mappings: HashMap<PageBase, PageEntry>,
+	devices: DeviceBus,
+	page_table: Arc<PageTable>,
 
-	// If we were to do multithreading, this would probably need to be a Send Cell type
 	reservations: MemoryReservations,
 	atomic_lock: AtomicBool,
 }
 
+/// An access that failed at virtual address `addr`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Fault {
+	pub addr: u64,
+	pub kind: FaultKind,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FaultKind {
+	/// the page tables don't map the address, or not for this access
+	Page,
+	/// the physical address isn't RAM, the bootrom or a device, or the page tables aren't in RAM
+	Access,
+}
+
+impl Fault {
+	fn access(addr: u64) -> Self {
+		Self {
+			addr,
+			kind: FaultKind::Access,
+		}
+	}
+
+	/// the exception the fault raises for `access`
+	pub fn cause(self, access: Access) -> TrapIdx {
+		match (self.kind, access) {
+			(FaultKind::Page, Access::Fetch) => TrapIdx::INSTRUCTION_PAGE_FAULT,
+			(FaultKind::Page, Access::Load) => TrapIdx::LOAD_PAGE_FAULT,
+			(FaultKind::Page, Access::Store) => TrapIdx::STORE_PAGE_FAULT,
+			(FaultKind::Access, Access::Fetch) => TrapIdx::INSTRUCTION_ACCESS_FAULT,
+			(FaultKind::Access, Access::Load) => TrapIdx::LOAD_ACCESS_FAULT,
+			(FaultKind::Access, Access::Store) => TrapIdx::STORE_ACCESS_FAULT,
+		}
+	}
+}
+
+/// A hart's view of memory. every hart has its own handle (see [Memory::new_hart]) with its own decoded instruction
+/// cache, on top of the same physical memory and mappings.
+///
+/// a hart only invalidates its own instruction cache when it writes to memory, like on hardware other harts have to
+/// run a `fence.i` before they're guaranteed to see code written by someone else
+pub struct Memory {
+	shared: Arc<SharedMemory>,
+	hart_id: usize,
+	// what the last LR read, a store conditional only succeeds if memory still holds it
+	reserved: LoadReserved,
+	// the shared page table, or this hart's own copy with the pages its watchpoints are on marked slow. watchpoints
+	// are on virtual addresses, so the copy is only for untranslated accesses, where those are the physical ones
+	page_table: Arc<PageTable>,
+	watchpoints: Watchpoints,
+	io_log: IoLog,
+	translation: Translation,
+	tlb: Tlb,
+
+	/// keyed by physical address, see [Self::decoded]
+	pub icache: InstructionCache,
+}
+
 impl Debug for Memory {
 	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
 		f.debug_struct("Memory").finish_non_exhaustive()
@@ -57,208 +183,764 @@ impl Debug for Memory {
 }
 
 impl Memory {
+	/// a new handle on the same memory for another hart, there can be as many harts as [MemoryBuilder::harts]
+	pub fn new_hart(&self, hart_id: usize) -> Self {
+		assert!(
+			hart_id < self.shared.reservations.harts.len(),
+			"memory was built for {} harts, not hart {hart_id}",
+			self.shared.reservations.harts.len()
+		);
+		Self {
+			shared: Arc::clone(&self.shared),
+			hart_id,
+			reserved: LoadReserved::default(),
+			page_table: Arc::clone(&self.shared.page_table),
+			watchpoints: Watchpoints::default(),
+			io_log: IoLog::default(),
+			translation: Translation::BARE,
+			tlb: Tlb::default(),
+			icache: InstructionCache::new(),
+		}
+	}
+
+	/// stops on accesses to `addr..addr + len` by this hart, see [Self::take_watch_hit]. only the pages the
+	/// watchpoint is on get slower
+	pub fn add_watchpoint(&mut self, addr: u64, len: u64, kind: WatchKind) {
+		self.watchpoints.insert(addr, len, kind);
+		self.update_page_table();
+	}
+
+	/// returns false if there was no such watchpoint
+	pub fn remove_watchpoint(&mut self, addr: u64, len: u64, kind: WatchKind) -> bool {
+		let removed = self.watchpoints.remove(addr, len, kind);
+		self.update_page_table();
+		removed
+	}
+
+	pub fn clear_watchpoints(&mut self) {
+		self.watchpoints.suspend();
+		self.update_page_table();
+	}
+
+	/// takes every watchpoint out until they're put back with [Self::restore_watchpoints]
+	pub fn suspend_watchpoints(&mut self) -> SuspendedWatchpoints {
+		let suspended = SuspendedWatchpoints(self.watchpoints.suspend());
+		self.update_page_table();
+		suspended
+	}
+
+	pub fn restore_watchpoints(&mut self, suspended: SuspendedWatchpoints) {
+		self.watchpoints.restore(suspended.0);
+		self.update_page_table();
+	}
+
+	pub fn has_watchpoints(&self) -> bool {
+		!self.watchpoints.is_empty()
+	}
+
+	/// the first access that hit a watchpoint since the last call, the access itself went through
+	#[inline]
+	pub fn take_watch_hit(&self) -> Option<WatchHit> {
+		self.watchpoints.take_hit()
+	}
+
+	/// reads an instruction parcel, fetches don't hit watchpoints
+	pub fn fetch_u16(&self, pc: u64) -> Result<u16, Fault> {
+		let mut buf = [0; 2];
+		self.fetch_slice(pc, &mut buf)?;
+		Ok(u16::from_le_bytes(buf))
+	}
+
+	/// reads a whole 32 bit instruction, fetches don't hit watchpoints
+	pub fn fetch_u32(&self, pc: u64) -> Result<u32, Fault> {
+		let mut buf = [0; 4];
+		self.fetch_slice(pc, &mut buf)?;
+		Ok(u32::from_le_bytes(buf))
+	}
+
+	fn fetch_slice(&self, pc: u64, buf: &mut [u8]) -> Result<(), Fault> {
+		// only a hit from before the fetch is kept
+		let hit = self.watchpoints.take_hit();
+		let result = self.read_access(pc, buf, Access::Fetch);
+		self.watchpoints.set_hit(hit);
+		result
+	}
+
+	/// [Self::read_slice] for the debugger, which doesn't hit watchpoints or end up in the device read log
+	pub fn debug_read_slice(&mut self, offset: u64, buf: &mut [u8]) -> Result<(), Fault> {
+		let watchpoints = self.watchpoints.suspend();
+		let io_log = std::mem::take(&mut self.io_log);
+		let result = self.read_slice(offset, buf);
+		self.io_log = io_log;
+		self.watchpoints.restore(watchpoints);
+		result
+	}
+
+	/// [Self::write_slice] for the debugger, which doesn't hit watchpoints
+	pub fn debug_write_slice(&mut self, offset: u64, val: &[u8]) -> Result<(), Fault> {
+		let watchpoints = self.watchpoints.suspend();
+		let result = self.write_slice(offset, val);
+		self.watchpoints.restore(watchpoints);
+		result
+	}
+
+	/// the instruction decoded from `pc` before, if the translation of `pc` is cached. decoded instructions are kept by
+	/// physical address, so they're shared between every virtual address the code is mapped at
+	#[inline(always)]
+	pub fn decoded(&mut self, pc: u64) -> Option<MicroOp> {
+		let addr = self.cached_fetch_addr(pc)?;
+		self.icache.get(addr)
+	}
+
+	/// [Self::decoded], along with the physical page the instruction is on
+	pub fn decoded_on_page(&mut self, pc: u64) -> Option<(MicroOp, PageBase)> {
+		let addr = self.cached_fetch_addr(pc)?;
+		Some((self.icache.get(addr)?, PageBase::from_addr(addr)))
+	}
+
+	/// remembers `op` as the instruction at `pc`, which was just fetched
+	pub fn cache_decoded(&mut self, pc: u64, op: MicroOp) {
+		if let Some(addr) = self.cached_fetch_addr(pc) {
+			self.icache.insert(addr, op);
+		}
+	}
+
+	/// forgets the instruction decoded from `pc`, if any
+	pub fn remove_decoded(&mut self, pc: u64) {
+		match self.cached_fetch_addr(pc) {
+			Some(addr) => self.icache.remove(addr),
+			// it could be anywhere
+			None => self.icache.clear(),
+		}
+	}
+
+	/// a handle for devices to access RAM with, see [Dma]
+	pub fn dma(&self) -> Dma {
+		Dma(Arc::downgrade(&self.shared))
+	}
+
+	/// the size of physical memory in bytes
+	pub fn phys_size(&self) -> u64 {
+		self.shared.phys.len() as u64
+	}
+
+	/// physical offsets of every page of physical memory that isn't all zero, see [PhysMemory::used_pages]
+	pub fn used_phys_pages(&self) -> Vec<u64> {
+		self.shared
+			.phys
+			.used_pages(PAGE_SIZE as usize)
+			.into_iter()
+			.map(|offset| offset as u64)
+			.collect()
+	}
+
+	/// reads the physical page at `phys_base`
+	pub fn read_phys_page(&self, phys_base: PageBase, buf: &mut [u8; PAGE_SIZE as usize]) {
+		self.shared.phys.read_words(phys_base.0 as usize, buf);
+	}
+
+	/// the bootrom as it is now, including whatever the guest wrote to it
+	pub fn bootrom_image(&self) -> BootromImage {
+		self.shared.bootrom().clone()
+	}
+
+	/// starts logging device reads, so they can be replayed from a [MemoryCheckpoint]. see [Self::set_replaying]
+	pub fn record_io(&mut self) {
+		self.io_log.enable();
+	}
+
+	/// while replaying, device reads come from the log and device writes are dropped, see [Device::replays_writes]
+	pub fn set_replaying(&mut self, replaying: bool) {
+		self.io_log.set_replaying(replaying);
+	}
+
+	/// `input` for something from outside the hart that isn't a device read, logged and replayed like one
+	pub fn logged_input(&self, input: impl FnOnce() -> u64) -> u64 {
+		let mut buf = [0; 8];
+		self.io_log.read(&mut buf, |buf| {
+			buf.copy_from_slice(&input().to_le_bytes());
+			true
+		});
+		u64::from_le_bytes(buf)
+	}
+
+	/// forgets the device reads that would be replayed from here on, for when the past was changed
+	pub fn forget_future_io(&mut self) {
+		self.io_log.truncate();
+	}
+
+	/// A copy of the memory this hart can see, to go back to with [Self::restore_checkpoint]. only pages that aren't
+	/// all zero are copied
+	pub fn checkpoint(&self) -> MemoryCheckpoint {
+		let pages = self
+			.used_phys_pages()
+			.into_iter()
+			.map(|phys_base| {
+				let mut page = Box::new([0; PAGE_SIZE as usize]);
+				self.read_phys_page(PageBase(phys_base), &mut page);
+				(phys_base, page)
+			})
+			.collect();
+		MemoryCheckpoint {
+			pages,
+			bootrom: self.bootrom_image(),
+			reservation: self.shared.reservations.held(self.hart_id).map(|_| self.reserved),
+			io_pos: self.io_log.position(),
+		}
+	}
+
+	/// puts memory back the way it was at `checkpoint`. other harts would see memory change under them, so this is
+	/// only for a single hart
+	pub fn restore_checkpoint(&mut self, checkpoint: &MemoryCheckpoint) {
+		let shared = &*self.shared;
+		let zero = [0; PAGE_SIZE as usize];
+		for phys_base in self.used_phys_pages() {
+			if checkpoint
+				.pages
+				.binary_search_by_key(&phys_base, |(base, _)| *base)
+				.is_err()
+			{
+				shared.phys.write_words(phys_base as usize, &zero);
+			}
+		}
+		for (phys_base, page) in &checkpoint.pages {
+			shared.phys.write_words(*phys_base as usize, page.as_slice());
+		}
+		*shared.bootrom_mut() = checkpoint.bootrom.clone();
+
+		shared.reservations.take(0, self.hart_id);
+		if let Some(reserved) = checkpoint.reservation {
+			shared.reservations.reserve(reserved.phys_addr, self.hart_id);
+			self.reserved = reserved;
+		}
+		if self.io_log.is_enabled() {
+			self.io_log.seek(checkpoint.io_pos);
+		}
+		self.icache.clear();
+		self.flush_tlb();
+	}
+
+	fn update_page_table(&mut self) {
+		// translations remember whether their page has watchpoints on it
+		self.flush_tlb();
+		if self.watchpoints.is_empty() {
+			self.page_table = Arc::clone(&self.shared.page_table);
+			return;
+		}
+		let mut page_table = PageTable::clone(&self.shared.page_table);
+		for base in self.watchpoints.pages() {
+			page_table.mark_slow(base);
+		}
+		self.page_table = Arc::new(page_table);
+	}
+
 	/// the reading primitive that does page lookups and such
-	/// returns Ok if the read succeeded, or Err(virt) if the read failed
-	/// where virt is the failing virtual address
+	/// returns Ok if the read succeeded, or the [Fault] at the failing virtual address
 	#[track_caller]
-	pub fn read_slice(&self, offset: u64, buf: &mut [u8]) -> Result<(), u64> {
-		for (idx, val) in buf.iter_mut().enumerate() {
-			let offset = offset + idx as u64;
-			let base = PageBase::from_addr(offset);
-			let Some(page_entry) = self.mappings.get(&base) else {
-				trace!("no page entry for {:#018X}", offset);
-				return Err(offset);
-			};
-			let page_offset = offset - base.0;
+	pub fn read_slice(&self, offset: u64, buf: &mut [u8]) -> Result<(), Fault> {
+		self.read_access(offset, buf, Access::Load)
+	}
 
-			match page_entry {
-				PageEntry::PhysBacked { phys_base } => {
-					let offset = phys_base + page_offset;
+	#[inline(always)]
+	fn read_access(&self, offset: u64, buf: &mut [u8], access: Access) -> Result<(), Fault> {
+		let shared = &*self.shared;
+		let mut done = 0;
+		while done < buf.len() {
+			let offset = offset.wrapping_add(done as u64);
+			let page_offset = offset & (PAGE_SIZE - 1);
+			let len = (buf.len() - done).min((PAGE_SIZE - page_offset) as usize);
+			let chunk = &mut buf[done..done + len];
+
+			let (page, addr) = self.lookup(offset, access)?;
+			match page {
+				FastPage::PhysBacked { phys_base } => {
+					let offset = (phys_base + page_offset) as usize;
 					trace!("Reading from physmem @ {:#018X}", offset);
-					*val = self.phys[offset as usize];
+					shared.phys.read(offset, chunk);
 				}
-				PageEntry::Bootrom { page_base } => {
-					let offset = page_base + page_offset;
+				FastPage::Bootrom { page_base } => {
+					let offset = (page_base + page_offset) as usize;
 					trace!("Reading from bootrom @ {:#018X}", offset);
-					*val = self.bootrom[offset as usize];
+					chunk.copy_from_slice(&shared.bootrom()[offset..offset + len]);
 				}
-				PageEntry::MMIO { on_read, .. } => {
-					trace!("Reading from MMIO @ {:#018X}", offset);
-					*val = on_read(offset);
+				FastPage::Slow => self.read_slow(offset, addr, chunk)?,
+				FastPage::Unmapped => {
+					trace!("no page entry for {:#018X}", offset);
+					return Err(Fault::access(offset));
 				}
 			}
+
+			done += len;
 		}
 		Ok(())
 	}
 
 	/// the writing primitive that does page lookups and such
-	/// returns Ok if the write succeeded, or Err(virt) if the write
-	/// where virt is the failing virtual address
+	/// returns Ok if the write succeeded, or the [Fault] at the failing virtual address
 	#[track_caller]
-	pub fn write_slice(&mut self, offset: u64, val: &[u8]) -> Result<(), u64> {
-		for (idx, val) in val.into_iter().enumerate() {
-			let offset = offset + idx as u64;
-			let base = PageBase::from_addr(offset);
-			let Some(page_entry) = self.mappings.get(&base) else {
-				trace!("no page entry for {:#018X}", offset);
-				return Err(offset);
-			};
-			let page_offset = offset - base.0;
+	pub fn write_slice(&mut self, offset: u64, val: &[u8]) -> Result<(), Fault> {
+		let mut done = 0;
+		while done < val.len() {
+			let offset = offset.wrapping_add(done as u64);
+			let page_offset = offset & (PAGE_SIZE - 1);
+			let len = (val.len() - done).min((PAGE_SIZE - page_offset) as usize);
+			let chunk = &val[done..done + len];
 
-			match page_entry {
-				PageEntry::PhysBacked { phys_base } => {
+			let (page, addr) = self.lookup(offset, Access::Store)?;
+			// anything decoded from the page we're about to write to is stale now
+			self.icache.invalidate_range(addr, len as u64);
+			let shared = &*self.shared;
+			match page {
+				FastPage::PhysBacked { phys_base } => {
 					// Invalidate reservations on memory whenever it's written to
 					let phys_addr = phys_base + page_offset;
-					self.reservations.unreserve(phys_addr);
+					shared.reservations.unreserve_range(phys_addr, len as u64);
 
-					trace!("Writing to physmem @ {:#018X}", phys_base);
-					self.phys[phys_addr as usize] = *val;
+					trace!("Writing to physmem @ {:#018X}", phys_addr);
+					shared.phys.write(phys_addr as usize, chunk);
 				}
 				// writing to bootrom is allowed, this makes it easier to write bootrom code
 				// without having to do loader shenanigans
-				PageEntry::Bootrom { page_base } => {
-					trace!("Writing to bootrom @ 0x{:#018X}", page_base);
-					self.bootrom[(page_base + page_offset) as usize] = *val;
+				FastPage::Bootrom { page_base } => {
+					let offset = (page_base + page_offset) as usize;
+					trace!("Writing to bootrom @ {:#018X}", offset);
+					shared.bootrom_mut().make_mut()[offset..offset + len].copy_from_slice(chunk);
 				}
-				PageEntry::MMIO { on_write, .. } => {
-					trace!("Writing to MMIO @ {:#018X}", offset);
-					on_write(offset, *val);
+				FastPage::Slow => self.write_slow(offset, addr, chunk)?,
+				FastPage::Unmapped => {
+					trace!("no page entry for {:#018X}", offset);
+					return Err(Fault::access(offset));
 				}
 			}
+
+			done += len;
 		}
 		Ok(())
 	}
 
-	/// Returns Err(virt_addr) on failure
-	fn translate_address(&self, virt_addr: u64) -> Result<u64, u64> {
-		let base = PageBase::from_addr(virt_addr);
-		let Some(page_entry) = self.mappings.get(&base) else {
-			return Err(virt_addr);
+	/// reads from devices, or byte by byte through the full mapping table, for pages the page table can't resolve on
+	/// its own or that have watchpoints on them. `vaddr` was translated to physical address `offset`
+	/// NOTE: buf must not cross a page boundary
+	fn read_slow(&self, vaddr: u64, offset: u64, buf: &mut [u8]) -> Result<(), Fault> {
+		self.watchpoints.check(vaddr, buf.len(), false);
+		let shared = &*self.shared;
+		if self.io_log.read(buf, |buf| shared.devices.read(offset, buf)) {
+			return Ok(());
+		}
+		let base = PageBase::from_addr(offset);
+		let Some(page_entry) = shared.mappings.get(&base) else {
+			trace!("no page entry for {:#018X}", offset);
+			return Err(Fault::access(vaddr));
 		};
-		let page_offset = virt_addr - base.0;
 
-		match page_entry {
-			PageEntry::PhysBacked { phys_base } => Ok(phys_base + page_offset),
-			PageEntry::Bootrom { page_base: _ }
-			| PageEntry::MMIO {
-				on_read: _,
-				on_write: _,
-			} => Err(virt_addr), // TODO: What to do for Bootrom & MMIO?
+		for (idx, val) in buf.iter_mut().enumerate() {
+			let offset = offset + idx as u64;
+			let page_offset = offset - base.0;
+			match page_entry {
+				PageEntry::PhysBacked { phys_base } => shared
+					.phys
+					.read((phys_base + page_offset) as usize, std::slice::from_mut(val)),
+				PageEntry::Bootrom { page_base } => *val = shared.bootrom()[(page_base + page_offset) as usize],
+			}
+		}
+		Ok(())
+	}
+
+	/// writes to devices, or byte by byte through the full mapping table, for pages the page table can't resolve on
+	/// its own or that have watchpoints on them. `vaddr` was translated to physical address `offset`
+	/// NOTE: val must not cross a page boundary
+	fn write_slow(&self, vaddr: u64, offset: u64, val: &[u8]) -> Result<(), Fault> {
+		self.watchpoints.check(vaddr, val.len(), true);
+		let shared = &*self.shared;
+		if !self.io_log.writes_live() && shared.devices.drops_replayed_write(offset, val.len()) {
+			return Ok(());
+		}
+		if shared.devices.write(offset, val) {
+			return Ok(());
+		}
+		let base = PageBase::from_addr(offset);
+		let Some(page_entry) = shared.mappings.get(&base) else {
+			trace!("no page entry for {:#018X}", offset);
+			return Err(Fault::access(vaddr));
+		};
+
+		for (idx, val) in val.iter().enumerate() {
+			let offset = offset + idx as u64;
+			let page_offset = offset - base.0;
+			match page_entry {
+				PageEntry::PhysBacked { phys_base } => {
+					let phys_addr = phys_base + page_offset;
+					shared.reservations.unreserve(phys_addr);
+					shared.phys.write(phys_addr as usize, std::slice::from_ref(val));
+				}
+				PageEntry::Bootrom { page_base } => {
+					shared.bootrom_mut().make_mut()[(page_base + page_offset) as usize] = *val;
+				}
+			}
+		}
+		Ok(())
+	}
+
+	/// images that land in a single run of physical memory get mapped straight from the file, anything else is copied
+	fn load_image(&mut self, addr: PageBase, file: &mut File) -> io::Result<()> {
+		let len = file.metadata()?.len();
+		let backing = |addr| self.translate_address(addr, Access::Store).map(|(offset, _)| offset);
+		let contiguous_phys = backing(addr.0).ok().filter(|&phys_base| {
+			(0..len)
+				.step_by(PAGE_SIZE as usize)
+				.all(|offset| backing(addr.0 + offset) == Ok(phys_base + offset))
+		});
+
+		match contiguous_phys {
+			// UNWRAP: images are loaded while building, before there are other handles
+			Some(phys_base) => Arc::get_mut(&mut self.shared)
+				.unwrap()
+				.phys
+				.load_image(phys_base as usize, file),
+			None => {
+				let mut data = Vec::new();
+				file.read_to_end(&mut data)?;
+				self.write_slice(addr.0, &data).map_err(|fault| {
+					io::Error::new(
+						io::ErrorKind::InvalidInput,
+						format!("image does not fit, {:#018X} is not mapped", fault.addr),
+					)
+				})
+			}
+		}
+	}
+
+	/// the offset into physical memory backing `virt_addr` and its physical address, or the [Fault] if `access` isn't
+	/// allowed or it isn't backed by physical memory
+	fn translate_address(&self, virt_addr: u64, access: Access) -> Result<(u64, u64), Fault> {
+		let (page, addr) = self.lookup(virt_addr, access)?;
+		match self.phys_offset(page, virt_addr, addr) {
+			Some(phys_addr) => Ok((phys_addr, addr)),
+			None => Err(Fault::access(virt_addr)),
+		}
+	}
+
+	/// the offset into physical memory backing `virt_addr`, which was looked up as `page` at physical address `addr`,
+	/// or None if it isn't RAM
+	fn phys_offset(&self, page: FastPage, virt_addr: u64, addr: u64) -> Option<u64> {
+		if let FastPage::PhysBacked { phys_base } = page {
+			return Some(phys_base + (virt_addr & (PAGE_SIZE - 1)));
+		}
+
+		let base = PageBase::from_addr(addr);
+		let page_offset = addr - base.0;
+		match self.shared.mappings.get(&base)? {
+			PageEntry::PhysBacked { phys_base } => Some(phys_base + page_offset),
+			PageEntry::Bootrom { page_base: _ } => None, // TODO: What to do for Bootrom?
 		}
 	}
 
 	#[inline(always)]
 	fn with_atomic_lock<R, F: FnOnce(&mut Memory) -> R>(&mut self, f: F) -> R {
-		while self.atomic_lock.swap(true, Ordering::Acquire) {
+		// the handle is cloned so the lock can be held while `f` has the whole of self
+		let shared = Arc::clone(&self.shared);
+		while shared.atomic_lock.swap(true, Ordering::Acquire) {
 			std::hint::spin_loop();
 		}
 
 		let result = f(self);
 
-		self.atomic_lock.store(false, Ordering::Release);
+		shared.atomic_lock.store(false, Ordering::Release);
 
 		result
 	}
 
-	/// Returns Err(virt_addr) on failure
-	pub fn load_reserved_word(&mut self, virt_addr: u64, hart_id: usize) -> Result<u32, u64> {
-		let phys_addr = self.translate_address(virt_addr)?;
-		self.reservations.reserve(phys_addr, hart_id);
-		Ok(self.read_u32(virt_addr)?)
+	/// Returns the [Fault] on failure
+	pub fn load_reserved_word(&mut self, virt_addr: u64) -> Result<u32, Fault> {
+		let (phys_addr, _) = self.translate_address(virt_addr, Access::Load)?;
+		self.shared.reservations.reserve(phys_addr, self.hart_id);
+		let word = self.read_u32(virt_addr)?;
+		self.reserved = LoadReserved {
+			phys_addr,
+			len: 4,
+			value: u64::from(word),
+		};
+		Ok(word)
 	}
 
-	/// Returns Err(virt_addr) on failure
-	pub fn load_reserved_dword(&mut self, virt_addr: u64, hart_id: usize) -> Result<u64, u64> {
-		let phys_addr = self.translate_address(virt_addr)?;
-		self.reservations.reserve(phys_addr, hart_id);
-		Ok(self.read_u64(virt_addr)?)
+	/// Returns the [Fault] on failure
+	pub fn load_reserved_dword(&mut self, virt_addr: u64) -> Result<u64, Fault> {
+		let (phys_addr, _) = self.translate_address(virt_addr, Access::Load)?;
+		self.shared.reservations.reserve(phys_addr, self.hart_id);
+		let dword = self.read_u64(virt_addr)?;
+		self.reserved = LoadReserved {
+			phys_addr,
+			len: 8,
+			value: dword,
+		};
+		Ok(dword)
 	}
 
-	/// Returns Ok(successful) or Err(virt_addr)
-	pub fn store_conditional_word(&mut self, virt_addr: u64, hart_id: usize, word: u32) -> Result<bool, u64> {
-		let phys_addr = self.translate_address(virt_addr)?;
-
-		let is_reserved = self.reservations.is_reserved(phys_addr, hart_id);
-		if !is_reserved {
+	/// Returns Ok(successful) or the [Fault].
+	/// a store from another hart can land between taking the reservation and writing, so the write is a compare
+	/// exchange against what the LR read. a store of the same value in that window goes unnoticed. reservations are
+	/// on whole lines, but what to compare against is only known where the LR read, so an SC anywhere else fails.
+	/// the host atomics write watched pages too, so they check watchpoints like the slow path does
+	pub fn store_conditional_word(&mut self, virt_addr: u64, word: u32) -> Result<bool, Fault> {
+		let (phys_addr, addr) = self.translate_address(virt_addr, Access::Store)?;
+		if !self.take_reservation(phys_addr, 4) {
 			return Ok(false);
 		}
 
-		self.with_atomic_lock(|this| {
-			let write_result = this.write_u32(virt_addr, word);
+		let stored = match self
+			.shared
+			.phys
+			.compare_exchange_u32(phys_addr as usize, self.reserved.value as u32, word)
+		{
+			Some(stored) => stored,
+			// misaligned, there's nothing to compare against atomically
+			None => self.write_u32(virt_addr, word).is_ok(),
+		};
+		if stored {
+			self.watchpoints.check(virt_addr, 4, true);
+			self.icache.invalidate_range(addr, 4);
+			self.shared.reservations.unreserve_range(phys_addr, 4);
+		}
+		Ok(stored)
+	}
 
-			this.reservations.unreserve(phys_addr);
+	/// Returns Ok(successful) or the [Fault], see store_conditional_word
+	pub fn store_conditional_dword(&mut self, virt_addr: u64, dword: u64) -> Result<bool, Fault> {
+		let (phys_addr, addr) = self.translate_address(virt_addr, Access::Store)?;
+		if !self.take_reservation(phys_addr, 8) {
+			return Ok(false);
+		}
 
-			Ok(write_result.is_ok())
-		})
+		let stored = match self
+			.shared
+			.phys
+			.compare_exchange_u64(phys_addr as usize, self.reserved.value, dword)
+		{
+			Some(stored) => stored,
+			// misaligned, there's nothing to compare against atomically
+			None => self.write_u64(virt_addr, dword).is_ok(),
+		};
+		if stored {
+			self.watchpoints.check(virt_addr, 8, true);
+			self.icache.invalidate_range(addr, 8);
+			self.shared.reservations.unreserve_range(phys_addr, 8);
+		}
+		Ok(stored)
 	}
 
-	/// Returns Ok(successful) or Err(virt_addr)
-	pub fn store_conditional_dword(&mut self, virt_addr: u64, hart_id: usize, dword: u64) -> Result<bool, u64> {
-		let phys_addr = self.translate_address(virt_addr)?;
+	/// gives up the reservation, returns whether an SC of `len` bytes at `phys_addr` can go ahead
+	fn take_reservation(&mut self, phys_addr: u64, len: u8) -> bool {
+		let held = self.shared.reservations.take(phys_addr, self.hart_id);
+		held && (self.reserved.phys_addr, self.reserved.len) == (phys_addr, len)
+	}
 
-		let is_reserved = self.reservations.is_reserved(phys_addr, hart_id);
-		if !is_reserved {
-			return Ok(false);
+	/// Performs `op` on the word at `virt_addr` and `val`, returns Ok(original_value) or the [Fault].
+	/// naturally aligned AMOs on ram are a single host atomic, anything else is done under the atomic lock. an AMO that
+	/// doesn't translate faults like a store. the host atomic checks watchpoints itself, watched pages are RAM too
+	pub fn amo_word(&mut self, virt_addr: u64, op: AmoOp, val: u32, ordering: Ordering) -> Result<u32, Fault> {
+		let (page, addr) = self.lookup(virt_addr, Access::Store)?;
+		if let Some(phys_addr) = self.phys_offset(page, virt_addr, addr) {
+			if let Some(word) = self.shared.phys.amo_u32(phys_addr as usize, op, val, ordering) {
+				self.watchpoints.check(virt_addr, 4, true);
+				self.icache.invalidate_range(addr, 4);
+				self.shared.reservations.unreserve_range(phys_addr, 4);
+				return Ok(word);
+			}
 		}
 
 		self.with_atomic_lock(|this| {
-			let write_result = this.write_u64(virt_addr, dword);
+			let word = this.read_u32(virt_addr)?;
+			this.write_u32(virt_addr, op.apply_u32(word, val))?;
+			Ok(word)
+		})
+	}
 
-			this.reservations.unreserve(phys_addr);
+	/// Performs `op` on the dword at `virt_addr` and `val`, returns Ok(original_value) or the [Fault].
+	/// see amo_word
+	pub fn amo_dword(&mut self, virt_addr: u64, op: AmoOp, val: u64, ordering: Ordering) -> Result<u64, Fault> {
+		let (page, addr) = self.lookup(virt_addr, Access::Store)?;
+		if let Some(phys_addr) = self.phys_offset(page, virt_addr, addr) {
+			if let Some(dword) = self.shared.phys.amo_u64(phys_addr as usize, op, val, ordering) {
+				self.watchpoints.check(virt_addr, 8, true);
+				self.icache.invalidate_range(addr, 8);
+				self.shared.reservations.unreserve_range(phys_addr, 8);
+				return Ok(dword);
+			}
+		}
 
-			Ok(write_result.is_ok())
+		self.with_atomic_lock(|this| {
+			let dword = this.read_u64(virt_addr)?;
+			this.write_u64(virt_addr, op.apply_u64(dword, val))?;
+			Ok(dword)
 		})
 	}
+}
 
-	/// Returns Ok(original_value) or Err(virt_addr)
-	pub fn atomic_op_word<F: FnOnce(u32) -> Option<u32>>(&mut self, virt_addr: u64, op: F) -> Result<u32, u64> {
-		self.with_atomic_lock(|this| {
-			let word = this.read_u32(virt_addr)?;
+impl SharedMemory {
+	fn bootrom(&self) -> std::sync::RwLockReadGuard<'_, BootromImage> {
+		// UNWRAP: nothing panics while holding the lock
+		self.bootrom.read().unwrap()
+	}
 
-			if let Some(replacement) = op(word) {
-				if let Err(failure_addr) = this.write_u32(virt_addr, replacement) {
-					return Err(failure_addr);
-				}
+	fn bootrom_mut(&self) -> std::sync::RwLockWriteGuard<'_, BootromImage> {
+		// UNWRAP: nothing panics while holding the lock
+		self.bootrom.write().unwrap()
+	}
+
+	/// the offset into physical memory of the RAM at physical address `addr`
+	fn ram_offset(&self, addr: u64) -> Option<usize> {
+		let phys_base = match self.page_table.lookup(addr) {
+			FastPage::PhysBacked { phys_base } => phys_base,
+			FastPage::Slow => match self.mappings.get(&PageBase::from_addr(addr)) {
+				Some(PageEntry::PhysBacked { phys_base }) => *phys_base,
+				_ => return None,
+			},
+			FastPage::Unmapped | FastPage::Bootrom { .. } => return None,
+		};
+		Some((phys_base + (addr & (PAGE_SIZE - 1))) as usize)
+	}
+
+	/// `addr..addr + len` as runs of physical memory (offset and length), or None if any of it isn't RAM
+	fn ram_runs(&self, addr: u64, len: usize) -> Option<Vec<(usize, usize)>> {
+		let end = addr.checked_add(len as u64)?;
+		let mut runs: Vec<(usize, usize)> = Vec::new();
+		let mut cur = addr;
+		while cur < end {
+			let offset = self.ram_offset(cur)?;
+			let piece = (PAGE_SIZE - (cur & (PAGE_SIZE - 1))).min(end - cur) as usize;
+			match runs.last_mut() {
+				// RAM is mapped contiguously, so a transfer is usually a single run
+				Some((prev, prev_len)) if *prev + *prev_len == offset => *prev_len += piece,
+				_ => runs.push((offset, piece)),
 			}
+			cur += piece as u64;
+		}
+		Some(runs)
+	}
+}
 
-			Ok(word)
-		})
+/// A device's handle on RAM, for moving data between it and guest memory without going through a hart. addresses
+/// are physical (there's no IOMMU) and only reach RAM, not the bootrom or other devices.
+///
+/// The handle doesn't keep memory alive, so a device mapped into the memory it points at doesn't make a cycle. like
+/// with another hart's writes, a hart has to run a `fence.i` before it's guaranteed to see code a device wrote
+#[derive(Debug, Clone)]
+pub struct Dma(Weak<SharedMemory>);
+
+impl Dma {
+	/// reads `buf.len()` bytes at physical address `addr`, returns false and reads nothing if they aren't all RAM
+	pub fn read(&self, addr: u64, buf: &mut [u8]) -> bool {
+		let Some(shared) = self.0.upgrade() else {
+			return false;
+		};
+		let Some(runs) = shared.ram_runs(addr, buf.len()) else {
+			return false;
+		};
+		let mut done = 0;
+		for (offset, len) in runs {
+			shared.phys.read_bulk(offset, &mut buf[done..done + len]);
+			done += len;
+		}
+		true
 	}
 
-	/// Returns Ok(original_value) or Err(virt_addr)
-	pub fn atomic_op_dword<F: FnOnce(u64) -> Option<u64>>(&mut self, virt_addr: u64, op: F) -> Result<u64, u64> {
-		self.with_atomic_lock(|this| {
-			let dword = this.read_u64(virt_addr)?;
+	/// writes `val` at physical address `addr`, returns false and writes nothing if it isn't all RAM. breaks the LR
+	/// reservations on it like a store would
+	pub fn write(&self, addr: u64, val: &[u8]) -> bool {
+		let Some(shared) = self.0.upgrade() else {
+			return false;
+		};
+		let Some(runs) = shared.ram_runs(addr, val.len()) else {
+			return false;
+		};
+		let mut done = 0;
+		for (offset, len) in runs {
+			shared.phys.write_bulk(offset, &val[done..done + len]);
+			shared.reservations.unreserve_range(offset as u64, len as u64);
+			done += len;
+		}
+		true
+	}
+}
+
+/// see [Memory::suspend_watchpoints]
+pub struct SuspendedWatchpoints(Vec<watch::Watchpoint>);
 
-			if let Some(replacement) = op(dword) {
-				if let Err(failure_addr) = this.write_u64(virt_addr, replacement) {
-					return Err(failure_addr);
+/// Where the last LR read and what it read there, the line the address is in is the one reserved
+#[derive(Debug, Clone, Copy, Default)]
+struct LoadReserved {
+	phys_addr: u64,
+	len: u8,
+	value: u64,
+}
+
+/// What [Memory::checkpoint] saved, physical pages are sorted by address
+pub struct MemoryCheckpoint {
+	pages: Vec<(u64, Box<[u8; PAGE_SIZE as usize]>)>,
+	bootrom: BootromImage,
+	reservation: Option<LoadReserved>,
+	io_pos: usize,
+}
+
+/// The read-modify-write done by an AMO, between the value in memory and the value of rs2
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum AmoOp {
+	Swap,
+	Add,
+	Xor,
+	And,
+	Or,
+	Min,
+	Max,
+	MinUnsigned,
+	MaxUnsigned,
+}
+
+macro_rules! impl_amo_apply {
+	($($ty:ty, $signed:ty);*) => {
+		impl AmoOp {
+			$(paste::paste!{
+				/// the value memory is replaced with
+				fn [<apply_ $ty>](self, mem: $ty, val: $ty) -> $ty {
+					match self {
+						AmoOp::Swap => val,
+						AmoOp::Add => mem.wrapping_add(val),
+						AmoOp::Xor => mem ^ val,
+						AmoOp::And => mem & val,
+						AmoOp::Or => mem | val,
+						AmoOp::Min => (mem as $signed).min(val as $signed) as $ty,
+						AmoOp::Max => (mem as $signed).max(val as $signed) as $ty,
+						AmoOp::MinUnsigned => mem.min(val),
+						AmoOp::MaxUnsigned => mem.max(val),
+					}
 				}
-			}
+			})*
+		}
+	};
+}
 
-			Ok(dword)
-		})
+impl_amo_apply!(u32, i32; u64, i64);
+
+/// the host memory ordering for an AMO with the given aq and rl bits, setting both makes it sequentially consistent
+pub fn amo_ordering(aq: bool, rl: bool) -> Ordering {
+	match (aq, rl) {
+		(false, false) => Ordering::Relaxed,
+		(true, false) => Ordering::Acquire,
+		(false, true) => Ordering::Release,
+		(true, true) => Ordering::SeqCst,
 	}
 }
 
 pub enum PageEntry {
-	PhysBacked {
-		phys_base: u64,
-	},
-	Bootrom {
-		page_base: u64,
-	},
-	MMIO {
-		on_read: Box<dyn Fn(u64) -> u8>,
-		on_write: Box<dyn Fn(u64, u8)>,
-	},
+	PhysBacked { phys_base: u64 },
+	Bootrom { page_base: u64 },
 }
 
 fn align_to_page(addr: u64) -> u64 {
 	(addr + (PAGE_SIZE - 1)) & !(PAGE_SIZE - 1)
 }
 
-const PAGE_SIZE: u64 = 4096;
+pub const PAGE_SIZE: u64 = 4096;
 #[derive(Default, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
 /// INVARIANT: is a multiple of PAGE_SIZE
 pub struct PageBase(u64);
@@ -267,6 +949,10 @@ impl PageBase {
 	pub fn from_addr(addr: u64) -> Self {
 		Self(addr & !(PAGE_SIZE - 1))
 	}
+
+	pub fn addr(self) -> u64 {
+		self.0
+	}
 }
 
 impl Debug for PageBase {
@@ -277,18 +963,118 @@ impl Debug for PageBase {
 	}
 }
 
+/// where a page lives, as resolved by the [PageTable]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum FastPage {
+	Unmapped,
+	PhysBacked {
+		phys_base: u64,
+	},
+	Bootrom {
+		page_base: u64,
+	},
+	/// the page has to be handled through the device bus or the full mapping table (out of range of the page table)
+	Slow,
+}
+
+/// A flat table from virtual page number to a compact [FastPage], built once from the memory mappings.
+/// this turns the page lookup in the load/store path into one bounds check and one indexed load
+/// instead of hashing a [PageBase]
+#[derive(Clone)]
+struct PageTable {
+	// entries are the page number of the backing memory in the low bits and the kind in the high bits,
+	// 0 is unmapped so the table can be allocated zeroed and untouched parts of it are never committed
+	entries: Box<[u32]>,
+}
+
+impl PageTable {
+	const KIND_SHIFT: u32 = 30;
+	const PAGE_NUMBER_MASK: u32 = (1 << Self::KIND_SHIFT) - 1;
+
+	const KIND_UNMAPPED: u32 = 0b00;
+	const KIND_PHYS: u32 = 0b01;
+	const KIND_BOOTROM: u32 = 0b10;
+	const KIND_SLOW: u32 = 0b11;
+
+	/// pages above this are always looked up in the mapping table. the table covers at most 64GiB of address space
+	/// and takes at most 64MiB itself for mappings at weird high addresses, and only the pages that are actually
+	/// mapped are ever written to
+	const MAX_ENTRIES: u64 = 1 << 24;
+
+	fn new(mappings: &HashMap<PageBase, PageEntry>, devices: &DeviceBus) -> Self {
+		let len = mappings
+			.keys()
+			.copied()
+			.chain(devices.pages())
+			.map(|base| base.0 / PAGE_SIZE + 1)
+			.filter(|&len| len <= Self::MAX_ENTRIES)
+			.max()
+			.unwrap_or(0);
+		let mut entries = vec![0_u32; len as usize].into_boxed_slice();
+
+		for (base, entry) in mappings.iter() {
+			let Some(slot) = entries.get_mut((base.0 / PAGE_SIZE) as usize) else {
+				continue;
+			};
+			*slot = match entry {
+				PageEntry::PhysBacked { phys_base } => Self::encode(Self::KIND_PHYS, *phys_base),
+				PageEntry::Bootrom { page_base } => Self::encode(Self::KIND_BOOTROM, *page_base),
+			};
+		}
+		for base in devices.pages() {
+			if let Some(slot) = entries.get_mut((base.0 / PAGE_SIZE) as usize) {
+				*slot = Self::KIND_SLOW << Self::KIND_SHIFT;
+			}
+		}
+
+		Self { entries }
+	}
+
+	/// sends every access to `base` through the slow path, which falls back to the full mapping table
+	fn mark_slow(&mut self, base: PageBase) {
+		if let Some(slot) = self.entries.get_mut((base.0 / PAGE_SIZE) as usize) {
+			*slot = Self::KIND_SLOW << Self::KIND_SHIFT;
+		}
+	}
+
+	fn encode(kind: u32, offset: u64) -> u32 {
+		let page_number = offset / PAGE_SIZE;
+		assert!(
+			page_number <= u64::from(Self::PAGE_NUMBER_MASK),
+			"backing offset {offset:#018X} is too large for the page table"
+		);
+		kind << Self::KIND_SHIFT | page_number as u32
+	}
+
+	#[inline(always)]
+	fn lookup(&self, addr: u64) -> FastPage {
+		let Some(&raw) = self.entries.get((addr / PAGE_SIZE) as usize) else {
+			return FastPage::Slow;
+		};
+
+		let offset = u64::from(raw & Self::PAGE_NUMBER_MASK) * PAGE_SIZE;
+		match raw >> Self::KIND_SHIFT {
+			Self::KIND_UNMAPPED => FastPage::Unmapped,
+			Self::KIND_PHYS => FastPage::PhysBacked { phys_base: offset },
+			Self::KIND_BOOTROM => FastPage::Bootrom { page_base: offset },
+			Self::KIND_SLOW => FastPage::Slow,
+			_ => unreachable!(),
+		}
+	}
+}
+
 macro_rules! impl_mem_rw {
 	($($ty:ty),*) => {
 		#[allow(unused)]
 		impl Memory {
 			$(paste::paste!{
-				pub fn [<read_ $ty:snake>](&self, offset: u64) -> Result<$ty, u64> {
+				pub fn [<read_ $ty:snake>](&self, offset: u64) -> Result<$ty, Fault> {
 					let mut buf = <$ty>::to_le_bytes($ty::default());
 					self.read_slice(offset, &mut buf)?;
 					Ok(<$ty>::from_le_bytes(buf))
 				}
 
-				pub fn [<write_ $ty:snake>](&mut self, offset: u64, val: $ty) -> Result<(), u64> {
+				pub fn [<write_ $ty:snake>](&mut self, offset: u64, val: $ty) -> Result<(), Fault> {
 					self.write_slice(offset, $ty::to_le_bytes(val).as_slice())?;
 					Ok(())
 				}
@@ -299,6 +1085,31 @@ macro_rules! impl_mem_rw {
 
 impl_mem_rw!(u8, u16, u32, u64, SoftFloat, SoftDouble);
 
+/// A page aligned bootrom image.
+/// clones share the same bytes, a [Memory] only makes its own copy once the guest writes to its bootrom
+#[derive(Debug, Clone, Default)]
+pub struct BootromImage(Arc<Vec<u8>>);
+
+impl BootromImage {
+	pub fn new(mut bootrom: Vec<u8>) -> Self {
+		let padded_len = align_to_page(bootrom.len() as u64);
+		bootrom.resize(padded_len as usize, 0_u8);
+		Self(Arc::new(bootrom))
+	}
+
+	fn make_mut(&mut self) -> &mut [u8] {
+		Arc::make_mut(&mut self.0).as_mut_slice()
+	}
+}
+
+impl Deref for BootromImage {
+	type Target = [u8];
+
+	fn deref(&self) -> &Self::Target {
+		self.0.as_slice()
+	}
+}
+
 #[derive(Default)]
 pub struct MemoryBuilder {
 	// size of physical memory
@@ -307,16 +1118,21 @@ pub struct MemoryBuilder {
 	physical_mappings: HashMap<PageBase, (PageBase, u64)>,
 
 	misc_maps: HashMap<PageBase, PageEntry>,
+	devices: DeviceBus,
 	// bootrom data, virtual offset
-	bootrom: Option<(Box<[u8]>, PageBase)>,
+	bootrom: Option<(BootromImage, PageBase)>,
+	phys_backing: PhysBacking,
+	// files loaded at a virtual address once everything is mapped
+	images: Vec<(PageBase, File)>,
+	// (physical address, file, file offset, length) loaded straight into physical memory
+	phys_images: Vec<(PageBase, File, u64, u64)>,
+	harts: Option<usize>,
 }
 
 impl MemoryBuilder {
-	pub fn bootrom(mut self, mut bootrom: Vec<u8>, addr: PageBase) -> Self {
+	pub fn bootrom(mut self, bootrom: BootromImage, addr: PageBase) -> Self {
 		assert!(self.bootrom.is_none(), "cannot set bootrom more than once");
-		let padded_len = align_to_page(bootrom.len() as u64);
-		bootrom.resize(padded_len as usize, 0_u8);
-		self.bootrom = Some((bootrom.into_boxed_slice(), addr));
+		self.bootrom = Some((bootrom, addr));
 		self
 	}
 
@@ -338,6 +1154,32 @@ impl MemoryBuilder {
 		self
 	}
 
+	pub fn phys_backing(mut self, backing: PhysBacking) -> Self {
+		self.phys_backing = backing;
+		self
+	}
+
+	/// How many harts share this memory (see [Memory::new_hart]), defaults to 1
+	pub fn harts(mut self, harts: usize) -> Self {
+		assert!(harts > 0, "memory needs at least one hart");
+		self.harts = Some(harts);
+		self
+	}
+
+	/// Loads the contents of `file` at `addr` without reading it up front where possible
+	pub fn image(mut self, addr: PageBase, file: File) -> Self {
+		self.images.push((addr, file));
+		self
+	}
+
+	/// Loads `len` bytes of `file` from `file_offset` on at physical address `phys_base`, mapped like
+	/// [Self::image] where possible
+	pub fn phys_image(mut self, phys_base: PageBase, file: File, file_offset: u64, len: u64) -> Self {
+		self.phys_images.push((phys_base, file, file_offset, len));
+		self
+	}
+
+	#[allow(unused)]
 	pub fn add_mapping(mut self, virt_addr: PageBase, entry: PageEntry) -> Self {
 		let prev = self.misc_maps.insert(virt_addr, entry);
 		assert!(
@@ -348,9 +1190,18 @@ impl MemoryBuilder {
 		self
 	}
 
+	/// Maps `device` at `addr..addr + len`, which doesn't have to be page aligned. the rest of the pages it's on
+	/// can't be mapped to anything else
+	pub fn device(mut self, addr: u64, len: u64, device: impl Device + 'static) -> Self {
+		self.devices.insert(addr, len, Box::new(device));
+		self
+	}
+
 	#[track_caller] // provides better panic location for caller
 	pub fn build(self) -> Memory {
-		let phys = vec![0_u8; self.physical.unwrap_or(0) as usize].into_boxed_slice();
+		let physical = self.physical.unwrap_or(0) as usize;
+		let mut phys = PhysMemory::new(physical, &self.phys_backing)
+			.unwrap_or_else(|e| panic!("could not allocate {physical:#X} bytes of physical memory: {e}"));
 		let mut mappings = HashMap::new();
 
 		let (bootrom, virt_addr) = self.bootrom.unwrap_or_default();
@@ -384,12 +1235,41 @@ impl MemoryBuilder {
 			assert!(prev.is_none(), "overlapped virtual address {:?} in misc mapping", virt);
 		}
 
-		Memory {
-			phys,
-			mappings,
-			bootrom,
-			reservations: MemoryReservations::new(),
-			atomic_lock: AtomicBool::default(),
+		for base in self.devices.pages() {
+			assert!(!mappings.contains_key(&base), "device on {:?} overlaps a mapping", base);
 		}
+
+		for (phys_base, mut file, file_offset, len) in self.phys_images {
+			phys.load_file(phys_base.0 as usize, &mut file, file_offset, len as usize)
+				.unwrap_or_else(|e| panic!("could not load image at physical {phys_base:?}: {e}"));
+		}
+
+		let page_table = Arc::new(PageTable::new(&mappings, &self.devices));
+		let mut mem = Memory {
+			shared: Arc::new(SharedMemory {
+				phys,
+				page_table: Arc::clone(&page_table),
+				mappings,
+				devices: self.devices,
+				bootrom: RwLock::new(bootrom),
+				reservations: MemoryReservations::new(self.harts.unwrap_or(1)),
+				atomic_lock: AtomicBool::default(),
+			}),
+			hart_id: 0,
+			reserved: LoadReserved::default(),
+			page_table,
+			watchpoints: Watchpoints::default(),
+			io_log: IoLog::default(),
+			translation: Translation::BARE,
+			tlb: Tlb::default(),
+			icache: InstructionCache::new(),
+		};
+
+		for (addr, mut file) in self.images {
+			mem.load_image(addr, &mut file)
+				.unwrap_or_else(|e| panic!("could not load image at {addr:?}: {e}"));
+		}
+
+		mem
 	}
 }
@@ -0,0 +1,150 @@
+use std::sync::Arc;
+
+use tracing::*;
+
+use super::{PageBase, PAGE_SIZE};
+
+/// A memory mapped device, see [super::MemoryBuilder::device].
+///
+/// `offset` is relative to the start of the range the device was registered for, and an access never leaves that
+/// range. `width` is 1, 2, 4 or 8 bytes, another length (a misaligned access split at a page boundary) is done one
+/// byte at a time. values are zero extended
+pub trait Device: Send + Sync {
+	fn read(&self, offset: u64, width: u8) -> u64;
+	fn write(&self, offset: u64, width: u8, val: u64);
+
+	/// whether the device's state is rolled back with the hart's replay checkpoints, so its writes still go through
+	/// while replaying. other devices already saw the writes the first time
+	fn replays_writes(&self) -> bool {
+		false
+	}
+}
+
+impl<D: Device + ?Sized> Device for Arc<D> {
+	fn read(&self, offset: u64, width: u8) -> u64 {
+		(**self).read(offset, width)
+	}
+
+	fn write(&self, offset: u64, width: u8, val: u64) {
+		(**self).write(offset, width, val)
+	}
+
+	fn replays_writes(&self) -> bool {
+		(**self).replays_writes()
+	}
+}
+
+struct Mapped {
+	start: u64,
+	len: u64,
+	/// [Device::replays_writes], asked once when the device is added
+	replays_writes: bool,
+	device: Box<dyn Device>,
+}
+
+impl Mapped {
+	fn pages(&self) -> impl Iterator<Item = PageBase> {
+		let first = PageBase::from_addr(self.start).addr();
+		let last = PageBase::from_addr(self.start + (self.len - 1)).addr();
+		(first..=last).step_by(PAGE_SIZE as usize).map(PageBase)
+	}
+}
+
+/// Every device, sorted by where their ranges start. ranges never overlap
+#[derive(Default)]
+pub(super) struct DeviceBus {
+	devices: Vec<Mapped>,
+}
+
+impl DeviceBus {
+	pub(super) fn insert(&mut self, start: u64, len: u64, device: Box<dyn Device>) {
+		assert!(len > 0, "device at {start:#018X} has an empty range");
+		let end = start
+			.checked_add(len - 1)
+			.unwrap_or_else(|| panic!("device at {start:#018X} wraps around the address space"));
+		let idx = self.devices.partition_point(|mapped| mapped.start <= start);
+		let overlaps_prev = idx
+			.checked_sub(1)
+			.is_some_and(|prev| start - self.devices[prev].start < self.devices[prev].len);
+		let overlaps_next = self.devices.get(idx).is_some_and(|next| next.start <= end);
+		assert!(
+			!overlaps_prev && !overlaps_next,
+			"device at {start:#018X} overlaps another device"
+		);
+		let replays_writes = device.replays_writes();
+		self.devices.insert(
+			idx,
+			Mapped {
+				start,
+				len,
+				replays_writes,
+				device,
+			},
+		);
+	}
+
+	/// every page any device has registers on
+	pub(super) fn pages(&self) -> impl Iterator<Item = PageBase> + '_ {
+		self.devices.iter().flat_map(Mapped::pages)
+	}
+
+	/// the device whose range holds all of `addr..addr + len`
+	#[inline]
+	fn find(&self, addr: u64, len: usize) -> Option<&Mapped> {
+		let idx = self
+			.devices
+			.partition_point(|mapped| mapped.start <= addr)
+			.checked_sub(1)?;
+		let mapped = &self.devices[idx];
+		let offset = addr - mapped.start;
+		(offset < mapped.len && mapped.len - offset >= len as u64).then_some(mapped)
+	}
+
+	/// whether a write to `addr..addr + len` has to be dropped while replaying, see [Device::replays_writes]
+	pub(super) fn drops_replayed_write(&self, addr: u64, len: usize) -> bool {
+		self.find(addr, len).is_some_and(|mapped| !mapped.replays_writes)
+	}
+
+	/// returns false if no device covers the whole of `buf`
+	pub(super) fn read(&self, addr: u64, buf: &mut [u8]) -> bool {
+		let Some(mapped) = self.find(addr, buf.len()) else {
+			return false;
+		};
+		trace!("Reading from MMIO @ {:#018X}", addr);
+		let offset = addr - mapped.start;
+		match buf.len() {
+			width @ (1 | 2 | 4 | 8) => {
+				let val = mapped.device.read(offset, width as u8);
+				buf.copy_from_slice(&val.to_le_bytes()[..width]);
+			}
+			_ => {
+				for (idx, byte) in buf.iter_mut().enumerate() {
+					*byte = mapped.device.read(offset + idx as u64, 1) as u8;
+				}
+			}
+		}
+		true
+	}
+
+	/// returns false if no device covers the whole of `val`
+	pub(super) fn write(&self, addr: u64, val: &[u8]) -> bool {
+		let Some(mapped) = self.find(addr, val.len()) else {
+			return false;
+		};
+		trace!("Writing to MMIO @ {:#018X}", addr);
+		let offset = addr - mapped.start;
+		match val.len() {
+			width @ (1 | 2 | 4 | 8) => {
+				let mut bytes = [0; 8];
+				bytes[..width].copy_from_slice(val);
+				mapped.device.write(offset, width as u8, u64::from_le_bytes(bytes));
+			}
+			_ => {
+				for (idx, byte) in val.iter().enumerate() {
+					mapped.device.write(offset + idx as u64, 1, u64::from(*byte));
+				}
+			}
+		}
+		true
+	}
+}
@@ -0,0 +1,74 @@
+use std::cell::{Cell, RefCell};
+
+/// A hart's device reads, in the order they happened, so a replay of the same instructions reads the same values
+/// without asking the devices again (their state has moved on since). writes are dropped while replaying, the
+/// devices already saw them the first time
+#[derive(Debug, Default)]
+pub(super) struct IoLog {
+	enabled: bool,
+	replaying: bool,
+	reads: RefCell<Vec<u64>>,
+	// the next read in `reads`, which is at its end unless a replay is going on
+	pos: Cell<usize>,
+}
+
+impl IoLog {
+	pub(super) fn enable(&mut self) {
+		self.enabled = true;
+	}
+
+	pub(super) fn is_enabled(&self) -> bool {
+		self.enabled
+	}
+
+	pub(super) fn set_replaying(&mut self, replaying: bool) {
+		self.replaying = replaying;
+	}
+
+	pub(super) fn position(&self) -> usize {
+		self.pos.get()
+	}
+
+	pub(super) fn seek(&mut self, pos: usize) {
+		self.pos.set(pos.min(self.reads.get_mut().len()));
+	}
+
+	/// forgets every read past the current position, for when the past was changed and won't be replayed
+	pub(super) fn truncate(&mut self) {
+		self.reads.get_mut().truncate(self.pos.get());
+	}
+
+	/// `read` does the actual device read if the value isn't in the log
+	#[inline]
+	pub(super) fn read(&self, buf: &mut [u8], read: impl FnOnce(&mut [u8]) -> bool) -> bool {
+		// only the debugger reads more than a register at once
+		if !self.enabled || buf.len() > 8 {
+			return read(buf);
+		}
+
+		let pos = self.pos.get();
+		let mut reads = self.reads.borrow_mut();
+		if self.replaying {
+			if let Some(val) = reads.get(pos) {
+				buf.copy_from_slice(&val.to_le_bytes()[..buf.len()]);
+				self.pos.set(pos + 1);
+				return true;
+			}
+		}
+		if !read(buf) {
+			return false;
+		}
+		let mut bytes = [0; 8];
+		bytes[..buf.len()].copy_from_slice(buf);
+		reads.truncate(pos);
+		reads.push(u64::from_le_bytes(bytes));
+		self.pos.set(pos + 1);
+		true
+	}
+
+	/// whether device writes should go through
+	#[inline]
+	pub(super) fn writes_live(&self) -> bool {
+		!(self.enabled && self.replaying)
+	}
+}
@@ -0,0 +1,369 @@
+//! Sv39 and Sv48 address translation, with a TLB in front of the page walker.
+//!
+//! Every hart has its own TLB, one array of entries for user mode and one for supervisor mode so going back and forth
+//! between them doesn't throw anything away. Entries are tagged with the ASID they were filled under, so they survive
+//! switching between address spaces too, and global ones hit in every address space. An entry holds what the
+//! [PageTable] says about the physical page it maps to, so a hit costs one compare more than an untranslated access
+//! before going straight to memory. It has a tag per kind of access that only matches if the page allows that
+//! access, which makes the permission check part of the tag compare. A store to a page that isn't dirty yet misses
+//! and walks the page table again to set D.
+//!
+//! The walker sets A and D itself (like Svadu) instead of raising page faults for them, since nothing can handle
+//! those here yet. Page tables have to be in RAM, a walk that reaches a table anywhere else raises an access fault.
+
+use std::cell::Cell;
+
+use super::{FastPage, Fault, FaultKind, Memory, PageBase, PAGE_SIZE};
+use crate::csr::{CSRPrivilege, MSTATUS_MPP, MSTATUS_MPP_SHIFT, MSTATUS_MPRV, MSTATUS_MXR, MSTATUS_SUM};
+
+const TLB_ENTRIES: usize = 256;
+
+// satp
+const SATP_MODE_SHIFT: u32 = 60;
+const SATP_MODE_BARE: u64 = 0;
+const SATP_MODE_SV39: u64 = 8;
+const SATP_MODE_SV48: u64 = 9;
+const SATP_ASID_SHIFT: u32 = 44;
+const SATP_ASID_MASK: u64 = 0xFFFF;
+const SATP_PPN_MASK: u64 = (1 << 44) - 1;
+
+// page table entries
+const PTE_V: u64 = 1 << 0;
+const PTE_R: u64 = 1 << 1;
+const PTE_W: u64 = 1 << 2;
+const PTE_X: u64 = 1 << 3;
+const PTE_U: u64 = 1 << 4;
+const PTE_G: u64 = 1 << 5;
+const PTE_A: u64 = 1 << 6;
+const PTE_D: u64 = 1 << 7;
+const PTE_PPN_SHIFT: u32 = 10;
+const PTE_PPN_MASK: u64 = (1 << 44) - 1;
+// Svpbmt and Svnapot aren't supported, so these have to be zero
+const PTE_RESERVED: u64 = 0x3FF << 54;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Access {
+	Fetch,
+	Load,
+	Store,
+}
+
+/// whether the MODE of `satp` is supported, writes with any other MODE have no effect
+pub fn satp_mode_supported(satp: u64) -> bool {
+	matches!(
+		satp >> SATP_MODE_SHIFT,
+		SATP_MODE_BARE | SATP_MODE_SV39 | SATP_MODE_SV48
+	)
+}
+
+/// How a hart translates addresses right now, from its privilege mode, mstatus and satp. see [Memory::set_translation]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Translation {
+	// page table levels, 3 for Sv39 and 4 for Sv48
+	levels: u32,
+	root: u64,
+	asid: u16,
+	// whether fetches and data accesses are translated and if so, whether as user mode
+	fetch: Option<bool>,
+	data: Option<bool>,
+	sum: bool,
+	mxr: bool,
+}
+
+impl Translation {
+	/// M-mode, or paging switched off
+	pub const BARE: Self = Self {
+		levels: 0,
+		root: 0,
+		asid: 0,
+		fetch: None,
+		data: None,
+		sum: false,
+		mxr: false,
+	};
+
+	pub fn new(privilege: CSRPrivilege, mstatus: u64, satp: u64) -> Self {
+		let levels = match satp >> SATP_MODE_SHIFT {
+			SATP_MODE_SV39 => 3,
+			SATP_MODE_SV48 => 4,
+			_ => return Self::BARE,
+		};
+		// MPRV makes loads and stores act as if in the privilege mode in MPP
+		let data_privilege = match (
+			mstatus & MSTATUS_MPRV != 0,
+			(mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT,
+		) {
+			(false, _) => privilege,
+			(true, 0b00) => CSRPrivilege::User,
+			(true, 0b01) => CSRPrivilege::Supervisor,
+			(true, _) => CSRPrivilege::Machine,
+		};
+		let context = |privilege| (privilege != CSRPrivilege::Machine).then_some(privilege == CSRPrivilege::User);
+		Self {
+			levels,
+			root: (satp & SATP_PPN_MASK) * PAGE_SIZE,
+			asid: ((satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK) as u16,
+			fetch: context(privilege),
+			data: context(data_privilege),
+			sum: mstatus & MSTATUS_SUM != 0,
+			mxr: mstatus & MSTATUS_MXR != 0,
+		}
+	}
+
+	/// Some(user mode) if `access` is translated
+	#[inline(always)]
+	fn context(&self, access: Access) -> Option<bool> {
+		match access {
+			Access::Fetch => self.fetch,
+			Access::Load | Access::Store => self.data,
+		}
+	}
+
+	/// whether the same virtual address could fetch from somewhere else under `other`
+	fn fetches_differ(&self, other: &Self) -> bool {
+		self.fetch != other.fetch
+			|| (self.fetch.is_some() && (self.levels, self.root, self.asid) != (other.levels, other.root, other.asid))
+	}
+}
+
+impl Default for Translation {
+	fn default() -> Self {
+		Self::BARE
+	}
+}
+
+#[derive(Debug, Clone, Copy)]
+struct TlbEntry {
+	// the virtual page number, per kind of access (see [Access]) if the page allows it, otherwise INVALID
+	tags: [u64; 3],
+	asid: u16,
+	global: bool,
+	vpn: u64,
+	// the virtual page numbers the leaf covers all have the same bits here, for sfence.vma on superpages
+	span: u64,
+	phys_base: u64,
+	page: FastPage,
+}
+
+impl TlbEntry {
+	// no virtual page number has the top bits set
+	const INVALID: u64 = u64::MAX;
+
+	const EMPTY: Self = Self {
+		tags: [Self::INVALID; 3],
+		asid: 0,
+		global: false,
+		vpn: 0,
+		span: 0,
+		phys_base: 0,
+		page: FastPage::Unmapped,
+	};
+
+	/// whether the entry translates virtual page `vpn` for `access` in address space `asid`. global entries are in
+	/// every address space
+	#[inline(always)]
+	fn hits(&self, vpn: u64, access: Access, asid: u16) -> bool {
+		self.tags[access as usize] == vpn && (self.global || self.asid == asid)
+	}
+}
+
+/// see the module docs
+pub(super) struct Tlb {
+	// indexed by whether the entry is for user mode, then by the low bits of the virtual page number
+	entries: Box<[[Cell<TlbEntry>; TLB_ENTRIES]; 2]>,
+}
+
+impl Default for Tlb {
+	fn default() -> Self {
+		Self {
+			entries: Box::new(std::array::from_fn(|_| {
+				std::array::from_fn(|_| Cell::new(TlbEntry::EMPTY))
+			})),
+		}
+	}
+}
+
+impl std::fmt::Debug for Tlb {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("Tlb").finish_non_exhaustive()
+	}
+}
+
+impl Tlb {
+	#[inline(always)]
+	fn slot(&self, user: bool, vpn: u64) -> &Cell<TlbEntry> {
+		&self.entries[usize::from(user)][vpn as usize % TLB_ENTRIES]
+	}
+
+	fn flush(&self, mut keep: impl FnMut(&TlbEntry) -> bool) {
+		for slot in self.entries.iter().flatten() {
+			if !keep(&slot.get()) {
+				slot.set(TlbEntry::EMPTY);
+			}
+		}
+	}
+}
+
+impl Memory {
+	/// switches to translating addresses like `translation` says. the TLB is kept unless MXR, SUM or the paging mode
+	/// changed
+	pub fn set_translation(&mut self, translation: Translation) {
+		let prev = std::mem::replace(&mut self.translation, translation);
+		if prev == translation {
+			return;
+		}
+		if (prev.levels, prev.sum, prev.mxr) != (translation.levels, translation.sum, translation.mxr) {
+			self.tlb.flush(|_| false);
+		}
+		if prev.fetches_differ(&translation) {
+			self.icache.forget_addresses();
+		}
+	}
+
+	/// SFENCE.VMA, drops the cached translations of `vaddr` (every one if None) in address space `asid` (every one
+	/// if None, global mappings are only dropped then)
+	pub fn sfence_vma(&mut self, vaddr: Option<u64>, asid: Option<u16>) {
+		let vpn = vaddr.map(|vaddr| vaddr / PAGE_SIZE);
+		self.tlb.flush(|entry| {
+			let addr_matches = vpn.is_none_or(|vpn| vpn & entry.span == entry.vpn & entry.span);
+			let asid_matches = asid.is_none_or(|asid| !entry.global && entry.asid == asid);
+			!(addr_matches && asid_matches)
+		});
+		if self.translation.fetch.is_some() {
+			self.icache.forget_addresses();
+		}
+	}
+
+	/// drops every cached translation, for when the memory the page tables are in could have changed
+	pub(super) fn flush_tlb(&mut self) {
+		self.tlb.flush(|_| false);
+		if self.translation.fetch.is_some() {
+			self.icache.forget_addresses();
+		}
+	}
+
+	/// where `vaddr` is for `access`: the page table lookup of its page and its physical address, or the [Fault] if
+	/// translating it failed
+	#[inline(always)]
+	pub(super) fn lookup(&self, vaddr: u64, access: Access) -> Result<(FastPage, u64), Fault> {
+		let Some(user) = self.translation.context(access) else {
+			return Ok((self.page_table.lookup(vaddr), vaddr));
+		};
+		let page_offset = vaddr & (PAGE_SIZE - 1);
+		let entry = self.tlb.slot(user, vaddr / PAGE_SIZE).get();
+		if entry.hits(vaddr / PAGE_SIZE, access, self.translation.asid) {
+			return Ok((entry.page, entry.phys_base + page_offset));
+		}
+		match self.walk(vaddr, access, user) {
+			Ok(entry) => Ok((entry.page, entry.phys_base + page_offset)),
+			Err(kind) => Err(Fault { addr: vaddr, kind }),
+		}
+	}
+
+	/// [Self::lookup] for fetches that only looks at the TLB, None if it would have to walk the page table
+	#[inline(always)]
+	pub(super) fn cached_fetch_addr(&self, pc: u64) -> Option<u64> {
+		let Some(user) = self.translation.fetch else {
+			return Some(pc);
+		};
+		let entry = self.tlb.slot(user, pc / PAGE_SIZE).get();
+		entry
+			.hits(pc / PAGE_SIZE, Access::Fetch, self.translation.asid)
+			.then(|| entry.phys_base + (pc & (PAGE_SIZE - 1)))
+	}
+
+	/// walks the page tables for `vaddr` and fills the TLB with the leaf. a leaf that points outside of RAM is still
+	/// filled in, the access itself faults then
+	#[cold]
+	fn walk(&self, vaddr: u64, access: Access, user: bool) -> Result<TlbEntry, FaultKind> {
+		let translation = &self.translation;
+		let levels = translation.levels;
+		// the bits above the virtual address have to be copies of its top bit
+		let va_bits = 12 + 9 * levels;
+		if (vaddr as i64) >> (va_bits - 1) != (vaddr as i64) >> 63 {
+			return Err(FaultKind::Page);
+		}
+
+		let vpn = vaddr / PAGE_SIZE;
+		'walk: loop {
+			let mut table = translation.root;
+			for level in (0..levels).rev() {
+				let pte_addr = table + ((vpn >> (9 * level)) & 0x1FF) * 8;
+				let pte_offset = self.ram_offset(pte_addr).ok_or(FaultKind::Access)?;
+				let mut bytes = [0; 8];
+				self.shared.phys.read(pte_offset, &mut bytes);
+				let pte = u64::from_le_bytes(bytes);
+
+				if pte & PTE_V == 0 || pte & (PTE_R | PTE_W) == PTE_W || pte & PTE_RESERVED != 0 {
+					return Err(FaultKind::Page);
+				}
+				let ppn = (pte >> PTE_PPN_SHIFT) & PTE_PPN_MASK;
+				if pte & (PTE_R | PTE_X) == 0 {
+					// A, D and U are reserved for pointers to the next level
+					if pte & (PTE_A | PTE_D | PTE_U) != 0 {
+						return Err(FaultKind::Page);
+					}
+					table = ppn * PAGE_SIZE;
+					continue;
+				}
+
+				// a superpage has to be aligned to its size
+				let span_pages = 1 << (9 * level);
+				if ppn & (span_pages - 1) != 0 {
+					return Err(FaultKind::Page);
+				}
+				let privileged_ok = if user { pte & PTE_U != 0 } else { pte & PTE_U == 0 };
+				let data_ok = privileged_ok || (!user && translation.sum);
+				let exec = pte & PTE_X != 0 && privileged_ok;
+				let read = (pte & PTE_R != 0 || (translation.mxr && pte & PTE_X != 0)) && data_ok;
+				let write = pte & PTE_W != 0 && data_ok;
+				let allowed = match access {
+					Access::Fetch => exec,
+					Access::Load => read,
+					Access::Store => write,
+				};
+				if !allowed {
+					return Err(FaultKind::Page);
+				}
+
+				let updated = pte | PTE_A | if access == Access::Store { PTE_D } else { 0 };
+				if updated != pte {
+					// UNWRAP: page table entries are aligned
+					if !self.shared.phys.compare_exchange_u64(pte_offset, pte, updated).unwrap() {
+						// another hart changed it in the meantime
+						continue 'walk;
+					}
+					self.shared.reservations.unreserve_range(pte_offset as u64, 8);
+				}
+
+				let phys_base = (ppn | (vpn & (span_pages - 1))) * PAGE_SIZE;
+				// the hart's own page table has the watchpoints marked at their virtual addresses, not physical ones
+				let page = if self.watchpoints.pages().any(|base| base == PageBase::from_addr(vaddr)) {
+					FastPage::Slow
+				} else {
+					self.shared.page_table.lookup(phys_base)
+				};
+				let tag = |allowed: bool| if allowed { vpn } else { TlbEntry::INVALID };
+				let entry = TlbEntry {
+					// stores only hit once the page is dirty, so the walk that sets D isn't skipped
+					tags: [tag(exec), tag(read), tag(write && updated & PTE_D != 0)],
+					asid: translation.asid,
+					global: pte & PTE_G != 0,
+					vpn,
+					span: !(span_pages - 1),
+					phys_base,
+					page,
+				};
+				self.tlb.slot(user, vpn).set(entry);
+				return Ok(entry);
+			}
+			// ran out of levels without finding a leaf
+			return Err(FaultKind::Page);
+		}
+	}
+
+	/// the offset into physical memory of the RAM at physical address `addr`
+	fn ram_offset(&self, addr: u64) -> Option<usize> {
+		self.shared.ram_offset(addr)
+	}
+}
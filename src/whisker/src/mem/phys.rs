@@ -0,0 +1,422 @@
+use std::fmt::Debug;
+use std::fs::{File, OpenOptions};
+use std::io::{self, Read as _, Seek as _, SeekFrom};
+use std::ops::Range;
+use std::os::fd::AsRawFd;
+use std::path::PathBuf;
+use std::ptr::{self, NonNull};
+use std::sync::atomic::{AtomicI32, AtomicI64, AtomicU16, AtomicU32, AtomicU64, AtomicU8, Ordering};
+
+use tracing::*;
+
+use super::AmoOp;
+
+/// Where guest physical memory lives on the host
+#[derive(Debug, Clone, Default)]
+pub enum PhysBacking {
+	/// anonymous memory, a page only costs anything once the guest touches it
+	#[default]
+	Anonymous,
+	/// anonymous memory from the reserved huge page pool, falls back to transparent huge pages if there are none
+	HugePages,
+	/// a shared mapping of a file, which is created or grown to the size of physical memory
+	File(PathBuf),
+}
+
+/// Guest physical memory, a single mapping that reads as zero until it's written to.
+///
+/// Every hart reads and writes it at the same time, so once it's built it is only ever accessed through relaxed
+/// atomics. naturally aligned accesses of up to 8 bytes are a single host access and never tear, anything else is
+/// done a byte at a time. ordering between harts comes from the guest's own fences and atomics
+pub struct PhysMemory {
+	ptr: NonNull<u8>,
+	len: usize,
+	// files can only be mapped over normal anonymous pages. a file backed mapping needs writes to reach the file, and
+	// huge pages can't be partially replaced
+	map_images: bool,
+	/// the parts of the mapping that are a file, which mincore can't tell anything about, see [Self::used_pages]
+	file_backed: Vec<Range<usize>>,
+}
+
+// SAFETY: the mapping is owned exclusively by this struct, and shared access only goes through atomics
+unsafe impl Send for PhysMemory {}
+unsafe impl Sync for PhysMemory {}
+
+impl Debug for PhysMemory {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("PhysMemory")
+			.field("len", &self.len)
+			.field("map_images", &self.map_images)
+			.finish_non_exhaustive()
+	}
+}
+
+impl PhysMemory {
+	pub fn new(len: usize, backing: &PhysBacking) -> io::Result<Self> {
+		if len == 0 {
+			return Ok(Self {
+				ptr: NonNull::dangling(),
+				len,
+				map_images: false,
+				file_backed: Vec::new(),
+			});
+		}
+
+		let mut file_backed = Vec::new();
+		let (ptr, map_images) = match backing {
+			PhysBacking::Anonymous => (map_anonymous(len, libc::MAP_NORESERVE)?, true),
+			PhysBacking::HugePages => map_huge(len)?,
+			PhysBacking::File(path) => {
+				let file = OpenOptions::new()
+					.read(true)
+					.write(true)
+					.create(true)
+					.truncate(false)
+					.open(path)?;
+				if file.metadata()?.len() < len as u64 {
+					file.set_len(len as u64)?;
+				}
+				// SAFETY: we're asking for a fresh mapping, nothing existing is affected
+				let ptr = unsafe {
+					libc::mmap(
+						ptr::null_mut(),
+						len,
+						libc::PROT_READ | libc::PROT_WRITE,
+						libc::MAP_SHARED,
+						file.as_raw_fd(),
+						0,
+					)
+				};
+				file_backed.push(0..len);
+				(check_mapping(ptr)?, false)
+			}
+		};
+
+		Ok(Self {
+			ptr,
+			len,
+			map_images,
+			file_backed,
+		})
+	}
+
+	/// Makes `offset..offset + file len` read as the contents of `file`.
+	/// the file is mapped copy on write when possible, so only the pages the guest touches are ever read
+	pub fn load_image(&mut self, offset: usize, file: &mut File) -> io::Result<()> {
+		let len = file.metadata()?.len() as usize;
+		self.load_file(offset, file, 0, len)
+	}
+
+	/// [Self::load_image] with only `len` bytes of `file`, starting at `file_offset`. unless they reach the end of the
+	/// file, they have to end on a page boundary
+	pub fn load_file(&mut self, offset: usize, file: &mut File, file_offset: u64, len: usize) -> io::Result<()> {
+		if offset.checked_add(len).is_none_or(|end| end > self.len) {
+			return Err(io::Error::new(
+				io::ErrorKind::InvalidInput,
+				format!("image of {len:#X} bytes does not fit at physical offset {offset:#X}"),
+			));
+		}
+		if len == 0 {
+			return Ok(());
+		}
+
+		let page_size = host_page_size();
+		if self.map_images && offset % page_size == 0 && file_offset % page_size as u64 == 0 {
+			// SAFETY: offset..offset + len is inside our mapping (checked above) so MAP_FIXED only replaces our own
+			// pages. the tail of the last page past the end of the file reads as zero
+			let ptr = unsafe {
+				libc::mmap(
+					self.ptr.as_ptr().add(offset).cast(),
+					len,
+					libc::PROT_READ | libc::PROT_WRITE,
+					libc::MAP_PRIVATE | libc::MAP_FIXED,
+					file.as_raw_fd(),
+					file_offset as libc::off_t,
+				)
+			};
+			match check_mapping(ptr) {
+				Ok(_) => {
+					self.file_backed.push(offset..offset + len);
+					return Ok(());
+				}
+				Err(err) => debug!("could not map image directly ({err}), copying it instead"),
+			}
+		}
+
+		file.seek(SeekFrom::Start(file_offset))?;
+		// SAFETY: in bounds (checked above), and we have exclusive access so nothing else can be using the memory
+		let dst = unsafe { std::slice::from_raw_parts_mut(self.ptr.as_ptr().add(offset), len) };
+		file.read_exact(dst)
+	}
+
+	pub fn len(&self) -> usize {
+		self.len
+	}
+
+	/// Offsets of every `page_size` page that isn't all zero. pages the host never committed are skipped without
+	/// reading them, so this is cheap for a guest that only touched a little of its memory. for a file mincore only
+	/// says what's in the page cache, so images and file backed memory are always read
+	pub fn used_pages(&self, page_size: usize) -> Vec<usize> {
+		let host_page = host_page_size();
+		let mut resident = vec![0_u8; self.len.div_ceil(host_page)];
+		// SAFETY: ptr..ptr + len is our mapping and resident has an entry for every host page of it
+		let ok = self.len != 0
+			&& unsafe { libc::mincore(self.ptr.as_ptr().cast(), self.len, resident.as_mut_ptr().cast()) } == 0;
+		if !ok {
+			debug!("could not tell which pages are resident, reading all of them");
+			resident.fill(1);
+		}
+		for range in &self.file_backed {
+			resident[range.start / host_page..range.end.div_ceil(host_page)].fill(1);
+		}
+
+		let mut words = vec![0_u8; page_size];
+		(0..self.len)
+			.step_by(page_size)
+			.filter(|&offset| resident[offset / host_page] & 1 != 0)
+			.filter(|&offset| {
+				self.read_words(offset, &mut words);
+				words.iter().any(|&byte| byte != 0)
+			})
+			.collect()
+	}
+
+	/// [Self::read] for a large buffer, a word at a time. `offset` and the length of `buf` have to be multiples of 8
+	pub fn read_words(&self, offset: usize, buf: &mut [u8]) {
+		assert!(
+			offset % 8 == 0 && buf.len() % 8 == 0,
+			"unaligned word read at {offset:#X}"
+		);
+		let ptr = self.ptr_at(offset, buf.len());
+		for (idx, chunk) in buf.chunks_exact_mut(8).enumerate() {
+			// SAFETY: in bounds and aligned, and all shared access to the mapping is atomic
+			let word = unsafe { AtomicU64::from_ptr(ptr.add(idx * 8).cast()) }.load(Ordering::Relaxed);
+			chunk.copy_from_slice(&word.to_ne_bytes());
+		}
+	}
+
+	/// [Self::write] for a large buffer, a word at a time. `offset` and the length of `val` have to be multiples of 8
+	pub fn write_words(&self, offset: usize, val: &[u8]) {
+		assert!(
+			offset % 8 == 0 && val.len() % 8 == 0,
+			"unaligned word write at {offset:#X}"
+		);
+		let ptr = self.ptr_at(offset, val.len());
+		for (idx, chunk) in val.chunks_exact(8).enumerate() {
+			// UNWRAP: chunks are exactly 8 bytes
+			let word = u64::from_ne_bytes(chunk.try_into().unwrap());
+			// SAFETY: in bounds and aligned, and all shared access to the mapping is atomic
+			unsafe { AtomicU64::from_ptr(ptr.add(idx * 8).cast()) }.store(word, Ordering::Relaxed);
+		}
+	}
+
+	/// [Self::read] for a buffer of any length and alignment, a word at a time wherever `offset` allows
+	pub fn read_bulk(&self, offset: usize, buf: &mut [u8]) {
+		let ptr = self.ptr_at(offset, buf.len());
+		let head = ptr.align_offset(8).min(buf.len());
+		let words = (buf.len() - head) / 8 * 8;
+		let (head_buf, rest) = buf.split_at_mut(head);
+		let (word_buf, tail_buf) = rest.split_at_mut(words);
+		for (idx, val) in head_buf.iter_mut().enumerate() {
+			// SAFETY: in bounds, bytes are always aligned
+			*val = unsafe { AtomicU8::from_ptr(ptr.add(idx)) }.load(Ordering::Relaxed);
+		}
+		if !word_buf.is_empty() {
+			self.read_words(offset + head, word_buf);
+		}
+		for (idx, val) in tail_buf.iter_mut().enumerate() {
+			// SAFETY: in bounds, bytes are always aligned
+			*val = unsafe { AtomicU8::from_ptr(ptr.add(head + words + idx)) }.load(Ordering::Relaxed);
+		}
+	}
+
+	/// [Self::write] for a buffer of any length and alignment, a word at a time wherever `offset` allows
+	pub fn write_bulk(&self, offset: usize, val: &[u8]) {
+		let ptr = self.ptr_at(offset, val.len());
+		let head = ptr.align_offset(8).min(val.len());
+		let words = (val.len() - head) / 8 * 8;
+		let (head_val, rest) = val.split_at(head);
+		let (word_val, tail_val) = rest.split_at(words);
+		for (idx, val) in head_val.iter().enumerate() {
+			// SAFETY: in bounds, bytes are always aligned
+			unsafe { AtomicU8::from_ptr(ptr.add(idx)) }.store(*val, Ordering::Relaxed);
+		}
+		if !word_val.is_empty() {
+			self.write_words(offset + head, word_val);
+		}
+		for (idx, val) in tail_val.iter().enumerate() {
+			// SAFETY: in bounds, bytes are always aligned
+			unsafe { AtomicU8::from_ptr(ptr.add(head + words + idx)) }.store(*val, Ordering::Relaxed);
+		}
+	}
+
+	/// returns a pointer to `offset`, panics unless `offset..offset + len` is inside the mapping
+	#[inline(always)]
+	fn ptr_at(&self, offset: usize, len: usize) -> *mut u8 {
+		assert!(
+			offset.checked_add(len).is_some_and(|end| end <= self.len),
+			"physical access of {len} bytes at {offset:#X} is out of bounds"
+		);
+		// SAFETY: checked to be in bounds
+		unsafe { self.ptr.as_ptr().add(offset) }
+	}
+
+	#[inline(always)]
+	pub fn read(&self, offset: usize, buf: &mut [u8]) {
+		let ptr = self.ptr_at(offset, buf.len());
+		macro_rules! load {
+			($atomic:ty) => {
+				// SAFETY: ptr is in bounds and aligned for $atomic, and all shared access to the mapping is atomic
+				unsafe { <$atomic>::from_ptr(ptr.cast()) }
+					.load(Ordering::Relaxed)
+					.to_ne_bytes()
+			};
+		}
+
+		match buf.len() {
+			1 => buf.copy_from_slice(&load!(AtomicU8)),
+			2 if ptr.cast::<u16>().is_aligned() => buf.copy_from_slice(&load!(AtomicU16)),
+			4 if ptr.cast::<u32>().is_aligned() => buf.copy_from_slice(&load!(AtomicU32)),
+			8 if ptr.cast::<u64>().is_aligned() => buf.copy_from_slice(&load!(AtomicU64)),
+			_ => {
+				for (idx, val) in buf.iter_mut().enumerate() {
+					// SAFETY: in bounds, bytes are always aligned
+					*val = unsafe { AtomicU8::from_ptr(ptr.add(idx)) }.load(Ordering::Relaxed);
+				}
+			}
+		}
+	}
+
+	#[inline(always)]
+	pub fn write(&self, offset: usize, val: &[u8]) {
+		let ptr = self.ptr_at(offset, val.len());
+		macro_rules! store {
+			($atomic:ty, $ty:ty) => {
+				// SAFETY: ptr is in bounds and aligned for $atomic, and all shared access to the mapping is atomic
+				// UNWRAP: the length was matched on
+				unsafe { <$atomic>::from_ptr(ptr.cast()) }
+					.store(<$ty>::from_ne_bytes(val.try_into().unwrap()), Ordering::Relaxed)
+			};
+		}
+
+		match val.len() {
+			1 => store!(AtomicU8, u8),
+			2 if ptr.cast::<u16>().is_aligned() => store!(AtomicU16, u16),
+			4 if ptr.cast::<u32>().is_aligned() => store!(AtomicU32, u32),
+			8 if ptr.cast::<u64>().is_aligned() => store!(AtomicU64, u64),
+			_ => {
+				for (idx, val) in val.iter().enumerate() {
+					// SAFETY: in bounds, bytes are always aligned
+					unsafe { AtomicU8::from_ptr(ptr.add(idx)) }.store(*val, Ordering::Relaxed);
+				}
+			}
+		}
+	}
+}
+
+macro_rules! impl_phys_amo {
+	($($ty:ty, $signed:ty => $atomic:ty, $signed_atomic:ty);*) => {
+		impl PhysMemory {
+			$(paste::paste!{
+				/// Performs `op` on the value at `offset` and `val` as a single host atomic.
+				/// returns the original value, or None if `offset` isn't naturally aligned
+				#[inline(always)]
+				pub fn [<amo_ $ty>](&self, offset: usize, op: AmoOp, val: $ty, ordering: Ordering) -> Option<$ty> {
+					let ptr = self.ptr_at(offset, size_of::<$ty>());
+					if !ptr.cast::<$ty>().is_aligned() {
+						return None;
+					}
+					// SAFETY: ptr is in bounds and aligned, and all shared access to the mapping is atomic
+					let (unsigned, signed) = unsafe { (<$atomic>::from_ptr(ptr.cast()), <$signed_atomic>::from_ptr(ptr.cast())) };
+					Some(match op {
+						AmoOp::Swap => unsigned.swap(val, ordering),
+						AmoOp::Add => unsigned.fetch_add(val, ordering),
+						AmoOp::Xor => unsigned.fetch_xor(val, ordering),
+						AmoOp::And => unsigned.fetch_and(val, ordering),
+						AmoOp::Or => unsigned.fetch_or(val, ordering),
+						AmoOp::Min => signed.fetch_min(val as $signed, ordering) as $ty,
+						AmoOp::Max => signed.fetch_max(val as $signed, ordering) as $ty,
+						AmoOp::MinUnsigned => unsigned.fetch_min(val, ordering),
+						AmoOp::MaxUnsigned => unsigned.fetch_max(val, ordering),
+					})
+				}
+
+				/// Replaces the value at `offset` with `new` if it's still `current`, returns whether it was replaced or
+				/// None if `offset` isn't naturally aligned
+				#[inline(always)]
+				pub fn [<compare_exchange_ $ty>](&self, offset: usize, current: $ty, new: $ty) -> Option<bool> {
+					let ptr = self.ptr_at(offset, size_of::<$ty>());
+					if !ptr.cast::<$ty>().is_aligned() {
+						return None;
+					}
+					// SAFETY: ptr is in bounds and aligned, and all shared access to the mapping is atomic
+					let atomic = unsafe { <$atomic>::from_ptr(ptr.cast()) };
+					Some(atomic.compare_exchange(current, new, Ordering::Relaxed, Ordering::Relaxed).is_ok())
+				}
+			})*
+		}
+	};
+}
+
+impl_phys_amo!(u32, i32 => AtomicU32, AtomicI32; u64, i64 => AtomicU64, AtomicI64);
+
+impl Drop for PhysMemory {
+	fn drop(&mut self) {
+		if self.len != 0 {
+			// SAFETY: we own ptr..ptr + len and nothing can reference it anymore
+			unsafe { libc::munmap(self.ptr.as_ptr().cast(), self.len) };
+		}
+	}
+}
+
+pub fn host_page_size() -> usize {
+	// SAFETY: sysconf has no preconditions
+	unsafe { libc::sysconf(libc::_SC_PAGESIZE) as usize }
+}
+
+fn check_mapping(ptr: *mut libc::c_void) -> io::Result<NonNull<u8>> {
+	if ptr == libc::MAP_FAILED {
+		return Err(io::Error::last_os_error());
+	}
+	// UNWRAP: mmap never hands out the null page
+	Ok(NonNull::new(ptr.cast()).unwrap())
+}
+
+/// `MAP_NORESERVE` lets us hand out more memory than the host has, which is fine since guests rarely touch all of it
+fn map_anonymous(len: usize, extra_flags: libc::c_int) -> io::Result<NonNull<u8>> {
+	// SAFETY: we're asking for a fresh mapping, nothing existing is affected
+	let ptr = unsafe {
+		libc::mmap(
+			ptr::null_mut(),
+			len,
+			libc::PROT_READ | libc::PROT_WRITE,
+			libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | extra_flags,
+			-1,
+			0,
+		)
+	};
+	check_mapping(ptr)
+}
+
+/// returns the mapping and whether it's made of normal pages
+#[cfg(target_os = "linux")]
+fn map_huge(len: usize) -> io::Result<(NonNull<u8>, bool)> {
+	// huge pages have to be reserved up front, otherwise the guest would crash us once the pool runs out
+	match map_anonymous(len, libc::MAP_HUGETLB) {
+		Ok(ptr) => Ok((ptr, false)),
+		Err(err) => {
+			warn!("could not map huge pages ({err}), falling back to transparent huge pages");
+			let ptr = map_anonymous(len, libc::MAP_NORESERVE)?;
+			// SAFETY: ptr..ptr + len was just mapped, this is only advice
+			unsafe { libc::madvise(ptr.as_ptr().cast(), len, libc::MADV_HUGEPAGE) };
+			Ok((ptr, true))
+		}
+	}
+}
+
+/// returns the mapping and whether it's made of normal pages
+#[cfg(not(target_os = "linux"))]
+fn map_huge(len: usize) -> io::Result<(NonNull<u8>, bool)> {
+	warn!("huge pages are only supported on linux, using normal pages");
+	Ok((map_anonymous(len, libc::MAP_NORESERVE)?, true))
+}
@@ -0,0 +1,114 @@
+use std::cell::Cell;
+
+use super::{PageBase, PAGE_SIZE};
+
+/// which accesses a watchpoint stops on
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum WatchKind {
+	Read,
+	Write,
+	Access,
+}
+
+/// the first access that hit a watchpoint, `addr` is the first watched byte it touched
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct WatchHit {
+	pub kind: WatchKind,
+	pub addr: u64,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(super) struct Watchpoint {
+	addr: u64,
+	len: u64,
+	kind: WatchKind,
+}
+
+impl Watchpoint {
+	fn pages(&self) -> impl Iterator<Item = PageBase> {
+		let first = PageBase::from_addr(self.addr).addr();
+		let last = PageBase::from_addr(self.addr.saturating_add(self.len - 1)).addr();
+		(first..=last).step_by(PAGE_SIZE as usize).map(PageBase)
+	}
+}
+
+/// A hart's watchpoints. the pages they're on take the slow path, which is the only place they're checked
+#[derive(Debug, Default)]
+pub(super) struct Watchpoints {
+	list: Vec<Watchpoint>,
+	hit: Cell<Option<WatchHit>>,
+}
+
+impl Watchpoints {
+	pub(super) fn is_empty(&self) -> bool {
+		self.list.is_empty()
+	}
+
+	pub(super) fn insert(&mut self, addr: u64, len: u64, kind: WatchKind) {
+		self.list.push(Watchpoint {
+			addr,
+			len: len.max(1),
+			kind,
+		});
+	}
+
+	/// returns false if there was no such watchpoint
+	pub(super) fn remove(&mut self, addr: u64, len: u64, kind: WatchKind) -> bool {
+		let watchpoint = Watchpoint {
+			addr,
+			len: len.max(1),
+			kind,
+		};
+		let Some(idx) = self.list.iter().position(|wp| *wp == watchpoint) else {
+			return false;
+		};
+		self.list.swap_remove(idx);
+		true
+	}
+
+	/// every page any watchpoint is on
+	pub(super) fn pages(&self) -> impl Iterator<Item = PageBase> + '_ {
+		self.list.iter().flat_map(Watchpoint::pages)
+	}
+
+	/// records a hit if `addr..addr + len` touches a watchpoint for this kind of access, the first hit is kept until
+	/// it's taken
+	#[inline]
+	pub(super) fn check(&self, addr: u64, len: usize, write: bool) {
+		if self.list.is_empty() || self.hit.get().is_some() {
+			return;
+		}
+		let end = addr.saturating_add(len as u64);
+		let hit = self.list.iter().find(|wp| {
+			let triggers = match wp.kind {
+				WatchKind::Read => !write,
+				WatchKind::Write => write,
+				WatchKind::Access => true,
+			};
+			triggers && addr < wp.addr.saturating_add(wp.len) && wp.addr < end
+		});
+		if let Some(wp) = hit {
+			self.hit.set(Some(WatchHit {
+				kind: wp.kind,
+				addr: addr.max(wp.addr),
+			}));
+		}
+	}
+
+	pub(super) fn take_hit(&self) -> Option<WatchHit> {
+		self.hit.take()
+	}
+
+	pub(super) fn set_hit(&self, hit: Option<WatchHit>) {
+		self.hit.set(hit);
+	}
+
+	/// takes every watchpoint out so accesses don't trigger them, until they're put back with [Self::restore]
+	pub(super) fn suspend(&mut self) -> Vec<Watchpoint> {
+		std::mem::take(&mut self.list)
+	}
+
+	pub(super) fn restore(&mut self, list: Vec<Watchpoint>) {
+		self.list = list;
+	}
+}
@@ -0,0 +1,323 @@
+//! A sampling profiler for hart 0.
+//!
+//! The hart runs in slices of exactly [ProfileArgs::profile_interval] instructions (blocks are only used while at
+//! least a whole block is left in a slice, so they don't overshoot), and the pc and call stack are sampled between
+//! them. Nothing is added to the cpu itself, the cost is a few interpreted instructions before every sample.
+//!
+//! Call stacks follow the frame pointer chain (`s0`, with the return address at `s0 - 8` and the caller's frame
+//! pointer at `s0 - 16`), so they're only complete for code built with `-fno-omit-frame-pointer`. `ra` fills in the
+//! caller of leaf functions that don't set up a frame. The report is symbolized against the ELF the kernel was made
+//! from.
+
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+
+use clap::Args;
+use tracing::*;
+
+use crate::cpu::{StopReason, WhiskerCpu};
+use crate::insn::Instruction;
+use crate::ty::GPRegisterIndex;
+
+/// how many frames a call stack is followed for at most
+const MAX_DEPTH: usize = 64;
+/// how many functions and pcs the report lists
+const REPORT_LEN: usize = 40;
+
+#[derive(Debug, Clone, Args)]
+pub struct ProfileArgs {
+	/// Sample hart 0 while it runs and write a report here. flamegraph compatible folded stacks go next to it with a
+	/// `.folded` extension
+	#[arg(long, conflicts_with = "use_gdb")]
+	pub profile: Option<PathBuf>,
+	/// Instructions between samples
+	#[arg(long, default_value_t = 9973, requires = "profile")]
+	pub profile_interval: u64,
+	/// The ELF to symbolize the report with. defaults to the kernel with an `.elf` extension, or the `out.elf` that
+	/// `cutie compile` leaves next to it
+	#[arg(long, requires = "profile")]
+	pub profile_elf: Option<PathBuf>,
+}
+
+#[derive(Default)]
+pub struct Profiler {
+	interval: u64,
+	samples: u64,
+	pcs: HashMap<u64, u64>,
+	// the pc, ra, then the return addresses along the frame pointer chain
+	stacks: HashMap<Vec<u64>, u64>,
+}
+
+impl Profiler {
+	pub fn new(interval: u64) -> Self {
+		Self {
+			interval: interval.max(1),
+			..Self::default()
+		}
+	}
+
+	/// [WhiskerCpu::run] with a sample taken every interval
+	pub fn run(&mut self, cpu: &mut WhiskerCpu, budget: u64) -> StopReason {
+		let end = cpu.cycles.saturating_add(budget);
+		loop {
+			match cpu.run(self.interval.min(end - cpu.cycles)) {
+				StopReason::BudgetExhausted if cpu.cycles < end => self.sample(cpu),
+				reason => return reason,
+			}
+		}
+	}
+
+	fn sample(&mut self, cpu: &mut WhiskerCpu) {
+		self.samples += 1;
+		*self.pcs.entry(cpu.pc).or_default() += 1;
+
+		let mut stack = vec![cpu.pc, cpu.registers.get(GPRegisterIndex::LINK_REG)];
+		let mut fp = cpu.registers.get(GPRegisterIndex::FRAME_PTR);
+		while stack.len() < MAX_DEPTH && fp != 0 && fp % 8 == 0 {
+			let (mut ret, mut prev) = ([0; 8], [0; 8]);
+			if cpu.mem.debug_read_slice(fp.wrapping_sub(8), &mut ret).is_err()
+				|| cpu.mem.debug_read_slice(fp.wrapping_sub(16), &mut prev).is_err()
+			{
+				break;
+			}
+			let (ret, prev) = (u64::from_le_bytes(ret), u64::from_le_bytes(prev));
+			if ret == 0 {
+				break;
+			}
+			stack.push(ret);
+			// callers' frames are further up the stack, anything else isn't a frame pointer
+			if prev <= fp {
+				break;
+			}
+			fp = prev;
+		}
+		*self.stacks.entry(stack).or_default() += 1;
+	}
+
+	/// writes the report to `path` and the folded stacks next to it. the instruction classes come from the decoded
+	/// instruction cache, so `cpu` has to be the hart that was sampled
+	pub fn write_report(&self, cpu: &mut WhiskerCpu, path: &Path, symbols: &Symbols) -> io::Result<()> {
+		let samples = self.samples.max(1) as f64;
+		let percent = |count: u64| count as f64 * 100.0 / samples;
+		let mut out = String::new();
+		// UNWRAPS: writing to a String can't fail
+		writeln!(
+			out,
+			"{} samples, one every {} instructions, {} instructions in total",
+			self.samples, self.interval, cpu.cycles
+		)
+		.unwrap();
+
+		let mut functions = HashMap::<&str, u64>::new();
+		for (&pc, &count) in &self.pcs {
+			*functions.entry(symbols.function(pc)).or_default() += count;
+		}
+		writeln!(out, "\nfunctions\n{:>10} {:>7}  function", "samples", "%").unwrap();
+		for (name, count) in sorted(functions).into_iter().take(REPORT_LEN) {
+			writeln!(out, "{count:>10} {:>6.2}%  {name}", percent(count)).unwrap();
+		}
+
+		writeln!(out, "\nhot spots\n{:>10} {:>7}  {:<18}  location", "samples", "%", "pc").unwrap();
+		for (pc, count) in sorted(self.pcs.clone()).into_iter().take(REPORT_LEN) {
+			writeln!(
+				out,
+				"{count:>10} {:>6.2}%  {pc:#018X}  {}",
+				percent(count),
+				symbols.location(pc)
+			)
+			.unwrap();
+		}
+
+		let mut classes = HashMap::<&str, u64>::new();
+		let mut compressed = 0;
+		for (&pc, &count) in &self.pcs {
+			let class = match cpu.mem.decoded(pc) {
+				Some(op) => {
+					if op.size == 2 {
+						compressed += count;
+					}
+					class(&op.instruction())
+				}
+				// thrown away by a write since, or never executed because the run stopped right there
+				None => "not decoded",
+			};
+			*classes.entry(class).or_default() += count;
+		}
+		writeln!(out, "\ninstruction classes\n{:>10} {:>7}  class", "samples", "%").unwrap();
+		for (class, count) in sorted(classes) {
+			writeln!(out, "{count:>10} {:>6.2}%  {class}", percent(count)).unwrap();
+		}
+		writeln!(
+			out,
+			"{compressed:>10} {:>6.2}%  (16 bit encodings, of any class)",
+			percent(compressed)
+		)
+		.unwrap();
+		fs::write(path, out)?;
+
+		let mut stacks = HashMap::<String, u64>::new();
+		for (stack, &count) in &self.stacks {
+			*stacks.entry(fold(stack, symbols)).or_default() += count;
+		}
+		let mut folded = String::new();
+		for (stack, count) in sorted(stacks) {
+			writeln!(folded, "{stack} {count}").unwrap();
+		}
+		fs::write(path.with_extension("folded"), folded)
+	}
+}
+
+/// a sampled stack as `outermost;...;innermost` function names
+fn fold(stack: &[u64], symbols: &Symbols) -> String {
+	// return addresses point after the call, so they're looked up a byte earlier to land in the calling function
+	let (pc, ra, chain) = (stack[0], stack[1], &stack[2..]);
+	let mut frames = vec![symbols.function(pc)];
+	let caller = symbols.function(ra.wrapping_sub(1));
+	// ra is stale unless pc is in a leaf function that hasn't pushed a frame, which is when it isn't in the chain
+	let first_in_chain = chain.first().map(|ret| symbols.function(ret.wrapping_sub(1)));
+	if ra != 0 && caller != frames[0] && Some(caller) != first_in_chain {
+		frames.push(caller);
+	}
+	frames.extend(chain.iter().map(|ret| symbols.function(ret.wrapping_sub(1))));
+	frames.reverse();
+	frames.join(";")
+}
+
+/// most samples first, ties in a stable order
+fn sorted<K: Ord>(counts: HashMap<K, u64>) -> Vec<(K, u64)> {
+	let mut counts: Vec<_> = counts.into_iter().collect();
+	counts.sort_unstable_by(|(lhs_key, lhs), (rhs_key, rhs)| rhs.cmp(lhs).then_with(|| lhs_key.cmp(rhs_key)));
+	counts
+}
+
+/// the [Instruction] variant an instruction belongs to
+fn class(insn: &Instruction) -> &'static str {
+	match insn {
+		Instruction::IntExtension(_) => "int",
+		Instruction::FloatExtension(_) => "float",
+		Instruction::Csr(_) => "csr",
+		Instruction::CompressedExtension(_) => "compressed",
+		Instruction::AtomicExtension(_) => "atomic",
+		Instruction::MultiplyInstruction(_) => "multiply",
+	}
+}
+
+/// The function and label symbols of an ELF, sorted by address
+#[derive(Debug, Default)]
+pub struct Symbols {
+	symbols: Vec<(u64, String)>,
+}
+
+impl Symbols {
+	/// finds the ELF for `kernel`, see [ProfileArgs::profile_elf]. no symbols if there isn't one, or it can't be read
+	pub fn for_kernel(elf: Option<&Path>, kernel: &Path) -> Self {
+		let candidates = match elf {
+			Some(elf) => vec![elf.to_owned()],
+			None => vec![kernel.with_extension("elf"), kernel.with_file_name("out.elf")],
+		};
+		for path in candidates {
+			let Ok(data) = fs::read(&path) else {
+				continue;
+			};
+			match Self::parse(&data) {
+				Some(symbols) => return symbols,
+				None => warn!(
+					"{} isn't a 64 bit little endian ELF with a symbol table",
+					path.display()
+				),
+			}
+		}
+		warn!("no symbols for {}, the profile only has addresses", kernel.display());
+		Self::default()
+	}
+
+	fn parse(data: &[u8]) -> Option<Self> {
+		const SHT_SYMTAB: u32 = 2;
+		const STT_NOTYPE: u8 = 0;
+		const STT_FUNC: u8 = 2;
+
+		// 64 bit, little endian
+		if data.get(..6)? != b"\x7FELF\x02\x01" {
+			return None;
+		}
+		let section_offset = read_u64(data, 0x28)?;
+		let section_size = u64::from(read_u16(data, 0x3A)?);
+		let sections = u64::from(read_u16(data, 0x3C)?);
+		let section = |idx: u64| section_offset.checked_add(idx.checked_mul(section_size)?);
+
+		let mut symbols = Vec::new();
+		for idx in 0..sections {
+			let header = section(idx)?;
+			if read_u32(data, header + 0x04)? != SHT_SYMTAB {
+				continue;
+			}
+			let (offset, size) = (read_u64(data, header + 0x18)?, read_u64(data, header + 0x20)?);
+			let strings = section(u64::from(read_u32(data, header + 0x28)?))?;
+			let string_offset = read_u64(data, strings + 0x18)?;
+			for symbol in (offset..offset.checked_add(size)?).step_by(24) {
+				let kind = *data.get(usize::try_from(symbol + 4).ok()?)? & 0xF;
+				let section = read_u16(data, symbol + 6)?;
+				let addr = read_u64(data, symbol + 8)?;
+				if !matches!(kind, STT_NOTYPE | STT_FUNC) || section == 0 || addr == 0 {
+					continue;
+				}
+				let name = read_str(data, string_offset.checked_add(u64::from(read_u32(data, symbol)?))?)?;
+				// local labels from the assembler aren't worth reporting
+				if name.is_empty() || name.starts_with(".L") || name.starts_with('$') {
+					continue;
+				}
+				symbols.push((addr, name.to_owned()));
+			}
+		}
+		symbols.sort_unstable();
+		symbols.dedup_by_key(|(addr, _)| *addr);
+		Some(Self { symbols })
+	}
+
+	fn lookup(&self, pc: u64) -> Option<&(u64, String)> {
+		let idx = self.symbols.partition_point(|(addr, _)| *addr <= pc).checked_sub(1)?;
+		self.symbols.get(idx)
+	}
+
+	/// the name of the symbol `pc` is in
+	fn function(&self, pc: u64) -> &str {
+		match self.lookup(pc) {
+			Some((_, name)) => name,
+			None => "[unknown]",
+		}
+	}
+
+	/// `symbol+offset`
+	fn location(&self, pc: u64) -> String {
+		match self.lookup(pc) {
+			Some((addr, name)) => format!("{name}+{:#X}", pc - addr),
+			None => "[unknown]".to_owned(),
+		}
+	}
+}
+
+fn read_bytes<const N: usize>(data: &[u8], offset: u64) -> Option<[u8; N]> {
+	let offset = usize::try_from(offset).ok()?;
+	data.get(offset..offset.checked_add(N)?)?.try_into().ok()
+}
+
+fn read_u16(data: &[u8], offset: u64) -> Option<u16> {
+	read_bytes(data, offset).map(u16::from_le_bytes)
+}
+
+fn read_u32(data: &[u8], offset: u64) -> Option<u32> {
+	read_bytes(data, offset).map(u32::from_le_bytes)
+}
+
+fn read_u64(data: &[u8], offset: u64) -> Option<u64> {
+	read_bytes(data, offset).map(u64::from_le_bytes)
+}
+
+fn read_str(data: &[u8], offset: u64) -> Option<&str> {
+	let rest = data.get(usize::try_from(offset).ok()?..)?;
+	let len = rest.iter().position(|&byte| byte == 0)?;
+	std::str::from_utf8(&rest[..len]).ok()
+}
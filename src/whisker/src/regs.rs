@@ -9,6 +9,10 @@ pub struct GPRegisters {
 }
 
 impl GPRegisters {
+	/// where x0..x31 live inside the struct, for translated code that works on them in place.
+	/// x0 is never written so it always reads as zero
+	pub const X_OFFSET: usize = std::mem::offset_of!(GPRegisters, x);
+
 	pub fn regs(&self) -> &[u64; 32] {
 		&self.x
 	}
@@ -0,0 +1,267 @@
+//! Recording a single hart's run so GDB can step and continue backwards through it.
+//!
+//! A hart on its own is deterministic except for what it reads from devices, so a recording is just those reads (see
+//! [crate::mem::Memory::record_io]) and a checkpoint of the whole hart every so many instructions. Going back to a
+//! cycle restores the last checkpoint before it and replays forward from there, with device reads served from the
+//! log and device writes dropped. Running forward from the past replays the same way until it catches up with the
+//! furthest the hart has been, and only then talks to the devices again.
+//!
+//! The CLINT's registers and the hart's clock are part of every checkpoint, and writes to the CLINT still go through
+//! while replaying (see [crate::mem::Device::replays_writes]). the clock each WFI woke at is logged like a device
+//! read, so timer interrupts and wakeups arrive at the same cycles as they did the first time. other devices' state
+//! isn't rolled back.
+//!
+//! Checkpoints only copy memory that isn't all zero. Once there are [MAX_CHECKPOINTS] of them every other one is
+//! dropped and the interval doubles, so a long run keeps a bounded number of them and the replay to any cycle stays
+//! within a few intervals.
+
+use std::fmt::Debug;
+
+use crate::cpu::{StopReason, TimerState, WhiskerCpu, WhiskerExecStatus};
+use crate::csr::CSRPrivilege;
+use crate::finisher::GuestExit;
+use crate::mem::{MemoryCheckpoint, WatchHit};
+
+const MAX_CHECKPOINTS: usize = 64;
+
+struct Checkpoint {
+	cycles: u64,
+	timer: TimerState,
+	pc: u64,
+	privilege: CSRPrivilege,
+	gprs: [u64; 32],
+	fprs: [u64; 32],
+	csrs: Vec<(u16, u64)>,
+	mem: MemoryCheckpoint,
+}
+
+impl Checkpoint {
+	fn take(cpu: &WhiskerCpu) -> Self {
+		Self {
+			cycles: cpu.cycles,
+			timer: cpu.timer_state(),
+			pc: cpu.pc,
+			privilege: cpu.privilege,
+			gprs: *cpu.registers.regs(),
+			fprs: *cpu.fp_registers.get_all_raw(),
+			csrs: cpu.csrs.iter().map(|csr| (csr.addr(), csr.val)).collect(),
+			mem: cpu.mem.checkpoint(),
+		}
+	}
+
+	fn restore(&self, cpu: &mut WhiskerCpu) {
+		cpu.cycles = self.cycles;
+		cpu.pc = self.pc;
+		cpu.privilege = self.privilege;
+		cpu.registers.set_all(&self.gprs);
+		cpu.fp_registers.set_all_raw(&self.fprs);
+		for &(addr, val) in &self.csrs {
+			// UNWRAP: the addresses came from the same CSRs
+			cpu.csrs.get_mut(addr).unwrap().val = val;
+		}
+		cpu.restore_timer_state(&self.timer);
+		cpu.mem.restore_checkpoint(&self.mem);
+		cpu.update_translation();
+		cpu.exit.clear();
+	}
+}
+
+/// where a reverse continue stopped
+pub enum ReverseStop {
+	/// on a breakpoint, before executing it
+	Breakpoint,
+	/// right after the access
+	Watchpoint(WatchHit),
+	/// at the start of the recording, nothing stopped it before
+	Begin,
+}
+
+pub struct Replay {
+	interval: u64,
+	// sorted by cycle, the first one is where the recording started
+	checkpoints: Vec<Checkpoint>,
+	// the furthest the hart has run, everything before it is replayed
+	head: u64,
+	// how the run ended at the head, the finisher write that ended it is dropped while replaying
+	exited: Option<GuestExit>,
+}
+
+impl Debug for Replay {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("Replay")
+			.field("interval", &self.interval)
+			.field("checkpoints", &self.checkpoints.len())
+			.field("head", &self.head)
+			.finish_non_exhaustive()
+	}
+}
+
+impl Replay {
+	/// starts recording `cpu` from where it is now, with a checkpoint every `interval` instructions
+	pub fn new(cpu: &mut WhiskerCpu, interval: u64) -> Self {
+		cpu.mem.record_io();
+		Self {
+			interval: interval.max(1),
+			checkpoints: vec![Checkpoint::take(cpu)],
+			head: cpu.cycles,
+			exited: None,
+		}
+	}
+
+	/// [WhiskerCpu::run], replaying up to the head if the hart is in the past
+	pub fn run(&mut self, cpu: &mut WhiskerCpu, budget: u64) -> StopReason {
+		let end = cpu.cycles.saturating_add(budget);
+		loop {
+			self.advance(cpu);
+			let replaying = cpu.cycles < self.head;
+			if !replaying {
+				if let Some(exit) = self.exited {
+					return StopReason::Exited(exit);
+				}
+			}
+			if cpu.cycles >= end {
+				return StopReason::BudgetExhausted;
+			}
+
+			let slice_end = if replaying { self.head } else { self.next_checkpoint() };
+			cpu.mem.set_replaying(replaying);
+			let reason = cpu.run(slice_end.min(end) - cpu.cycles);
+			cpu.mem.set_replaying(false);
+			match reason {
+				StopReason::BudgetExhausted => {}
+				StopReason::Exited(exit) => {
+					self.advance(cpu);
+					self.exited = Some(exit);
+					return reason;
+				}
+				reason => {
+					self.advance(cpu);
+					return reason;
+				}
+			}
+		}
+	}
+
+	/// [WhiskerCpu::execute_one], replayed if the hart is in the past
+	pub fn step(&mut self, cpu: &mut WhiskerCpu) -> Result<(), WhiskerExecStatus> {
+		self.advance(cpu);
+		cpu.mem.set_replaying(cpu.cycles < self.head);
+		let result = cpu.execute_one();
+		cpu.mem.set_replaying(false);
+		self.advance(cpu);
+		result
+	}
+
+	/// goes back one instruction, returns false if the hart is already at the start of the recording
+	pub fn reverse_step(&mut self, cpu: &mut WhiskerCpu) -> bool {
+		if cpu.cycles <= self.checkpoints[0].cycles {
+			return false;
+		}
+		self.seek(cpu, cpu.cycles - 1);
+		true
+	}
+
+	/// goes back to the last breakpoint or watchpoint hit before now, or to the start of the recording
+	pub fn reverse_continue(&mut self, cpu: &mut WhiskerCpu) -> ReverseStop {
+		let now = cpu.cycles;
+		// the checkpoints are searched from the latest one before now, the first one with a hit has the last hit
+		let latest = self.checkpoints.partition_point(|cp| cp.cycles < now);
+		for idx in (0..latest).rev() {
+			let end = self.checkpoints.get(idx + 1).map_or(now, |next| next.cycles.min(now));
+			self.checkpoints[idx].restore(cpu);
+			if let Some((cycles, stop)) = self.last_hit(cpu, end, now) {
+				self.seek(cpu, cycles);
+				return stop;
+			}
+		}
+		self.seek(cpu, self.checkpoints[0].cycles);
+		ReverseStop::Begin
+	}
+
+	/// GDB changed the hart or its memory, so the recording past this point won't happen anymore
+	pub fn rewrite_history(&mut self, cpu: &mut WhiskerCpu) {
+		let now = cpu.cycles;
+		self.checkpoints.retain(|cp| cp.cycles < now);
+		self.checkpoints.push(Checkpoint::take(cpu));
+		self.head = now;
+		self.exited = None;
+		cpu.mem.forget_future_io();
+	}
+
+	fn next_checkpoint(&self) -> u64 {
+		// UNWRAP: there's always the first checkpoint
+		self.checkpoints.last().unwrap().cycles.saturating_add(self.interval)
+	}
+
+	/// moves the head along with the hart, taking checkpoints on the way
+	fn advance(&mut self, cpu: &WhiskerCpu) {
+		if cpu.cycles < self.head {
+			return;
+		}
+		self.head = cpu.cycles;
+		if cpu.cycles < self.next_checkpoint() || cpu.trap_pending() {
+			return;
+		}
+		self.checkpoints.push(Checkpoint::take(cpu));
+		if self.checkpoints.len() > MAX_CHECKPOINTS {
+			// keeps the first one, where the recording started
+			let mut idx = 0;
+			self.checkpoints.retain(|_| {
+				idx += 1;
+				idx % 2 == 1
+			});
+			self.interval = self.interval.saturating_mul(2);
+		}
+	}
+
+	/// replays from a checkpoint to `end`, stopping like a forward run would, and returns the last stop before `now`
+	fn last_hit(&mut self, cpu: &mut WhiskerCpu, end: u64, now: u64) -> Option<(u64, ReverseStop)> {
+		let interrupt = std::mem::take(&mut cpu.interrupt);
+		cpu.mem.set_replaying(true);
+		let mut last = None;
+		while cpu.cycles < end {
+			match cpu.run(end - cpu.cycles) {
+				StopReason::HitBreakpoint => {
+					last = Some((cpu.cycles, ReverseStop::Breakpoint));
+					// steps over it like GDB does when it continues from a breakpoint
+					let breakpoints = cpu.suspend_breakpoints();
+					let _ = cpu.execute_one();
+					cpu.restore_breakpoints(breakpoints);
+				}
+				StopReason::HitWatchpoint(hit) if cpu.cycles < now => {
+					last = Some((cpu.cycles, ReverseStop::Watchpoint(hit)));
+				}
+				// the stop GDB is at now
+				StopReason::HitWatchpoint(_) => break,
+				_ => break,
+			}
+		}
+		cpu.mem.set_replaying(false);
+		cpu.interrupt = interrupt;
+		last
+	}
+
+	/// puts the hart back at `target`, which has to lie between the start of the recording and the head
+	fn seek(&mut self, cpu: &mut WhiskerCpu, target: u64) {
+		let idx = self.checkpoints.partition_point(|cp| cp.cycles <= target) - 1;
+		let checkpoint = &self.checkpoints[idx];
+		// replaying on from where the hart is is cheaper, if it's between the checkpoint and the target
+		if !(checkpoint.cycles..=target).contains(&cpu.cycles) {
+			checkpoint.restore(cpu);
+		}
+
+		let breakpoints = cpu.suspend_breakpoints();
+		let watchpoints = cpu.mem.suspend_watchpoints();
+		let interrupt = std::mem::take(&mut cpu.interrupt);
+		cpu.mem.set_replaying(true);
+		while cpu.cycles < target {
+			if !matches!(cpu.run(target - cpu.cycles), StopReason::BudgetExhausted) {
+				break;
+			}
+		}
+		cpu.mem.set_replaying(false);
+		cpu.interrupt = interrupt;
+		cpu.mem.restore_watchpoints(watchpoints);
+		cpu.restore_breakpoints(breakpoints);
+	}
+}
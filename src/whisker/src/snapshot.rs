@@ -0,0 +1,196 @@
+//! Snapshots of a whole single hart machine, so runs that share a long prefix can start from where it ends.
+//!
+//! A snapshot is a header followed by the contents of guest RAM. All values are little endian. The header holds the
+//! hart's registers, CSRs, pc, clock, privilege mode and CLINT timer, the bootrom (the guest may have written to it),
+//! and the runs of physical memory that aren't all zero. Only those runs are stored, each one page aligned in the
+//! file, so restoring maps them copy on write instead of reading them: a restore costs about the same no matter how
+//! much memory the guest used, and the pages are only read once the guest touches them.
+//!
+//! Other devices don't keep any state worth saving (the UART's control registers are lost), and neither do LR
+//! reservations, so a store conditional right after a restore fails.
+
+use std::fs::File;
+use std::io::{self, BufReader, BufWriter, Read, Seek as _, Write};
+use std::path::Path;
+use std::sync::Arc;
+
+use crate::clint::Clint;
+use crate::cpu::WhiskerCpu;
+use crate::csr::{CSRPrivilege, NUM_CSRS};
+use crate::mem::{BootromImage, PageBase, PhysBacking, PAGE_SIZE};
+use crate::ty::SupportedExtensions;
+use crate::uart::Uart;
+
+const MAGIC: [u8; 8] = *b"whiskers";
+const VERSION: u16 = 3;
+
+/// pages of physical memory that are stored back to back
+struct Run {
+	phys_base: u64,
+	pages: u64,
+}
+
+/// Writes `cpu` and its memory to `path`. other harts aren't saved, so this only makes sense for a single hart
+pub fn write(cpu: &WhiskerCpu, path: &Path) -> io::Result<()> {
+	let mut runs: Vec<Run> = Vec::new();
+	for page in cpu.mem.used_phys_pages() {
+		match runs.last_mut() {
+			Some(run) if run.phys_base + run.pages * PAGE_SIZE == page => run.pages += 1,
+			_ => runs.push(Run {
+				phys_base: page,
+				pages: 1,
+			}),
+		}
+	}
+
+	let mut header = Vec::new();
+	header.extend_from_slice(&MAGIC);
+	header.extend_from_slice(&VERSION.to_le_bytes());
+	header.extend_from_slice(&cpu.supported_extensions.bits().to_le_bytes());
+	header.extend_from_slice(&cpu.pc.to_le_bytes());
+	header.extend_from_slice(&cpu.cycles.to_le_bytes());
+	header.extend_from_slice(&cpu.skipped_time.to_le_bytes());
+	header.push(cpu.privilege as u8);
+	for reg in cpu.registers.regs().iter().chain(cpu.fp_registers.get_all_raw()) {
+		header.extend_from_slice(&reg.to_le_bytes());
+	}
+	let csrs = cpu.csrs.iter().collect::<Vec<_>>();
+	header.extend_from_slice(&(csrs.len() as u16).to_le_bytes());
+	for csr in csrs {
+		header.extend_from_slice(&csr.addr().to_le_bytes());
+		header.extend_from_slice(&csr.val.to_le_bytes());
+	}
+	let (mtimecmp, msip) = cpu.clint.as_ref().map_or((u64::MAX, false), |clint| clint.registers(0));
+	header.extend_from_slice(&mtimecmp.to_le_bytes());
+	header.push(u8::from(msip));
+	let bootrom = cpu.mem.bootrom_image();
+	header.extend_from_slice(&(bootrom.len() as u64).to_le_bytes());
+	header.extend_from_slice(&bootrom);
+	header.extend_from_slice(&cpu.mem.phys_size().to_le_bytes());
+	header.extend_from_slice(&(runs.len() as u64).to_le_bytes());
+	for run in &runs {
+		header.extend_from_slice(&run.phys_base.to_le_bytes());
+		header.extend_from_slice(&run.pages.to_le_bytes());
+	}
+	// the pages start on a page boundary so they can be mapped
+	header.resize(header.len().next_multiple_of(PAGE_SIZE as usize), 0);
+
+	let mut out = BufWriter::new(File::create(path)?);
+	out.write_all(&header)?;
+	let mut page = [0_u8; PAGE_SIZE as usize];
+	for run in &runs {
+		for idx in 0..run.pages {
+			cpu.mem
+				.read_phys_page(PageBase::from_addr(run.phys_base + idx * PAGE_SIZE), &mut page);
+			out.write_all(&page)?;
+		}
+	}
+	out.flush()
+}
+
+/// Builds hart 0 of a machine like [crate::init_cpu] does, but in the state saved at `path` instead of at reset
+pub fn restore(path: &Path, backing: PhysBacking, uart: Arc<Uart>) -> io::Result<WhiskerCpu> {
+	let file = File::open(path)?;
+	let mut reader = BufReader::new(file.try_clone()?);
+
+	if read_array(&mut reader)? != MAGIC {
+		return Err(invalid_data("not a whisker snapshot"));
+	}
+	let version = u16::from_le_bytes(read_array(&mut reader)?);
+	if version != VERSION {
+		return Err(invalid_data(format!("unsupported snapshot version {version}")));
+	}
+	let supported = SupportedExtensions::from_bits(read_u64(&mut reader)?);
+	let pc = read_u64(&mut reader)?;
+	let cycles = read_u64(&mut reader)?;
+	let skipped_time = read_u64(&mut reader)?;
+	let privilege = match read_array::<1>(&mut reader)?[0] {
+		0b00 => CSRPrivilege::User,
+		0b01 => CSRPrivilege::Supervisor,
+		0b11 => CSRPrivilege::Machine,
+		privilege => {
+			return Err(invalid_data(format!(
+				"snapshot has an unknown privilege mode {privilege}"
+			)))
+		}
+	};
+	let mut gprs = [0; 32];
+	let mut fprs = [0; 32];
+	for reg in gprs.iter_mut().chain(fprs.iter_mut()) {
+		*reg = read_u64(&mut reader)?;
+	}
+	let csr_count = u16::from_le_bytes(read_array(&mut reader)?);
+	let csrs = (0..csr_count)
+		.map(|_| Ok((u16::from_le_bytes(read_array(&mut reader)?), read_u64(&mut reader)?)))
+		.collect::<io::Result<Vec<_>>>()?;
+	let mtimecmp = read_u64(&mut reader)?;
+	let msip = read_array::<1>(&mut reader)?[0] != 0;
+	let mut bootrom = vec![0; read_u64(&mut reader)? as usize];
+	reader.read_exact(&mut bootrom)?;
+	let phys_size = read_u64(&mut reader)?;
+	if phys_size != crate::DRAM_SIZE {
+		return Err(invalid_data(format!(
+			"snapshot has {phys_size:#X} bytes of memory, not {:#X}",
+			crate::DRAM_SIZE
+		)));
+	}
+	let run_count = read_u64(&mut reader)?;
+	let runs = (0..run_count)
+		.map(|_| {
+			Ok(Run {
+				phys_base: read_u64(&mut reader)?,
+				pages: read_u64(&mut reader)?,
+			})
+		})
+		.collect::<io::Result<Vec<_>>>()?;
+
+	let header_len = reader.stream_position()?;
+	let mut file_offset = header_len.next_multiple_of(PAGE_SIZE);
+	let exit = Arc::default();
+	let clint = Arc::new(Clint::new(1));
+	clint.restore_registers(0, mtimecmp, msip);
+	let mut mem = crate::memory_layout(BootromImage::new(bootrom), backing, 1, uart, &exit, &clint);
+	for run in &runs {
+		let len = run.pages * PAGE_SIZE;
+		if run.phys_base.checked_add(len).is_none_or(|end| end > phys_size) {
+			return Err(invalid_data(format!("run at {:#X} is out of bounds", run.phys_base)));
+		}
+		mem = mem.phys_image(PageBase::from_addr(run.phys_base), file.try_clone()?, file_offset, len);
+		file_offset += len;
+	}
+	if file.metadata()?.len() < file_offset {
+		return Err(invalid_data("snapshot is truncated"));
+	}
+
+	let mut cpu = WhiskerCpu::new(0, supported, mem.build(), None);
+	cpu.exit = exit;
+	cpu.clint = Some(clint);
+	cpu.pc = pc;
+	cpu.cycles = cycles;
+	cpu.skipped_time = skipped_time;
+	cpu.privilege = privilege;
+	cpu.registers.set_all(&gprs);
+	cpu.fp_registers.set_all_raw(&fprs);
+	for (addr, val) in csrs {
+		let Some(csr) = (addr < NUM_CSRS).then(|| cpu.csrs.get_mut(addr)).flatten() else {
+			return Err(invalid_data(format!("snapshot has an unknown CSR {addr:#05X}")));
+		};
+		csr.val = val;
+	}
+	cpu.update_translation();
+	Ok(cpu)
+}
+
+fn invalid_data(msg: impl Into<String>) -> io::Error {
+	io::Error::new(io::ErrorKind::InvalidData, msg.into())
+}
+
+fn read_array<const N: usize>(reader: &mut impl Read) -> io::Result<[u8; N]> {
+	let mut buf = [0_u8; N];
+	reader.read_exact(&mut buf)?;
+	Ok(buf)
+}
+
+fn read_u64(reader: &mut impl Read) -> io::Result<u64> {
+	read_array(reader).map(u64::from_le_bytes)
+}
@@ -2,6 +2,7 @@ use crate::cpu::WhiskerCpu;
 
 pub mod double;
 pub mod float;
+pub mod host;
 
 /// Defined on unpriv isa page 119
 #[derive(Debug, Clone, Copy)]
@@ -104,12 +105,20 @@ impl RoundingMode {
 		}
 	}
 
+	/// the rounding mode an instruction with this rm field uses, reading frm for dynamic
+	pub fn resolve(self, cpu: &WhiskerCpu) -> Self {
+		match self {
+			// FIXME: the reserved frm values should make the instruction illegal, they round to nearest for now
+			RoundingMode::Dynamic => Self::from_u8(((cpu.csrs.read_fcsr() & FCSR_ROUNDING_MODE_MASK) >> 5) as u8)
+				.filter(|rm| *rm != RoundingMode::Dynamic)
+				.unwrap_or(RoundingMode::RoundToNearestTieEven),
+			rm => rm,
+		}
+	}
+
 	/// This should NEVER be used outside of the `soft` module, hence marked as unsafe
 	pub unsafe fn write_thread_local(self, cpu: &WhiskerCpu) {
-		let val = match self {
-			RoundingMode::Dynamic => (cpu.csrs.read_fcsr() & FCSR_ROUNDING_MODE_MASK >> 5) as u8,
-			rm => rm.to_sf_u8(),
-		};
+		let val = self.resolve(cpu).to_sf_u8();
 		unsafe {
 			softfloat_sys::softfloat_roundingMode_write_helper(val);
 		}
@@ -148,12 +157,18 @@ impl ExceptionFlags {
 		self.0 & Self::FLAG_INVALID != 0
 	}
 
+	/// accrues the flags into fflags, softfloat uses the same bits
 	pub fn update_cpu(self, cpu: &mut WhiskerCpu) {
-		todo!()
+		if self.0 != 0 {
+			let val = cpu.csrs.read_fcsr() | u64::from(self.0);
+			cpu.csrs.write_fcsr(val);
+		}
 	}
 
+	/// returns the flags raised since the last call
 	pub fn get_from_softfloat() -> Self {
 		let val = unsafe { softfloat_sys::softfloat_exceptionFlags_read_helper() };
+		unsafe { softfloat_sys::softfloat_exceptionFlags_write_helper(0) };
 		Self(val)
 	}
 }
@@ -4,7 +4,7 @@ use softfloat_sys::float64_t;
 
 use crate::cpu::WhiskerCpu;
 
-use super::{FClass, RoundingMode};
+use super::{ExceptionFlags, FClass, RoundingMode};
 
 #[derive(Debug, Clone, Copy)]
 #[repr(transparent)]
@@ -85,38 +85,41 @@ impl SoftDouble {
 	}
 
 	pub fn add(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_add(self.0, other.0) })
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_add(self.0, other.0) })
 	}
 
 	pub fn sub(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_sub(self.0, other.0) })
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_sub(self.0, other.0) })
 	}
 
 	pub fn mul(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_mul(self.0, other.0) })
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_mul(self.0, other.0) })
 	}
 
 	pub fn div(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_div(self.0, other.0) })
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_div(self.0, other.0) })
 	}
 
 	pub fn rem(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_rem(self.0, other.0) })
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_rem(self.0, other.0) })
 	}
 
 	pub fn mul_add(&self, mul: &Self, add: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_mulAdd(self.0, mul.0, add.0) })
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_mulAdd(self.0, mul.0, add.0) })
 	}
 
 	pub fn sqrt(&self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
+		Self::compute(rm, cpu, || unsafe { softfloat_sys::f64_sqrt(self.0) })
+	}
+
+	/// computes with softfloat, the exceptions raised are accrued into fflags so they don't leak into the next
+	/// operation
+	#[inline(always)]
+	fn compute(rm: RoundingMode, cpu: &mut WhiskerCpu, soft: impl FnOnce() -> float64_t) -> Self {
 		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f64_sqrt(self.0) })
+		let res = soft();
+		ExceptionFlags::get_from_softfloat().update_cpu(cpu);
+		Self(res)
 	}
 }
 
@@ -4,7 +4,7 @@ use softfloat_sys::float32_t;
 
 use crate::cpu::WhiskerCpu;
 
-use super::{ExceptionFlags, FClass, RoundingMode};
+use super::{host, ExceptionFlags, FClass, RoundingMode};
 
 #[derive(Debug, Clone, Copy)]
 #[repr(transparent)]
@@ -95,40 +95,84 @@ impl SoftFloat {
 	}
 
 	pub fn add(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		let res = unsafe { softfloat_sys::f32_add(self.0, other.0) };
-		ExceptionFlags::get_from_softfloat().update_cpu(cpu);
-		Self(res)
+		Self::compute(
+			rm,
+			cpu,
+			|| host::add(self.to_f32(), other.to_f32()),
+			|| unsafe { softfloat_sys::f32_add(self.0, other.0) },
+		)
 	}
 
 	pub fn sub(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f32_sub(self.0, other.0) })
+		Self::compute(
+			rm,
+			cpu,
+			|| host::sub(self.to_f32(), other.to_f32()),
+			|| unsafe { softfloat_sys::f32_sub(self.0, other.0) },
+		)
 	}
 
 	pub fn mul(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f32_mul(self.0, other.0) })
+		Self::compute(
+			rm,
+			cpu,
+			|| host::mul(self.to_f32(), other.to_f32()),
+			|| unsafe { softfloat_sys::f32_mul(self.0, other.0) },
+		)
 	}
 
 	pub fn div(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f32_div(self.0, other.0) })
+		Self::compute(
+			rm,
+			cpu,
+			|| host::div(self.to_f32(), other.to_f32()),
+			|| unsafe { softfloat_sys::f32_div(self.0, other.0) },
+		)
 	}
 
 	pub fn rem(&self, other: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f32_rem(self.0, other.0) })
+		Self::compute(rm, cpu, || None, || unsafe { softfloat_sys::f32_rem(self.0, other.0) })
 	}
 
 	pub fn mul_add(&self, mul: &Self, add: &Self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
-		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f32_mulAdd(self.0, mul.0, add.0) })
+		Self::compute(
+			rm,
+			cpu,
+			|| host::mul_add(self.to_f32(), mul.to_f32(), add.to_f32()),
+			|| unsafe { softfloat_sys::f32_mulAdd(self.0, mul.0, add.0) },
+		)
 	}
 
 	pub fn sqrt(&self, rm: RoundingMode, cpu: &mut WhiskerCpu) -> Self {
+		Self::compute(
+			rm,
+			cpu,
+			|| host::sqrt(self.to_f32()),
+			|| unsafe { softfloat_sys::f32_sqrt(self.0) },
+		)
+	}
+
+	/// takes the result from `host` if it can give one (see [host]) and the cpu isn't set to exact floats, otherwise
+	/// from `soft`. either way the exceptions raised are accrued into fflags
+	#[inline(always)]
+	fn compute(
+		rm: RoundingMode,
+		cpu: &mut WhiskerCpu,
+		host: impl FnOnce() -> host::HostResult,
+		soft: impl FnOnce() -> float32_t,
+	) -> Self {
+		if !cpu.exact_float && rm.resolve(cpu) == RoundingMode::RoundToNearestTieEven {
+			if let Some((res, inexact)) = host() {
+				if inexact {
+					ExceptionFlags(ExceptionFlags::FLAG_INEXACT).update_cpu(cpu);
+				}
+				return Self::from_f32(res);
+			}
+		}
 		unsafe { rm.write_thread_local(cpu) };
-		Self(unsafe { softfloat_sys::f32_sqrt(self.0) })
+		let res = soft();
+		ExceptionFlags::get_from_softfloat().update_cpu(cpu);
+		Self(res)
 	}
 }
 
@@ -0,0 +1,69 @@
+//! Single precision operations on the host fpu.
+//!
+//! These only give an answer when it's the exact result softfloat computes when rounding to nearest even, with
+//! inexact being the only exception it can raise: every operand is finite and the result is normal (and not the
+//! smallest normal), so nothing overflowed, underflowed, divided by zero or produced a NaN. Everything else returns
+//! None and is left to softfloat. Whether the result is inexact is worked out from error terms that are exact in
+//! double precision.
+
+/// the result and whether it's inexact
+pub type HostResult = Option<(f32, bool)>;
+
+#[inline(always)]
+fn checked<const N: usize>(operands: [f32; N], result: f32, inexact: impl FnOnce() -> bool) -> HostResult {
+	let usable = operands.iter().all(|val| val.is_finite()) && result.is_normal() && result.abs() != f32::MIN_POSITIVE;
+	usable.then(|| (result, inexact()))
+}
+
+/// the rounding error of `lhs + rhs` rounded to `sum`, valid as long as nothing overflowed
+#[inline(always)]
+fn two_sum_error(lhs: f64, rhs: f64, sum: f64) -> f64 {
+	let rhs_part = sum - lhs;
+	(lhs - (sum - rhs_part)) + (rhs - rhs_part)
+}
+
+#[inline]
+pub fn add(lhs: f32, rhs: f32) -> HostResult {
+	let sum = lhs + rhs;
+	// two single precision values always add up exactly in double precision, unless their exponents are far apart
+	checked([lhs, rhs], sum, || {
+		let (lhs, rhs) = (f64::from(lhs), f64::from(rhs));
+		two_sum_error(lhs, rhs, lhs + rhs) != 0.0 || lhs + rhs != f64::from(sum)
+	})
+}
+
+#[inline]
+pub fn sub(lhs: f32, rhs: f32) -> HostResult {
+	add(lhs, -rhs)
+}
+
+#[inline]
+pub fn mul(lhs: f32, rhs: f32) -> HostResult {
+	// 24 bit mantissas multiply into 48 bits, which double precision holds exactly
+	checked([lhs, rhs], lhs * rhs, || {
+		f64::from(lhs) * f64::from(rhs) != f64::from(lhs * rhs)
+	})
+}
+
+#[inline]
+pub fn div(lhs: f32, rhs: f32) -> HostResult {
+	let quot = lhs / rhs;
+	checked([lhs, rhs], quot, || f64::from(quot) * f64::from(rhs) != f64::from(lhs))
+}
+
+#[inline]
+pub fn sqrt(val: f32) -> HostResult {
+	let root = val.sqrt();
+	checked([val], root, || f64::from(root) * f64::from(root) != f64::from(val))
+}
+
+#[inline]
+pub fn mul_add(lhs: f32, rhs: f32, add: f32) -> HostResult {
+	let result = lhs.mul_add(rhs, add);
+	// exact if lhs * rhs == result - add, the product is exact and so is the difference unless it has an error term
+	checked([lhs, rhs, add], result, || {
+		let (result, add) = (f64::from(result), f64::from(add));
+		let diff = result - add;
+		two_sum_error(result, -add, diff) != 0.0 || f64::from(lhs) * f64::from(rhs) != diff
+	})
+}
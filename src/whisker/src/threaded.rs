@@ -0,0 +1,405 @@
+//! Threaded code for straight line runs of decoded instructions.
+//!
+//! Every [Opcode] has a handler in one dispatch table, which the interpreter goes through for single instructions as
+//! well. A block is built from the instruction cache once execution jumps to its first instruction. Running it is a
+//! single lookup followed by one indirect call per instruction, the pc and cycle count are only written back once
+//! the block is left. Blocks end at the first branch or jump, so control flow only ever leaves through their last
+//! instruction or through one that traps, jumps, or throws away decoded instructions. they also end right before an
+//! instruction that reads the hart's clock (see [reads_clock]), so it runs in the interpreter with the cycle count
+//! up to date.
+//!
+//! Opcodes without a dedicated handler are turned back into an [crate::insn::Instruction] for the interpreter, which
+//! keeps this exact without mirroring every instruction here.
+
+use std::collections::HashMap;
+
+use crate::cpu::WhiskerCpu;
+use crate::icache::Invalidations;
+use crate::insn::uop::{MicroOp, Opcode};
+use crate::mem::{Access, Memory, PageBase};
+
+/// the most instructions a single block retires
+pub const MAX_BLOCK_LEN: usize = 64;
+/// how often a block head is tried before settling for a block that stops at an instruction that isn't decoded yet.
+/// the first few runs through new code tend to decode more of it
+const INCOMPLETE_TRIES: u8 = 8;
+
+/// executes `op` which starts at `pc`. returns whether to go on with the next op, a handler that stops has to leave
+/// the pc where execution continues
+type Handler = fn(&mut WhiskerCpu, &MicroOp, u64) -> bool;
+
+static HANDLERS: [Handler; Opcode::COUNT] = {
+	let mut handlers: [Handler; Opcode::COUNT] = [interpret; Opcode::COUNT];
+	macro_rules! handlers {
+		($($opcode:ident => $handler:ident,)*) => {
+			$(handlers[Opcode::$opcode as usize] = $handler;)*
+		};
+	}
+	handlers! {
+		CNop => nop,
+		Mul => mul,
+		Mulw => mulw,
+		Lui => lui,
+		Auipc => auipc,
+		Sb => sb,
+		Sh => sh,
+		Sw => sw,
+		Sd => sd,
+		Lb => lb,
+		Lh => lh,
+		Lw => lw,
+		Ld => ld,
+		Lbu => lbu,
+		Lhu => lhu,
+		Lwu => lwu,
+		Add => add,
+		Sub => sub,
+		Xor => xor,
+		Or => or,
+		And => and,
+		Sll => sll,
+		Srl => srl,
+		Sra => sra,
+		Slt => slt,
+		Sltu => sltu,
+		Addi => addi,
+		Xori => xori,
+		Ori => ori,
+		Andi => andi,
+		Slli => slli,
+		Srli => srli,
+		Srai => srai,
+		Slti => slti,
+		Sltiu => sltiu,
+		Addiw => addiw,
+		Slliw => slliw,
+		Srliw => srliw,
+		Sraiw => sraiw,
+		Addw => addw,
+		Subw => subw,
+		Sllw => sllw,
+		Srlw => srlw,
+		Sraw => sraw,
+		Jal => jal,
+		Jalr => jalr,
+		Beq => beq,
+		Bne => bne,
+		Blt => blt,
+		Bge => bge,
+		Bltu => bltu,
+		Bgeu => bgeu,
+	}
+	handlers
+};
+
+/// executes `op` which starts at `pc`, the cpu's pc has to point past it already.
+/// returns false if execution doesn't simply go on with the next instruction
+#[inline(always)]
+pub fn dispatch(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+	HANDLERS[op.opcode as usize](cpu, op, pc)
+}
+
+struct Block {
+	ops: Box<[MicroOp]>,
+	/// where execution continues if the block runs to the end without leaving early
+	end: u64,
+	pages: Vec<PageBase>,
+}
+
+#[derive(Default)]
+pub struct BlockCache {
+	blocks: HashMap<u64, Block>,
+	/// block start pcs by every page they have instructions on
+	pages: HashMap<PageBase, Vec<u64>>,
+	/// how many times a block head was turned down for not being decoded far enough
+	tries: HashMap<u64, u8>,
+}
+
+impl std::fmt::Debug for BlockCache {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("BlockCache")
+			.field("blocks", &self.blocks.len())
+			.finish_non_exhaustive()
+	}
+}
+
+impl BlockCache {
+	/// drops every block built from instructions the cache has thrown away
+	pub fn invalidate(&mut self, invalidations: &Invalidations) {
+		if invalidations.all {
+			self.blocks.clear();
+			self.pages.clear();
+			self.tries.clear();
+			return;
+		}
+		for page in &invalidations.pages {
+			for pc in self.pages.remove(page).unwrap_or_default() {
+				if let Some(block) = self.blocks.remove(&pc) {
+					for page in &block.pages {
+						if let Some(blocks) = self.pages.get_mut(page) {
+							blocks.retain(|block| *block != pc);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	/// runs the block starting at the cpu's pc, building it first if needed.
+	/// returns how many instructions were retired, or None if the interpreter has to execute the instruction at pc
+	#[inline]
+	pub fn run(&mut self, cpu: &mut WhiskerCpu) -> Option<u64> {
+		let mut pc = cpu.pc;
+		let block = match self.blocks.get(&pc) {
+			Some(block) => block,
+			None => self.build(pc, &mut cpu.mem)?,
+		};
+
+		for (idx, op) in block.ops.iter().enumerate() {
+			if !dispatch(cpu, op, pc) {
+				return Some(idx as u64 + 1);
+			}
+			pc = pc.wrapping_add(op.len());
+		}
+		cpu.pc = block.end;
+		Some(block.ops.len() as u64)
+	}
+
+	#[cold]
+	fn build(&mut self, pc: u64, mem: &mut Memory) -> Option<&Block> {
+		let mut ops = Vec::new();
+		let mut pages = Vec::new();
+		let mut next = pc;
+		let mut complete = false;
+		while ops.len() < MAX_BLOCK_LEN {
+			// decoded instructions never cross a page
+			let Some((op, page)) = mem.decoded_on_page(next) else {
+				break;
+			};
+			if reads_clock(op.opcode) {
+				complete = true;
+				break;
+			}
+			pages.push(page);
+			next = next.wrapping_add(op.len());
+			ops.push(op);
+			if ends_block(op.opcode) {
+				complete = true;
+				break;
+			}
+		}
+		if ops.is_empty() {
+			return None;
+		}
+		if !complete && ops.len() < MAX_BLOCK_LEN {
+			let tries = self.tries.entry(pc).or_default();
+			*tries += 1;
+			if *tries < INCOMPLETE_TRIES {
+				return None;
+			}
+		}
+		self.tries.remove(&pc);
+
+		pages.dedup();
+		for page in &pages {
+			self.pages.entry(*page).or_default().push(pc);
+		}
+
+		Some(self.blocks.entry(pc).or_insert(Block {
+			ops: ops.into_boxed_slice(),
+			end: next,
+			pages,
+		}))
+	}
+}
+
+pub fn ends_block(opcode: Opcode) -> bool {
+	use Opcode::*;
+	matches!(opcode, Jal | Jalr | Beq | Bne | Blt | Bge | Bltu | Bgeu)
+}
+
+/// whether the instruction sees the hart's clock, through a CSR (time, mip) or by waiting in WFI. the clock is
+/// only exact between blocks, so these never go into one
+pub fn reads_clock(opcode: Opcode) -> bool {
+	use Opcode::*;
+	matches!(opcode, Csrrw | Csrrs | Csrrc | Csrrwi | Csrrsi | Csrrci | Wfi)
+}
+
+/// stops after `op`, execution continues with the instruction after it
+#[inline(always)]
+fn leave(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+	cpu.pc = pc.wrapping_add(op.len());
+	false
+}
+
+fn interpret(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+	let next = pc.wrapping_add(op.len());
+	cpu.pc = next;
+	cpu.execute_insn(op.instruction(), pc);
+	!(cpu.trap_pending() || cpu.mem.icache.has_invalidations() || cpu.pc != next)
+}
+
+fn nop(_: &mut WhiskerCpu, _: &MicroOp, _: u64) -> bool {
+	true
+}
+
+// everything below has to match what the interpreter does exactly
+
+fn lui(cpu: &mut WhiskerCpu, op: &MicroOp, _pc: u64) -> bool {
+	cpu.registers.set(op.rd(), op.imm as u64);
+	true
+}
+
+fn auipc(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+	cpu.registers.set(op.rd(), pc.wrapping_add_signed(op.imm));
+	true
+}
+
+/// `$name` computes dst from the lhs and rhs registers
+macro_rules! reg_op {
+	($($name:ident(|$lhs:ident, $rhs:ident| $result:expr);)*) => {$(
+		fn $name(cpu: &mut WhiskerCpu, op: &MicroOp, _pc: u64) -> bool {
+			let $lhs = cpu.registers.get(op.rs1());
+			let $rhs = cpu.registers.get(op.rs2());
+			cpu.registers.set(op.rd(), $result);
+			true
+		}
+	)*};
+}
+
+/// `$name` computes dst from the lhs register and the immediate
+macro_rules! imm_op {
+	($($name:ident(|$lhs:ident, $imm:ident| $result:expr);)*) => {$(
+		fn $name(cpu: &mut WhiskerCpu, op: &MicroOp, _pc: u64) -> bool {
+			let $lhs = cpu.registers.get(op.rs1());
+			let $imm = op.imm;
+			cpu.registers.set(op.rd(), $result);
+			true
+		}
+	)*};
+}
+
+reg_op! {
+	add(|lhs, rhs| lhs.wrapping_add(rhs));
+	sub(|lhs, rhs| lhs.wrapping_sub(rhs));
+	xor(|lhs, rhs| lhs ^ rhs);
+	or(|lhs, rhs| lhs | rhs);
+	and(|lhs, rhs| lhs & rhs);
+	sll(|lhs, rhs| lhs.wrapping_shl(rhs as u32));
+	srl(|lhs, rhs| lhs.wrapping_shr(rhs as u32));
+	sra(|lhs, rhs| (lhs as i64).wrapping_shr(rhs as u32) as u64);
+	slt(|lhs, rhs| ((lhs as i64) < rhs as i64) as u64);
+	sltu(|lhs, rhs| (lhs < rhs) as u64);
+	addw(|lhs, rhs| (lhs as u32).wrapping_add(rhs as u32) as u64);
+	subw(|lhs, rhs| (lhs as u32).wrapping_sub(rhs as u32) as u64);
+	sllw(|lhs, rhs| (lhs as u32).wrapping_shl(rhs as u32 & 0b11111) as i32 as i64 as u64);
+	srlw(|lhs, rhs| (lhs as u32).wrapping_shr(rhs as u32 & 0b11111) as i32 as i64 as u64);
+	sraw(|lhs, rhs| (lhs as i32).wrapping_shr(rhs as u32 & 0b11111) as i64 as u64);
+	mul(|lhs, rhs| lhs.wrapping_mul(rhs));
+	mulw(|lhs, rhs| (lhs as i32).wrapping_mul(rhs as i32) as i64 as u64);
+}
+
+imm_op! {
+	addi(|lhs, imm| lhs.wrapping_add_signed(imm));
+	xori(|lhs, imm| lhs ^ imm as u64);
+	ori(|lhs, imm| lhs | imm as u64);
+	andi(|lhs, imm| lhs & imm as u64);
+	slli(|lhs, imm| lhs.wrapping_shl(imm as u32));
+	srli(|lhs, imm| lhs.wrapping_shr(imm as u32));
+	srai(|lhs, imm| (lhs as i64).wrapping_shr(imm as u32) as u64);
+	slti(|lhs, imm| ((lhs as i64) < imm) as u64);
+	sltiu(|lhs, imm| (lhs < imm as u64) as u64);
+	addiw(|lhs, imm| (lhs as u32).wrapping_add_signed(imm as i32) as i32 as i64 as u64);
+	slliw(|lhs, imm| (lhs as u32).wrapping_shl(imm as u32) as u64);
+	srliw(|lhs, imm| (lhs as u32).wrapping_shr(imm as u32) as u64);
+	sraiw(|lhs, imm| (lhs as i32).wrapping_shr(imm as u32) as u64);
+}
+
+/// `$name` loads from lhs + imm into dst, `$merge` combines the loaded value with what dst held before
+macro_rules! load_op {
+	($($name:ident($read:ident, |$old:ident, $val:ident| $merge:expr);)*) => {$(
+		fn $name(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+			let addr = cpu.registers.get(op.rs1()).wrapping_add_signed(op.imm);
+			match cpu.mem.$read(addr) {
+				Ok($val) => {
+					let $old = cpu.registers.get(op.rd());
+					cpu.registers.set(op.rd(), $merge);
+					true
+				}
+				Err(fault) => {
+					cpu.request_trap(fault.cause(Access::Load), fault.addr);
+					leave(cpu, op, pc)
+				}
+			}
+		}
+	)*};
+}
+
+load_op! {
+	lb(read_u8, |old, val| (old & 0xFFFFFFFF_FFFFFF00) | u64::from(val));
+	lh(read_u16, |old, val| (old & 0xFFFFFFFF_FFFF0000) | u64::from(val));
+	lw(read_u32, |old, val| (old & 0xFFFFFFFF_00000000) | u64::from(val));
+	ld(read_u64, |_old, val| val);
+	lbu(read_u8, |_old, val| u64::from(val));
+	lhu(read_u16, |_old, val| u64::from(val));
+	lwu(read_u32, |_old, val| u64::from(val));
+}
+
+/// `$name` stores the low bits of rhs to lhs + imm. the block is left if that threw away decoded instructions
+macro_rules! store_op {
+	($($name:ident($write:ident, $ty:ty);)*) => {$(
+		fn $name(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+			let addr = cpu.registers.get(op.rs1()).wrapping_add_signed(op.imm);
+			let val = cpu.registers.get(op.rs2()) as $ty;
+			match cpu.mem.$write(addr, val) {
+				Ok(()) if !cpu.mem.icache.has_invalidations() => true,
+				Ok(()) => leave(cpu, op, pc),
+				Err(fault) => {
+					cpu.request_trap(fault.cause(Access::Store), fault.addr);
+					leave(cpu, op, pc)
+				}
+			}
+		}
+	)*};
+}
+
+store_op! {
+	sb(write_u8, u8);
+	sh(write_u16, u16);
+	sw(write_u32, u32);
+	sd(write_u64, u64);
+}
+
+fn jal(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+	cpu.registers.set(op.rd(), pc + 4);
+	cpu.pc = pc.wrapping_add_signed(op.imm);
+	false
+}
+
+fn jalr(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+	// the link register is written before the target is read, like the interpreter does
+	cpu.registers.set(op.rd(), pc + 4);
+	cpu.pc = cpu.registers.get(op.rs1()).wrapping_add_signed(op.imm) & !1;
+	false
+}
+
+/// `$name` goes to pc + imm if `$cond` holds for the lhs and rhs registers, or falls through
+macro_rules! branch_op {
+	($($name:ident(|$lhs:ident, $rhs:ident| $cond:expr);)*) => {$(
+		fn $name(cpu: &mut WhiskerCpu, op: &MicroOp, pc: u64) -> bool {
+			let $lhs = cpu.registers.get(op.rs1());
+			let $rhs = cpu.registers.get(op.rs2());
+			cpu.pc = if $cond { pc.wrapping_add_signed(op.imm) } else { pc.wrapping_add(op.len()) };
+			false
+		}
+	)*};
+}
+
+branch_op! {
+	beq(|lhs, rhs| lhs == rhs);
+	bne(|lhs, rhs| lhs != rhs);
+	blt(|lhs, rhs| (lhs as i64) < rhs as i64);
+	bge(|lhs, rhs| lhs as i64 >= rhs as i64);
+	bltu(|lhs, rhs| lhs < rhs);
+	bgeu(|lhs, rhs| lhs >= rhs);
+}
@@ -0,0 +1,533 @@
+//! Binary execution traces.
+//!
+//! A trace is a header followed by a stream of records, each starting with a tag byte. All values are little endian.
+//! The pc and registers are tracked by the decoder so records only carry what changed, which also means a trace can
+//! only be read front to back. `whisker decode-trace` renders a trace in the old logfile text format.
+//!
+//! A [TraceWindow] limits recording to part of a run, cycles outside of it are skipped over by the decoder.
+
+use std::fmt::Write as _;
+use std::fs::File;
+use std::io::{self, BufReader, BufWriter, Read, Write};
+use std::mem;
+use std::num::NonZeroU64;
+use std::path::Path;
+use std::sync::mpsc::{self, Receiver, SyncSender};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use clap::Args;
+
+use crate::cpu::WhiskerCpu;
+use crate::insn::Instruction;
+use crate::mem::{MemoryBuilder, PageBase, PAGE_SIZE};
+use crate::ty::{GPRegisterIndex, SupportedExtensions};
+
+const MAGIC: [u8; 8] = *b"whiskert";
+const VERSION: u16 = 1;
+
+// cycle: u64, pc: u64, gprs: [u64; 32], fprs: [u64; 32]
+const TAG_SYNC: u8 = 0;
+// starts the next cycle
+const TAG_CYCLE: u8 = 1;
+// pc: u64, the pc was changed outside of the cpu (e.g. by GDB)
+const TAG_PC: u8 = 2;
+const TAG_TRAPPING: u8 = 3;
+const TAG_BREAKPOINT: u8 = 4;
+// raw: u32, only the low 16 bits are used for compressed instructions
+const TAG_FETCHED: u8 = 5;
+// cause: u64, mtval: u64
+const TAG_REQUEST_TRAP: u8 = 6;
+// pc: u64, count: u8, then count * (register: u8, value: u64). registers 0..32 are GPRs, 32..64 are FPRs
+const TAG_STATE: u8 = 7;
+// cycles: u64, cycles that ran without being recorded
+const TAG_SKIP: u8 = 8;
+
+const BUFFER_SIZE: usize = 1 << 20;
+// the largest record is a sync
+const MAX_RECORD_SIZE: usize = 1 + 8 * 66;
+// buffers that can be waiting on the writer thread before the cpu has to wait for it
+const BUFFERS_IN_FLIGHT: usize = 4;
+// a partial buffer is handed off once it's this old so that killing a run only loses the last moment of its trace.
+// the clock is only looked at every HAND_OFF_CHECK_CYCLES cycles, recorded or not
+const HAND_OFF_INTERVAL: Duration = Duration::from_millis(100);
+const HAND_OFF_CHECK_CYCLES: u32 = 1 << 12;
+
+/// Limits which cycles end up in a trace.
+/// without any start condition recording starts right away, otherwise it starts once the first one is met
+#[derive(Debug, Clone, Args)]
+pub struct TraceWindow {
+	/// Start recording at this cycle
+	#[arg(long = "trace-start-cycle", requires = "logfile")]
+	pub start_cycle: Option<u64>,
+	/// Start recording once this pc is about to execute
+	#[arg(long = "trace-start-pc", requires = "logfile", value_parser = parse_u64)]
+	pub start_pc: Option<u64>,
+	/// Start recording with the cycle that takes the first trap
+	#[arg(long = "trace-start-on-trap", requires = "logfile")]
+	pub start_on_trap: bool,
+	/// Stop recording after this cycle
+	#[arg(long = "trace-stop-cycle", requires = "logfile")]
+	pub stop_cycle: Option<u64>,
+	/// Stop recording after the instruction at this pc executed
+	#[arg(long = "trace-stop-pc", requires = "logfile", value_parser = parse_u64)]
+	pub stop_pc: Option<u64>,
+	/// Only record one in every N cycles
+	#[arg(long = "trace-sample", requires = "logfile", default_value = "1")]
+	pub sample: NonZeroU64,
+}
+
+impl Default for TraceWindow {
+	fn default() -> Self {
+		Self {
+			start_cycle: None,
+			start_pc: None,
+			start_on_trap: false,
+			stop_cycle: None,
+			stop_pc: None,
+			sample: NonZeroU64::MIN,
+		}
+	}
+}
+
+/// accepts decimal or 0x prefixed hex
+fn parse_u64(s: &str) -> Result<u64, std::num::ParseIntError> {
+	match s.strip_prefix("0x").or_else(|| s.strip_prefix("0X")) {
+		Some(hex) => u64::from_str_radix(hex, 16),
+		None => s.parse(),
+	}
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum WindowState {
+	Waiting,
+	Recording,
+	// the instruction at the stop pc is being recorded, the window closes after it
+	Stopping,
+}
+
+/// What to do with the cycle that is about to run
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum TraceCycle {
+	Record,
+	Skip,
+	/// the window closed, nothing more will be recorded
+	Finished,
+}
+
+/// Records an execution trace of a cpu.
+///
+/// Records are gathered in a large buffer which is handed off to a writer thread once it fills up or gets old, the
+/// last partial buffer is written when the tracer is dropped.
+pub struct Tracer {
+	buf: Vec<u8>,
+	full: Option<SyncSender<Vec<u8>>>,
+	empty: Receiver<Vec<u8>>,
+	writer: Option<JoinHandle<io::Result<()>>>,
+	last_hand_off: Instant,
+	cycles_until_check: u32,
+
+	window: TraceWindow,
+	window_state: WindowState,
+	// cycles to skip before the next sample
+	sample_countdown: u64,
+
+	// what the decoder knows the state to be as of the last record
+	cycle: u64,
+	pc: u64,
+	gprs: [u64; 32],
+	fprs: [u64; 32],
+}
+
+impl std::fmt::Debug for Tracer {
+	fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+		f.debug_struct("Tracer").finish_non_exhaustive()
+	}
+}
+
+impl Tracer {
+	pub fn create(path: &Path, supported_extensions: SupportedExtensions, window: TraceWindow) -> io::Result<Self> {
+		let mut file = File::create(path)?;
+		file.write_all(&MAGIC)?;
+		file.write_all(&VERSION.to_le_bytes())?;
+		file.write_all(&supported_extensions.bits().to_le_bytes())?;
+
+		let (full_tx, full_rx) = mpsc::sync_channel::<Vec<u8>>(BUFFERS_IN_FLIGHT);
+		let (empty_tx, empty_rx) = mpsc::channel();
+		let writer = thread::Builder::new().name("trace writer".to_owned()).spawn(move || {
+			for mut buf in full_rx {
+				file.write_all(&buf)?;
+				buf.clear();
+				// the tracer may already be gone
+				let _ = empty_tx.send(buf);
+			}
+			file.flush()
+		})?;
+
+		let window_state = if window.start_cycle.is_none() && window.start_pc.is_none() && !window.start_on_trap {
+			WindowState::Recording
+		} else {
+			WindowState::Waiting
+		};
+
+		Ok(Self {
+			buf: Vec::with_capacity(BUFFER_SIZE),
+			full: Some(full_tx),
+			empty: empty_rx,
+			writer: Some(writer),
+			last_hand_off: Instant::now(),
+			cycles_until_check: HAND_OFF_CHECK_CYCLES,
+			window,
+			window_state,
+			sample_countdown: 0,
+			cycle: 0,
+			pc: 0,
+			gprs: [0; 32],
+			fprs: [0; 32],
+		})
+	}
+
+	/// decides if `cycle`, which starts at `pc`, is recorded
+	#[inline]
+	pub fn begin_cycle(&mut self, cycle: u64, pc: u64) -> TraceCycle {
+		self.cycles_until_check -= 1;
+		if self.cycles_until_check == 0 {
+			self.cycles_until_check = HAND_OFF_CHECK_CYCLES;
+			if !self.buf.is_empty() && self.last_hand_off.elapsed() >= HAND_OFF_INTERVAL {
+				self.hand_off();
+			}
+		}
+
+		match self.window_state {
+			WindowState::Waiting => {
+				if !(self.window.start_cycle.is_some_and(|start| cycle >= start) || self.window.start_pc == Some(pc)) {
+					return TraceCycle::Skip;
+				}
+				self.window_state = WindowState::Recording;
+			}
+			WindowState::Recording => {}
+			WindowState::Stopping => return TraceCycle::Finished,
+		}
+
+		if self.window.stop_cycle.is_some_and(|stop| cycle > stop) {
+			return TraceCycle::Finished;
+		}
+		if self.window.stop_pc == Some(pc) {
+			self.window_state = WindowState::Stopping;
+		}
+
+		if self.sample_countdown == 0 {
+			self.sample_countdown = self.window.sample.get() - 1;
+			TraceCycle::Record
+		} else {
+			self.sample_countdown -= 1;
+			TraceCycle::Skip
+		}
+	}
+
+	/// writes the full state, the decoder starts from here
+	pub fn sync(&mut self, cycle: u64, pc: u64, gprs: &[u64; 32], fprs: &[u64; 32]) {
+		self.reserve();
+		self.buf.push(TAG_SYNC);
+		self.put_u64(cycle);
+		self.put_u64(pc);
+		for &val in gprs.iter().chain(fprs) {
+			self.put_u64(val);
+		}
+		self.cycle = cycle;
+		self.pc = pc;
+		self.gprs = *gprs;
+		self.fprs = *fprs;
+	}
+
+	#[inline]
+	pub fn cycle(&mut self, cycle: u64, pc: u64) {
+		self.reserve();
+		if cycle != self.cycle + 1 {
+			self.buf.push(TAG_SKIP);
+			self.put_u64(cycle - self.cycle - 1);
+		}
+		self.cycle = cycle;
+		if pc != self.pc {
+			self.buf.push(TAG_PC);
+			self.put_u64(pc);
+			self.pc = pc;
+		}
+		self.buf.push(TAG_CYCLE);
+	}
+
+	pub fn trapping(&mut self) {
+		self.buf.push(TAG_TRAPPING);
+	}
+
+	pub fn breakpoint(&mut self) {
+		self.buf.push(TAG_BREAKPOINT);
+	}
+
+	#[inline]
+	pub fn fetched(&mut self, raw: u32) {
+		self.buf.push(TAG_FETCHED);
+		self.buf.extend_from_slice(&raw.to_le_bytes());
+	}
+
+	/// only records the trap when `recording`, the cycle that takes the first trap can also open the window
+	pub fn request_trap(&mut self, recording: bool, cause: u64, mtval: u64) {
+		if self.window_state == WindowState::Waiting && self.window.start_on_trap {
+			self.window_state = WindowState::Recording;
+		}
+		if !recording {
+			return;
+		}
+		self.reserve();
+		self.buf.push(TAG_REQUEST_TRAP);
+		self.put_u64(cause);
+		self.put_u64(mtval);
+	}
+
+	/// records the state after an instruction executed, only registers that changed since the last state are written
+	#[inline]
+	pub fn state(&mut self, pc: u64, gprs: &[u64; 32], fprs: &[u64; 32]) {
+		self.buf.push(TAG_STATE);
+		self.put_u64(pc);
+		self.pc = pc;
+
+		let count_idx = self.buf.len();
+		self.buf.push(0);
+		let mut count = 0;
+		for idx in 0..32 {
+			if gprs[idx] != self.gprs[idx] {
+				self.buf.push(idx as u8);
+				self.put_u64(gprs[idx]);
+				self.gprs[idx] = gprs[idx];
+				count += 1;
+			}
+			if fprs[idx] != self.fprs[idx] {
+				self.buf.push(32 + idx as u8);
+				self.put_u64(fprs[idx]);
+				self.fprs[idx] = fprs[idx];
+				count += 1;
+			}
+		}
+		self.buf[count_idx] = count;
+	}
+
+	#[inline(always)]
+	fn put_u64(&mut self, val: u64) {
+		self.buf.extend_from_slice(&val.to_le_bytes());
+	}
+
+	/// makes sure there's space for everything a single cycle can record, a cycle is at most a pc change, a cycle
+	/// record, a fetch, a trap request and a state with every register
+	#[inline]
+	fn reserve(&mut self) {
+		if self.buf.len() + 2 * MAX_RECORD_SIZE > BUFFER_SIZE {
+			self.hand_off();
+		}
+	}
+
+	fn hand_off(&mut self) {
+		let next = self
+			.empty
+			.try_recv()
+			.unwrap_or_else(|_| Vec::with_capacity(BUFFER_SIZE));
+		let full = mem::replace(&mut self.buf, next);
+		self.last_hand_off = Instant::now();
+		// UNWRAP: the sender is only taken on drop
+		if self.full.as_ref().unwrap().send(full).is_err() {
+			// the writer thread stopped, the error is reported when it's joined
+			self.buf.clear();
+		}
+	}
+}
+
+impl Drop for Tracer {
+	fn drop(&mut self) {
+		if !self.buf.is_empty() {
+			self.hand_off();
+		}
+		drop(self.full.take());
+		// UNWRAP: the writer is only taken here
+		match self.writer.take().unwrap().join() {
+			Ok(Ok(())) => {}
+			Ok(Err(e)) => tracing::error!("failed to write trace: {e:?}"),
+			Err(_) => tracing::error!("trace writer panicked"),
+		}
+	}
+}
+
+/// Renders the trace at `path` as text into `out`
+pub fn decode(path: &Path, out: &mut dyn Write) -> io::Result<()> {
+	let mut reader = BufReader::new(File::open(path)?);
+
+	let mut magic = [0_u8; 8];
+	reader.read_exact(&mut magic)?;
+	if magic != MAGIC {
+		return Err(io::Error::new(io::ErrorKind::InvalidData, "not a whisker trace"));
+	}
+	let version = u16::from_le_bytes(read_array(&mut reader)?);
+	if version != VERSION {
+		return Err(io::Error::new(
+			io::ErrorKind::InvalidData,
+			format!("unsupported trace version {version}"),
+		));
+	}
+	let supported = SupportedExtensions::from_bits(read_u64(&mut reader)?);
+
+	let mut decoder = Decoder::new(supported);
+	let mut out = BufWriter::new(out);
+	let mut text = String::new();
+	loop {
+		let mut tag = [0_u8];
+		match reader.read_exact(&mut tag) {
+			Ok(()) => {}
+			Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => break,
+			Err(e) => return Err(e),
+		}
+
+		let result = decoder.record(tag[0], &mut reader, &mut text);
+		out.write_all(text.as_bytes())?;
+		text.clear();
+		if let Err(e) = result {
+			// keep everything up to the broken record, a trace can end in the middle of one if whisker was killed
+			// while it was being written
+			out.flush()?;
+			return Err(e);
+		}
+	}
+	out.flush()
+}
+
+struct Decoder {
+	cycle: u64,
+	pc: u64,
+	gprs: [u64; 32],
+	fprs: [u64; 32],
+	// raw instructions are decoded by a cpu that has nothing but a single page of memory to put them in
+	scratch: WhiskerCpu,
+}
+
+impl Decoder {
+	fn new(supported: SupportedExtensions) -> Self {
+		let mem = MemoryBuilder::default()
+			.physical_size(PAGE_SIZE)
+			.phys_mapping(PageBase::from_addr(0), PageBase::from_addr(0), PAGE_SIZE)
+			.build();
+		Self {
+			cycle: 0,
+			pc: 0,
+			gprs: [0; 32],
+			fprs: [0; 32],
+			scratch: WhiskerCpu::new(0, supported, mem, None),
+		}
+	}
+
+	// UNWRAPS: writing to string cannot fail
+	fn record(&mut self, tag: u8, reader: &mut impl Read, out: &mut String) -> io::Result<()> {
+		match tag {
+			TAG_SYNC => {
+				self.cycle = read_u64(reader)?;
+				self.pc = read_u64(reader)?;
+				for val in self.gprs.iter_mut().chain(&mut self.fprs) {
+					*val = read_u64(reader)?;
+				}
+			}
+			TAG_CYCLE => {
+				self.cycle += 1;
+				writeln!(out, "cycle {}", self.cycle).unwrap();
+			}
+			TAG_PC => self.pc = read_u64(reader)?,
+			TAG_SKIP => self.cycle += read_u64(reader)?,
+			TAG_TRAPPING => writeln!(out, "  trapping").unwrap(),
+			TAG_BREAKPOINT => {
+				writeln!(out, "  reached breakpoint at {:#018X}", self.pc).unwrap();
+				// the cycle is started again once the breakpoint is out of the way
+				self.cycle -= 1;
+			}
+			TAG_FETCHED => {
+				let raw = u32::from_le_bytes(read_array(reader)?);
+				let size = if raw & 0b11 == 0b11 { 4 } else { 2 };
+				self.scratch
+					.mem
+					.write_slice(0, &raw.to_le_bytes()[..size])
+					.expect("scratch memory is mapped");
+				self.scratch.pc = 0;
+				match Instruction::fetch_instruction(&mut self.scratch) {
+					Ok(op) => writeln!(out, "  {:#018X}: fetched {:?}", self.pc, op.instruction()).unwrap(),
+					Err(()) => writeln!(out, "  {:#018X}: fetched undecodable {:#010X}", self.pc, raw).unwrap(),
+				}
+			}
+			TAG_REQUEST_TRAP => {
+				let cause = read_u64(reader)?;
+				let mtval = read_u64(reader)?;
+				writeln!(
+					out,
+					"  requesting trap kind cause={:#018X} mtval={:#018X}",
+					cause, mtval
+				)
+				.unwrap();
+			}
+			TAG_STATE => {
+				self.pc = read_u64(reader)?;
+				let [count] = read_array(reader)?;
+				for _ in 0..count {
+					let [idx] = read_array(reader)?;
+					let val = read_u64(reader)?;
+					match idx {
+						0..32 => self.gprs[idx as usize] = val,
+						32..64 => self.fprs[idx as usize - 32] = val,
+						_ => {
+							return Err(io::Error::new(
+								io::ErrorKind::InvalidData,
+								format!("invalid register {idx} in cycle {}", self.cycle),
+							))
+						}
+					}
+				}
+				writeln!(out, "state after cycle {}", self.cycle).unwrap();
+				self.dump(out);
+			}
+			_ => {
+				return Err(io::Error::new(
+					io::ErrorKind::InvalidData,
+					format!("invalid record {tag:#04X} after cycle {}", self.cycle),
+				))
+			}
+		}
+		Ok(())
+	}
+
+	// UNWRAPS: writing to string cannot fail
+	fn dump(&self, out: &mut String) {
+		writeln!(out, "    pc: {:#018X}\n", self.pc).unwrap();
+		for idx in 0..32 {
+			let val = self.gprs[idx as usize];
+			// we do this for pretty display purposes
+			let idx = GPRegisterIndex::new(idx).unwrap();
+			writeln!(out, "  {:>4}: {val:#018X} ({val:})", idx.display(),).unwrap();
+		}
+
+		writeln!(out).unwrap();
+		for (idx, &val) in self.fprs.iter().enumerate() {
+			writeln!(
+				out,
+				"  {:>4}: {:#018X} (f64: {}, f32: {})",
+				format!("fp{idx}"),
+				val,
+				f64::from_bits(val),
+				f32::from_bits(val as u32)
+			)
+			.unwrap();
+		}
+		out.push_str("\n\n");
+	}
+}
+
+fn read_array<const N: usize>(reader: &mut impl Read) -> io::Result<[u8; N]> {
+	let mut buf = [0_u8; N];
+	reader.read_exact(&mut buf)?;
+	Ok(buf)
+}
+
+fn read_u64(reader: &mut impl Read) -> io::Result<u64> {
+	read_array(reader).map(u64::from_le_bytes)
+}
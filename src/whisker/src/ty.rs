@@ -22,6 +22,12 @@ impl<T> RegisterIndex<T> {
 		}
 	}
 
+	/// the index in the low five bits of `bits`, the rest are ignored
+	#[inline(always)]
+	pub const fn from_bits(bits: u8) -> Self {
+		Self(bits & 0b11111, PhantomData)
+	}
+
 	pub fn as_usize(&self) -> usize {
 		// TODO: tell this to the optimizer better?
 		debug_assert!(self.0 <= 31);
@@ -61,6 +67,8 @@ impl GPRegisterIndex {
 	pub const SP: GPRegisterIndex = RegisterIndex(2, PhantomData);
 	pub const GLOBAL_PTR: GPRegisterIndex = RegisterIndex(3, PhantomData);
 	pub const THREAD_PTR: GPRegisterIndex = RegisterIndex(4, PhantomData);
+	/// s0
+	pub const FRAME_PTR: GPRegisterIndex = RegisterIndex(8, PhantomData);
 
 	pub fn display(&self) -> &'static str {
 		match self.0 {
@@ -189,10 +197,24 @@ impl SupportedExtensions {
 	pub const Y_RESERVED: Self = Self(1 << 24);
 	pub const Z_RESERVED: Self = Self(1 << 25);
 
+	/// what guests run with unless told otherwise
+	pub const RV64IMAFC: Self =
+		Self(Self::INTEGER.0 | Self::MULTIPLY.0 | Self::ATOMIC.0 | Self::FLOAT.0 | Self::COMPRESSED.0);
+	/// as the extensions a decoder is instantiated for: look at the cpu's supported extensions at runtime instead
+	pub const DYNAMIC: u64 = u64::MAX;
+
 	pub const fn empty() -> Self {
 		SupportedExtensions(0)
 	}
 
+	pub const fn bits(self) -> u64 {
+		self.0
+	}
+
+	pub const fn from_bits(bits: u64) -> Self {
+		SupportedExtensions(bits)
+	}
+
 	pub const fn has(self, other: Self) -> bool {
 		(self.0 & other.0) == other.0
 	}
@@ -285,8 +307,9 @@ impl TrapIdx {
 	pub const ILLEGAL_INSTRUCTION: Self = Self(2);
 	pub const BREAKPOINT: Self = Self(3);
 	pub const LOAD_ADDR_MISALIGNED: Self = Self(4);
-	pub const STORE_ADDR_MISALIGNED: Self = Self(5);
-	pub const STORE_ACCESS_FAULT: Self = Self(6);
+	pub const LOAD_ACCESS_FAULT: Self = Self(5);
+	pub const STORE_ADDR_MISALIGNED: Self = Self(6);
+	pub const STORE_ACCESS_FAULT: Self = Self(7);
 	pub const ECALL_UMODE: Self = Self(7);
 	pub const ECALL_SMODE: Self = Self(8);
 	pub const ECALL_MMODE: Self = Self(10);
@@ -296,6 +319,9 @@ impl TrapIdx {
 	pub const SOFTWARE_CHECK: Self = Self(18);
 	pub const HARDWARE_CHECK: Self = Self(19);
 	pub const MEOW_ERR: Self = Self(31);
+
+	pub const MACHINE_SOFTWARE_INTERRUPT: Self = Self(Self::INTERRUPT_MASK | 3);
+	pub const MACHINE_TIMER_INTERRUPT: Self = Self(Self::INTERRUPT_MASK | 7);
 }
 
 /// these exist to allow the generic RegisterIndex to derive things without needing the underlying register
@@ -0,0 +1,202 @@
+//! A 16550 style UART for the guest's console.
+//!
+//! Output is buffered and written out at every newline, once the buffer fills up, and otherwise at least every
+//! [FLUSH_INTERVAL] so output without a trailing newline still shows up. There is no input yet, so the receive buffer
+//! is always empty, and no interrupts are raised. The divisor latch and the other control registers only hold what
+//! was written to them.
+
+use std::io::{self, Write};
+use std::sync::{Arc, Mutex, Weak};
+use std::thread;
+use std::time::Duration;
+
+use tracing::*;
+
+use crate::mem::Device;
+
+/// how much output is held back at most
+const BUFFER_SIZE: usize = 4096;
+/// how long output without a newline is held back at most
+const FLUSH_INTERVAL: Duration = Duration::from_millis(20);
+
+mod regs {
+	/// receive buffer (read) and transmit holding register (write), divisor latch low with DLAB set
+	pub const DATA: u64 = 0;
+	/// interrupt enable, divisor latch high with DLAB set
+	pub const IER: u64 = 1;
+	/// interrupt identification (read) and fifo control (write)
+	pub const IIR_FCR: u64 = 2;
+	pub const LCR: u64 = 3;
+	pub const MCR: u64 = 4;
+	pub const LSR: u64 = 5;
+	pub const MSR: u64 = 6;
+	pub const SCR: u64 = 7;
+
+	pub const LCR_DLAB: u8 = 1 << 7;
+	pub const FCR_ENABLE: u8 = 1 << 0;
+	/// nothing pending, with the fifo enabled bits on top when it is
+	pub const IIR_NONE: u8 = 0x01;
+	pub const IIR_FIFO_ENABLED: u8 = 0xC0;
+	/// the transmitter is always empty, output goes straight to the buffer
+	pub const LSR_IDLE: u8 = 0x60;
+	/// clear to send, data set ready and carrier detect
+	pub const MSR_CONNECTED: u8 = 0xB0;
+}
+
+#[derive(Default)]
+struct Registers {
+	ier: u8,
+	fcr: u8,
+	lcr: u8,
+	mcr: u8,
+	scr: u8,
+	divisor: [u8; 2],
+}
+
+struct Output {
+	buf: Vec<u8>,
+	sink: Box<dyn Write + Send>,
+}
+
+impl Output {
+	fn flush(&mut self) {
+		if self.buf.is_empty() {
+			return;
+		}
+		if let Err(e) = self.sink.write_all(&self.buf).and_then(|()| self.sink.flush()) {
+			warn!("could not write UART output, dropping {} bytes: {e:?}", self.buf.len());
+		}
+		self.buf.clear();
+	}
+}
+
+pub struct Uart {
+	regs: Mutex<Registers>,
+	out: Arc<Mutex<Output>>,
+}
+
+impl Uart {
+	/// everything the guest writes ends up in `sink`
+	pub fn new(sink: Box<dyn Write + Send>) -> Self {
+		let out = Arc::new(Mutex::new(Output {
+			buf: Vec::with_capacity(BUFFER_SIZE),
+			sink,
+		}));
+		let weak = Arc::downgrade(&out);
+		thread::Builder::new()
+			.name("uart-flush".into())
+			.spawn(move || flush_periodically(weak))
+			.unwrap_or_else(|e| panic!("could not spawn the UART flush thread: {e:?}"));
+		Self {
+			regs: Mutex::default(),
+			out,
+		}
+	}
+
+	/// writes out whatever is still held back, for when the process exits without dropping the UART
+	pub fn flush(&self) {
+		// UNWRAP: nothing panics while holding the lock
+		self.out.lock().unwrap().flush();
+	}
+
+	fn transmit(&self, val: u8) {
+		// UNWRAP: nothing panics while holding the lock
+		let mut out = self.out.lock().unwrap();
+		out.buf.push(val);
+		if val == b'\n' || out.buf.len() >= BUFFER_SIZE {
+			out.flush();
+		}
+	}
+}
+
+/// runs until the UART is dropped
+fn flush_periodically(out: Weak<Mutex<Output>>) {
+	loop {
+		thread::sleep(FLUSH_INTERVAL);
+		let Some(out) = out.upgrade() else {
+			return;
+		};
+		// UNWRAP: nothing panics while holding the lock
+		out.lock().unwrap().flush();
+	}
+}
+
+impl Drop for Uart {
+	fn drop(&mut self) {
+		// UNWRAP: nothing panics while holding the lock
+		self.out.lock().unwrap().flush();
+	}
+}
+
+impl Device for Uart {
+	fn read(&self, offset: u64, _width: u8) -> u64 {
+		use regs::*;
+		// UNWRAP: nothing panics while holding the lock
+		let regs = self.regs.lock().unwrap();
+		let dlab = regs.lcr & LCR_DLAB != 0;
+		let val = match offset {
+			DATA if dlab => regs.divisor[0],
+			IER if dlab => regs.divisor[1],
+			DATA => 0,
+			IER => regs.ier,
+			IIR_FCR if regs.fcr & FCR_ENABLE != 0 => IIR_NONE | IIR_FIFO_ENABLED,
+			IIR_FCR => IIR_NONE,
+			LCR => regs.lcr,
+			MCR => regs.mcr,
+			LSR => LSR_IDLE,
+			MSR => MSR_CONNECTED,
+			SCR => regs.scr,
+			_ => 0,
+		};
+		u64::from(val)
+	}
+
+	fn write(&self, offset: u64, _width: u8, val: u64) {
+		use regs::*;
+		let val = val as u8;
+		// UNWRAP: nothing panics while holding the lock
+		let mut regs = self.regs.lock().unwrap();
+		let dlab = regs.lcr & LCR_DLAB != 0;
+		match offset {
+			DATA if dlab => regs.divisor[0] = val,
+			IER if dlab => regs.divisor[1] = val,
+			DATA => {
+				drop(regs);
+				self.transmit(val);
+			}
+			IER => regs.ier = val & 0x0F,
+			IIR_FCR => regs.fcr = val,
+			LCR => regs.lcr = val,
+			MCR => regs.mcr = val & 0x1F,
+			SCR => regs.scr = val,
+			_ => {}
+		}
+	}
+}
+
+/// where a UART's output goes
+#[derive(Debug, Clone)]
+pub enum Console {
+	Stdout,
+	File(std::path::PathBuf),
+	/// a TCP connection made to this address
+	Tcp(String),
+}
+
+impl Console {
+	/// parses `tcp:<address>`, or anything else as the path of a file
+	pub fn parse(arg: &str) -> Result<Self, String> {
+		Ok(match arg.strip_prefix("tcp:") {
+			Some(addr) => Self::Tcp(addr.to_string()),
+			None => Self::File(arg.into()),
+		})
+	}
+
+	pub fn open(&self) -> io::Result<Box<dyn Write + Send>> {
+		Ok(match self {
+			Self::Stdout => Box::new(io::stdout()),
+			Self::File(path) => Box::new(std::fs::File::create(path)?),
+			Self::Tcp(addr) => Box::new(std::net::TcpStream::connect(addr)?),
+		})
+	}
+}
@@ -0,0 +1,604 @@
+//! A virtio block device on the virtio-mmio transport (version 2, virtio 1.x), backed by an image file.
+//!
+//! The image is mapped shared into the host's address space and requests copy straight between the mapping and
+//! guest RAM (see [Dma]), so the host page cache does the reading ahead and writing back and nothing is buffered in
+//! between. a flush request syncs the mapping to the file.
+//!
+//! There's a single request queue. writing to QueueNotify processes every request the driver made available since the
+//! last notify before the write returns, publishing them in the used ring in one go. there's no interrupt controller
+//! yet, so no interrupt is raised: drivers poll the used ring or InterruptStatus, and find their requests done as soon
+//! as they've notified. since requests finish at a fixed point in the instruction stream, runs stay deterministic.
+//!
+//! The device offers VIRTIO_F_VERSION_1, VIRTIO_BLK_F_FLUSH and, for read-only images, VIRTIO_BLK_F_RO. indirect
+//! descriptors and event indices aren't offered. requests read IN, write OUT, flush and GET_ID, anything else
+//! completes as unsupported.
+
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::fd::AsRawFd;
+use std::path::Path;
+use std::ptr::{self, NonNull};
+use std::sync::atomic::{self, Ordering};
+use std::sync::Mutex;
+
+use tracing::*;
+
+use crate::mem::{Device, Dma};
+
+/// the size of a sector, which request offsets and the capacity are counted in
+const SECTOR_SIZE: u64 = 512;
+/// the largest queue the driver can set up
+const MAX_QUEUE_SIZE: u16 = 256;
+/// what GET_ID answers with, padded with zeroes to [ID_LEN]
+const DEVICE_ID: &[u8] = b"whisker";
+const ID_LEN: usize = 20;
+
+mod regs {
+	pub const MAGIC_VALUE: u64 = 0x000;
+	pub const VERSION: u64 = 0x004;
+	pub const DEVICE_ID: u64 = 0x008;
+	pub const VENDOR_ID: u64 = 0x00c;
+	pub const DEVICE_FEATURES: u64 = 0x010;
+	pub const DEVICE_FEATURES_SEL: u64 = 0x014;
+	pub const DRIVER_FEATURES: u64 = 0x020;
+	pub const DRIVER_FEATURES_SEL: u64 = 0x024;
+	pub const QUEUE_SEL: u64 = 0x030;
+	pub const QUEUE_NUM_MAX: u64 = 0x034;
+	pub const QUEUE_NUM: u64 = 0x038;
+	pub const QUEUE_READY: u64 = 0x044;
+	pub const QUEUE_NOTIFY: u64 = 0x050;
+	pub const INTERRUPT_STATUS: u64 = 0x060;
+	pub const INTERRUPT_ACK: u64 = 0x064;
+	pub const STATUS: u64 = 0x070;
+	pub const QUEUE_DESC_LOW: u64 = 0x080;
+	pub const QUEUE_DESC_HIGH: u64 = 0x084;
+	pub const QUEUE_DRIVER_LOW: u64 = 0x090;
+	pub const QUEUE_DRIVER_HIGH: u64 = 0x094;
+	pub const QUEUE_DEVICE_LOW: u64 = 0x0a0;
+	pub const QUEUE_DEVICE_HIGH: u64 = 0x0a4;
+	pub const CONFIG_GENERATION: u64 = 0x0fc;
+	/// the device specific configuration, for a block device it starts with the capacity in sectors
+	pub const CONFIG: u64 = 0x100;
+
+	/// "virt"
+	pub const MAGIC: u32 = 0x7472_6976;
+	pub const BLOCK_DEVICE: u32 = 2;
+	/// "whsk", there's no registered vendor id to use
+	pub const VENDOR: u32 = 0x6b73_6877;
+
+	pub const STATUS_FEATURES_OK: u32 = 1 << 3;
+	pub const STATUS_DRIVER_OK: u32 = 1 << 2;
+	pub const STATUS_NEEDS_RESET: u32 = 1 << 6;
+	pub const INTERRUPT_USED_BUFFER: u32 = 1 << 0;
+
+	pub const F_BLK_RO: u64 = 1 << 5;
+	pub const F_BLK_FLUSH: u64 = 1 << 9;
+	pub const F_VERSION_1: u64 = 1 << 32;
+}
+
+mod ring {
+	pub const DESC_SIZE: u64 = 16;
+	pub const DESC_F_NEXT: u16 = 1 << 0;
+	pub const DESC_F_WRITE: u16 = 1 << 1;
+	pub const DESC_F_INDIRECT: u16 = 1 << 2;
+	/// flags and idx come before the rings
+	pub const RING_HEADER: u64 = 4;
+	pub const USED_ELEM_SIZE: u64 = 8;
+}
+
+mod req {
+	pub const HEADER_SIZE: u64 = 16;
+	pub const IN: u32 = 0;
+	pub const OUT: u32 = 1;
+	pub const FLUSH: u32 = 4;
+	pub const GET_ID: u32 = 8;
+
+	pub const S_OK: u8 = 0;
+	pub const S_IOERR: u8 = 1;
+	pub const S_UNSUPP: u8 = 2;
+}
+
+/// The image file, mapped shared so writes reach the file
+struct DiskImage {
+	ptr: NonNull<u8>,
+	len: usize,
+	read_only: bool,
+}
+
+// SAFETY: the mapping is owned exclusively by this struct
+unsafe impl Send for DiskImage {}
+
+impl DiskImage {
+	fn open(path: &Path, read_only: bool) -> io::Result<Self> {
+		let file = OpenOptions::new().read(true).write(!read_only).open(path)?;
+		let len = file.metadata()?.len() as usize;
+		if len == 0 {
+			return Ok(Self {
+				ptr: NonNull::dangling(),
+				len,
+				read_only,
+			});
+		}
+		Ok(Self {
+			ptr: map_file(&file, len, read_only)?,
+			len,
+			read_only,
+		})
+	}
+
+	fn bytes(&self) -> &[u8] {
+		// SAFETY: the mapping is `len` bytes and only this struct accesses it. if another process changes the file
+		// under us that's like changing a disk under a running machine
+		unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+	}
+
+	/// only for writable images, a read-only one isn't mapped writable
+	fn bytes_mut(&mut self) -> &mut [u8] {
+		assert!(!self.read_only, "writing to a read-only disk image");
+		// SAFETY: see Self::bytes, and we have exclusive access
+		unsafe { std::slice::from_raw_parts_mut(self.ptr.as_ptr(), self.len) }
+	}
+
+	/// waits until everything written to the mapping is in the file
+	fn sync(&self) -> io::Result<()> {
+		if self.read_only || self.len == 0 {
+			return Ok(());
+		}
+		// SAFETY: syncing our own mapping doesn't change it
+		if unsafe { libc::msync(self.ptr.as_ptr().cast(), self.len, libc::MS_SYNC) } != 0 {
+			return Err(io::Error::last_os_error());
+		}
+		Ok(())
+	}
+}
+
+impl Drop for DiskImage {
+	fn drop(&mut self) {
+		if self.len != 0 {
+			// SAFETY: we own the mapping and nothing refers to it past this point
+			unsafe { libc::munmap(self.ptr.as_ptr().cast(), self.len) };
+		}
+	}
+}
+
+fn map_file(file: &File, len: usize, read_only: bool) -> io::Result<NonNull<u8>> {
+	let prot = match read_only {
+		true => libc::PROT_READ,
+		false => libc::PROT_READ | libc::PROT_WRITE,
+	};
+	// SAFETY: we're asking for a fresh mapping, nothing existing is affected
+	let ptr = unsafe { libc::mmap(ptr::null_mut(), len, prot, libc::MAP_SHARED, file.as_raw_fd(), 0) };
+	if ptr == libc::MAP_FAILED {
+		return Err(io::Error::last_os_error());
+	}
+	// UNWRAP: a successful mmap never returns null
+	Ok(NonNull::new(ptr.cast()).unwrap())
+}
+
+#[derive(Debug, Default)]
+struct Queue {
+	num: u16,
+	ready: bool,
+	desc: u64,
+	avail: u64,
+	used: u64,
+	// the device's own copies of the ring indices, the driver can't change them
+	last_avail: u16,
+	used_idx: u16,
+}
+
+/// one buffer of a descriptor chain
+#[derive(Debug, Clone, Copy)]
+struct Buffer {
+	addr: u64,
+	len: u64,
+	writable: bool,
+}
+
+/// the descriptor table or a ring points outside of RAM, or a chain is broken. the device needs a reset
+#[derive(Debug)]
+struct QueueError(&'static str);
+
+struct State {
+	image: DiskImage,
+	dma: Option<Dma>,
+	status: u32,
+	interrupt_status: u32,
+	device_features_sel: u32,
+	driver_features: u64,
+	driver_features_sel: u32,
+	queue_sel: u32,
+	queue: Queue,
+	// the chain being processed, kept around so a request doesn't allocate
+	chain: Vec<Buffer>,
+}
+
+pub struct VirtioBlk {
+	state: Mutex<State>,
+}
+
+impl VirtioBlk {
+	/// a device for the image at `path`. its size is rounded down to whole sectors
+	pub fn open(path: &Path, read_only: bool) -> io::Result<Self> {
+		let image = DiskImage::open(path, read_only)?;
+		if image.len as u64 % SECTOR_SIZE != 0 {
+			warn!(
+				"disk image {} isn't a whole number of sectors, the last {} bytes can't be accessed",
+				path.display(),
+				image.len as u64 % SECTOR_SIZE
+			);
+		}
+		Ok(Self {
+			state: Mutex::new(State {
+				image,
+				dma: None,
+				status: 0,
+				interrupt_status: 0,
+				device_features_sel: 0,
+				driver_features: 0,
+				driver_features_sel: 0,
+				queue_sel: 0,
+				queue: Queue::default(),
+				chain: Vec::new(),
+			}),
+		})
+	}
+
+	/// gives the device access to the RAM its requests point into, it fails every request until then
+	pub fn attach(&self, dma: Dma) {
+		self.state().dma = Some(dma);
+	}
+
+	fn state(&self) -> std::sync::MutexGuard<'_, State> {
+		// UNWRAP: nothing panics while holding the lock
+		self.state.lock().unwrap()
+	}
+}
+
+impl State {
+	fn device_features(&self) -> u64 {
+		let mut features = regs::F_VERSION_1 | regs::F_BLK_FLUSH;
+		if self.image.read_only {
+			features |= regs::F_BLK_RO;
+		}
+		features
+	}
+
+	fn capacity(&self) -> u64 {
+		self.image.len as u64 / SECTOR_SIZE
+	}
+
+	fn reset(&mut self) {
+		self.status = 0;
+		self.interrupt_status = 0;
+		self.device_features_sel = 0;
+		self.driver_features = 0;
+		self.driver_features_sel = 0;
+		self.queue_sel = 0;
+		self.queue = Queue::default();
+	}
+
+	fn set_status(&mut self, status: u32) {
+		if status == 0 {
+			self.reset();
+			return;
+		}
+		let mut status = status;
+		if status & regs::STATUS_FEATURES_OK != 0 && self.status & regs::STATUS_FEATURES_OK == 0 {
+			let features = self.driver_features;
+			if features & !self.device_features() != 0 || features & regs::F_VERSION_1 == 0 {
+				debug!("virtio-blk driver asked for unsupported features {features:#X}");
+				status &= !regs::STATUS_FEATURES_OK;
+			}
+		}
+		self.status = status | (self.status & regs::STATUS_NEEDS_RESET);
+	}
+
+	fn read_register(&self, offset: u64) -> u32 {
+		let queue = &self.queue;
+		let selected = self.queue_sel == 0;
+		match offset {
+			regs::MAGIC_VALUE => regs::MAGIC,
+			regs::VERSION => 2,
+			regs::DEVICE_ID => regs::BLOCK_DEVICE,
+			regs::VENDOR_ID => regs::VENDOR,
+			regs::DEVICE_FEATURES => match self.device_features_sel {
+				0 => self.device_features() as u32,
+				1 => (self.device_features() >> 32) as u32,
+				_ => 0,
+			},
+			regs::QUEUE_NUM_MAX if selected => u32::from(MAX_QUEUE_SIZE),
+			regs::QUEUE_NUM if selected => u32::from(queue.num),
+			regs::QUEUE_READY if selected => u32::from(queue.ready),
+			regs::INTERRUPT_STATUS => self.interrupt_status,
+			regs::STATUS => self.status,
+			regs::QUEUE_DESC_LOW if selected => queue.desc as u32,
+			regs::QUEUE_DESC_HIGH if selected => (queue.desc >> 32) as u32,
+			regs::QUEUE_DRIVER_LOW if selected => queue.avail as u32,
+			regs::QUEUE_DRIVER_HIGH if selected => (queue.avail >> 32) as u32,
+			regs::QUEUE_DEVICE_LOW if selected => queue.used as u32,
+			regs::QUEUE_DEVICE_HIGH if selected => (queue.used >> 32) as u32,
+			// the config never changes
+			regs::CONFIG_GENERATION => 0,
+			_ => 0,
+		}
+	}
+
+	fn write_register(&mut self, offset: u64, val: u32) {
+		fn set_low(reg: &mut u64, val: u32) {
+			*reg = (*reg & !0xFFFF_FFFF) | u64::from(val);
+		}
+		fn set_high(reg: &mut u64, val: u32) {
+			*reg = (*reg & 0xFFFF_FFFF) | (u64::from(val) << 32);
+		}
+
+		let selected = self.queue_sel == 0;
+		let queue = &mut self.queue;
+		match offset {
+			regs::DEVICE_FEATURES_SEL => self.device_features_sel = val,
+			regs::DRIVER_FEATURES => match self.driver_features_sel {
+				0 => set_low(&mut self.driver_features, val),
+				1 => set_high(&mut self.driver_features, val),
+				_ => {}
+			},
+			regs::DRIVER_FEATURES_SEL => self.driver_features_sel = val,
+			regs::QUEUE_SEL => self.queue_sel = val,
+			regs::QUEUE_NUM if selected => queue.num = (val as u16).min(MAX_QUEUE_SIZE),
+			regs::QUEUE_READY if selected => {
+				queue.ready = val & 1 != 0;
+				queue.last_avail = 0;
+				queue.used_idx = 0;
+			}
+			regs::QUEUE_NOTIFY => {
+				if val == 0 {
+					self.process_queue();
+				}
+			}
+			regs::INTERRUPT_ACK => self.interrupt_status &= !val,
+			regs::STATUS => self.set_status(val),
+			regs::QUEUE_DESC_LOW if selected => set_low(&mut queue.desc, val),
+			regs::QUEUE_DESC_HIGH if selected => set_high(&mut queue.desc, val),
+			regs::QUEUE_DRIVER_LOW if selected => set_low(&mut queue.avail, val),
+			regs::QUEUE_DRIVER_HIGH if selected => set_high(&mut queue.avail, val),
+			regs::QUEUE_DEVICE_LOW if selected => set_low(&mut queue.used, val),
+			regs::QUEUE_DEVICE_HIGH if selected => set_high(&mut queue.used, val),
+			_ => trace!("ignoring a virtio-blk write of {val:#X} to {offset:#X}"),
+		}
+	}
+
+	/// completes every request the driver made available, then publishes them all at once
+	fn process_queue(&mut self) {
+		let Some(dma) = self.dma.clone() else {
+			return;
+		};
+		if !self.queue.ready || self.status & regs::STATUS_DRIVER_OK == 0 || self.status & regs::STATUS_NEEDS_RESET != 0
+		{
+			return;
+		}
+		match self.process_available(&dma) {
+			Ok(0) => {}
+			Ok(_) => self.interrupt_status |= regs::INTERRUPT_USED_BUFFER,
+			Err(QueueError(why)) => {
+				warn!("virtio-blk queue is broken ({why}), it needs a reset");
+				self.status |= regs::STATUS_NEEDS_RESET;
+			}
+		}
+	}
+
+	/// returns how many requests were completed
+	fn process_available(&mut self, dma: &Dma) -> Result<u16, QueueError> {
+		let num = self.queue.num;
+		if num == 0 {
+			return Err(QueueError("the queue is empty"));
+		}
+		let avail_idx = read_u16(dma, self.queue.avail.checked_add(2))?;
+		// the requests the index makes available have to be read after it
+		atomic::fence(Ordering::Acquire);
+
+		let mut done = 0;
+		while self.queue.last_avail != avail_idx {
+			let slot = u64::from(self.queue.last_avail % num);
+			let head = read_u16(dma, ring_entry(self.queue.avail, slot, 2))?;
+			let written = self.process_chain(dma, head)?;
+
+			let used_slot = u64::from(self.queue.used_idx % num);
+			let mut elem = [0; ring::USED_ELEM_SIZE as usize];
+			elem[..4].copy_from_slice(&u32::from(head).to_le_bytes());
+			elem[4..].copy_from_slice(&written.to_le_bytes());
+			let elem_addr = ring_entry(self.queue.used, used_slot, ring::USED_ELEM_SIZE);
+			if !elem_addr.is_some_and(|addr| dma.write(addr, &elem)) {
+				return Err(QueueError("the used ring isn't in RAM"));
+			}
+			self.queue.last_avail = self.queue.last_avail.wrapping_add(1);
+			self.queue.used_idx = self.queue.used_idx.wrapping_add(1);
+			done += 1;
+		}
+		if done != 0 {
+			// the driver has to see the used elements and the data once it sees the index
+			atomic::fence(Ordering::Release);
+			let idx_addr = self.queue.used.checked_add(2);
+			if !idx_addr.is_some_and(|addr| dma.write(addr, &self.queue.used_idx.to_le_bytes())) {
+				return Err(QueueError("the used ring isn't in RAM"));
+			}
+		}
+		Ok(done)
+	}
+
+	/// carries out the request starting at descriptor `head`, returns how many bytes were written to its buffers
+	fn process_chain(&mut self, dma: &Dma, head: u16) -> Result<u32, QueueError> {
+		let num = self.queue.num;
+		self.chain.clear();
+		let mut idx = head;
+		loop {
+			if idx >= num {
+				return Err(QueueError("a descriptor index is out of bounds"));
+			}
+			if self.chain.len() >= usize::from(num) {
+				return Err(QueueError("a descriptor chain loops"));
+			}
+			let mut desc = [0; ring::DESC_SIZE as usize];
+			let desc_addr = u64::from(idx)
+				.checked_mul(ring::DESC_SIZE)
+				.and_then(|off| self.queue.desc.checked_add(off));
+			if !desc_addr.is_some_and(|addr| dma.read(addr, &mut desc)) {
+				return Err(QueueError("the descriptor table isn't in RAM"));
+			}
+			// UNWRAP: the ranges have the right lengths
+			let addr = u64::from_le_bytes(desc[0..8].try_into().unwrap());
+			let len = u32::from_le_bytes(desc[8..12].try_into().unwrap());
+			let flags = u16::from_le_bytes(desc[12..14].try_into().unwrap());
+			let next = u16::from_le_bytes(desc[14..16].try_into().unwrap());
+			if flags & ring::DESC_F_INDIRECT != 0 {
+				return Err(QueueError("indirect descriptors weren't negotiated"));
+			}
+			self.chain.push(Buffer {
+				addr,
+				len: u64::from(len),
+				writable: flags & ring::DESC_F_WRITE != 0,
+			});
+			if flags & ring::DESC_F_NEXT == 0 {
+				break;
+			}
+			idx = next;
+		}
+
+		// the header is at the start of the first buffer and the status is the last byte of the last one, whatever
+		// is in between is the data
+		let first = self.chain[0];
+		// UNWRAP: the chain has at least one buffer
+		let last = *self.chain.last().unwrap();
+		// buffers that wrap around the address space are malformed too
+		let data_addr = first.addr.checked_add(req::HEADER_SIZE);
+		let status_addr = last.len.checked_sub(1).and_then(|off| last.addr.checked_add(off));
+		let well_formed = !first.writable && first.len >= req::HEADER_SIZE && last.writable;
+		let Some((data_addr, status_addr)) = data_addr.zip(status_addr).filter(|_| well_formed) else {
+			debug!("virtio-blk request at descriptor {head} is malformed");
+			return Ok(0);
+		};
+		let mut header = [0; req::HEADER_SIZE as usize];
+		let (status, written) = if !dma.read(first.addr, &mut header) {
+			(req::S_IOERR, 0)
+		} else {
+			// UNWRAP: the ranges have the right lengths
+			let ty = u32::from_le_bytes(header[0..4].try_into().unwrap());
+			let sector = u64::from_le_bytes(header[8..16].try_into().unwrap());
+			self.chain[0].addr = data_addr;
+			self.chain[0].len -= req::HEADER_SIZE;
+			let end = self.chain.len() - 1;
+			self.chain[end].len -= 1;
+			self.chain.retain(|buf| buf.len != 0);
+			self.process_request(dma, ty, sector)
+		};
+		if !dma.write(status_addr, &[status]) {
+			debug!("virtio-blk status byte of the request at descriptor {head} isn't in RAM");
+		}
+		// the used length is only 32 bits, a chain can hold more than that
+		Ok(u32::try_from(written + 1).unwrap_or(u32::MAX))
+	}
+
+	/// carries out a request on the data buffers in `self.chain`, returns its status and how many bytes of data it
+	/// wrote to them
+	fn process_request(&mut self, dma: &Dma, ty: u32, sector: u64) -> (u8, u64) {
+		let len: u64 = self.chain.iter().map(|buf| buf.len).sum();
+		let capacity = self.capacity() * SECTOR_SIZE;
+		let start = sector
+			.checked_mul(SECTOR_SIZE)
+			.filter(|start| start.checked_add(len).is_some_and(|end| end <= capacity));
+		match ty {
+			req::IN => {
+				let Some(start) = start.filter(|_| self.chain.iter().all(|buf| buf.writable)) else {
+					return (req::S_IOERR, 0);
+				};
+				let mut pos = start as usize;
+				for buf in &self.chain {
+					let len = buf.len as usize;
+					if !dma.write(buf.addr, &self.image.bytes()[pos..pos + len]) {
+						return (req::S_IOERR, 0);
+					}
+					pos += len;
+				}
+				(req::S_OK, len)
+			}
+			req::OUT => {
+				let writable = !self.image.read_only && self.chain.iter().all(|buf| !buf.writable);
+				let Some(start) = start.filter(|_| writable) else {
+					return (req::S_IOERR, 0);
+				};
+				let mut pos = start as usize;
+				for buf in &self.chain {
+					let len = buf.len as usize;
+					if !dma.read(buf.addr, &mut self.image.bytes_mut()[pos..pos + len]) {
+						return (req::S_IOERR, 0);
+					}
+					pos += len;
+				}
+				(req::S_OK, 0)
+			}
+			req::FLUSH => match self.image.sync() {
+				Ok(()) => (req::S_OK, 0),
+				Err(e) => {
+					warn!("could not flush the disk image: {e}");
+					(req::S_IOERR, 0)
+				}
+			},
+			req::GET_ID => {
+				let mut id = [0; ID_LEN];
+				id[..DEVICE_ID.len()].copy_from_slice(DEVICE_ID);
+				let mut written = 0;
+				for buf in self.chain.iter().filter(|buf| buf.writable) {
+					let len = (buf.len as usize).min(ID_LEN - written);
+					if !dma.write(buf.addr, &id[written..written + len]) {
+						return (req::S_IOERR, 0);
+					}
+					written += len;
+				}
+				(req::S_OK, written as u64)
+			}
+			ty => {
+				debug!("unsupported virtio-blk request type {ty}");
+				(req::S_UNSUPP, 0)
+			}
+		}
+	}
+}
+
+/// the address of entry `idx` of the ring at `base`, None if it doesn't fit in the address space
+fn ring_entry(base: u64, idx: u64, size: u64) -> Option<u64> {
+	base.checked_add(ring::RING_HEADER)?.checked_add(idx.checked_mul(size)?)
+}
+
+/// reads from the available ring, `addr` is None if it didn't fit in the address space
+fn read_u16(dma: &Dma, addr: Option<u64>) -> Result<u16, QueueError> {
+	let mut buf = [0; 2];
+	if !addr.is_some_and(|addr| dma.read(addr, &mut buf)) {
+		return Err(QueueError("the available ring isn't in RAM"));
+	}
+	Ok(u16::from_le_bytes(buf))
+}
+
+impl Device for VirtioBlk {
+	fn read(&self, offset: u64, width: u8) -> u64 {
+		let state = self.state();
+		if offset >= regs::CONFIG {
+			// the config space can be read at any width, it's just the capacity
+			let config = state.capacity().to_le_bytes();
+			let start = (offset - regs::CONFIG) as usize;
+			let mut val = [0; 8];
+			for (idx, byte) in val.iter_mut().take(usize::from(width)).enumerate() {
+				*byte = config.get(start + idx).copied().unwrap_or(0);
+			}
+			return u64::from_le_bytes(val);
+		}
+		if width != 4 || offset % 4 != 0 {
+			return 0;
+		}
+		u64::from(state.read_register(offset))
+	}
+
+	fn write(&self, offset: u64, width: u8, val: u64) {
+		if offset >= regs::CONFIG || width != 4 || offset % 4 != 0 {
+			return;
+		}
+		self.state().write_register(offset, val as u32);
+	}
+}